@@ -102,12 +102,26 @@
 #define USERSTACKBOTTOM	(USERSPACETOP - (1024 * PAGE_SIZE))	// 1024 stack pages allowed
 #define USERHEAPSIZE	(2048 * PAGE_SIZE)	// 8 MiB heap max
 
+/*
+ * Address space IDs.
+ *
+ * Every TLB entry is tagged with the ASID of its address space, so several
+ * address spaces can keep entries in the TLB at once. ASIDs are handed out
+ * per CPU; the bits above ASID_MASK count generations, and an ASID is only
+ * good during the generation it was handed out in. When a CPU runs out, it
+ * flushes its TLB and starts a new generation. ASID 0 is never handed out.
+ */
+#define ASID_BITS			6
+#define ASID_MASK			((1 << ASID_BITS) - 1)
+#define ASID_TO_TLBHI(asid)	(((asid) & ASID_MASK) << 6)	// TLBHI_PID field
+
 union page_table_entry {
 	struct {
-		unsigned int addr : 20, : 7;	// address in memory or swap
-		unsigned int x : 1;				// executable (unused)
-		unsigned int r : 1;				// readable (unused)
-		unsigned int w : 1;				// writeable (unused)
+		unsigned int addr : 20, : 6;	// address in memory or swap
+		unsigned int pf : 1;			// prefetched from swap and not used yet
+		unsigned int x : 1;				// executable (the TLB can't enforce this one)
+		unsigned int r : 1;				// readable
+		unsigned int w : 1;				// writeable
 		unsigned int p : 1;				// present
 		unsigned int b : 1;				// busy
 	};
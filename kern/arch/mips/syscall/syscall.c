@@ -114,6 +114,11 @@ syscall(struct trapframe *tf)
 				 	(userptr_t)tf->tf_a1);
 			break;
 
+	    case SYS_nanosleep:
+			err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+					(userptr_t)tf->tf_a1);
+			break;
+
 		/* 
 		 * Copy the string from the user pointer before calling sys_open so that
 		 * sys_open can be called from within the kernel (e.g. in vfiles_init).
@@ -203,6 +208,23 @@ syscall(struct trapframe *tf)
 			err = sys_sbrk((intptr_t) tf->tf_a0, &retval);
 			break;
 
+		case SYS_mmap: {
+			// fd is the fifth argument, so it's on the stack,
+			// and the 64-bit offset after it is aligned to 8
+			int fd;
+			uint64_t offset;
+			err = copyin((userptr_t) tf->tf_sp + 16, &fd, sizeof(int));
+			if(err == 0)
+				err = copyin((userptr_t) tf->tf_sp + 24, &offset, sizeof(uint64_t));
+			if(err == 0)
+				err = sys_mmap((userptr_t) tf->tf_a0, tf->tf_a1, tf->tf_a2, tf->tf_a3, fd, offset, &retval);
+			break;
+		}
+
+		case SYS_munmap:
+			err = sys_munmap((userptr_t) tf->tf_a0, tf->tf_a1);
+			break;
+
 	    case SYS_sync:
 			err = sys_sync();
 			break;
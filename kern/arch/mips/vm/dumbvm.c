@@ -133,6 +133,22 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+bool
+asid_live(struct addrspace *as, unsigned cpunum)
+{
+	(void)as;
+	(void)cpunum;
+	return false;
+}
+
+void
+tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	(void)as;
+	(void)vaddr;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -10,25 +10,39 @@
 #include <vfs.h>
 #include <vnode.h>
 #include <kern/stat.h>
+#include <kern/mman.h>
 #include <uio.h>
 #include <clock.h>
+#include <kcache.h>
+#include <buf.h>
+
+static void fpage_clean(unsigned long max);
 
 // write-back swap daemon
 // "Memory Access Traversal Daemon"
 static void mat_daemon(void *a, unsigned long b) {
 	(void) a;
 	(void) b;
-	unsigned long i, n, nmax, s, t;
+	unsigned long i, n, nmax, ms, t;
 	struct addrspace *as;
+	struct swap_req reqs[SWAP_BATCH];	// dirty pages are written back in batches
+	struct swap_batch batch = { 0 };	// so adjacent swap indices can be clustered
+	unsigned nreqs;
 	while(true) {
-		s = 1;
+		ms = 1000;
 		if(nfree > 0 && ncmes / nfree < 6)  { 		// more than 1/8 of memory is free
-			s = 8 - (ncmes / nfree);				// sleep less if less memory is free
+			ms = 8000 - (1000 * ncmes / nfree);		// sleep less if less memory is free
 			goto bed;
 		}
 
+		if(nfdirty > 0)				// dirty mapped file pages can't be evicted
+			fpage_clean(nfdirty);	// until they're written back
+
+		buffer_shrink(SWAP_BATCH * PAGE_SIZE);	// file data is in the page cache, so clean
+												// buffers are the cheapest memory to give up
+
 		if(nswap / ncmes > 1) {			// if there's a lot more in swap than RAM,
-			s = 2 * nswap / ncmes;		// writing back with the daemon will just waste time
+			ms = 2000 * nswap / ncmes;	// writing back with the daemon will just waste time
 			goto bed;					// since it's probably already thrashing
 		}
 
@@ -36,33 +50,38 @@ static void mat_daemon(void *a, unsigned long b) {
 		i = clock;	// start at the clock index - preemptively swap out the pages that will be evicted soonest
 		n = 0;		// number of swapped dirty pages
 		t = 0;		// total number of pages iterated past
+		nreqs = 0;
 
 		while(n < nmax && t < ncmes) {	// t just in case nmax is too big (from busy or tlb dirty pages)
 			if(i == ncmes)
 				i = 0;
-			if(core_map[i].va != 0 && !core_map[i].md.kernel && !core_map[i].md.busy && !core_map[i].md.tlb && core_map[i].md.dirty) {
+			if(core_map[i].va != 0 && !core_map[i].md.kernel && !core_map[i].md.busy && !tlb_states[i].tlb && core_map[i].md.dirty && !CMI_IS_FILE(i)) {
 				spinlock_acquire(&core_map_splk); 	// only acquire spinlocks once you find a suitable entry
 													// give up if the entry changed since you checked
 													// hopefully this will make the daemon block productive threads less
 
 				as = core_map[i].as;
-				if(!(core_map[i].va != 0 && !core_map[i].md.kernel && !core_map[i].md.busy && !core_map[i].md.tlb && core_map[i].md.dirty)) {
+				if(!(core_map[i].va != 0 && !core_map[i].md.kernel && !core_map[i].md.busy && !tlb_states[i].tlb && core_map[i].md.dirty && !CMI_IS_FILE(i))) {
 					spinlock_release(&core_map_splk);	// the core map entry isn't good anymore
 					goto next;
 				}
 
-				spinlock_release(&core_map_splk);	// do a little dance to keep the cme synchronized
-				core_map[i].md.busy = 1;			// and prevent deadlock
+				core_map[i].md.busy = 1;			// do a little dance to keep the cme synchronized
+				spinlock_release(&core_map_splk);	// and prevent deadlock (busy also keeps 'as' the owner)
 				spinlock_acquire(&as->addr_splk);	
 				spinlock_acquire(&core_map_splk);
 
-				swap_copy_out(as, i);
-				n++;
+				swap_prepare_out(as, i, &reqs[nreqs++], &batch);	// the CME stays busy until
+				n++;												// swap_io_done() writes it back
 
-				core_map[i].md.busy = 0;
-				wchan_wakeall(as->addr_wchan, &as->addr_splk);
-				spinlock_release(&as->addr_splk);
 				spinlock_release(&core_map_splk);
+				spinlock_release(&as->addr_splk);
+
+				if(nreqs == SWAP_BATCH) {
+					swap_submit(reqs, nreqs);
+					swap_batch_wait(&batch);
+					nreqs = 0;
+				}
 			}
 
 			next:
@@ -70,8 +89,13 @@ static void mat_daemon(void *a, unsigned long b) {
 				t++;
 		}
 
+		if(nreqs > 0) {
+			swap_submit(reqs, nreqs);
+			swap_batch_wait(&batch);
+		}
+
 		bed:
-			clocksleep(s);
+			thread_sleep_ms(ms);
 	}
 }
 
@@ -98,12 +122,22 @@ void swap_bootstrap(void) {
 	}
 	bitmap_mark(swap_bitmap, 0); // fill the 0th index, since we don't want bitmap_alloc to return it later
 
-	swap_lk = lock_create("swap_lk");
-	if(swap_lk == NULL) {
-		panic("lock_create of swap_lk failed\n");
+	swap_refs = kmalloc(swap_size * sizeof(uint16_t));
+	if(swap_refs == NULL) {
+		panic("kmalloc of swap_refs failed\n");
 	}
+	bzero(swap_refs, swap_size * sizeof(uint16_t));
+
+	swap_io_bootstrap();
 
 	clock = 0;
+	prefetch_window = 4;
+
+
+	cow_wchan = wchan_create("cow_wchan");
+	if(cow_wchan == NULL) {
+		panic("wchan_create of cow_wchan failed\n");
+	}
 
 
 	// TLB shootdown setup
@@ -127,8 +161,101 @@ void swap_bootstrap(void) {
 }
 
 
+static uint32_t asid_next[MAXCPUS];		// last ASID (with generation) handed out on each cpu
+static uint32_t asid_active[MAXCPUS];	// TLBHI_PID bits of the address space each cpu is running
+
+
+// Whether 'as' has an ASID from the current generation on 'cpunum',
+// i.e. whether that cpu's TLB might have entries for it.
+bool asid_live(struct addrspace *as, unsigned cpunum) {
+	uint32_t asid = as->asids[cpunum];
+	return asid != 0 && ((asid ^ asid_next[cpunum]) & ~ASID_MASK) == 0;
+}
+
+
+// Whether any cpu besides this one might have TLB entries for 'as'
+static bool asid_live_elsewhere(struct addrspace *as) {
+	for(unsigned i = 0; i < MAXCPUS; i++) {
+		if(i != curcpu->c_number && asid_live(as, i))
+			return true;
+	}
+	return false;
+}
+
+
+// *** Assumes 'as' isn't running on any other cpu
+// Make 'as' get a fresh ASID the next time it runs on another cpu, so whatever
+// entries it left in their TLBs can never match again. Cheaper than a shootdown.
+static void asid_drop_others(struct addrspace *as) {
+	for(unsigned i = 0; i < MAXCPUS; i++) {
+		if(i != curcpu->c_number)
+			as->asids[i] = 0;
+	}
+}
+
+
+// *** Assumes interrupts are off
+// *** Assumes 'as' has been activated on this cpu
+// TLBHI_PID bits to tag this cpu's TLB entries for 'as' with
+static uint32_t asid_pid(struct addrspace *as) {
+	KASSERT(asid_live(as, curcpu->c_number));
+	return ASID_TO_TLBHI(as->asids[curcpu->c_number]);
+}
+
+
+// *** Assumes interrupts are off
+// Give 'as' an ASID on this cpu (unless it has a good one already) and
+// make it the one user translations match. Used in as_activate().
+void asid_activate(struct addrspace *as) {
+	unsigned cpu = curcpu->c_number;
+
+	if(!asid_live(as, cpu)) {
+		uint32_t asid = ++asid_next[cpu];
+		if((asid & ASID_MASK) == 0) {	// out of ASIDs: start a new generation with an empty TLB
+			invalidate_tlb();
+			asid = ++asid_next[cpu];
+		}
+		as->asids[cpu] = asid;
+	}
+
+	asid_active[cpu] = ASID_TO_TLBHI(as->asids[cpu]);
+	tlb_setpid(asid_active[cpu]);
+}
+
+
+// *** Assumes interrupts are off
+// Invalidate this cpu's TLB entry for 'vaddr' in 'as', if there is one
+void tlb_invalidate(struct addrspace *as, vaddr_t vaddr) {
+	unsigned cpu = curcpu->c_number;
+
+	if(!asid_live(as, cpu))
+		return;
+
+	int result = tlb_probe((vaddr & TLBHI_VPAGE) | ASID_TO_TLBHI(as->asids[cpu]), 0);
+	if(result >= 0)
+		tlb_write(TLBHI_INVALID(result), TLBLO_INVALID(), result);
+
+	tlb_setpid(asid_active[cpu]);	// probing and writing clobbered the current ASID
+}
+
+
+// *** Assumes the core map spinlock is held
+// Whether the page at 'cmi' can be swapped out (or evicted, for file pages).
+// Mapped file pages have to be clean, not in the middle of a write-back and
+// not pinned by a system call.
+static bool cme_evictable(unsigned long cmi) {
+	struct core_map_entry *cme = &core_map[cmi];
+
+	if(cme->va == 0 || cme->md.kernel || cme->md.busy)
+		return false;
+	return !CMI_IS_MAPPED_FILE(cmi) || (!cme->md.dirty && !cme->md.wback && !cme->md.walk
+			&& pcache_entries[cmi].pins == 0);
+}
+
+
 // *** Assumes the core map spinlock is held (and probably address space too)
-// Returns -1 if there are no pages that can be swapped out (kernel or busy)
+// Returns -1 if there are no pages that can be swapped out (kernel, busy, dirty
+// mapped file pages or free; free pages come from frame_alloc() instead)
 // Currently uses a sort of clock algorithm preferring not-recent, not-TLB entries,
 // but because it's self contained it could easily be substituted with something else
 // and switched in a config.
@@ -137,9 +264,9 @@ static long choose_page_to_swap(void) {
 	while(nchecked < ncmes) {
 		if(clock == ncmes)	// make the clock circular
 			clock = 0;
-		if(core_map[clock].md.recent == 1)
-			core_map[clock].md.recent = 0;
-		else if(!core_map[clock].md.kernel && !core_map[clock].md.busy && !core_map[clock].md.tlb) {
+		if(tlb_states[clock].recent == 1)
+			tlb_states[clock].recent = 0;
+		else if(!tlb_states[clock].tlb && cme_evictable(clock)) {
 			clock++;
 			return clock - 1;
 		}
@@ -150,7 +277,7 @@ static long choose_page_to_swap(void) {
 	while(nchecked < twice) {
 		if(clock == ncmes)
 			clock = 0;
-		if(!core_map[clock].md.kernel && !core_map[clock].md.busy && !core_map[clock].md.tlb) {	// no more recent entries
+		if(!tlb_states[clock].tlb && cme_evictable(clock)) {	// no more recent entries
 			clock++;
 			return clock - 1;
 		}
@@ -161,7 +288,7 @@ static long choose_page_to_swap(void) {
 	while(nchecked < thrice) {			// if there's nothing on the third loop, give up
 		if(clock == ncmes)
 			clock = 0;
-		if(!core_map[clock].md.kernel && !core_map[clock].md.busy) {	// accept entries in TLB
+		if(cme_evictable(clock)) {	// accept entries in TLB
 			clock++;
 			return clock - 1;
 		}
@@ -172,11 +299,280 @@ static long choose_page_to_swap(void) {
 }
 
 
+// *** Assumes the core map spinlock is held
+// Drop a reference to a swap index, freeing it once no PTE or CME refers to it.
+static void swap_unref(unsigned swapi) {
+	KASSERT(swapi != 0);
+	KASSERT(swap_refs[swapi] > 0);
+
+	swap_refs[swapi]--;
+	if(swap_refs[swapi] == 0) {
+		bitmap_unmark(swap_bitmap, swapi);
+		nswap--;
+	}
+}
+
+
+// *** Assumes the core map spinlock is held
+// The user page at 'cmi' is leaving its frame, so if it was part of a whole
+// large page, the rest of the large page goes back to being ordinary pages.
+static void lpage_split(unsigned long cmi) {
+	if(!core_map[cmi].md.contig)
+		return;
+
+	unsigned long base = cmi & ~((unsigned long) LPAGE_PAGES - 1);	// large pages are buddy blocks
+	for(unsigned long j = base; j < base + LPAGE_PAGES; j++) {
+		if(!core_map[j].md.kernel)
+			core_map[j].md.contig = 0;
+	}
+	nlp_splits++;
+}
+
+
+// *** Assumes that the address space and core map spinlocks are held
+// Sleep until the busy CME at 'cmi' might have been released, and return with
+// both spinlocks held again. Callers have to recheck anything they looked at.
+// Shared pages can be released by any of their sharers, who only hold their own
+// address space spinlock, so those waits go on cow_wchan instead (and file
+// pages, which have no owner, on pcache_wchan).
+static void cme_sleep(struct addrspace *as, unsigned long cmi) {
+	if(core_map[cmi].refcount > 1 || CMI_IS_FILE(cmi)) {
+		spinlock_release(&as->addr_splk);
+
+		wchan_sleep(CMI_IS_FILE(cmi) ? pcache_wchan : cow_wchan, &core_map_splk);
+
+		spinlock_release(&core_map_splk);	// keep the address space -> core map ordering
+		spinlock_acquire(&as->addr_splk);
+		spinlock_acquire(&core_map_splk);
+	}
+	else {
+		spinlock_release(&core_map_splk);
+
+		wchan_sleep(as->addr_wchan, &as->addr_splk);
+
+		spinlock_acquire(&core_map_splk);
+	}
+}
+
+
+// Sharer list nodes are recycled through this list instead of being kfree'd,
+// since they're released with the core map spinlock held (protected by it too).
+static struct cow_sharer *cow_sharer_cache = NULL;
+
+// *** Assumes no spinlocks are held
+static struct cow_sharer *cow_sharer_get(void) {
+	spinlock_acquire(&core_map_splk);
+
+	struct cow_sharer *s = cow_sharer_cache;
+	if(s != NULL)
+		cow_sharer_cache = s->next;
+
+	spinlock_release(&core_map_splk);
+
+	if(s == NULL) {
+		s = kmalloc(sizeof(struct cow_sharer));
+		if(s == NULL) {
+			panic("kmalloc failed\n");
+		}
+	}
+	return s;
+}
+
+// *** Assumes the core map spinlock is held
+static void cow_sharer_put(struct cow_sharer *s) {
+	s->as = NULL;
+	s->va = 0;
+	s->vn = NULL;
+	s->next = cow_sharer_cache;
+	cow_sharer_cache = s;
+}
+
+
+// *** Assumes that the address space and core map spinlocks are held
+// *** Assumes the CME is either marked busy by us or not busy at all
+// Stop sharing the copy-on-write page at 'cmi' with 'as'. If 'as' was the CME's
+// owner, the first remaining sharer takes its place.
+static void cow_unshare(unsigned long cmi, struct addrspace *as) {
+	struct core_map_entry *cme = &core_map[cmi];
+	struct cow_sharer **sp = &cow_sharers[cmi];
+	struct cow_sharer *s;
+
+	KASSERT(cme->refcount > 1);
+	KASSERT(*sp != NULL);
+
+	if(cme->as == as) {
+		s = *sp;
+		cme->as = s->as;
+	}
+	else {
+		while((*sp)->as != as) {
+			sp = &(*sp)->next;
+			KASSERT(*sp != NULL);
+		}
+		s = *sp;
+	}
+
+	*sp = s->next;
+	cme->refcount--;
+	cow_sharer_put(s);
+}
+
+
+// *** Assumes no spinlocks are held
+// *** Assumes that the CME has been marked busy by us, so its sharers can't change
+// Set the busy bit on the PTE of every other sharer of the page at 'cmi', so none
+// of them can load it into the TLB while it's being swapped out.
+static void cow_busy_sharers(unsigned long cmi) {
+	for(struct cow_sharer *s = cow_sharers[cmi]; s != NULL; s = s->next) {
+		spinlock_acquire(&s->as->addr_splk);
+
+		union page_table_entry *pte = VADDR_TO_PTE(s->as->ptd, core_map[cmi].va);
+
+		// only the holder of the CME's busy bit sets busy on a PTE that maps it
+		KASSERT(pte->b == 0);
+		KASSERT(pte->p == 1);
+		KASSERT(PTE_TO_CMI(pte) == cmi);
+
+		pte->b = 1;
+
+		spinlock_release(&s->as->addr_splk);
+	}
+}
+
+
+// *** Assumes no spinlocks are held
+// *** Assumes that the CME has been marked busy by us, so its sharers can't change
+// Point the PTE of every other sharer of the page at 'cmi' (virtual address 'va')
+// at the page's copy in swap, and wake up anyone who was waiting on it.
+static void cow_swap_sharers(unsigned long cmi, vaddr_t va, unsigned swapi) {
+	for(struct cow_sharer *s = cow_sharers[cmi]; s != NULL; s = s->next) {
+		spinlock_acquire(&s->as->addr_splk);
+
+		union page_table_entry *pte = VADDR_TO_PTE(s->as->ptd, va);
+
+		KASSERT(pte->b == 1);
+
+		pte->p = 0;
+		pte->b = 0;
+		pte->addr = swapi;
+
+		wchan_wakeall(s->as->addr_wchan, &s->as->addr_splk);
+		spinlock_release(&s->as->addr_splk);
+	}
+}
+
+
+// *** Assumes the core map spinlock is held
+// Find the link to the entry for 'as' mapping the file page at 'cmi' at 'va'
+// in the page's list of mappers.
+static struct cow_sharer **fpage_mapper(unsigned long cmi, struct addrspace *as, vaddr_t va) {
+	struct cow_sharer **sp = &cow_sharers[cmi];
+
+	KASSERT(CMI_IS_FILE(cmi));
+
+	while((*sp)->as != as || (*sp)->va != va) {
+		sp = &(*sp)->next;
+		KASSERT(*sp != NULL);
+	}
+	return sp;
+}
+
+
+// *** Assumes that the address space and core map spinlocks are held
+// *** Assumes nobody is walking the mappers of the file page at 'cmi'
+// 'as' is done mapping the file page at 'cmi' at 'va'; take it off the page's
+// mappers and drop its reference.
+static void fpage_unmap(unsigned long cmi, struct addrspace *as, vaddr_t va) {
+	KASSERT(core_map[cmi].md.walk == 0);
+
+	struct cow_sharer **sp = fpage_mapper(cmi, as, va);
+	struct cow_sharer *s = *sp;
+
+	*sp = s->next;
+	cow_sharer_put(s);
+
+	pcache_unmap(cmi);
+}
+
+
+// *** Assumes that a different addrspace spinlock (unless 'other_as' is NULL)
+// *** and the core map spinlock are held
+// Take the clean mapped file page at 'cmi' away from everything that maps it,
+// so it can be evicted like any other file page. The mappers fault it back in
+// through the page cache. Works like swap_out() does for sharers: their PTEs
+// are marked busy, their TLB entries shot down, and then their PTEs cleared.
+static void fpage_unmap_all(unsigned long cmi, struct addrspace *other_as) {
+	struct core_map_entry *cme = &core_map[cmi];
+	struct cow_sharer *s;
+
+	KASSERT(CMI_IS_MAPPED_FILE(cmi));
+	KASSERT(cme->md.dirty == 0);
+	KASSERT(cme->md.wback == 0);
+	KASSERT(cme->md.walk == 0);
+
+	cme->md.busy = 1;	// keep pcache_get() and anyone else off the page,
+	cme->md.walk = 1;	// and the mappers (and so their address spaces) where they are
+
+	spinlock_release(&core_map_splk);
+	if(other_as != NULL)
+		spinlock_release(&other_as->addr_splk);
+
+	for(s = cow_sharers[cmi]; s != NULL; s = s->next) {
+		spinlock_acquire(&s->as->addr_splk);
+
+		union page_table_entry *pte = VADDR_TO_PTE(s->as->ptd, s->va);
+
+		// only the holder of the CME's busy bit sets busy on a PTE that maps it
+		KASSERT(pte->b == 0);
+		KASSERT(pte->p == 1);
+		KASSERT(PTE_TO_CMI(pte) == cmi);
+
+		pte->b = 1;
+
+		spinlock_release(&s->as->addr_splk);
+	}
+
+	if(tlb_states[cmi].tlb) {	// nobody can load it now that their PTEs are busy
+		for(s = cow_sharers[cmi]; s != NULL; s = s->next) {
+			const struct tlbshootdown ts = {TLBHI_VPAGE & s->va, s->as};
+			ipi_broadcast_tlbshootdown(&ts);
+		}
+	}
+
+	for(s = cow_sharers[cmi]; s != NULL; s = s->next) {
+		spinlock_acquire(&s->as->addr_splk);
+
+		VADDR_TO_PTE(s->as->ptd, s->va)->all = 0;
+
+		wchan_wakeall(s->as->addr_wchan, &s->as->addr_splk);
+		spinlock_release(&s->as->addr_splk);	// 's->as' may be gone after this
+	}
+
+	if(other_as != NULL)
+		spinlock_acquire(&other_as->addr_splk);
+	spinlock_acquire(&core_map_splk);
+
+	while(cow_sharers[cmi] != NULL) {
+		s = cow_sharers[cmi];
+		cow_sharers[cmi] = s->next;
+		cow_sharer_put(s);
+		cme->refcount--;
+	}
+
+	KASSERT(cme->refcount == 0);
+
+	cme->md.walk = 0;
+	cme->md.busy = 0;
+	tlb_states[cmi].tlb = 0;
+	wchan_wakeall(pcache_wchan, &core_map_splk);
+}
+
+
 // *** Assumes that the address space and core map spinlocks are held
 // *** Assumes that the CME has been marked busy by us and doesn't change its status
-// Put a copy of data tracked in the core map at 'cmi' into swap 
-// (either at an existing index or a new one) and update the CME accordingly.
-void swap_copy_out(struct addrspace *as, unsigned long cmi) {
+// Pick the swap index a copy of the data at 'cmi' goes to (either an existing index
+// or a new one), update the CME accordingly and fill in 'req' to write it there.
+void swap_prepare_out(struct addrspace *as, unsigned long cmi, struct swap_req *req, struct swap_batch *batch) {
 
 	struct core_map_entry *cme = &core_map[cmi];
 
@@ -186,12 +582,16 @@ void swap_copy_out(struct addrspace *as, unsigned long cmi) {
 
 	unsigned int swapi; 
 	
-	if(!cme->md.s_pres) {
+	if(!cme->md.s_pres || swap_refs[cme->md.swap] > 1) {
+		if(cme->md.s_pres)				// other address spaces still refer to the old copy
+			swap_unref(cme->md.swap);	// in swap, so it can't be overwritten
+
 		int err = bitmap_alloc(swap_bitmap, &swapi);	// find a swap index
 		if(err != 0)
 			panic("Out of swap space :(\n");
 
 		nswap++;
+		swap_refs[swapi] = 1;
 
 		cme->md.s_pres = 1;
 		cme->md.swap = swapi;
@@ -199,32 +599,37 @@ void swap_copy_out(struct addrspace *as, unsigned long cmi) {
 	else
 		swapi = cme->md.swap;	// or use the one that already exists
 
-	spinlock_release(&core_map_splk);
-	spinlock_release(&as->addr_splk);
+	req->as = as;
+	req->va = cme->va;
+	req->cmi = cmi;
+	req->swapi = swapi;
+	req->write = true;
+	req->batch = batch;
+}
 
-	lock_acquire(swap_lk);
 
-	struct iovec iov;
-	struct uio uio;
-	uio_kinit(&iov, &uio, (void *) PADDR_TO_KVADDR(CMI_TO_PADDR(cmi)), PAGE_SIZE, swapi * PAGE_SIZE, UIO_WRITE);
+// *** Assumes that the address space and core map spinlocks are held
+// *** Assumes that the CME has been marked busy by us and doesn't change its status
+// Put a copy of data tracked in the core map at 'cmi' into swap and wait for it.
+void swap_copy_out(struct addrspace *as, unsigned long cmi) {
 
-	int err = VOP_WRITE(swap_vnode, &uio);	// write out a copy to swap
-	if(err != 0)
-		panic("Write to swap failed\n");
+	struct swap_req req;
 
-	lock_release(swap_lk);
+	swap_prepare_out(as, cmi, &req, NULL);
+	swap_submit(&req, 1);
 
-	spinlock_acquire(&as->addr_splk);
+	spinlock_release(&core_map_splk);
+	while(!req.done)
+		wchan_sleep(as->addr_wchan, &as->addr_splk);
 	spinlock_acquire(&core_map_splk);
 
-	cme->md.dirty = 0;	// swap_copy_out is only called on ptes not in the TLB
-	ndirty--;			// (including ones that were just shot down)
-
-	KASSERT(cme->md.busy == 1);
+	KASSERT(core_map[cmi].md.busy == 1);
+	KASSERT(core_map[cmi].md.dirty == 0);
 }
 
 
-// *** Assumes that a different addrspace spinlock and the core map spinlock are held
+// *** Assumes that a different addrspace spinlock (unless 'other_as' is NULL)
+// *** and the core map spinlock are held
 // Move the data at 'cme' to swap and clear the CME / update the PTE.
 void swap_out(unsigned long cmi, struct addrspace *other_as) {
 
@@ -233,11 +638,23 @@ void swap_out(unsigned long cmi, struct addrspace *other_as) {
 
 	KASSERT(cme->md.busy == 0);
 	KASSERT(cme->md.kernel == 0);
+
+	if(CMI_IS_FILE(cmi)) {	// only clean file pages are chosen, so there's nothing to write
+		if(cme->refcount > 0)
+			fpage_unmap_all(cmi, other_as);
+		pcache_steal(cmi);
+		return;
+	}
+
 	KASSERT(as != NULL);
 
+	lpage_split(cmi);
+
 	cme->md.busy = 1;	// preserve atomicity across spinlock jumps
+	bool shared = cme->refcount > 1;	// sharers can't change while we hold the busy bit
 	spinlock_release(&core_map_splk);
-	spinlock_release(&other_as->addr_splk);
+	if(other_as != NULL)
+		spinlock_release(&other_as->addr_splk);
 
 	spinlock_acquire(&as->addr_splk);
 	spinlock_acquire(&core_map_splk);
@@ -256,19 +673,40 @@ void swap_out(unsigned long cmi, struct addrspace *other_as) {
 
 	pte->b = 1;
 
-	if(cme->md.tlb) {
+	if(shared) {
+		spinlock_release(&core_map_splk);
+		spinlock_release(&as->addr_splk);
+
+		cow_busy_sharers(cmi);
+
+		spinlock_acquire(&as->addr_splk);
+		spinlock_acquire(&core_map_splk);
+	}
+
+	if(tlb_states[cmi].tlb) {
 		spinlock_release(&core_map_splk);
 		spinlock_release(&as->addr_splk);
 
 		const struct tlbshootdown ts = {TLBHI_VPAGE & cme->va, as};
 
 		ipi_broadcast_tlbshootdown(&ts);	// invalidate TLB before swapping out
-		cme->md.tlb = 0;
+
+		if(shared) {	// sharers' entries are tagged with their own ASIDs
+			for(struct cow_sharer *s = cow_sharers[cmi]; s != NULL; s = s->next) {
+				const struct tlbshootdown sts = {TLBHI_VPAGE & cme->va, s->as};
+				ipi_broadcast_tlbshootdown(&sts);
+			}
+		}
+
+		tlb_states[cmi].tlb = 0;
 
 		spinlock_acquire(&as->addr_splk);
 		spinlock_acquire(&core_map_splk);
 	}
 
+	// Read-only pages go to swap too, rather than being dropped and read in again
+	// from the executable: the fault could then come from inside the file system
+	// (in a copy to or from a user buffer), which can't be re-entered.
 	if(cme->md.dirty || !cme->md.s_pres) {	// we only need to do the write if there doesn't
 		swap_copy_out(as, cmi);				// already exist an identical copy in swap
 	}
@@ -277,15 +715,26 @@ void swap_out(unsigned long cmi, struct addrspace *other_as) {
 	KASSERT(cme->as != 0);
 	KASSERT(cme->md.s_pres);
 
-	pte->p = 0;
-	pte->b = 0;
-	pte->addr = cme->md.swap;
+	unsigned swapi = cme->md.swap;
+	vaddr_t va = cme->va;
+
+	if(pte->pf)
+		npf_misses++;
 
 	KASSERT(cme->md.busy == 1);
 
+	pte->p = 0;
+	pte->b = 0;
+	pte->pf = 0;
+	pte->addr = swapi;
+
+	swap_refs[swapi] += cme->refcount - 1;	// the CME's reference moves to the PTE,
+											// and every other sharer gets one too
 	cme->va = 0;
 	cme->as = 0;
+	cme->refcount = 0;
 	cme->md.all = 0;
+	tlb_states[cmi].all = 0;
 	cme->md.busy = 1;
 
 	wchan_wakeall(as->addr_wchan, &as->addr_splk);
@@ -295,11 +744,24 @@ void swap_out(unsigned long cmi, struct addrspace *other_as) {
 	spinlock_release(&core_map_splk);
 	spinlock_release(&as->addr_splk);
 
-	spinlock_acquire(&other_as->addr_splk);
+	if(shared)
+		cow_swap_sharers(cmi, va, swapi);
+
+	if(other_as != NULL)
+		spinlock_acquire(&other_as->addr_splk);
 	spinlock_acquire(&core_map_splk);
 
 	KASSERT(cme->md.busy == 1);
 
+	if(shared) {
+		while(cow_sharers[cmi] != NULL) {
+			struct cow_sharer *s = cow_sharers[cmi];
+			cow_sharers[cmi] = s->next;
+			cow_sharer_put(s);
+		}
+		wchan_wakeall(cow_wchan, &core_map_splk);
+	}
+
 	cme->md.busy = 0;
 	// no one can be waiting on this because it
 	// doesn't have an address space
@@ -307,11 +769,103 @@ void swap_out(unsigned long cmi, struct addrspace *other_as) {
 
 
 // *** Assumes that the address space and core map spinlocks are held
-// Copy the data tracked by 'pte' in swap into the page referenced by 'cme'
+// Track scans through the address space and decide how many pages
+// to read around a fault on 'vaddr'.
+static unsigned prefetch_size(struct addrspace *as, vaddr_t vaddr) {
+
+	if(as->pf_dir != 0 && vaddr == as->pf_next) {	// the scan goes on, so widen the window
+		as->pf_window = as->pf_window ? 2 * as->pf_window : 1;
+		if(as->pf_window > PREFETCH_MAX)
+			as->pf_window = PREFETCH_MAX;
+	}
+	else if(vaddr == as->pf_last + PAGE_SIZE) {		// stride 1
+		as->pf_dir = 1;
+		as->pf_window = 1;
+	}
+	else if(vaddr + PAGE_SIZE == as->pf_last) {		// reverse scan
+		as->pf_dir = -1;
+		as->pf_window = 1;
+	}
+	else {
+		as->pf_dir = 0;
+		as->pf_window = 0;
+	}
+	as->pf_last = vaddr;
+
+	unsigned window = as->pf_window < prefetch_window ? as->pf_window : prefetch_window;
+
+	if(nfree < ncmes / 16)		// prefetching only takes free pages, but back off
+		window = 0;				// before it leaves none for faults that need them
+	else if(nfree < ncmes / 8)
+		window /= 2;
+
+	return window;
+}
+
+
+// *** Assumes that the address space and core map spinlocks are held
+// Fill in 'reqs' to read pages following 'vaddr' in the direction of the
+// current scan, as long as they're in swap at indices continuing 'swapi'
+// (so they come in with the same transfer) and there are free pages for them.
+// The CMEs and PTEs are marked busy. Returns the number of requests.
+static unsigned swap_prefetch(struct addrspace *as, vaddr_t vaddr, unsigned swapi, struct swap_req *reqs) {
+
+	unsigned window = prefetch_size(as, vaddr);
+	unsigned lo = swapi, hi = swapi;
+	unsigned n = 0, k;
+	vaddr_t pva = vaddr;
+
+	for(k = 0; k < window; k++) {
+		pva += (vaddr_t) (as->pf_dir * PAGE_SIZE);
+		if(pva < PAGE_SIZE || pva >= USERSPACETOP)
+			break;
+		if(as->ptd->pts[L1INDEX(pva)] == NULL)
+			break;
+
+		union page_table_entry *pte = VADDR_TO_PTE(as->ptd, pva);
+		if(pte->addr == 0 || pte->b)
+			break;
+		if(pte->p)		// already in memory; keep looking past it
+			continue;
+
+		if(pte->addr == hi + 1)
+			hi++;
+		else if(pte->addr == lo - 1)
+			lo--;
+		else
+			break;
+
+		long cmi = frame_alloc(0);
+		if(cmi == -1)
+			break;
+
+		core_map[cmi].md.busy = 1;
+		pte->b = 1;
+
+		reqs[n].as = as;
+		reqs[n].va = pva;
+		reqs[n].cmi = cmi;
+		reqs[n].swapi = pte->addr;
+		reqs[n].write = false;
+		reqs[n].batch = NULL;
+		n++;
+	}
+
+	as->pf_next = vaddr + (vaddr_t) (as->pf_dir * (int) (k + 1) * PAGE_SIZE);
+
+	return n;
+}
+
+
+// *** Assumes that the address space and core map spinlocks are held
+// Copy the data tracked by 'pte' in swap into the page referenced by 'cme',
+// along with whatever swap_prefetch() picks to read around it.
 void swap_copy_in(struct addrspace *as, vaddr_t vaddr, unsigned long cmi) {
 
 	union page_table_entry *pte = VADDR_TO_PTE(as->ptd, vaddr);
 	struct core_map_entry *cme = &core_map[cmi];
+	struct swap_req reqs[1 + PREFETCH_MAX];
+	unsigned i, n;
 
 	KASSERT(cme->md.kernel == 0);
 	KASSERT(cme->md.busy == 0);
@@ -324,60 +878,112 @@ void swap_copy_in(struct addrspace *as, vaddr_t vaddr, unsigned long cmi) {
 	cme->md.busy = 1;	// protect across spinlock jumps
 	pte->b = 1;
 
-	spinlock_release(&core_map_splk);
-	spinlock_release(&as->addr_splk);
-
-	lock_acquire(swap_lk);
-
-	struct iovec iov;
-	struct uio uio;
-	uio_kinit(&iov, &uio, (void *) PADDR_TO_KVADDR(CMI_TO_PADDR(cmi)), PAGE_SIZE, pte->addr * PAGE_SIZE, UIO_READ);
+	reqs[0].as = as;
+	reqs[0].va = vaddr;
+	reqs[0].cmi = cmi;
+	reqs[0].swapi = pte->addr;
+	reqs[0].write = false;
+	reqs[0].batch = NULL;
 
-	int err = VOP_READ(swap_vnode, &uio);	// copy in data from swap
-	if(err != 0)
-		panic("Read from swap failed\n");
+	n = 1 + swap_prefetch(as, vaddr, pte->addr, &reqs[1]);
 
-	lock_release(swap_lk);
+	swap_submit(reqs, n);
 
-	spinlock_acquire(&as->addr_splk);
+	spinlock_release(&core_map_splk);
+	for(i = 0; i < n; i++) {
+		while(!reqs[i].done)	// swap_io_done() fills in the CMEs and PTEs
+			wchan_sleep(as->addr_wchan, &as->addr_splk);
+	}
 	spinlock_acquire(&core_map_splk);
 
+	KASSERT(cme->as == as);
+	KASSERT(cme->va == vaddr);
 	KASSERT(cme->md.busy == 1);
-	KASSERT(pte->b == 1);
 
-	cme->va = vaddr;
-	cme->as = as;
-	cme->md.all = 0;	// also sets busy to 0
-	cme->md.swap = pte->addr;	// update the cme to reflect the copy in swap
-	cme->md.s_pres = 1;
-
-	KASSERT(cme->md.kernel == 0);
+	cme->md.busy = 0;
 
-	pte->addr = ADDR_TO_FRAME(CMI_TO_PADDR(cmi));	
-	pte->p = 1;
-	pte->b = 0;
+	for(i = 1; i < n; i++) {
+		KASSERT(core_map[reqs[i].cmi].md.busy == 1);
+		core_map[reqs[i].cmi].md.busy = 0;
+		VADDR_TO_PTE(as->ptd, reqs[i].va)->pf = 1;
+	}
+	npf_issued += n - 1;
 
 	wchan_wakeall(as->addr_wchan, &as->addr_splk);
 }
 
 
-// *** Assumes that the address space and core map spinlocks are held
-// Move the data tracked by 'pte' in swap into memory.
-// (Swap a page out first if there are no free core map entries.)
-void swap_in(struct addrspace *as, vaddr_t vaddr) {
-
-	long cmi = choose_page_to_swap();
-	if(cmi == -1) {
-		panic("Out of pages to swap :(\n");	// this probably means the kernel has allocated
-	}										// too many page tables; not much we can do about that
+// *** Assumes no spinlocks are held
+// Finish a request once a swap worker has done its I/O. The request's CME
+// (and, for page-ins, its PTE) is still busy, so the address space is alive.
+void swap_io_done(struct swap_req *req) {
 
-	KASSERT(core_map[cmi].md.kernel == 0);
-	KASSERT(core_map[cmi].md.busy == 0);
+	struct addrspace *as = req->as;
+	struct core_map_entry *cme = &core_map[req->cmi];
 
-	if(core_map[cmi].va != 0)
-		swap_out(cmi, as);
+	spinlock_acquire(&as->addr_splk);
+	spinlock_acquire(&core_map_splk);
+
+	KASSERT(cme->md.busy == 1);
+
+	if(req->write) {
+		KASSERT(cme->as == as);
+
+		cme->md.dirty = 0;	// only pages that aren't in the TLB are written out
+		ndirty--;			// (including ones that were just shot down)
+
+		if(req->batch != NULL) {	// write-back; nobody is waiting on 'done'
+			cme->md.busy = 0;
+			if(cme->refcount > 1)
+				wchan_wakeall(cow_wchan, &core_map_splk);
+		}
+	}
 	else {
-		nfree--;
+		union page_table_entry *pte = VADDR_TO_PTE(as->ptd, req->va);
+
+		KASSERT(pte->b == 1);
+		KASSERT(pte->addr == req->swapi);
+
+		cme->va = req->va;
+		cme->as = as;
+		cme->refcount = 1;
+		cme->md.all = 0;
+		tlb_states[req->cmi].all = 0;
+		cme->md.swap = req->swapi;	// update the cme to reflect the copy in swap
+									// (the PTE's reference to it becomes the CME's)
+		cme->md.s_pres = 1;
+		cme->md.busy = 1;			// swap_copy_in() lets go once it has the spinlocks back,
+									// so the page can't be evicted before it's used
+
+		pte->addr = ADDR_TO_FRAME(CMI_TO_PADDR(req->cmi));
+		pte->p = 1;
+		pte->b = 0;
+	}
+
+	req->done = true;	// 'req' may be gone once the address space lock is dropped
+	wchan_wakeall(as->addr_wchan, &as->addr_splk);
+
+	spinlock_release(&core_map_splk);
+	spinlock_release(&as->addr_splk);
+}
+
+
+// *** Assumes that the address space and core map spinlocks are held
+// Move the data tracked by 'pte' in swap into memory.
+// (Swap a page out first if there are no free core map entries.)
+void swap_in(struct addrspace *as, vaddr_t vaddr) {
+
+	long cmi = frame_alloc(0);
+	if(cmi == -1) {
+		cmi = choose_page_to_swap();
+		if(cmi == -1) {
+			panic("Out of pages to swap :(\n");	// this probably means the kernel has allocated
+		}										// too many page tables; not much we can do about that
+
+		KASSERT(core_map[cmi].md.kernel == 0);
+		KASSERT(core_map[cmi].md.busy == 0);
+
+		swap_out(cmi, as);
 	}
 
 	KASSERT(core_map[cmi].md.busy == 0);
@@ -403,7 +1009,7 @@ static union page_table_entry* get_pte(struct addrspace *as, vaddr_t vaddr, bool
 		// no other address space will be allocating new PTEs, 
 		// so we can let go of the spinlock without causing problems
 
-		ptd->pts[l1] = kmalloc(sizeof(struct page_table));
+		ptd->pts[l1] = kcache_alloc(pt_cache);
 		if(ptd->pts[l1] == NULL) {
 			panic("kmalloc failed\n");
 		}
@@ -420,16 +1026,12 @@ static union page_table_entry* get_pte(struct addrspace *as, vaddr_t vaddr, bool
 }
 
 
-// *** Assumes the address space and core map spinlocks are held
+// *** Assumes the address space (unless 'as' is NULL) and core map spinlocks are held
 // Returns the index to an empty (or newly empty) core map entry
-static long find_cmi(struct addrspace *as) {
-	long i;
-	for(i = 0; i < (long) ncmes; i++) {
-		if(!core_map[i].md.busy && core_map[i].va == 0) {
-			nfree--;
-			return i;
-		}
-	}
+long find_cmi(struct addrspace *as) {
+	long i = frame_alloc(0);
+	if(i != -1)
+		return i;
 
 	i = choose_page_to_swap();
 	if(i < 0) {
@@ -447,9 +1049,81 @@ static long find_cmi(struct addrspace *as) {
 }
 
 
+// Set the permission bits of 'pte' from the PROT_ bits in 'perms'.
+static void pte_set_perms(union page_table_entry *pte, uint8_t perms) {
+	pte->r = (perms & PROT_READ) != 0;
+	pte->w = (perms & PROT_WRITE) != 0;
+	pte->x = (perms & PROT_EXEC) != 0;
+}
+
+
+// *** Assumes the address space spinlock is held
+// Back the whole aligned large page around 'vaddr' with a block of contiguous
+// frames, if it's all stack or heap, none of it has been touched yet and there's
+// a free block. Returns false if the caller should fall back to alloc_upage().
+static bool alloc_lpage(struct addrspace *as, vaddr_t vaddr) {
+	vaddr_t base = vaddr & ~((vaddr_t) LPAGE_SIZE - 1);
+	vaddr_t end = base + LPAGE_SIZE;
+
+	bool heap = base >= as->heap_bottom && end <= as->heap_top;
+	bool stack = base >= USERSTACKBOTTOM && end <= USERSTACK;
+	if(!heap && !stack)
+		return false;
+
+	union page_table_entry *ptes = get_pte(as, base, true);	// large pages don't straddle page tables
+	for(unsigned k = 0; k < LPAGE_PAGES; k++) {
+		if(ptes[k].all != 0)
+			return false;
+	}
+
+	spinlock_acquire(&core_map_splk);
+
+	long cmi = frame_alloc(LPAGE_ORDER);	// nothing is evicted to make room for a large page
+	if(cmi < 0) {
+		nlp_fallbacks++;
+		spinlock_release(&core_map_splk);
+		return false;
+	}
+
+	for(unsigned k = 0; k < LPAGE_PAGES; k++) {
+		struct core_map_entry *cme = &core_map[cmi + k];
+
+		KASSERT(cme->va == 0);
+		KASSERT(cme->as == NULL);
+		KASSERT(cme->md.all == 0);
+
+		cme->va = base + k * PAGE_SIZE;
+		cme->as = as;
+		cme->refcount = 1;
+		cme->md.contig = 1;
+		cme->md.busy = 1;	// keep the clock off the frames while they're zeroed
+	}
+	nlp_allocs++;
+
+	spinlock_release(&core_map_splk);
+
+	// user pages must be zeroed, and 64K is too long to hold up the whole core map;
+	// nobody else can get at the PTEs, since we hold the address space spinlock
+	bzero((void *) PADDR_TO_KVADDR(CMI_TO_PADDR(cmi)), LPAGE_SIZE);
+
+	spinlock_acquire(&core_map_splk);
+
+	for(unsigned k = 0; k < LPAGE_PAGES; k++) {
+		core_map[cmi + k].md.busy = 0;
+
+		ptes[k].p = 1;
+		ptes[k].addr = ADDR_TO_FRAME(CMI_TO_PADDR(cmi + k));
+		pte_set_perms(&ptes[k], PROT_READ | PROT_WRITE);
+	}
+
+	spinlock_release(&core_map_splk);
+	return true;
+}
+
+
 // *** 'as_splk' marks whether the address space spinlock is held when calling the function
 // *** If not 'as_splk', the CME has its busy bit set at the end - remember to unset and wake
-// 'perms' is nonzero when calling from as_define_region()
+// 'perms' holds the PROT_ bits of the segment the page is in.
 // If no flags are set, appropriate default values for stack/heap are used 
 // (but vaddr must be a valid stack/heap address).
 // Returns 0 upon success.
@@ -459,9 +1133,10 @@ int alloc_upage(struct addrspace *as, vaddr_t vaddr, uint8_t perms, bool as_splk
 	union page_table_entry new_pte;
 	new_pte.all = 0;
 
-	if(perms == 0) {	// allow mappings outside heap/stack for as_define_region()
+	if(perms == 0) {	// allow mappings outside heap/stack for segments
 		if(vaddr < as->heap_bottom || (vaddr >= as->heap_top && vaddr < USERSTACKBOTTOM) || vaddr >= USERSTACK)
 			return EINVAL;
+		perms = PROT_READ | PROT_WRITE;
 	}
 
 	if(!as_splk)
@@ -482,9 +1157,12 @@ int alloc_upage(struct addrspace *as, vaddr_t vaddr, uint8_t perms, bool as_splk
 
 	core_map[i].va = vaddr;
 	core_map[i].as = as;
+	core_map[i].refcount = 1;
 	core_map[i].md.all = 0;
+	tlb_states[i].all = 0;
 	new_pte.p = 1;
 	new_pte.addr = ADDR_TO_FRAME(CMI_TO_PADDR(i));
+	pte_set_perms(&new_pte, perms);
 	bzero((void *) PADDR_TO_KVADDR(CMI_TO_PADDR(i)), PAGE_SIZE);	// user pages must be zeroed
 	*pte = new_pte;
 
@@ -515,75 +1193,89 @@ void free_upage(struct addrspace *as, vaddr_t vaddr, bool as_splk) {
 	while(pte->b)
 		wchan_sleep(as->addr_wchan, &as->addr_splk);
 
-	if(pte->p) {
+	if(pte->addr == 0) {	// file page evicted while we waited
+		if(!as_splk)
+			spinlock_release(&as->addr_splk);
+		return;
+	}
+
+	spinlock_acquire(&core_map_splk);
 
+	if(pte->p && CMI_IS_FILE(PTE_TO_CMI(pte))) {
 		unsigned long i = PTE_TO_CMI(pte);
 
-		spinlock_acquire(&core_map_splk);
+		// Whoever has a file page busy just to read or write its data doesn't
+		// need us to wait, only a walk of its mappers (see fpage_write() and
+		// fpage_unmap_all()), which may take it away from us. Other address
+		// spaces map it too, so the TLB state doesn't tell us about ours.
+		while(core_map[i].md.walk) {
+			cme_sleep(as, i);
 
-		while(core_map[i].md.busy) {	// wait until the physical page isn't busy
-			spinlock_release(&core_map_splk);
+			if(!pte->p)
+				goto gone;
+		}
 
-			wchan_sleep(as->addr_wchan, &as->addr_splk);
+		tlb_invalidate(as, vaddr);
+		asid_drop_others(as);
+
+		fpage_unmap(i, as, vaddr);
+	}
+	else if(pte->p) {
+
+		unsigned long i = PTE_TO_CMI(pte);
+
+		while(core_map[i].md.busy) {	// wait until the physical page isn't busy
+			cme_sleep(as, i);
 
 			if(!pte->p)
 				goto swapped;
-
-			spinlock_acquire(&core_map_splk);
 		}
 
 		KASSERT(core_map[i].va != 0);
-		KASSERT(core_map[i].as == as);
 		KASSERT(core_map[i].md.kernel == 0);
 		KASSERT(core_map[i].md.busy == 0);
 		KASSERT(pte->b == 0);
 
-		if(core_map[i].md.tlb == 1) {							// I don't think this case is in any of the tests,
-			int result = tlb_probe(TLBHI_VPAGE & vaddr, 0);		// but remove freed mappings from the TLB so attempts
-			if(result >= 0)										// to access them fail in the right way
-				tlb_write(TLBHI_INVALID(result), TLBLO_INVALID(), result);
+		if(tlb_states[i].tlb == 1) {		// I don't think this case is in any of the tests,
+			tlb_invalidate(as, vaddr);		// but remove freed mappings from the TLB so attempts
+			asid_drop_others(as);			// to access them fail in the right way
 		}
 
-		bool s_pres = core_map[i].md.s_pres;		// keep these values stored temporarily
-		unsigned long swapi = core_map[i].md.swap;	// to make the spinlock hopping easier
+		if(pte->pf)
+			npf_misses++;
 
-		core_map[i].va = 0;
-		core_map[i].as = NULL;
-		core_map[i].md.all = 0;
-		nfree++;
+		if(core_map[i].refcount > 1) {	// other address spaces still share the page
+			cow_unshare(i, as);
+		}
+		else {
+			KASSERT(core_map[i].as == as);
 
-		if(s_pres) {
-			spinlock_release(&core_map_splk);
-			spinlock_release(&as->addr_splk);	
-			lock_acquire(swap_lk);
+			lpage_split(i);		// the frame goes back to the allocator on its own
 
-			bitmap_unmark(swap_bitmap, swapi);
-			nswap--;
+			if(core_map[i].md.s_pres)
+				swap_unref(core_map[i].md.swap);
 
-			lock_release(swap_lk);
-			spinlock_acquire(&as->addr_splk);
-		}
-		else {
-			spinlock_release(&core_map_splk);
+			core_map[i].va = 0;
+			core_map[i].as = NULL;
+			core_map[i].refcount = 0;
+			core_map[i].md.all = 0;
+			tlb_states[i].all = 0;
+			frame_free(i, 1);
 		}
 	}
 	else {
 
 		swapped:
 
-		spinlock_release(&as->addr_splk);	
 		// no other thread will access a pte that's only in swap, 
 		// so we don't need to set the busy bit
 
-		lock_acquire(swap_lk);
-
-		bitmap_unmark(swap_bitmap, pte->addr);
-		nswap--;
+		swap_unref(pte->addr);
+	}
 
-		lock_release(swap_lk);
+	gone:
 
-		spinlock_acquire(&as->addr_splk);
-	}
+	spinlock_release(&core_map_splk);
 
 	pte->all = 0;
 
@@ -592,6 +1284,56 @@ void free_upage(struct addrspace *as, vaddr_t vaddr, bool as_splk) {
 }
 
 
+// *** Assumes no spinlocks are held
+// Allocate the page at 'vaddr' and fill 'len' bytes of it from 'pgoff' on with
+// data read from 'v' at 'pos'; the rest stays zeroed. Used for pages of lazily
+// loaded executable segments. The page is busy while the file system reads into
+// it, so it can't be swapped out from under the read.
+int alloc_upage_file(struct addrspace *as, vaddr_t vaddr, uint8_t perms, struct vnode *v, off_t pos, size_t pgoff, size_t len) {
+	KASSERT(perms != 0);
+	KASSERT(pgoff + len <= PAGE_SIZE);
+
+	spinlock_acquire(&as->addr_splk);
+
+	union page_table_entry *pte = get_pte(as, vaddr, true);
+	if(pte->addr != 0) {	// someone else got here first
+		spinlock_release(&as->addr_splk);
+		return 0;
+	}
+
+	int err = alloc_upage(as, vaddr, perms, true);
+	if(err != 0) {
+		spinlock_release(&as->addr_splk);
+		return err;
+	}
+
+	spinlock_acquire(&core_map_splk);
+	unsigned long cmi = PTE_TO_CMI(pte);
+	core_map[cmi].md.busy = 1;
+	spinlock_release(&core_map_splk);
+	spinlock_release(&as->addr_splk);
+
+	if(len > 0) {
+		struct iovec iov;
+		struct uio ku;
+		uio_kinit(&iov, &ku, (void *) (PADDR_TO_KVADDR(CMI_TO_PADDR(cmi)) + pgoff), len, pos, UIO_READ);
+		err = VOP_READ(v, &ku);		// a short read just leaves zeros
+	}
+
+	spinlock_acquire(&as->addr_splk);
+	spinlock_acquire(&core_map_splk);
+	core_map[cmi].md.busy = 0;
+	spinlock_release(&core_map_splk);
+	wchan_wakeall(as->addr_wchan, &as->addr_splk);
+
+	if(err != 0)
+		free_upage(as, vaddr, true);
+
+	spinlock_release(&as->addr_splk);
+	return err;
+}
+
+
 // *** Assumes no spinlocks are held
 // Calls alloc_upage() multiple times with error handling. Success is all or nothing.
 int alloc_upages(struct addrspace *as, vaddr_t vaddr, unsigned npages, uint8_t perms) {
@@ -623,7 +1365,7 @@ void free_upages(struct addrspace *as, vaddr_t vaddr, unsigned npages) {
 	// (while including entire page tables in the middle)
 
 	unsigned long l1_start = L1INDEX(vaddr);
-	unsigned long l1_max = l1_start + ROUND_UP(npages, NUM_PTES);
+	unsigned long l1_max = L1INDEX(vaddr + npages * PAGE_SIZE - 1) + 1;	// regions can straddle page tables
 	for(unsigned long i = l1_start; i < l1_max; i++) {
 
 		if(ptd->pts[i] != 0) {
@@ -639,7 +1381,7 @@ void free_upages(struct addrspace *as, vaddr_t vaddr, unsigned npages) {
 					free_upage(as, L12_TO_VADDR(i, j), true);	
 			}
 			if(l2_start == 0 && l2_max == NUM_PTES) {
-				kfree(ptd->pts[i]);
+				kcache_free(pt_cache, ptd->pts[i]);
 				ptd->pts[i] = 0;
 			}
 		}
@@ -650,11 +1392,261 @@ void free_upages(struct addrspace *as, vaddr_t vaddr, unsigned npages) {
 
 
 // *** Assumes no spinlocks are held
-// Deep copies the contents of 'old' into 'new'
+// *** Assumes the file page at 'cmi' is busy from pcache_get() (by way of VOP_MMAP)
+// Map the file page at 'cmi' at 'vaddr' in 'as' with the PROT_ bits in 'perms'
+// and let go of it. 'v' is the file, which the mapping's region holds.
+void map_fpage(struct addrspace *as, vaddr_t vaddr, unsigned long cmi, uint8_t perms, struct vnode *v) {
+	KASSERT(vaddr < USERSPACETOP);
+
+	union page_table_entry new_pte;
+	new_pte.all = 0;
+
+	struct cow_sharer *mapper = cow_sharer_get();
+
+	spinlock_acquire(&as->addr_splk);
+
+	union page_table_entry *pte = get_pte(as, vaddr, true);
+
+	KASSERT(pte->addr == 0);
+
+	spinlock_acquire(&core_map_splk);
+
+	while(core_map[cmi].md.walk)
+		cme_sleep(as, cmi);
+
+	mapper->as = as;
+	mapper->va = vaddr;
+	mapper->vn = v;
+	mapper->next = cow_sharers[cmi];
+	cow_sharers[cmi] = mapper;
+
+	pcache_map(cmi);
+
+	new_pte.p = 1;
+	new_pte.addr = ADDR_TO_FRAME(CMI_TO_PADDR(cmi));
+	pte_set_perms(&new_pte, perms);
+	*pte = new_pte;
+
+	spinlock_release(&core_map_splk);
+	spinlock_release(&as->addr_splk);
+}
+
+
+// *** Assumes the core map spinlock is held, and no other spinlocks
+// *** Assumes nobody is walking the mappers of the mapped file page at 'cmi'
+// *** or writing it back
+// Write the file page at 'cmi' back through the file system straight from its
+// frame, and return with no spinlocks held. It's marked clean and shot down
+// from its mappers' TLBs first, so their next write goes through perms_fault()
+// and dirties it again, and anything they wrote before that is in the frame
+// when it's written. Holding a reference keeps the frame from being freed.
+static int fpage_write(unsigned long cmi) {
+	struct core_map_entry *cme = &core_map[cmi];
+
+	KASSERT(CMI_IS_MAPPED_FILE(cmi));
+	KASSERT(cme->md.walk == 0);
+	KASSERT(cme->md.wback == 0);
+
+	if(!pcache_needs_wback(cmi)) {
+		if(cme->md.dirty) {		// truncated away, so it's never written back
+			cme->md.dirty = 0;
+			nfdirty--;
+		}
+		spinlock_release(&core_map_splk);
+		return 0;
+	}
+
+	struct vnode *v = cow_sharers[cmi]->vn;	// every mapper's region holds the file
+	off_t pos = (off_t) pcache_entries[cmi].pgno * PAGE_SIZE;
+	bool intlb = tlb_states[cmi].tlb;
+
+	cme->md.dirty = 0;
+	nfdirty--;
+	cme->md.walk = 1;	// the mappers (and so their regions and 'v') stay put
+	cme->md.wback = 1;
+	cme->refcount++;
+
+	spinlock_release(&core_map_splk);
+
+	VOP_INCREF(v);
+
+	if(intlb) {		// write-protect the page everywhere
+		for(struct cow_sharer *s = cow_sharers[cmi]; s != NULL; s = s->next) {
+			const struct tlbshootdown ts = {TLBHI_VPAGE & s->va, s->as};
+			ipi_broadcast_tlbshootdown(&ts);
+		}
+	}
+
+	spinlock_acquire(&core_map_splk);
+	cme->md.walk = 0;
+	wchan_wakeall(pcache_wchan, &core_map_splk);
+	spinlock_release(&core_map_splk);
+
+	struct stat st;
+	int result = VOP_STAT(v, &st);
+	if(result == 0 && pos < st.st_size) {	// writing through a mapping doesn't make the file longer
+		size_t n = st.st_size - pos < PAGE_SIZE ? st.st_size - pos : PAGE_SIZE;
+
+		struct iovec iov;
+		struct uio ku;
+		uio_kinit(&iov, &ku, (void *) cme->va, n, pos, UIO_WRITE);
+		result = VOP_WRITE(v, &ku);		// pcache_write() sees it's the page itself
+	}
+
+	VOP_DECREF(v);
+
+	spinlock_acquire(&core_map_splk);
+
+	if(result != 0 && !cme->md.dirty) {	// try again next time
+		cme->md.dirty = 1;
+		nfdirty++;
+	}
+
+	cme->md.wback = 0;
+	wchan_wakeall(pcache_wchan, &core_map_splk);
+	pcache_unmap(cmi);
+
+	spinlock_release(&core_map_splk);
+	return result;
+}
+
+
+// *** Assumes no spinlocks are held
+// If 'vaddr' maps a file page that's been written through a shared mapping,
+// write it back to the file. A write-back that's already going on may have
+// missed what was written through 'vaddr', so it's waited out first.
+int fpage_sync(struct addrspace *as, vaddr_t vaddr) {
+	spinlock_acquire(&as->addr_splk);
+
+	if(as->ptd->pts[L1INDEX(vaddr)] == NULL) {
+		spinlock_release(&as->addr_splk);
+		return 0;
+	}
+
+	union page_table_entry *pte = VADDR_TO_PTE(as->ptd, vaddr);
+
+	spinlock_acquire(&core_map_splk);
+
+	while(pte->p && CMI_IS_FILE(PTE_TO_CMI(pte))
+			&& (core_map[PTE_TO_CMI(pte)].md.walk || core_map[PTE_TO_CMI(pte)].md.wback))
+		cme_sleep(as, PTE_TO_CMI(pte));
+
+	if(!pte->p || !CMI_IS_FILE(PTE_TO_CMI(pte)) || !core_map[PTE_TO_CMI(pte)].md.dirty) {
+		spinlock_release(&core_map_splk);
+		spinlock_release(&as->addr_splk);
+		return 0;
+	}
+
+	unsigned long cmi = PTE_TO_CMI(pte);
+	spinlock_release(&as->addr_splk);
+
+	return fpage_write(cmi);
+}
+
+
+// *** Assumes no spinlocks are held
+// *** Assumes 'vaddr' is in a mmap() region of 'as', the current address space
+// Fault in the page at 'vaddr', ready to be written to if 'write' (so a private
+// mapping gets its own copy now), and if it's a file page, pin it so it isn't
+// evicted until fpage_unpin(). '*pinned' says whether it was.
+int fpage_pin(struct addrspace *as, vaddr_t vaddr, bool write, bool *pinned) {
+	*pinned = false;
+
+	while(true) {
+		int err = tlb_miss(as, vaddr, write);
+		if(err == 0 && write)
+			err = perms_fault(as, vaddr);
+		if(err != 0)
+			return err;
+
+		spinlock_acquire(&as->addr_splk);
+
+		union page_table_entry *pte = VADDR_TO_PTE(as->ptd, vaddr);
+		if(!pte->p || pte->b) {		// evicted already
+			spinlock_release(&as->addr_splk);
+			continue;
+		}
+
+		spinlock_acquire(&core_map_splk);
+
+		unsigned long cmi = PTE_TO_CMI(pte);
+		if(CMI_IS_FILE(cmi) && core_map[cmi].md.walk) {	// it may be on its way out
+			cme_sleep(as, cmi);
+			spinlock_release(&core_map_splk);
+			spinlock_release(&as->addr_splk);
+			continue;
+		}
+
+		if(CMI_IS_FILE(cmi)) {
+			pcache_entries[cmi].pins++;
+			*pinned = true;
+		}
+
+		spinlock_release(&core_map_splk);
+		spinlock_release(&as->addr_splk);
+		return 0;
+	}
+}
+
+
+// *** Assumes no spinlocks are held
+// Undo fpage_pin() of the page at 'vaddr', if it pinned a file page. Nothing can
+// have changed that in between: pinned pages aren't evicted, private mappings
+// were copied when they were pinned for writing, and only we unmap our pages.
+void fpage_unpin(struct addrspace *as, vaddr_t vaddr) {
+	spinlock_acquire(&as->addr_splk);
+	spinlock_acquire(&core_map_splk);
+
+	union page_table_entry *pte = VADDR_TO_PTE(as->ptd, vaddr);
+
+	if(pte->p && CMI_IS_FILE(PTE_TO_CMI(pte))) {	// (a private copy may be in swap)
+		KASSERT(pcache_entries[PTE_TO_CMI(pte)].pins > 0);
+		pcache_entries[PTE_TO_CMI(pte)].pins--;
+	}
+
+	spinlock_release(&core_map_splk);
+	spinlock_release(&as->addr_splk);
+}
+
+
+// *** Assumes no spinlocks are held
+// Write back up to 'max' dirty mapped file pages, starting at the clock hand
+// (the pages that will be evicted soonest), so they can be evicted.
+static void fpage_clean(unsigned long max) {
+	unsigned long i = clock, n = 0;
+
+	for(unsigned long t = 0; t < ncmes && n < max; t++, i++) {
+		if(i >= ncmes)
+			i = 0;
+		if(!CMI_IS_MAPPED_FILE(i) || !core_map[i].md.dirty)	// only lock for likely pages
+			continue;
+
+		spinlock_acquire(&core_map_splk);
+
+		if(CMI_IS_MAPPED_FILE(i) && core_map[i].md.dirty && !core_map[i].md.walk && !core_map[i].md.wback) {
+			fpage_write(i);		// nobody to tell if this fails; the page stays dirty
+			n++;
+		}
+		else {
+			spinlock_release(&core_map_splk);
+		}
+	}
+}
+
+
+// *** Assumes no spinlocks are held
+// *** Assumes 'old' is the current address space and 'new' isn't running yet
+// Copies the contents of 'old' into 'new' copy on write: pages in memory are shared
+// until one side writes to them (see perms_fault()), and pages in swap share their
+// swap index, so fork doesn't have to copy or read in anything.
 void pth_copy(struct addrspace *old, struct addrspace *new) {
 
+	struct cow_sharer *sharer = NULL;
+
 	spinlock_acquire(&old->addr_splk);
 
+	asid_drop_others(old);	// other CPUs may still have writeable entries for pages we're about to share
+
 	struct page_table_directory *old_ptd = old->ptd;
 
 	unsigned long max = L1INDEX(USERSPACETOP);	// no page tables address MIPS_KSEG0 or up
@@ -664,88 +1656,100 @@ void pth_copy(struct addrspace *old, struct addrspace *new) {
 			for(unsigned long j = 0; j < NUM_PTES; j++) {
 				if(old_pt->ptes[j].addr != 0) {
 					union page_table_entry *old_pte = &old_pt->ptes[j];
-
-					spinlock_release(&old->addr_splk);
-					union page_table_entry *new_pte = get_pte(new, L12_TO_VADDR(i,j), false);
-					spinlock_acquire(&old->addr_splk);
-
-					new_pte->addr = 0;
-					new_pte->p = 1;
+					vaddr_t vaddr = L12_TO_VADDR(i,j);
 
 					spinlock_release(&old->addr_splk);
 
-					int err = alloc_upage(new, L12_TO_VADDR(i,j), 1, false);
-					// use '1' for perms so that any region is valid, not just stack/heap
+					union page_table_entry *new_pte = get_pte(new, vaddr, false);
+					if(sharer == NULL)
+						sharer = cow_sharer_get();
 
 					spinlock_acquire(&old->addr_splk);
-					spinlock_acquire(&new->addr_splk);	// nothing will acquire new then old, so this won't deadlock
-					spinlock_acquire(&core_map_splk);
-
-					core_map[PTE_TO_CMI(new_pte)].md.busy = 0;
-					wchan_wakeall(new->addr_wchan, &new->addr_splk);
-
-					spinlock_release(&new->addr_splk);
 
-					KASSERT(err == 0);
+					while(true) {
+						while(old_pte->b)	// wait out swapping
+							wchan_sleep(old->addr_wchan, &old->addr_splk);
 
-					if(!old_pte->p) {	// read from swap into the new page
-					
-						struct core_map_entry *cme = &core_map[PTE_TO_CMI(new_pte)];
+						spinlock_acquire(&new->addr_splk);	// nothing will acquire new then old, so this won't deadlock
+						spinlock_acquire(&core_map_splk);
 
-						cme->md.busy = 1;
-						old_pte->b = 1;
+						if(!old_pte->p)
+							break;
+						if(CMI_IS_FILE(PTE_TO_CMI(old_pte)) ? !core_map[PTE_TO_CMI(old_pte)].md.walk
+								: !core_map[PTE_TO_CMI(old_pte)].md.busy)	// see free_upage()
+							break;
 
+						spinlock_release(&new->addr_splk);	// the sharers of a busy page can't change,
+						cme_sleep(old, PTE_TO_CMI(old_pte));	// so wait for it to be released
 						spinlock_release(&core_map_splk);
-						spinlock_release(&old->addr_splk);
-
-						lock_acquire(swap_lk);
-
-						struct iovec iov;
-						struct uio uio;
-						uio_kinit(&iov, &uio, (void *) PADDR_TO_KVADDR(CMI_TO_PADDR(PTE_TO_CMI(new_pte))), PAGE_SIZE, old_pte->addr * PAGE_SIZE, UIO_READ);
+					}
 
-						int err = VOP_READ(swap_vnode, &uio);
-						if(err != 0)
-							panic("Read from swap failed\n");
+					KASSERT(old_pte->b == 0);
+					KASSERT(new_pte->all == 0);
 
-						lock_release(swap_lk);
+					if(old_pte->addr == 0) {	// file page evicted while we waited
+						spinlock_release(&core_map_splk);
+						spinlock_release(&new->addr_splk);
+						continue;
+					}
 
-						spinlock_acquire(&old->addr_splk);
-						spinlock_acquire(&new->addr_splk);
-						spinlock_acquire(&core_map_splk);
+					if(old_pte->p && CMI_IS_FILE(PTE_TO_CMI(old_pte))) {
+						// the child maps the same file page (private
+						// mappings copy it when they're written to),
+						// and its copy of the region holds the same file
+						unsigned long cmi = PTE_TO_CMI(old_pte);
+
+						sharer->as = new;
+						sharer->va = vaddr;
+						sharer->vn = (*fpage_mapper(cmi, old, vaddr))->vn;
+						sharer->next = cow_sharers[cmi];
+						cow_sharers[cmi] = sharer;
+						sharer = NULL;
+						core_map[cmi].refcount++;
+					}
+					else if(old_pte->p) {
+						unsigned long cmi = PTE_TO_CMI(old_pte);
+						struct core_map_entry *cme = &core_map[cmi];
 
-						KASSERT(cme->md.busy == 1);
-						KASSERT(old_pte->b == 1);
+						KASSERT(cme->md.kernel == 0);
+						KASSERT(cme->refcount > 0);
 
-						cme->md.busy = 0;
-						old_pte->b = 0;
-						
-						wchan_wakeall(old->addr_wchan, &old->addr_splk);
-						wchan_wakeall(new->addr_wchan, &new->addr_splk);
+						sharer->as = new;
+						sharer->next = cow_sharers[cmi];
+						cow_sharers[cmi] = sharer;
+						sharer = NULL;
+						cme->refcount++;
 
-						spinlock_release(&new->addr_splk);
+						if(tlb_states[cmi].tlb)		// 'old' may have the page mapped writeable in this TLB
+							tlb_invalidate(old, vaddr);
 					}
 					else {
-						KASSERT(core_map[PTE_TO_CMI(new_pte)].md.busy == 0);
-						KASSERT(core_map[PTE_TO_CMI(new_pte)].as == new);
-
-						memcpy((void *) PADDR_TO_KVADDR(FRAME_TO_ADDR(new_pte->addr)), 
-								(void *) PADDR_TO_KVADDR(FRAME_TO_ADDR(old_pte->addr)), 
-								PAGE_SIZE);
+						KASSERT(swap_refs[old_pte->addr] > 0);
+						swap_refs[old_pte->addr]++;
 					}
+
+					*new_pte = *old_pte;
+					new_pte->pf = 0;	// only count prefetch hits once
+
 					spinlock_release(&core_map_splk);
+					spinlock_release(&new->addr_splk);
 				}
 			}
 		}
 	}
 
 	spinlock_release(&old->addr_splk);
+
+	if(sharer != NULL)
+		kfree(sharer);
 }
 
 
-// Handle a readonly fault (which in OS161 just manages the dirty bit since
-// permissions aren't actually supported)
+// Handle a readonly fault (which in OS161 manages the dirty bit since
+// permissions aren't actually supported, and breaks copy on write sharing)
 int perms_fault(struct addrspace *as, vaddr_t faultaddress) {
+	struct mmap_region *mr = mmap_find(as, faultaddress);
+
 	spinlock_acquire(&as->addr_splk);
 
 	union page_table_entry *pte = VADDR_TO_PTE(as->ptd, faultaddress);
@@ -755,6 +1759,11 @@ int perms_fault(struct addrspace *as, vaddr_t faultaddress) {
 	while(pte->b) 
 		wchan_sleep(as->addr_wchan, &as->addr_splk);
 
+	if(pte->addr != 0 && !pte->w) {	// read-only segment or mapping
+		spinlock_release(&as->addr_splk);
+		return EFAULT;
+	}
+
 	if(!pte->p) {
 		spinlock_release(&as->addr_splk);
 		return 0;	// succeed so that the user program will fault again with a TLB miss
@@ -764,12 +1773,8 @@ int perms_fault(struct addrspace *as, vaddr_t faultaddress) {
 
 	spinlock_acquire(&core_map_splk);
 
-	while(core_map[i].md.busy) {
-		spinlock_release(&core_map_splk);
-
-		wchan_sleep(as->addr_wchan, &as->addr_splk);
-
-		spinlock_acquire(&core_map_splk);
+	while(CMI_IS_FILE(i) ? core_map[i].md.walk : core_map[i].md.busy) {	// see free_upage() about file pages
+		cme_sleep(as, i);
 
 		if(!pte->p)
 			break;
@@ -781,31 +1786,123 @@ int perms_fault(struct addrspace *as, vaddr_t faultaddress) {
 		return 0;	// succeed so that the user program will fault again with a TLB miss
 	}
 
-	core_map[i].md.dirty = 1;
-	ndirty++;
+	if(CMI_IS_FILE(i)) {
+		KASSERT(mr != NULL);
+
+		if(!mr->mr_shared) {	// a private mapping gets its own copy of the file page
+			long new = find_cmi(as);
+
+			KASSERT(core_map[new].md.busy == 0);
+			KASSERT(core_map[new].md.kernel == 0);
+			KASSERT(core_map[new].va == 0);
+			KASSERT(core_map[new].as == NULL);
+
+			while(pte->p && core_map[i].md.walk)	// find_cmi() may have let go of the spinlocks
+				cme_sleep(as, i);					// (the new frame is ours, with an empty CME)
+
+			if(!pte->p) {		// 'i' was evicted meanwhile
+				frame_free(new, 1);
+				spinlock_release(&core_map_splk);
+				spinlock_release(&as->addr_splk);
+				return 0;		// succeed so that the user program will fault again with a TLB miss
+			}
+
+			memcpy((void *) PADDR_TO_KVADDR(CMI_TO_PADDR(new)),
+					(void *) PADDR_TO_KVADDR(CMI_TO_PADDR(i)),
+					PAGE_SIZE);
+
+			core_map[new].va = faultaddress & PAGE_FRAME;
+			core_map[new].as = as;
+			core_map[new].refcount = 1;
+			core_map[new].md.all = 0;
+			tlb_states[new].all = 0;
+
+			fpage_unmap(i, as, faultaddress & PAGE_FRAME);
+
+			pte->addr = ADDR_TO_FRAME(CMI_TO_PADDR(new));
+
+			asid_drop_others(as);	// forget entries for the file page on other CPUs
+
+			i = new;
+		}
+		// writes through a shared mapping go to the file page itself
+	}
+	else if(core_map[i].refcount > 1) {	// copy on write
+		lpage_split(i);
+
+		core_map[i].md.busy = 1;	// keep the shared page from being swapped out or unshared
+		pte->b = 1;					// while we find a page to copy it into
+
+		long new = find_cmi(as);
+
+		KASSERT(core_map[new].md.busy == 0);
+		KASSERT(core_map[new].md.kernel == 0);
+		KASSERT(core_map[new].va == 0);
+		KASSERT(core_map[new].as == NULL);
+
+		memcpy((void *) PADDR_TO_KVADDR(CMI_TO_PADDR(new)),
+				(void *) PADDR_TO_KVADDR(CMI_TO_PADDR(i)),
+				PAGE_SIZE);
+
+		core_map[new].va = faultaddress & PAGE_FRAME;
+		core_map[new].as = as;
+		core_map[new].refcount = 1;
+		core_map[new].md.all = 0;
+		tlb_states[new].all = 0;
+
+		cow_unshare(i, as);
+		core_map[i].md.busy = 0;
+		wchan_wakeall(cow_wchan, &core_map_splk);
+
+		pte->addr = ADDR_TO_FRAME(CMI_TO_PADDR(new));
+		pte->b = 0;
+		wchan_wakeall(as->addr_wchan, &as->addr_splk);
+
+		asid_drop_others(as);	// forget entries for the shared page on other CPUs
+
+		i = new;
+	}
+
+	bool fdirtied = false;
+
+	if(!core_map[i].md.dirty) {
+		core_map[i].md.dirty = 1;
+		if(CMI_IS_FILE(i)) {
+			nfdirty++;
+			fdirtied = true;
+		}
+		else {
+			ndirty++;	// ndirty is what the write-back daemon has to write to swap
+		}
+	}
 
 	// spinlock turns off interrupts, so TLB won't get messed up
 
 	uint32_t entryhi, entrylo;
 
-	entryhi = faultaddress & TLBHI_VPAGE;
-
-	uint32_t j = tlb_probe(entryhi, 0);
-	tlb_read(&entryhi, &entrylo, j);
+	entryhi = (faultaddress & TLBHI_VPAGE) | asid_pid(as);
+	entrylo = (FRAME_TO_ADDR(pte->addr) & TLBLO_PPAGE) | TLBLO_VALID | TLBLO_DIRTY;
 
-	entrylo |= TLBLO_DIRTY;
-	tlb_write(entryhi, entrylo, j);
+	int j = tlb_probe(entryhi, 0);
+	if(j >= 0) {	// otherwise it'll be loaded (clean) on the next TLB miss
+		tlb_write(entryhi, entrylo, j);
+		tlb_states[i].tlb = 1;
+	}
 
 	spinlock_release(&core_map_splk);
 	spinlock_release(&as->addr_splk);
 
+	// Not from copyin()/copyout(), which may be in the middle of the file system.
+	if(fdirtied && nfdirty > ncmes / FDIRTY_DENOM && curthread->t_machdep.tm_badfaultfunc == NULL)
+		fpage_clean(SWAP_BATCH);
+
 	return 0;
 }
 
 
-// *** Assumes address space and core map spinlocks are held
+// *** Assumes the spinlock of 'as' is held, and the core map spinlock if 'cm_splk'
 // Returns the index of an entry in the TLB to be replaced.
-static unsigned long choose_tlb_entry() {
+static unsigned long choose_tlb_entry(struct addrspace *as, bool cm_splk) {
 	uint32_t oldentryhi = 0, oldentrylo = 0;
 	unsigned long old_cmi;
 	unsigned long tlbi;
@@ -824,48 +1921,132 @@ static unsigned long choose_tlb_entry() {
 	} while (core_map[old_cmi].md.busy);	// avoid busy entries - more trouble than they're worth
 
 	if(old_cmi != 0) {
-		core_map[old_cmi].md.tlb = 0;
-		core_map[old_cmi].md.recent = 1;
+		struct core_map_entry *cme = &core_map[old_cmi];
+		struct addrspace *old_as = cme->as;
+
+		// The page may still be in a TLB if the entry was left over from a dead ASID,
+		// if it's shared (or a file page), or if the owner has a live ASID on another cpu.
+		// Without the core map spinlock, only the pages of 'as' are sure to stay put
+		// while we look, so other pages are left marked as in the TLB to be safe.
+		if((cm_splk || old_as == as) && cme->refcount == 1 && old_as != NULL
+				&& asid_live(old_as, curcpu->c_number)
+				&& (oldentryhi & TLBHI_PID) == ASID_TO_TLBHI(old_as->asids[curcpu->c_number])
+				&& !asid_live_elsewhere(old_as))
+			tlb_states[old_cmi].tlb = 0;
+		tlb_states[old_cmi].recent = 1;
 	}
 
 	return tlbi;
 }
 
 
+// *** Assumes the address space spinlock is held, and the core map spinlock if 'cm_splk'
+// *** Assumes the page at 'pte' is present and its PTE isn't busy
+// Load a TLB entry for the page at 'vaddr'. Entries are loaded clean, so the
+// first write goes through perms_fault() and we can track the dirty bit.
+static void tlb_load(struct addrspace *as, vaddr_t vaddr, union page_table_entry *pte, bool cm_splk) {
+	unsigned long cmi = PTE_TO_CMI(pte);
+	tlb_states[cmi].tlb = 1;
+
+	if(core_map[cmi].md.contig) {	// large pages are rare enough to count under the lock
+		if(!cm_splk)
+			spinlock_acquire(&core_map_splk);
+		if(core_map[cmi].md.contig)
+			nlp_hits++;
+		if(!cm_splk)
+			spinlock_release(&core_map_splk);
+	}
+
+	uint32_t newentryhi = 0, newentrylo = 0;
+
+	newentryhi = (vaddr & TLBHI_VPAGE) | asid_pid(as);
+	newentrylo = (FRAME_TO_ADDR(pte->addr) & TLBLO_PPAGE) | TLBLO_VALID;
+
+	unsigned long tlbi = choose_tlb_entry(as, cm_splk);
+
+	tlb_write(newentryhi, newentrylo, tlbi);
+}
+
+
 // Handle read and write faults
-int tlb_miss(struct addrspace *as, vaddr_t faultaddress) {
+// Pages are always loaded clean, so the first write goes through perms_fault(),
+// except that writes to read-only pages fail here and now.
+//
+// Most misses are on pages that are already in memory, and those only need the
+// address space spinlock: while we hold it and the PTE isn't busy, the page
+// can't be freed, and swap_out() (which marks the PTE busy under it before
+// looking at the TLB state) will see that we loaded it. So faults in different
+// address spaces don't serialize on the core map spinlock.
+int tlb_miss(struct addrspace *as, vaddr_t faultaddress, bool write) {
 	spinlock_acquire(&as->addr_splk);
 
 	union page_table_entry *pte = get_pte(as, faultaddress, true);
 
+	if(pte->p && !pte->b && !pte->pf && !CMI_IS_FILE(PTE_TO_CMI(pte))) {	// the fast path
+		if(write && !pte->w) {
+			spinlock_release(&as->addr_splk);
+			return EFAULT;
+		}
+
+		tlb_load(as, faultaddress, pte, false);
+
+		spinlock_release(&as->addr_splk);
+		return 0;
+	}
+
 	if(pte->addr == 0) {
-		int err = alloc_upage(as, faultaddress, 0, true);
-		if(err != 0) {
+		struct mmap_region *mr = mmap_find(as, faultaddress);
+		int err;
+
+		struct lazy_region *lr;
+
+		if(mr != NULL) {	// the file system may sleep getting the page
 			spinlock_release(&as->addr_splk);
-			return err;
+			err = mmap_fault(as, mr, faultaddress);
+			if(err != 0)
+				return err;
+			spinlock_acquire(&as->addr_splk);
+		}
+		else if((lr = as_find_region(as, faultaddress)) != NULL) {	// first touch of a segment page
+			spinlock_release(&as->addr_splk);
+			err = as_region_fault(as, lr, faultaddress);
+			if(err != 0)
+				return err;
+			spinlock_acquire(&as->addr_splk);
+		}
+		else if(!lpage_enabled || !alloc_lpage(as, faultaddress)) {
+			err = alloc_upage(as, faultaddress, 0, true);
+			if(err != 0) {
+				spinlock_release(&as->addr_splk);
+				return err;
+			}
 		}
 	}
 	
 	while(pte->b)
 		wchan_sleep(as->addr_wchan, &as->addr_splk);
 
+	if(pte->addr == 0) {	// file page evicted while we waited, so fault again
+		spinlock_release(&as->addr_splk);
+		return 0;
+	}
+
+	if(write && !pte->w) {
+		spinlock_release(&as->addr_splk);
+		return EFAULT;
+	}
+
 	spinlock_acquire(&core_map_splk);
 
 	if(!pte->p)
 		swap_in(as, faultaddress);
 
-	unsigned long cmi = PTE_TO_CMI(pte);
-	core_map[cmi].md.tlb = 1;
-
-	uint32_t newentryhi = 0, newentrylo = 0;
-
-	newentryhi = faultaddress & TLBHI_VPAGE;
-	newentrylo = (FRAME_TO_ADDR(pte->addr) & TLBLO_PPAGE) | TLBLO_VALID;
-	// write permissions aren't set so we can track the dirty bit
-
-	unsigned long tlbi = choose_tlb_entry();
+	if(pte->pf) {	// read around an earlier fault
+		pte->pf = 0;
+		npf_hits++;
+	}
 
-	tlb_write(newentryhi, newentrylo, tlbi);
+	tlb_load(as, faultaddress, pte, true);
 
 	spinlock_release(&core_map_splk);
 	spinlock_release(&as->addr_splk);
@@ -875,7 +2056,7 @@ int tlb_miss(struct addrspace *as, vaddr_t faultaddress) {
 
 
 // Invalidate all entries in this cpu's TLB
-// Used in as_activate()
+// Used when this cpu runs out of ASIDs
 void invalidate_tlb(void) {
 	for(unsigned i = 0; i < NUM_TLB; i++)
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
@@ -884,9 +2065,7 @@ void invalidate_tlb(void) {
 
 // Respond to an ipi_tlbshootdown
 void vm_tlbshootdown(const struct tlbshootdown *ts) {
-	int result = tlb_probe(ts->oldentryhi, 0);
-	if(result >= 0)	// shoot down the TLB entry
-		tlb_write(TLBHI_INVALID(result), TLBLO_INVALID(), result);
+	tlb_invalidate(ts->as, ts->oldentryhi);	// only the entry with the address space's ASID
 
 	spinlock_acquire(&ts_splk);
 
@@ -895,4 +2074,4 @@ void vm_tlbshootdown(const struct tlbshootdown *ts) {
 		wchan_wakeall(ts_wchan, &ts_splk);
 
 	spinlock_release(&ts_splk);
-}
\ No newline at end of file
+}
@@ -843,9 +843,11 @@ emufs_namefile(struct vnode *v, struct uio *uio)
  */
 static
 int
-emufs_mmap(struct vnode *v)
+emufs_mmap(struct vnode *v, off_t pos, unsigned long *ret)
 {
 	(void)v;
+	(void)pos;
+	(void)ret;
 	return ENOSYS;
 }
 
@@ -1116,7 +1118,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_gettype = emufs_dir_gettype,
 	.vop_isseekable = emufs_isseekable,
 	.vop_fsync = emufs_void_op_isdir,
-	.vop_mmap = emufs_void_op_isdir,
+	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = emufs_truncate_isdir,
 	.vop_namefile = emufs_namefile,
 
@@ -1271,6 +1273,8 @@ static const struct fs_ops emufs_fsops = {
 	/* we don't do block I/O */
 	.fsop_readblock = NULL,
 	.fsop_writeblock = NULL,
+	.fsop_readblocks = NULL,
+	.fsop_writeblocks = NULL,
 };
 
 /*
@@ -36,7 +36,10 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <current.h>
+#include <thread.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,15 +99,209 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Disk requests.
+ *
+ * Each lhd_io call becomes one request (or, for user buffers, a
+ * series of them through a kernel bounce buffer) on the disk's queue.
+ * The device moves one sector at a time through its on-card buffer;
+ * whenever a sector finishes, the interrupt handler copies the data,
+ * picks the next sector to do, and starts it, so the disk never waits
+ * on a thread to be scheduled. Requesters just sleep until their own
+ * request is finished.
+ *
+ * The next sector is chosen as follows:
+ *   - a request past its deadline goes first, the oldest first;
+ *   - otherwise, requests in the most urgent I/O class (the
+ *     requester's t_ioclass) are served in C-LOOK order: the lowest
+ *     sector beyond the head position, wrapping around to the lowest
+ *     sector overall.
+ * Since a request in progress always wants the sector after the one
+ * just done, C-LOOK keeps it going, and a request that starts where
+ * another ends runs straight on from it; that is as much merging as
+ * a one-sector device can use. Deadlines (in sectors transferred
+ * since the request was queued) keep less urgent classes from being
+ * starved.
+ */
+struct lhd_req {
+	struct lhd_req *lr_next;	/* queue link */
+	struct uio *lr_uio;		/* kernel-space uio for the data */
+	uint32_t lr_sector;		/* next sector to transfer */
+	uint32_t lr_left;		/* sectors still to go */
+	unsigned lr_class;		/* IOCLASS_* */
+	unsigned lr_expire;		/* lh_ops value of the deadline */
+	bool lr_write;
+	bool lr_done;
+	int lr_result;
+};
+
+/* Deadlines by class, in sectors transferred. */
+static const unsigned lhd_deadline[IOCLASS_COUNT] = {
+	128,	/* IOCLASS_SWAP */
+	256,	/* IOCLASS_JOURNAL */
+	1024,	/* IOCLASS_NORMAL */
+};
+
+/* Size of the bounce buffer for user I/O, in sectors. */
+#define LHD_BOUNCE	8
+
+/*
+ * Choose the next request to work on, or NULL if the queue is empty.
+ * The queue lock must be held.
+ */
+static
+struct lhd_req *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_req *lr, *best, *lowest;
+	unsigned class;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	best = NULL;
+	for (lr = lh->lh_queue; lr != NULL; lr = lr->lr_next) {
+		if ((int)(lh->lh_ops - lr->lr_expire) < 0) {
+			continue;
+		}
+		if (best == NULL ||
+		    (int)(lr->lr_expire - best->lr_expire) < 0) {
+			best = lr;
+		}
+	}
+	if (best != NULL) {
+		return best;
+	}
+
+	class = IOCLASS_COUNT;
+	for (lr = lh->lh_queue; lr != NULL; lr = lr->lr_next) {
+		if (lr->lr_class < class) {
+			class = lr->lr_class;
+		}
+	}
+
+	lowest = NULL;
+	for (lr = lh->lh_queue; lr != NULL; lr = lr->lr_next) {
+		if (lr->lr_class != class) {
+			continue;
+		}
+		if (lr->lr_sector > lh->lh_headpos &&
+		    (best == NULL || lr->lr_sector < best->lr_sector)) {
+			best = lr;
+		}
+		if (lowest == NULL || lr->lr_sector < lowest->lr_sector) {
+			lowest = lr;
+		}
+	}
+	return best != NULL ? best : lowest;
+}
+
+/*
+ * Take a request off the queue, record its result, and wake up its
+ * requester. The queue lock must be held.
+ */
+static
+void
+lhd_finish(struct lhd_softc *lh, struct lhd_req *lr, int err)
+{
+	struct lhd_req **pp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	for (pp = &lh->lh_queue; *pp != lr; pp = &(*pp)->lr_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = lr->lr_next;
+	lr->lr_next = NULL;
+
+	lr->lr_result = err;
+	lr->lr_done = true;
+	wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+}
+
+/*
+ * Start the next sector, if there's anything to do. The queue lock
+ * must be held and the device must be idle.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_req *lr;
+	uint32_t statval;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lh->lh_cur == NULL);
+
+	while ((lr = lhd_pick(lh)) != NULL) {
+		/*
+		 * Are we writing? If so, transfer the data to the
+		 * on-card buffer.
+		 */
+		if (lr->lr_write) {
+			result = uiomove(lh->lh_buf, LHD_SECTSIZE, lr->lr_uio);
+			membar_store_store();
+			if (result) {
+				lhd_finish(lh, lr, result);
+				continue;
+			}
+		}
+
+		lh->lh_cur = lr;
+		lh->lh_headpos = lr->lr_sector;
+		lh->lh_ops++;
+
+		statval = LHD_WORKING;
+		if (lr->lr_write) {
+			statval |= LHD_ISWRITE;
+		}
+
+		/* Tell it what sector we want... */
+		lhd_wreg(lh, LHD_REG_SECT, lr->lr_sector);
+
+		/* and start the operation. */
+		lhd_wreg(lh, LHD_REG_STAT, statval);
+		return;
+	}
+}
+
+/*
+ * Record that a sector has completed: move the data out of the
+ * on-card buffer if reading, finish the request if it's done or
+ * failed, and start the next sector.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_req *lr;
+
+	spinlock_acquire(&lh->lh_lock);
+	lr = lh->lh_cur;
+	if (lr == NULL) {
+		/* Nothing was running; spurious */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+	lh->lh_cur = NULL;
+
+	if (err == 0 && !lr->lr_write) {
+		membar_load_load();
+		err = uiomove(lh->lh_buf, LHD_SECTSIZE, lr->lr_uio);
+	}
+
+	if (err) {
+		lhd_finish(lh, lr, err);
+	}
+	else {
+		lr->lr_sector++;
+		lr->lr_left--;
+		if (lr->lr_left == 0) {
+			lhd_finish(lh, lr, 0);
+		}
+	}
+
+	lhd_start(lh);
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
@@ -179,6 +376,52 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Queue a request for LEN sectors starting at SECTOR, moving the
+ * data through UIO (which must be in kernel space), and wait for it.
+ */
+static
+int
+lhd_submit(struct lhd_softc *lh, struct uio *uio, uint32_t sector,
+	   uint32_t len)
+{
+	struct lhd_req lr;
+	struct lhd_req **pp;
+
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+
+	if (len == 0) {
+		return 0;
+	}
+
+	lr.lr_next = NULL;
+	lr.lr_uio = uio;
+	lr.lr_sector = sector;
+	lr.lr_left = len;
+	lr.lr_class = curthread->t_ioclass;
+	KASSERT(lr.lr_class < IOCLASS_COUNT);
+	lr.lr_write = uio->uio_rw == UIO_WRITE;
+	lr.lr_done = false;
+	lr.lr_result = 0;
+
+	spinlock_acquire(&lh->lh_lock);
+	lr.lr_expire = lh->lh_ops + lhd_deadline[lr.lr_class];
+	/* Add at the end, so ties go to the oldest request. */
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		/* nothing */
+	}
+	*pp = &lr;
+	if (lh->lh_cur == NULL) {
+		lhd_start(lh);
+	}
+	while (!lr.lr_done) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return lr.lr_result;
+}
+
 /*
  * I/O function (for both reads and writes)
  */
@@ -192,8 +435,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	struct iovec kiov;
+	struct uio kuio;
+	uint32_t n;
+	void *bounce;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -207,61 +452,44 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	/* Kernel buffers can be filled straight from the interrupt handler. */
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return lhd_submit(lh, uio, sector, len);
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	/* User buffers go through a bounce buffer. */
+	bounce = kmalloc(LHD_BOUNCE * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	result = 0;
+	while (len > 0) {
+		n = len < LHD_BOUNCE ? len : LHD_BOUNCE;
+		uio_kinit(&kiov, &kuio, bounce, n * LHD_SECTSIZE,
+			  (off_t)sector * LHD_SECTSIZE, uio->uio_rw);
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		result = lhd_submit(lh, &kuio, sector, n);
 		if (result) {
-			return result;
+			break;
+		}
+		if (uio->uio_rw == UIO_READ) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
+		sector += n;
+		len -= n;
 	}
+	kfree(bounce);
 
-	return 0;
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -284,17 +512,16 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
 		return ENOMEM;
 	}
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_ops = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
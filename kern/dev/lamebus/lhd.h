@@ -31,6 +31,9 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
+
+struct lhd_req;	/* private to lhd.c */
 
 /*
  * Our sector size
@@ -51,9 +54,12 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the request queue */
+	struct wchan *lh_wchan;		/* Requesters wait here */
+	struct lhd_req *lh_queue;	/* Outstanding requests */
+	struct lhd_req *lh_cur;		/* Request on the device, if any */
+	uint32_t lh_headpos;		/* Last sector started */
+	unsigned lh_ops;		/* Sectors started, for deadlines */
 
 	struct device lh_dev;		/* VFS device structure */
 };
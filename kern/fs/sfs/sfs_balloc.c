@@ -33,6 +33,7 @@
  * Block allocation.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <synch.h>
@@ -78,9 +79,234 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
 	return 0;
 }
 
+/*
+ * Block placement.
+ *
+ * A file's next block goes right after the last block allocated to
+ * it (sv_allocnext) if that's free, so files written sequentially
+ * come out contiguous. When it isn't, we search forward from there
+ * for a free block, wrapping around at the end of the volume, and
+ * then hold the next SFS_PREALLOC-1 free blocks after it for the
+ * file, so that another file growing at the same time doesn't end up
+ * interleaved with it. Held blocks are marked in sfs_resvmap, which
+ * is in memory only: nothing about it is ever written to disk. The
+ * hold is dropped when the vnode is reclaimed, and other files take
+ * held blocks anyway once there's nothing else free.
+ *
+ * The freemap is divided into regions, one per freemap block, and
+ * sfs_freecount keeps the number of free blocks in each, so that the
+ * search can skip over full regions without looking at them.
+ *
+ * All of this is protected by sfs_freemaplock, including the
+ * allocation fields in the vnode.
+ */
+
+#define SFS_PREALLOC 8
+
+/*
+ * Count the free blocks in each region. Done at mount time once
+ * the freemap is settled.
+ */
+void
+sfs_bcount(struct sfs_fs *sfs)
+{
+	unsigned char *map;
+	unsigned nregions, region, i, j;
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	map = bitmap_getdata(sfs->sfs_freemap);
+	nregions = SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks);
+	for (region = 0; region < nregions; region++) {
+		sfs->sfs_freecount[region] = 0;
+		for (i = 0; i < SFS_BLOCKSIZE; i++) {
+			for (j = 0; j < CHAR_BIT; j++) {
+				if ((map[region * SFS_BLOCKSIZE + i] & (1 << j)) == 0) {
+					sfs->sfs_freecount[region]++;
+				}
+			}
+		}
+	}
+
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Check if BLOCK can be allocated: it's free, and either not held
+ * for some file or RESVOK is set.
+ */
+static
+bool
+sfs_bavail(struct sfs_fs *sfs, daddr_t block, bool resvok)
+{
+	if (bitmap_isset(sfs->sfs_freemap, block)) {
+		return false;
+	}
+	return resvok || !bitmap_isset(sfs->sfs_resvmap, block);
+}
+
+/*
+ * Find an available block at or after GOAL, wrapping around at the
+ * end of the volume. Returns false if there isn't one.
+ */
+static
+bool
+sfs_bsearch(struct sfs_fs *sfs, daddr_t goal, bool resvok, daddr_t *ret)
+{
+	unsigned char *map;
+	unsigned nregions, region, n;
+	daddr_t block, end;
+
+	map = bitmap_getdata(sfs->sfs_freemap);
+	nregions = SFS_FREEMAPBLOCKS(sfs->sfs_sb.sb_nblocks);
+
+	if (goal >= sfs->sfs_sb.sb_nblocks) {
+		goal = 0;
+	}
+	region = goal / SFS_BITSPERBLOCK;
+	block = goal;
+
+	/* nregions+1 passes, to get the start of the goal's region last */
+	for (n = 0; n <= nregions; n++) {
+		if (sfs->sfs_freecount[region] > 0) {
+			end = (region + 1) * SFS_BITSPERBLOCK;
+			if (end > sfs->sfs_sb.sb_nblocks) {
+				end = sfs->sfs_sb.sb_nblocks;
+			}
+			for (; block < end; block++) {
+				if (map[block / CHAR_BIT] == 0xff) {
+					/* skip to the end of the byte */
+					block |= CHAR_BIT - 1;
+					continue;
+				}
+				if (sfs_bavail(sfs, block, resvok)) {
+					*ret = block;
+					return true;
+				}
+			}
+		}
+		region = (region + 1) % nregions;
+		block = region * SFS_BITSPERBLOCK;
+	}
+	return false;
+}
+
+/*
+ * Drop the blocks held for SV. Must hold the freemap lock.
+ */
+static
+void
+sfs_bunreserve_prelocked(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	for (i = 0; i < sv->sv_resvlen; i++) {
+		if (bitmap_isset(sfs->sfs_resvmap, sv->sv_resvstart + i)) {
+			bitmap_unmark(sfs->sfs_resvmap, sv->sv_resvstart + i);
+		}
+	}
+	sv->sv_resvstart = 0;
+	sv->sv_resvlen = 0;
+}
+
+/*
+ * Drop the blocks held for SV, when it's going away.
+ */
+void
+sfs_bunreserve(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	bool alreadylocked;
+
+	alreadylocked = lock_do_i_hold(sfs->sfs_freemaplock);
+	if (!alreadylocked) {
+		lock_acquire(sfs->sfs_freemaplock);
+	}
+
+	sfs_bunreserve_prelocked(sfs, sv);
+
+	if (!alreadylocked) {
+		lock_release(sfs->sfs_freemaplock);
+	}
+}
+
+/*
+ * Hold the free blocks following BLOCK, which SV just got, for SV's
+ * next allocations.
+ */
+static
+void
+sfs_breserve(struct sfs_fs *sfs, struct sfs_vnode *sv, daddr_t block)
+{
+	daddr_t next;
+
+	sfs_bunreserve_prelocked(sfs, sv);
+
+	next = block + 1;
+	while (next < sfs->sfs_sb.sb_nblocks &&
+	       next - block < SFS_PREALLOC &&
+	       sfs_bavail(sfs, next, false)) {
+		bitmap_mark(sfs->sfs_resvmap, next);
+		next++;
+	}
+	sv->sv_resvstart = block + 1;
+	sv->sv_resvlen = next - (block + 1);
+}
+
+/*
+ * Pick a block for SV (or for nothing in particular, if SV is null)
+ * and mark it in use. Must hold the freemap lock.
+ */
+static
+int
+sfs_bchoose(struct sfs_fs *sfs, struct sfs_vnode *sv, daddr_t *ret)
+{
+	daddr_t block, goal;
+
+	goal = 0;
+	if (sv != NULL) {
+		goal = sv->sv_allocnext;
+	}
+
+	if (sv != NULL && goal >= sv->sv_resvstart &&
+	    goal < sv->sv_resvstart + sv->sv_resvlen &&
+	    sfs_bavail(sfs, goal, true)) {
+		/* Next block held for this file; take it */
+		block = goal;
+	}
+	else if (sfs_bsearch(sfs, goal, false, &block) ||
+		 sfs_bsearch(sfs, goal, true, &block)) {
+		if (sv != NULL) {
+			sfs_breserve(sfs, sv, block);
+		}
+	}
+	else {
+		return ENOSPC;
+	}
+
+	if (bitmap_isset(sfs->sfs_resvmap, block)) {
+		bitmap_unmark(sfs->sfs_resvmap, block);
+	}
+	bitmap_mark(sfs->sfs_freemap, block);
+	KASSERT(sfs->sfs_freecount[block / SFS_BITSPERBLOCK] > 0);
+	sfs->sfs_freecount[block / SFS_BITSPERBLOCK]--;
+	sfs->sfs_freemapdirty = true;
+
+	if (sv != NULL) {
+		sv->sv_allocnext = block + 1;
+	}
+
+	*ret = block;
+	return 0;
+}
+
 /*
  * Allocate a block.
  *
+ * SV is the file the block is for, or null if it's for a new inode;
+ * blocks for the same file are kept together where possible.
+ *
  * Returns the block number, plus a buffer for it if BUFRET isn't
  * null. The buffer, if any, is marked valid and dirty, and zeroed
  * out.
@@ -88,20 +314,19 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block, struct buf **bufret)
  * Uses 1 buffer.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret)
+sfs_balloc(struct sfs_fs *sfs, struct sfs_vnode *sv,
+	   daddr_t *diskblock, struct buf **bufret)
 {
 	int result;
 
 	lock_acquire(sfs->sfs_freemaplock);
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	result = sfs_bchoose(sfs, sv, diskblock);
 	if (result) {
 		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 
-	sfs->sfs_freemapdirty = true;
-
 	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
@@ -114,6 +339,7 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret)
 	if (result) {
 		lock_acquire(sfs->sfs_freemaplock);
 		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		sfs->sfs_freecount[*diskblock / SFS_BITSPERBLOCK]++;
 		/* in case someone wrote it out during the clearblock */
 		sfs->sfs_freemapdirty = true;
 		lock_release(sfs->sfs_freemaplock);
@@ -146,6 +372,7 @@ sfs_bfree_prelocked(struct sfs_fs *sfs, daddr_t diskblock)
 	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
 
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
+	sfs->sfs_freecount[diskblock / SFS_BITSPERBLOCK]++;
 
 	struct sfs_jphys_block rec = {curthread->tx->tid, diskblock};
 	sfs_jphys_write_with_fsdata(sfs, SFS_JPHYS_FREEB, &rec, sizeof(rec), NULL);
@@ -38,6 +38,7 @@
 #include <synch.h>
 #include <vfs.h>
 #include <buf.h>
+#include <vm.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -411,11 +412,12 @@ sfs_blockobj_set(struct sfs_blockobj *bo, uint32_t offset, uint32_t newval)
 
 /*
  * Given a pointer to a block slot, return it, allocating a block
- * if necessary.
+ * if necessary. SV is the file the block belongs to.
  */
 static
 int
-sfs_bmap_get(struct sfs_fs *sfs, struct sfs_blockobj *bo, uint32_t offset,
+sfs_bmap_get(struct sfs_fs *sfs, struct sfs_vnode *sv,
+	     struct sfs_blockobj *bo, uint32_t offset,
 	     bool doalloc, daddr_t *diskblock_ret)
 {
 	daddr_t block;
@@ -430,7 +432,7 @@ sfs_bmap_get(struct sfs_fs *sfs, struct sfs_blockobj *bo, uint32_t offset,
 	 * Do we need to allocate?
 	 */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block, NULL);
+		result = sfs_balloc(sfs, sv, &block, NULL);
 		if (result) {
 			return result;
 		}
@@ -475,10 +477,14 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
 	uint32_t idoff;
 	uint32_t fileblocks_per_entry;
 	struct sfs_blockobj idobj;
+	struct sfs_vnode *sv;
 	int result;
 
+	KASSERT(inodeobj->bo_isinode);
+	sv = inodeobj->bo_inode.i_sv;
+
 	/* Get the block inodeobj immediately points to (maybe allocating) */
-	result = sfs_bmap_get(sfs, inodeobj, 0, doalloc, &block);
+	result = sfs_bmap_get(sfs, sv, inodeobj, 0, doalloc, &block);
 	if (result) {
 		return result;
 	}
@@ -525,7 +531,7 @@ sfs_bmap_subtree(struct sfs_fs *sfs, struct sfs_blockobj *inodeobj,
 		sfs_blockobj_init_idblock(&idobj, idbuf);
 
 		/* Get the address of the next layer down (maybe allocating) */
-		result = sfs_bmap_get(sfs, &idobj, idoff, doalloc, &block);
+		result = sfs_bmap_get(sfs, sv, &idobj, idoff, doalloc, &block);
 
 		sfs_blockobj_cleanup(&idobj);
 		buffer_release(idbuf);
@@ -1152,6 +1158,11 @@ sfs_itrunc(struct sfs_vnode *sv, off_t newlen)
 	}
 	inodeptr = sfs_dinode_map(sv);
 
+	/* Cached pages mustn't outlive the blocks they came from */
+	if (newlen < inodeptr->sfi_size) {
+		pcache_truncate(&sfs->sfs_absfs, sv->sv_ino, newlen);
+	}
+
 	/* Length in blocks (divide rounding up) */
 	oldblocklen = DIVROUNDUP(inodeptr->sfi_size, SFS_BLOCKSIZE);
 	newblocklen = DIVROUNDUP(newlen, SFS_BLOCKSIZE);
@@ -36,6 +36,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <synch.h>
+#include <vfs.h>
 #include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -117,11 +118,73 @@ sfs_dir_nentries(struct sfs_vnode *sv, int *ret)
 	return 0;
 }
 
+/* Number of directory entries in a block, and so in an index bucket */
+#define SFS_DIRPERBLOCK ((int)(SFS_BLOCKSIZE / sizeof(struct sfs_direntry)))
+
+/*
+ * Hash a name for the directory name index. sfsck has a copy of this
+ * that must be kept the same.
+ *
+ * . and .. hash to 0, so they never leave the first block, where mkdir
+ * puts them; rename expects .. in slot 1.
+ */
+static
+uint32_t
+sfs_dir_hash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return 0;
+	}
+	for (; *name != 0; name++) {
+		hash = (hash ^ (unsigned char)*name) * 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Find the first slot of the index bucket NAME belongs in. Hands back
+ * -1 if the directory has no name index.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires 1 buffer.
+ */
+static
+int
+sfs_dir_bucket(struct sfs_vnode *sv, const char *name, int *firstslot)
+{
+	struct sfs_dinode *dino;
+	uint32_t hash;
+	int result;
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	dino = sfs_dinode_map(sv);
+
+	if (dino->sfi_dirflags & SFS_DIR_INDEXED) {
+		hash = sfs_dir_hash(name) & ((1U << dino->sfi_dirdepth) - 1);
+		*firstslot = dino->sfi_dirbuckets[hash] * SFS_DIRPERBLOCK;
+	}
+	else {
+		*firstslot = -1;
+	}
+
+	sfs_dinode_unload(sv);
+	return 0;
+}
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
  *
+ * If the directory has a name index, only the name's bucket is
+ * searched, and any empty slot handed back is in that bucket.
+ *
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
  *
  * Requires up to 3 buffers.
@@ -131,7 +194,7 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_direntry tsd;
-	int found, nentries, i, result;
+	int found, nentries, first, last, i, result;
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
@@ -140,9 +203,28 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		return result;
 	}
 
+	result = sfs_dir_bucket(sv, name, &first);
+	if (result) {
+		return result;
+	}
+	if (first < 0) {
+		first = 0;
+		last = nentries;
+	}
+	else {
+		last = first + SFS_DIRPERBLOCK;
+		if (last > nentries) {
+			/* The end of the bucket is past EOF; that's free too */
+			last = nentries;
+			if (emptyslot != NULL) {
+				*emptyslot = last;
+			}
+		}
+	}
+
 	/* For each slot... */
 	found = 0;
-	for (i=0; i<nentries; i++) {
+	for (i=first; i<last; i++) {
 
 		/* Read the entry from that slot */
 		result = sfs_readdir(sv, i, &tsd);
@@ -225,6 +307,209 @@ sfs_dir_findino(struct sfs_vnode *sv, uint32_t ino,
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Journal and make a change to a 16-bit field of a directory's inode.
+ * The inode must be loaded.
+ */
+static
+void
+sfs_dir_set16(struct sfs_vnode *sv, uint16_t *field, uint16_t val)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *dino = sfs_dinode_map(sv);
+
+	struct sfs_jphys_write16 rec = {curthread->tx->tid,			// txid
+									sv->sv_ino,					// daddr
+									*field,						// old data
+									val,						// new data
+									(void *)field - (void *)dino};	// offset
+	sfs_jphys_write_with_fsdata(sfs, SFS_JPHYS_WRITE16, &rec, sizeof(rec), sv->sv_dinobuf);
+
+	*field = val;
+	sfs_dinode_mark_dirty(sv);
+}
+
+/*
+ * Journal and install a new bucket table for a directory's name
+ * index. The inode must be loaded.
+ */
+static
+void
+sfs_dir_setbuckets(struct sfs_vnode *sv, const uint16_t *buckets)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *dino = sfs_dinode_map(sv);
+	char *old = (char *)dino->sfi_dirbuckets;
+	const char *new = (const char *)buckets;
+	struct sfs_jphys_writem rec;
+	size_t count;
+
+	KASSERT(sizeof(dino->sfi_dirbuckets) % WRITEM_LEN == 0);
+
+	for (count = 0; count < sizeof(dino->sfi_dirbuckets); count += WRITEM_LEN) {
+		rec.tid = curthread->tx->tid;
+		rec.index = sv->sv_ino;
+		rec.offset = (old + count) - (char *)dino;
+		rec.len = WRITEM_LEN;
+		memcpy(&rec.old, old + count, WRITEM_LEN);
+		memcpy(&rec.new, new + count, WRITEM_LEN);
+
+		sfs_jphys_write_with_fsdata(sfs, SFS_JPHYS_WRITEM, &rec, sizeof(rec), sv->sv_dinobuf);
+	}
+
+	memcpy(old, new, sizeof(dino->sfi_dirbuckets));
+	sfs_dinode_mark_dirty(sv);
+}
+
+/*
+ * Give a brand new (still empty) directory a name index, with block 0
+ * as its only bucket. Directories made before there were indexes
+ * already have entries and so are left linear.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires 1 buffer.
+ */
+static
+int
+sfs_dir_mkindex(struct sfs_vnode *sv)
+{
+	struct sfs_dinode *dino;
+	int result;
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	dino = sfs_dinode_map(sv);
+
+	if (dino->sfi_size == 0 && !(dino->sfi_dirflags & SFS_DIR_INDEXED)) {
+		KASSERT(dino->sfi_dirdepth == 0);
+		KASSERT(dino->sfi_dirbuckets[0] == 0);
+		sfs_dir_set16(sv, &dino->sfi_dirflags,
+			      dino->sfi_dirflags | SFS_DIR_INDEXED);
+	}
+
+	sfs_dinode_unload(sv);
+	return 0;
+}
+
+/*
+ * Make room in the full bucket NAME belongs in by splitting it: the
+ * entries whose next hash bit is set move to a new block at the end of
+ * the directory. If the bucket is the only one for its hash bits, the
+ * bucket table is doubled first. If the table can't grow any more, the
+ * index is dropped instead, and the directory is linear from then on;
+ * every slot is still an ordinary entry, so nothing needs to move.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_freemaplock.
+ *
+ * Requires up to 3 buffers.
+ */
+static
+int
+sfs_dir_split(struct sfs_vnode *sv, const char *name)
+{
+	uint16_t buckets[SFS_DIRBUCKETS];
+	struct sfs_dinode *dino;
+	struct sfs_direntry sd, emptysd;
+	unsigned depth, localdepth, sharers, oldblock, newblock, j;
+	int nentries, newslot, i, result;
+
+	result = sfs_dir_nentries(sv, &nentries);
+	if (result) {
+		return result;
+	}
+
+	result = sfs_dinode_load(sv);
+	if (result) {
+		return result;
+	}
+	dino = sfs_dinode_map(sv);
+	KASSERT(dino->sfi_dirflags & SFS_DIR_INDEXED);
+
+	memcpy(buckets, dino->sfi_dirbuckets, sizeof(buckets));
+	depth = dino->sfi_dirdepth;
+	oldblock = buckets[sfs_dir_hash(name) & ((1U << depth) - 1)];
+
+	/* A bucket that uses N bits of the hash is in 2^(depth-N) slots */
+	sharers = 0;
+	for (j=0; j < (1U << depth); j++) {
+		if (buckets[j] == oldblock) {
+			sharers++;
+		}
+	}
+	for (localdepth = depth; sharers > 1; sharers >>= 1) {
+		localdepth--;
+	}
+
+	if (localdepth == depth) {
+		if (depth == SFS_DIRDEPTH_MAX) {
+			sfs_dir_set16(sv, &dino->sfi_dirflags,
+				      dino->sfi_dirflags & ~SFS_DIR_INDEXED);
+			sfs_dinode_unload(sv);
+			return 0;
+		}
+
+		/* Double the table; the new half repeats the old */
+		memcpy(buckets + (1U << depth), buckets,
+		       (1U << depth) * sizeof(buckets[0]));
+		sfs_dir_setbuckets(sv, buckets);
+		depth++;
+		sfs_dir_set16(sv, &dino->sfi_dirdepth, depth);
+	}
+
+	/* Every bucket has its own block, so there's always room for one more */
+	newblock = DIVROUNDUP(nentries, SFS_DIRPERBLOCK);
+	KASSERT(newblock < SFS_DIRBUCKETS);
+
+	bzero(&emptysd, sizeof(emptysd));
+	emptysd.sfd_ino = SFS_NOINO;
+
+	/* Extend the directory over all of the new block */
+	result = sfs_writedir(sv, (newblock + 1) * SFS_DIRPERBLOCK - 1, &emptysd);
+	if (result) {
+		sfs_dinode_unload(sv);
+		return result;
+	}
+
+	for (j=0; j < (1U << depth); j++) {
+		if (buckets[j] == oldblock && ((j >> localdepth) & 1)) {
+			buckets[j] = newblock;
+		}
+	}
+	sfs_dir_setbuckets(sv, buckets);
+
+	/* Move the entries that now belong in the new bucket */
+	newslot = newblock * SFS_DIRPERBLOCK;
+	for (i = oldblock * SFS_DIRPERBLOCK;
+	     i < (int)(oldblock + 1) * SFS_DIRPERBLOCK; i++) {
+		result = sfs_readdir(sv, i, &sd);
+		if (result) {
+			break;
+		}
+		if (sd.sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		if (((sfs_dir_hash(sd.sfd_name) >> localdepth) & 1) == 0) {
+			continue;
+		}
+
+		result = sfs_writedir(sv, newslot++, &sd);
+		if (result) {
+			break;
+		}
+		result = sfs_writedir(sv, i, &emptysd);
+		if (result) {
+			break;
+		}
+	}
+
+	sfs_dinode_unload(sv);
+	return result;
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -237,11 +522,20 @@ int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
 	int emptyslot = -1;
-	int result;
+	int first, result;
 	struct sfs_direntry sd;
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
+	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
+		return ENAMETOOLONG;
+	}
+
+	result = sfs_dir_mkindex(sv);
+	if (result) {
+		return result;
+	}
+
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
 	if (result!=0 && result!=ENOENT) {
@@ -251,8 +545,27 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return EEXIST;
 	}
 
-	if (strlen(name)+1 > sizeof(sd.sfd_name)) {
-		return ENAMETOOLONG;
+	/*
+	 * In an indexed directory the entry has to go in its own
+	 * bucket; if that's full, split it and look again.
+	 */
+	while (emptyslot < 0) {
+		result = sfs_dir_bucket(sv, name, &first);
+		if (result) {
+			return result;
+		}
+		if (first < 0) {
+			break;
+		}
+		result = sfs_dir_split(sv, name);
+		if (result) {
+			return result;
+		}
+		result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+		if (result!=ENOENT) {
+			KASSERT(result != 0);
+			return result;
+		}
 	}
 
 	/* If we didn't get an empty slot, add the entry at the end. */
@@ -273,6 +586,9 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		*slot = emptyslot;
 	}
 
+	/* Forget that the name didn't exist. */
+	vfs_nc_remove(&sv->sv_absvn, name);
+
 	/* Write the entry. */
 	return sfs_writedir(sv, emptyslot, &sd);
 }
@@ -301,12 +617,19 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 	if(err != 0) {
 		panic("Couldn't find file to unlink in directory\n");
 	}
+	tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+	vfs_nc_remove(&sv->sv_absvn, tsd.sfd_name);
 
 	struct sfs_vnode *direntry; 
 	err = sfs_loadvnode(sfs, tsd.sfd_ino, SFS_TYPE_INVAL, &direntry);
 	if(err)
 		panic("Purgatory directory open failed\n");
 
+	// a directory only has the one name, so it's going away (or moving)
+	if(direntry->sv_type == SFS_TYPE_DIR) {
+		vfs_nc_purgedir(&direntry->sv_absvn);
+	}
+
 	err = sfs_dinode_load(direntry);
 	if(err) {
 		panic("Couldn't load dinode for dir unlink\n");
@@ -320,31 +643,11 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 		struct sfs_vnode *purgatory = sfs->purgatory;
 		lock_acquire(purgatory->sv_lock);
 
-		// find number of entries in purgatory
-		int nentries, i;
-		struct sfs_direntry tsd2;
-		err = sfs_dir_nentries(purgatory, &nentries);
-		if (err) {
-			panic("Purgatory directory doesn't have a number of entries...\n");
-		}
-
-		// iterate over entries in purgatory and find a free slot
-		for (i = 0; i < nentries; i++) {
-			err = sfs_readdir(purgatory, i, &tsd2);
-			if(err) {
-				panic("Couldn't read file from purgatory directory\n");
-			}
-			if (tsd2.sfd_ino == SFS_NOINO) {	// find empty slot
-				break;
-			}
-		}
-		// or if no empty slots in the middle, use the next one (nentries)
-
-		struct sfs_direntry newsd;
-		newsd.sfd_ino = tsd.sfd_ino;
-		snprintf(newsd.sfd_name, SFS_NAMELEN, "%u", tsd.sfd_ino);
+		// file it under its inode number, so reclaim can look it up by name
+		char name[SFS_NAMELEN];
+		snprintf(name, sizeof(name), "%u", tsd.sfd_ino);
 
-		err = sfs_writedir(purgatory, i, &newsd);
+		err = sfs_dir_link(purgatory, name, tsd.sfd_ino, NULL);
 		if(err != 0) {
 			panic("Couldn't write unlinked file into purgatory\n");
 		}
@@ -386,7 +689,7 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
  * Returns the vnode with its inode unloaded.
  *
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
- *    Also gets/releases sfs_vnlock.
+ *    Also gets/releases a vnode table lock.
  *    Returns the result vnode locked.
  *
  * Requires up to 3 buffers.
@@ -433,31 +736,68 @@ sfs_dir_checkempty(struct sfs_vnode *sv)
  * Look for a name in a directory and hand back a vnode for the
  * file, if there is one.
  *
+ * If it isn't there and SLOT is given, hands back a free slot the name
+ * can go in, or -1 if its index bucket is full; sfs_dir_link can make
+ * room.
+ *
+ * Lookups that don't want the slot go through the VFS name cache.
+ * Anything that changes a name must tell the cache (sfs_dir_link and
+ * sfs_dir_unlink do). If NCDROP is given, what was found is entered
+ * in the cache too; the caller must vfs_nc_release NCDROP after
+ * letting go of the vnode lock.
+ *
  * Locking: must hold vnode lock. May get/release sfs_freemaplock.
- *    Also gets/releases sfs_vnlock.
+ *    Also gets/releases a vnode table lock.
  *
  * Requires up to 3 buffers.
  */
 int
 sfs_lookonce(struct sfs_vnode *sv, const char *name, struct sfs_vnode **ret,
-		int *slot)
+		int *slot, struct vfs_ncdrop *ncdrop)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct vnode *v;
 	uint32_t ino;
 	int result, result2;
 	int emptyslot = -1;
+	int first;
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
+	if (ncdrop != NULL) {
+		ncdrop->ncd_dir = NULL;
+		ncdrop->ncd_vn = NULL;
+	}
+
+	/* The name cache can't say where the slot is. */
+	if (slot == NULL && vfs_nc_lookup(&sv->sv_absvn, name, &v)) {
+		if (v == NULL) {
+			*ret = NULL;
+			return ENOENT;
+		}
+		*ret = v->vn_data;
+		return 0;
+	}
+
 	result = sfs_dir_findname(sv, name, &ino, slot, &emptyslot);
 	if (result == ENOENT) {
+		if (ncdrop != NULL) {
+			vfs_nc_enter(&sv->sv_absvn, name, NULL, ncdrop);
+		}
 		*ret = NULL;
 		if (slot != NULL) {
 			if (emptyslot < 0) {
-				result2 = sfs_dir_nentries(sv, &emptyslot);
+				result2 = sfs_dir_bucket(sv, name, &first);
 				if (result2) {
 					return result2;
 				}
+				/* In a linear directory, add it at the end */
+				if (first < 0) {
+					result2 = sfs_dir_nentries(sv, &emptyslot);
+					if (result2) {
+						return result2;
+					}
+				}
 			}
 			*slot = emptyslot;
 		}
@@ -471,6 +811,9 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name, struct sfs_vnode **ret,
 	if (result) {
 		return result;
 	}
+	if (ncdrop != NULL) {
+		vfs_nc_enter(&sv->sv_absvn, name, &(*ret)->sv_absvn, ncdrop);
+	}
 
 	return 0;
 }
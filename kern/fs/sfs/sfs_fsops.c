@@ -43,7 +43,9 @@
 #include <vfs.h>
 #include <buf.h>
 #include <device.h>
+#include <vm.h>
 #include <sfs.h>
+#include <kcache.h>
 #include "sfsprivate.h"
 
 
@@ -122,13 +124,15 @@ static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct sfs_vnode *sv;
+	unsigned i;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	/* Go over the table of loaded vnodes, syncing as we go. */
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		for (sv = sfs->sfs_vnhash[i].vb_head; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			VOP_FSYNC(&sv->sv_absvn);
+		}
 	}
 	return 0;
 }
@@ -350,6 +354,18 @@ sfs_getvolname(struct fs *fs)
 /*
  * Destructor for struct sfs_fs.
  */
+static
+void
+sfs_vnhash_destroy(struct sfs_fs *sfs, unsigned nbuckets)
+{
+	unsigned i;
+
+	for (i=0; i<nbuckets; i++) {
+		KASSERT(sfs->sfs_vnhash[i].vb_head == NULL);
+		lock_destroy(sfs->sfs_vnhash[i].vb_lock);
+	}
+}
+
 static
 void
 sfs_fs_destroy(struct sfs_fs *sfs)
@@ -361,7 +377,13 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	if (sfs->sfs_resvmap != NULL) {
+		bitmap_destroy(sfs->sfs_resvmap);
+	}
+	if (sfs->sfs_freecount != NULL) {
+		kfree(sfs->sfs_freecount);
+	}
+	sfs_vnhash_destroy(sfs, SFS_VNHASH_SIZE);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -377,12 +399,14 @@ sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
 
+	/* Read-ahead holds vnode references; make it let go. */
+	sfs_readahead_forget(sfs);
 
 	lock_acquire(sfs->sfs_vnlock);
 	lock_acquire(sfs->sfs_freemaplock);
 
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 1) {
+	if (sfs->sfs_nvnodes > 1) {
 		lock_release(sfs->sfs_freemaplock);
 		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
@@ -409,6 +433,9 @@ sfs_unmount(struct fs *fs)
 	/* All buffers should be clean; invalidate them. */
 	drop_fs_buffers(fs);
 
+	/* Likewise any cached file pages. */
+	pcache_purge(fs);
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -433,6 +460,8 @@ static const struct fs_ops sfs_fsops = {
 	.fsop_unmount = sfs_unmount,
 	.fsop_readblock = sfs_readblock,
 	.fsop_writeblock = sfs_writeblock,
+	.fsop_readblocks = sfs_readblocks,
+	.fsop_writeblocks = sfs_writeblocks,
 	.fsop_attachbuf = sfs_attachbuf,
 	.fsop_detachbuf = sfs_detachbuf,
 };
@@ -447,6 +476,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -477,14 +507,21 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		goto cleanup_object;
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		sfs->sfs_vnhash[i].vb_head = NULL;
+		sfs->sfs_vnhash[i].vb_lock = lock_create("sfs_vnhash");
+		if (sfs->sfs_vnhash[i].vb_lock == NULL) {
+			sfs_vnhash_destroy(sfs, i);
+			goto cleanup_object;
+		}
 	}
+	sfs->sfs_nvnodes = 0;
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freecount = NULL;
+	sfs->sfs_resvmap = NULL;
 
 	/* locks */
 	sfs->sfs_vnlock = lock_create("sfs_vnlock");
@@ -529,7 +566,7 @@ cleanup_freemaplock:
 cleanup_vnlock:
 	lock_destroy(sfs->sfs_vnlock);
 cleanup_vnodes:
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_vnhash_destroy(sfs, SFS_VNHASH_SIZE);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -591,6 +628,13 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		if (tx_lock==NULL) {
 			panic("sfs_mount: Could not create tx_lock\n");
 		}
+
+		tx_cache = kcache_create("sfs tx", sizeof(struct tx), NULL, NULL);
+		if (tx_cache==NULL) {
+			panic("sfs_mount: Could not create tx_cache\n");
+		}
+
+		sfs_readahead_bootstrap();
 	}
 
 	if(sfs_datas == NULL) {	// only one sfs_data array for all sfs devices
@@ -663,6 +707,17 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		sfs_fs_destroy(sfs);
 		return ENOMEM;
 	}
+	/* Allocator state that goes with it; filled in after recovery */
+	sfs->sfs_resvmap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
+	sfs->sfs_freecount = kmalloc(SFS_FS_FREEMAPBLOCKS(sfs) *
+				     sizeof(sfs->sfs_freecount[0]));
+	if (sfs->sfs_resvmap == NULL || sfs->sfs_freecount == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sfs->sfs_freemaplock);
+		sfs->sfs_device = NULL;
+		sfs_fs_destroy(sfs);
+		return ENOMEM;
+	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
 		lock_release(sfs->sfs_vnlock);
@@ -1163,6 +1218,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/*       Recovery code end      */
 	/********************************/
 
+	/* Now the freemap is right, count the free space in it */
+	sfs_bcount(sfs);
+
 	unreserve_buffers(SFS_BLOCKSIZE);
 
 	/* Done with container-level scanning */
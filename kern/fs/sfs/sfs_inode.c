@@ -42,6 +42,7 @@
 #include <buf.h>
 #include <sfs.h>
 #include "sfsprivate.h"
+#include "opt-sfschecks.h"
 
 
 /*
@@ -66,9 +67,26 @@ sfs_vnode_create(uint32_t ino, unsigned type)
 	sv->sv_type = type;
 	sv->sv_dinobuf = NULL;
 	sv->sv_dinobufcount = 0;
+	sv->sv_ranext = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+	sv->sv_allocnext = 0;
+	sv->sv_resvstart = 0;
+	sv->sv_resvlen = 0;
+	sv->sv_hashnext = NULL;
 	return sv;
 }
 
+/*
+ * Vnode table chain for inode INO.
+ */
+static
+struct sfs_vnbucket *
+sfs_vnbucket(struct sfs_fs *sfs, uint32_t ino)
+{
+	return &sfs->sfs_vnhash[ino % SFS_VNHASH_SIZE];
+}
+
 /*
  * Destructor for sfs_vnode.
  */
@@ -176,8 +194,9 @@ sfs_dinode_mark_dirty(struct sfs_vnode *sv)
  *
  * This function should try to avoid returning errors other than EBUSY.
  *
- * Locking: gets/releases vnode lock. Gets/releases sfs_vnlock, and
- *    possibly also sfs_freemaplock, while holding the vnode lock.
+ * Locking: gets/releases vnode lock. Gets/releases the vnode table
+ *    lock for the inode, sfs_vnlock, and possibly also sfs_freemaplock,
+ *    while holding the vnode lock.
  *
  * Requires 1 buffer locally but may also afterward call sfs_itrunc,
  * which takes 4.
@@ -187,8 +206,9 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	struct sfs_vnbucket *vb = sfs_vnbucket(sfs, sv->sv_ino);
+	struct sfs_vnode **svp;
 	struct sfs_dinode *iptr;
-	unsigned ix, i, num;
 	bool buffers_needed;
 	int result;
 
@@ -210,7 +230,7 @@ sfs_reclaim(struct vnode *v)
 
 	lock_acquire(purgatory->sv_lock);
 
-	lock_acquire(sfs->sfs_vnlock);
+	lock_acquire(vb->vb_lock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
@@ -225,7 +245,7 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		lock_release(sfs->sfs_vnlock);
+		lock_release(vb->vb_lock);
 		lock_release(purgatory->sv_lock);
 
 		if(purgatory != sv)
@@ -245,7 +265,7 @@ sfs_reclaim(struct vnode *v)
 		 * This case is likely to lead to problems, but
 		 * there's essentially no helping it...
 		 */
-		lock_release(sfs->sfs_vnlock);
+		lock_release(vb->vb_lock);
 		lock_release(purgatory->sv_lock);
 
 		if(purgatory != sv)
@@ -273,7 +293,7 @@ sfs_reclaim(struct vnode *v)
 		if (result) {
 			sfs_dinode_unload(sv);
 			sfs_unlock_freemap(sfs);
-			lock_release(sfs->sfs_vnlock);
+			lock_release(vb->vb_lock);
 			lock_release(purgatory->sv_lock);
 
 			if(sv != purgatory)
@@ -297,8 +317,12 @@ sfs_reclaim(struct vnode *v)
 		bzero(&emptysd, sizeof(emptysd));
 		emptysd.sfd_ino = SFS_NOINO;
 
+		// sfs_dir_unlink filed it under its inode number
+		char name[SFS_NAMELEN];
+		snprintf(name, sizeof(name), "%u", sv->sv_ino);
+
 		int slot;
-		int err = sfs_dir_findino(purgatory, sv->sv_ino, NULL, &slot);
+		int err = sfs_dir_findname(purgatory, name, NULL, &slot, NULL);
 		if(err)
 			panic("reclaim called on vnode that isn't unlinked\n");
 
@@ -312,38 +336,38 @@ sfs_reclaim(struct vnode *v)
 		sfs_dinode_unload(sv);
 	}
 
-	if(!nested) {
-		sfs_txend(sfs, SFS_JPHYS_RECLAIM);
-	}
-	if (buffers_needed) {
-		unreserve_buffers(SFS_BLOCKSIZE);
-	}
+	/* Give back any blocks we were holding for it. */
+	sfs_bunreserve(sfs, sv);
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
+	for (svp = &vb->vb_head; *svp != NULL && *svp != sv;
+	     svp = &(*svp)->sv_hashnext);
+	if (*svp == NULL) {
 		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
 		      sfs->sfs_sb.sb_volname, sv->sv_ino);
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	*svp = sv->sv_hashnext;
+
+	lock_acquire(sfs->sfs_vnlock);
+	sfs->sfs_nvnodes--;
+	lock_release(sfs->sfs_vnlock);
 
 	vnode_cleanup(&sv->sv_absvn);
 
-	lock_release(sfs->sfs_vnlock);
+	lock_release(vb->vb_lock);
 	lock_release(purgatory->sv_lock);
 
 	if(purgatory != sv)
 		lock_release(sv->sv_lock);
 
+	/* End the transaction only now, since it may checkpoint */
+	if(!nested) {
+		sfs_txend(sfs, SFS_JPHYS_RECLAIM);
+	}
+	if (buffers_needed) {
+		unreserve_buffers(SFS_BLOCKSIZE);
+	}
+
 	sfs_vnode_destroy(sv);
 
 	/* Done */
@@ -356,7 +380,8 @@ sfs_reclaim(struct vnode *v)
  *
  * The vnode is returned unlocked and with its inode not loaded.
  *
- * Locking: gets/releases sfs_vnlock.
+ * Locking: gets/releases the vnode table lock for INO, and
+ *    sfs_vnlock while holding it.
  *
  * May require 3 buffers if VOP_DECREF triggers reclaim.
  */
@@ -364,30 +389,25 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
+	struct sfs_vnbucket *vb = sfs_vnbucket(sfs, ino);
 	struct sfs_vnode *sv;
 	struct buf *dinobuf;
 	struct sfs_dinode *dino;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* sfs_vnlock protects the vnodes table */
-	lock_acquire(sfs->sfs_vnlock);
-
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	/* The chain's lock protects its part of the vnode table */
+	lock_acquire(vb->vb_lock);
 
+	/* Look in the vnode table */
+	for (sv = vb->vb_head; sv != NULL; sv = sv->sv_hashnext) {
+#if OPT_SFSCHECKS
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: %s: Found inode %u in unallocated block\n",
 			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
+#endif
 
 		if (sv->sv_ino==ino) {
 			/* Found */
@@ -396,7 +416,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_absvn);
-			lock_release(sfs->sfs_vnlock);
+			lock_release(vb->vb_lock);
 
 			*ret = sv;
 			return 0;
@@ -418,12 +438,13 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	 * Read the block the inode is in.
 	 *
 	 * (We can do this before creating and locking the new vnode
-	 * because we are holding the vnode table lock. Nobody else can
-	 * be in here trying to load the same vnode at the same time.)
+	 * because we are holding the vnode table lock for INO. Nobody
+	 * else can be in here trying to load the same vnode at the same
+	 * time.)
 	 */
 	result = buffer_read(&sfs->sfs_absfs, ino, SFS_BLOCKSIZE, &dinobuf);
 	if (result) {
-		lock_release(sfs->sfs_vnlock);
+		lock_release(vb->vb_lock);
 		return result;
 	}
 	dino = buffer_map(dinobuf);
@@ -474,30 +495,52 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	 */
 	sv = sfs_vnode_create(ino, dino->sfi_type);
 	if (sv==NULL) {
-		lock_release(sfs->sfs_vnlock);
+		lock_release(vb->vb_lock);
 		return ENOMEM;
 	}
 
+	/*
+	 * Seed the block placement hint (see sfs_balloc.c) so that a
+	 * file that's appended to goes on where it left off: after the
+	 * last of its direct blocks that's mapped, or after the inode
+	 * if it has none. (Finding a later block would mean reading
+	 * indirect blocks.) No lock needed; nobody else can see SV yet.
+	 */
+	sv->sv_allocnext = ino + 1;
+	if (dino->sfi_size > 0) {
+		uint32_t fileblock = (dino->sfi_size - 1) / SFS_BLOCKSIZE;
+
+		if (fileblock >= SFS_NDIRECT) {
+			fileblock = SFS_NDIRECT - 1;
+		}
+		while (fileblock > 0 && dino->sfi_direct[fileblock] == 0) {
+			fileblock--;
+		}
+		if (dino->sfi_direct[fileblock] != 0) {
+			sv->sv_allocnext = dino->sfi_direct[fileblock] + 1;
+		}
+	}
+
 	buffer_release(dinobuf);
 
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
 		sfs_vnode_destroy(sv);
-		lock_release(sfs->sfs_vnlock);
+		lock_release(vb->vb_lock);
 		return result;
 	}
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		sfs_vnode_destroy(sv);
-		lock_release(sfs->sfs_vnlock);
-		return result;
-	}
+	sv->sv_hashnext = vb->vb_head;
+	vb->vb_head = sv;
+
+	lock_acquire(sfs->sfs_vnlock);
+	sfs->sfs_nvnodes++;
 	lock_release(sfs->sfs_vnlock);
 
+	lock_release(vb->vb_lock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -510,7 +553,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
  * As a matter of convenience, returns the vnode with its inode loaded.
  *
  * Locking: Gets/release sfs_freemaplock.
- *    Also gets/releases sfs_vnlock, but does not hold them together.
+ *    Also gets/releases vnode table locks, but does not hold them together.
  *
  * Requires up to 3 buffers as sfs_loadvnode might trigger reclaim and
  * truncate.
@@ -527,7 +570,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino, NULL);
+	result = sfs_balloc(sfs, NULL, &ino, NULL);
 	if (result) {
 		return result;
 	}
@@ -560,6 +603,11 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	dino = sfs_dinode_map(*ret);
 	KASSERT(dino->sfi_linkcount == 0);
 
+	/* Try to put its first block right after the inode */
+	sfs_lock_freemap(sfs);
+	(*ret)->sv_allocnext = ino + 1;
+	sfs_unlock_freemap(sfs);
+
 	return result;
 }
 
@@ -40,6 +40,7 @@
 #include <vfs.h>
 #include <buf.h>
 #include <device.h>
+#include <vm.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
@@ -101,6 +102,35 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	return result;
 }
 
+/*
+ * Read or write a run of N consecutive blocks with one device
+ * request.
+ */
+static
+int
+sfs_rwblocks(struct sfs_fs *sfs, daddr_t block, void **data, unsigned n,
+	     enum uio_rw rw)
+{
+	struct iovec iov[FS_MAXCLUSTER];
+	struct uio ku;
+	unsigned i;
+
+	KASSERT(n > 0 && n <= FS_MAXCLUSTER);
+
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = data[i];
+		iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = ((off_t)block) * SFS_BLOCKSIZE;
+	ku.uio_resid = n * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+	return sfs_rwblock(sfs, &ku);
+}
+
 /*
  * Read a block.
  */
@@ -118,27 +148,35 @@ sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
 }
 
 /*
- * Write a block.
+ * Read several consecutive blocks.
  */
 int
-sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
-	       void *data, size_t len)
+sfs_readblocks(struct fs *fs, daddr_t block, void **data, unsigned n,
+	       size_t len)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	struct iovec iov;
-	struct uio ku;
-	bool isjournal;
-	int result;
-
-	struct sfs_data *md = fsbufdata;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	isjournal = sfs_block_is_journal(sfs, block);
+	return sfs_rwblocks(sfs, block, data, n, UIO_READ);
+}
+
+/*
+ * Write a run of N consecutive blocks that are either all journal
+ * blocks or all not.
+ */
+static
+int
+sfs_writerun(struct sfs_fs *sfs, daddr_t block, void **fsbufdata,
+	     void **data, unsigned n, bool isjournal)
+{
+	struct sfs_data *md;
+	unsigned i, oldclass;
+	int result;
 
 	if (isjournal) {
 		/*
-		 * We're writing a journal buffer; the journal must be
+		 * We're writing journal buffers; the journal must be
 		 * written in order, so all earlier journal buffers
 		 * must be written first.
 		 *
@@ -154,44 +192,146 @@ sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 		 *
 		 * Instead, we use special-case logic in the journal
 		 * code for this situation.
+		 *
+		 * Only the blocks before the run need flushing; the
+		 * rest of the run goes out in order in the same
+		 * request. (Flushing for a later block in the run
+		 * would wait on buffers we're holding.)
 		 */
 		result = sfs_jphys_flushforjournalblock(sfs, block);
 		if (result) {
 			return result;
 		}
 	}
-	else if(md != NULL) {
-		if(md->newlsn > 0) {
-			sfs_jphys_flush(sfs, md->newlsn);
+	else {
+		for (i=0; i<n; i++) {
+			md = fsbufdata[i];
+			if(md != NULL && md->newlsn > 0) {
+				sfs_jphys_flush(sfs, md->newlsn);
+			}
 		}
 	}
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	result = sfs_rwblock(sfs, &ku);
+	/* Journal writes hold up everyone flushing; let them go first. */
+	oldclass = curthread->t_ioclass;
+	if (isjournal && oldclass > IOCLASS_JOURNAL) {
+		curthread->t_ioclass = IOCLASS_JOURNAL;
+	}
+	result = sfs_rwblocks(sfs, block, data, n, UIO_WRITE);
+	curthread->t_ioclass = oldclass;
 	if (result) {
 		return result;
 	}
 
-	if(md != NULL) {
-		lock_acquire(sfs_data_lock);
+	for (i=0; i<n; i++) {
+		md = fsbufdata[i];
+		if(md != NULL) {
+			lock_acquire(sfs_data_lock);
 
-		md->oldlsn = 0;
-		md->newlsn = 0;
+			md->oldlsn = 0;
+			md->newlsn = 0;
 
-		lock_release(sfs_data_lock);
-	}
+			lock_release(sfs_data_lock);
+		}
 
-	if (isjournal) {
-		sfs_wrote_journal_block(sfs, block);
+		if (isjournal) {
+			sfs_wrote_journal_block(sfs, block + i);
+		}
 	}
 
 	return 0;
 }
 
+/*
+ * Write a block.
+ */
+int
+sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
+	       void *data, size_t len)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+
+	return sfs_writerun(sfs, block, &fsbufdata, &data, 1,
+			    sfs_block_is_journal(sfs, block));
+}
+
+/*
+ * Write several consecutive blocks.
+ *
+ * The journal is one contiguous area, so the run is at most three
+ * pieces: blocks before the journal, journal blocks, and blocks after
+ * it. Write the journal piece first, so that when the others flush
+ * the journal for write-ahead logging, any journal blocks they need
+ * from this run are already on disk and recorded as such.
+ */
+int
+sfs_writeblocks(struct fs *fs, daddr_t block, void **fsbufdata,
+		void **data, unsigned n, size_t len)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+	unsigned start[3], count[3];
+	bool isjournal[3];
+	unsigned npieces, i, j;
+	bool jr;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(n > 0);
+
+	npieces = 0;
+	for (i=0; i<n; i++) {
+		jr = sfs_block_is_journal(sfs, block + i);
+		if (npieces > 0 && isjournal[npieces-1] == jr) {
+			count[npieces-1]++;
+			continue;
+		}
+		KASSERT(npieces < 3);
+		start[npieces] = i;
+		count[npieces] = 1;
+		isjournal[npieces] = jr;
+		npieces++;
+	}
+
+	/* journal first (pass 0), then everything else (pass 1) */
+	for (j=0; j<2; j++) {
+		for (i=0; i<npieces; i++) {
+			if (isjournal[i] != (j == 0)) {
+				continue;
+			}
+			result = sfs_writerun(sfs, block + start[i],
+					      fsbufdata + start[i],
+					      data + start[i], count[i],
+					      isjournal[i]);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
+/*
+ * Where the data a uio is about to move comes from, if it's kernel
+ * memory, or NULL. Tells pcache_write() when a mapped page is being
+ * written back from its own frame.
+ */
+static
+const void *
+sfs_uio_ksrc(struct uio *uio)
+{
+	if (uio->uio_segflg != UIO_SYSSPACE || uio->uio_rw != UIO_WRITE ||
+	    uio->uio_iovcnt == 0) {
+		return NULL;
+	}
+	return uio->uio_iov->iov_kbase;
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -212,6 +352,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	struct buf *iobuffer;
 	char *ioptr;
+	const void *src;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -256,6 +397,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	 * Now perform the requested operation into/out of the buffer.
 	 */
 	ioptr = buffer_map(iobuffer);
+	src = sfs_uio_ksrc(uio);
 	result = uiomove(ioptr+skipstart, len, uio);
 	if (result) {
 		buffer_release(iobuffer);
@@ -273,6 +415,11 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 		sfs_jphys_write_with_fsdata(sfs, SFS_JPHYS_WRITEB, &rec, sizeof(rec), iobuffer);
 
 		buffer_mark_dirty(iobuffer);
+
+		/* Keep any cached page of the file up to date */
+		pcache_write(&sfs->sfs_absfs, sv->sv_ino,
+			     (off_t)fileblock * SFS_BLOCKSIZE, ioptr,
+			     SFS_BLOCKSIZE, src);
 	}
 
 	buffer_release(iobuffer);
@@ -293,6 +440,7 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 	struct buf *iobuf;
 	void *ioptr;
+	const void *src;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -336,6 +484,7 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	 * Do the I/O into the buffer.
 	 */
 	ioptr = buffer_map(iobuf);
+	src = sfs_uio_ksrc(uio);
 	result = uiomove(ioptr, SFS_BLOCKSIZE, uio);
 	if (result) {
 		buffer_release(iobuf);
@@ -350,12 +499,211 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 
 		buffer_mark_valid(iobuf);
 		buffer_mark_dirty(iobuf);
+
+		/* Keep any cached page of the file up to date */
+		pcache_write(&sfs->sfs_absfs, sv->sv_ino,
+			     (off_t)fileblock * SFS_BLOCKSIZE, ioptr,
+			     SFS_BLOCKSIZE, src);
 	}
 
 	buffer_release(iobuf);
 	return 0;
 }
 
+/*
+ * Fill a fresh page-cache page with page PGNO of a file that has
+ * FILEBLOCKS blocks. Holes and blocks past EOF read as zeros. Runs
+ * of consecutive disk blocks are read with one request. File data is
+ * only cached here: blocks that aren't in the buffer cache already
+ * aren't put there.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+int
+sfs_fillpage(struct sfs_vnode *sv, uint32_t pgno, char *page,
+	     uint32_t fileblocks)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	daddr_t diskblocks[PAGE_SIZE / SFS_BLOCKSIZE];
+	void *data[PAGE_SIZE / SFS_BLOCKSIZE];
+	uint32_t fileblock, i, runstart;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	fileblock = pgno * (PAGE_SIZE / SFS_BLOCKSIZE);
+	for (i=0; i<PAGE_SIZE / SFS_BLOCKSIZE; i++) {
+		diskblocks[i] = 0;
+		data[i] = page + i * SFS_BLOCKSIZE;
+		if (fileblock + i < fileblocks) {
+			result = sfs_bmap(sv, fileblock + i, false,
+					  &diskblocks[i]);
+			if (result) {
+				return result;
+			}
+		}
+		if (diskblocks[i] == 0) {
+			bzero(data[i], SFS_BLOCKSIZE);
+		}
+	}
+
+	runstart = 0;
+	for (i=1; i<=PAGE_SIZE / SFS_BLOCKSIZE; i++) {
+		if (i < PAGE_SIZE / SFS_BLOCKSIZE &&
+		    diskblocks[runstart] != 0 &&
+		    diskblocks[i] == diskblocks[i-1] + 1) {
+			continue;
+		}
+		if (diskblocks[runstart] != 0) {
+			result = buffer_readthrough_run(&sfs->sfs_absfs,
+							diskblocks[runstart],
+							i - runstart,
+							SFS_BLOCKSIZE,
+							&data[runstart]);
+			if (result) {
+				return result;
+			}
+		}
+		runstart = i;
+	}
+	return 0;
+}
+
+/*
+ * Read file data through the page cache. The caller has already
+ * clipped the read at EOF.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 2 buffers.
+ */
+static
+int
+sfs_cachedread(struct sfs_vnode *sv, struct uio *uio, uint32_t fileblocks)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned long cmi;
+	uint32_t pgno, pgoff, len;
+	char *page;
+	bool fresh;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	while (uio->uio_resid > 0) {
+		pgno = uio->uio_offset / PAGE_SIZE;
+		pgoff = uio->uio_offset % PAGE_SIZE;
+		len = PAGE_SIZE - pgoff;
+		if (len > uio->uio_resid) {
+			len = uio->uio_resid;
+		}
+
+		cmi = pcache_get(&sfs->sfs_absfs, sv->sv_ino, pgno, &fresh);
+		page = (char *)PADDR_TO_KVADDR(CMI_TO_PADDR(cmi));
+		if (fresh) {
+			result = sfs_fillpage(sv, pgno, page, fileblocks);
+			if (result) {
+				pcache_discard(cmi);
+				return result;
+			}
+		}
+
+		result = uiomove(page + pgoff, len, uio);
+		pcache_release(cmi);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Get the page-cache page holding the page of the file at POS, for
+ * mmap. Hands back its core map index with the page busy. Past EOF
+ * the page reads as zeros.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 2 buffers.
+ */
+int
+sfs_getpage(struct sfs_vnode *sv, off_t pos, unsigned long *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *inodeptr;
+	unsigned long cmi;
+	uint32_t pgno;
+	bool fresh;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(pos % PAGE_SIZE == 0);
+
+	pgno = pos / PAGE_SIZE;
+	cmi = pcache_get(&sfs->sfs_absfs, sv->sv_ino, pgno, &fresh);
+	if (fresh) {
+		result = sfs_dinode_load(sv);
+		if (result) {
+			pcache_discard(cmi);
+			return result;
+		}
+		inodeptr = sfs_dinode_map(sv);
+		result = sfs_fillpage(sv, pgno,
+				      (char *)PADDR_TO_KVADDR(CMI_TO_PADDR(cmi)),
+				      DIVROUNDUP(inodeptr->sfi_size, SFS_BLOCKSIZE));
+		sfs_dinode_unload(sv);
+		if (result) {
+			pcache_discard(cmi);
+			return result;
+		}
+	}
+	*ret = cmi;
+	return 0;
+}
+
+/*
+ * Bring page PGNO of the file into the page cache ahead of a reader,
+ * unless it's cached already.
+ *
+ * Locking: must hold vnode lock.
+ *
+ * Requires up to 2 buffers.
+ */
+int
+sfs_readaheadpage(struct sfs_vnode *sv, uint32_t pgno)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dinode *inodeptr;
+	long cmi;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	cmi = pcache_get_ahead(&sfs->sfs_absfs, sv->sv_ino, pgno);
+	if (cmi == -1) {
+		return 0;
+	}
+	result = sfs_dinode_load(sv);
+	if (result) {
+		pcache_discard(cmi);
+		return result;
+	}
+	inodeptr = sfs_dinode_map(sv);
+	result = sfs_fillpage(sv, pgno,
+			      (char *)PADDR_TO_KVADDR(CMI_TO_PADDR(cmi)),
+			      DIVROUNDUP(inodeptr->sfi_size, SFS_BLOCKSIZE));
+	sfs_dinode_unload(sv);
+	if (result) {
+		pcache_discard(cmi);
+		return result;
+	}
+	pcache_release(cmi);
+	return 0;
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  *
@@ -370,11 +718,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	off_t origoffset;
 	struct sfs_dinode *inodeptr;
 
 	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	origresid = uio->uio_resid;
+	origoffset = uio->uio_offset;
 
 	result = sfs_dinode_load(sv);
 	if (result) {
@@ -404,6 +754,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		/* Reads go through the page cache. */
+		result = sfs_cachedread(sv, uio,
+					DIVROUNDUP(size, SFS_BLOCKSIZE));
+		goto out;
 	}
 
 	/*
@@ -475,6 +830,15 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		inodeptr->sfi_size = uio->uio_offset;
 		sfs_dinode_mark_dirty(sv);
 	}
+
+	/* If reading and we got anything, maybe read ahead */
+	if (result == 0 &&
+	    uio->uio_rw == UIO_READ &&
+	    uio->uio_offset > origoffset) {
+		sfs_readahead(sv, origoffset / SFS_BLOCKSIZE,
+			      DIVROUNDUP(uio->uio_offset, SFS_BLOCKSIZE),
+			      DIVROUNDUP(inodeptr->sfi_size, SFS_BLOCKSIZE));
+	}
 	sfs_dinode_unload(sv);
 
 	/* Add in any extra amount we couldn't read because of EOF */
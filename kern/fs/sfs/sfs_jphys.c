@@ -32,10 +32,13 @@
 #include <lib.h>
 #include <wchan.h>
 #include <synch.h>
+#include <spinlock.h>
+#include <clock.h>
 #include <proc.h>
 #include <current.h>
 #include <buf.h>
 #include <sfs.h>
+#include <kcache.h>
 #include "sfsprivate.h"
 
 /*
@@ -101,6 +104,11 @@ struct sfs_jphys {
 
 	uint32_t jp_odometer;		/* counter of jblocks used */
 
+	struct lock *jp_commitlock;	/* lock for the following */
+	struct cv *jp_commitcv;		/* to wait for a sync flush */
+	bool jp_committing;		/* a sync flush is in progress */
+	sfs_lsn_t jp_committedlsn;	/* flushed by sync through here */
+
 	struct spinlock jp_lsnmaplock;	/* lock for the following */
 	sfs_lsn_t *jp_firstlsns;	/* first lsn in each journal block */
 	uint32_t jp_oldestjblock;	/* oldest journal block in memory */
@@ -112,6 +120,17 @@ struct sfs_jphys {
 	struct sfs_jposition jp_recov_headpos;
 };
 
+/*
+ * Journal statistics, for all volumes together.
+ */
+static struct spinlock sfs_jstats_lock = SPINLOCK_INITIALIZER;
+static unsigned sfs_jstats_bytes;	/* bytes of records written */
+static unsigned sfs_jstats_jblocks;	/* journal blocks used */
+static unsigned sfs_jstats_commits;	/* transactions committed */
+static unsigned sfs_jstats_flushes;	/* flushes that padded the head block */
+static unsigned sfs_jstats_checkpoints;	/* checkpoints from sfs_txend */
+static unsigned sfs_jstats_since;	/* clock_ticks() at first mount */
+
 ////////////////////////////////////////////////////////////
 // support code
 
@@ -333,6 +352,10 @@ sfs_getnextbuf(struct sfs_fs *sfs)
 	jp->jp_gettingnext = NULL;
 	jp->jp_odometer++;
 	cv_broadcast(jp->jp_nextcv, jp->jp_lock);
+
+	spinlock_acquire(&sfs_jstats_lock);
+	sfs_jstats_jblocks++;
+	spinlock_release(&sfs_jstats_lock);
 }
 
 /*
@@ -509,6 +532,10 @@ sfs_jphys_write_internal(struct sfs_fs *sfs,
 	sfs_put_journal(sfs, lsn, &hdr, sizeof(hdr));
 	sfs_put_journal(sfs, lsn, rec, len);
 
+	spinlock_acquire(&sfs_jstats_lock);
+	sfs_jstats_bytes += totallen;
+	spinlock_release(&sfs_jstats_lock);
+
 	/* Call the callback, if any */
 	if (callback != NULL) {
 		callback(sfs, lsn, ctx);
@@ -731,6 +758,10 @@ sfs_jphys_flush(struct sfs_fs *sfs, sfs_lsn_t lsn)
 		if (jp->jp_nextbuf == NULL && jp->jp_gettingnext == curthread){
 			sfs_getnextbuf(sfs);
 		}
+
+		spinlock_acquire(&sfs_jstats_lock);
+		sfs_jstats_flushes++;
+		spinlock_release(&sfs_jstats_lock);
 	}
 
 	/*
@@ -801,23 +832,50 @@ sfs_jphys_flushforjournalblock(struct sfs_fs *sfs, daddr_t diskblock)
 
 /*
  * Flush the whole journal.
- */ 
+ *
+ * This is how sync and fsync make transactions durable; ending a
+ * transaction doesn't flush anything by itself, since the records go
+ * out anyway when the head block fills or a block they cover is
+ * written back. Because flushing pads out the journal head block,
+ * syncing callers share flushes: only one thread at a time does one,
+ * covering everything in the journal when it starts. Threads that
+ * come along while it's running wait for it, and whoever is still not
+ * covered does the next one for all of them.
+ */
 int
 sfs_jphys_flushall(struct sfs_fs *sfs)
 {
 	struct sfs_jphys *jp = sfs->sfs_jphys;
-	sfs_lsn_t nextlsn;
+	sfs_lsn_t lsn, upto;
 	int result;
 
-	lock_acquire(jp->jp_lock);
-	nextlsn = jp->jp_nextlsn;
-	lock_release(jp->jp_lock);
+	lsn = sfs_jphys_peeknextlsn(sfs) - 1;
 
-	result = sfs_jphys_flush(sfs, nextlsn - 1);
-	if (result) {
-		return result;
+	lock_acquire(jp->jp_commitlock);
+	while (jp->jp_committedlsn < lsn) {
+		if (jp->jp_committing) {
+			cv_wait(jp->jp_commitcv, jp->jp_commitlock);
+			continue;
+		}
+		jp->jp_committing = true;
+		lock_release(jp->jp_commitlock);
+
+		upto = sfs_jphys_peeknextlsn(sfs) - 1;
+		result = sfs_jphys_flush(sfs, upto);
+
+		lock_acquire(jp->jp_commitlock);
+		jp->jp_committing = false;
+		if (result == 0 && upto > jp->jp_committedlsn) {
+			jp->jp_committedlsn = upto;
+		}
+		cv_broadcast(jp->jp_commitcv, jp->jp_commitlock);
+		if (result) {
+			lock_release(jp->jp_commitlock);
+			return result;
+		}
 	}
-	
+	lock_release(jp->jp_commitlock);
+
 	return 0;
 }
 
@@ -950,6 +1008,66 @@ sfs_jphys_clearodometer(struct sfs_jphys *jp)
 	lock_release(jp->jp_lock);
 }
 
+/*
+ * If the journal odometer has reached LIMIT, reset it and return
+ * true. This lets only one of several threads that notice the
+ * journal filling up go on to checkpoint.
+ */
+bool
+sfs_jphys_takeodometer(struct sfs_jphys *jp, uint32_t limit)
+{
+	bool ret;
+
+	KASSERT(jp->jp_writermode);
+
+	lock_acquire(jp->jp_lock);
+	ret = jp->jp_odometer >= limit;
+	if (ret) {
+		jp->jp_odometer = 0;
+	}
+	lock_release(jp->jp_lock);
+
+	return ret;
+}
+
+/*
+ * Print the journal statistics.
+ */
+void
+sfs_printstats(void)
+{
+	unsigned bytes, jblocks, commits, flushes, checkpoints, since;
+	unsigned secs, rate;
+
+	spinlock_acquire(&sfs_jstats_lock);
+	bytes = sfs_jstats_bytes;
+	jblocks = sfs_jstats_jblocks;
+	commits = sfs_jstats_commits;
+	flushes = sfs_jstats_flushes;
+	checkpoints = sfs_jstats_checkpoints;
+	since = sfs_jstats_since;
+	spinlock_release(&sfs_jstats_lock);
+
+	kprintf("SFS journal:\n");
+	kprintf("   %u bytes of records in %u blocks\n", bytes, jblocks);
+	kprintf("   %u commits in %u flushes\n", commits, flushes);
+	if (commits > 0) {
+		kprintf("   %u bytes per commit\n", bytes / commits);
+	}
+	if (flushes > 0) {
+		/* hundredths, to show the batching */
+		rate = commits * 100 / flushes;
+		kprintf("   %u.%02u commits per flush\n", rate / 100, rate % 100);
+	}
+	secs = (clock_ticks() - since) / HZ;
+	if (since != 0 && secs > 0) {
+		rate = flushes * 100 / secs;
+		kprintf("   %u.%02u flushes per second over %u seconds\n",
+			rate / 100, rate % 100, secs);
+	}
+	kprintf("   %u checkpoints\n", checkpoints);
+}
+
 ////////////////////////////////////////////////////////////
 // journal iterator (reader mode) interface
 
@@ -2055,6 +2173,24 @@ sfs_jphys_create(void)
 
 	jp->jp_odometer = 0;
 
+	jp->jp_commitlock = lock_create("sfs_commit");
+	if (jp->jp_commitlock == NULL) {
+		cv_destroy(jp->jp_nextcv);
+		lock_destroy(jp->jp_lock);
+		kfree(jp);
+		return NULL;
+	}
+	jp->jp_commitcv = cv_create("sfs_commit");
+	if (jp->jp_commitcv == NULL) {
+		lock_destroy(jp->jp_commitlock);
+		cv_destroy(jp->jp_nextcv);
+		lock_destroy(jp->jp_lock);
+		kfree(jp);
+		return NULL;
+	}
+	jp->jp_committing = false;
+	jp->jp_committedlsn = 0;
+
 	spinlock_init(&jp->jp_lsnmaplock);
 	jp->jp_firstlsns = NULL;
 	jp->jp_oldestjblock = 0;
@@ -2083,6 +2219,9 @@ sfs_jphys_destroy(struct sfs_jphys *jp)
 	kfree(jp->jp_firstlsns);
 	KASSERT(jp->jp_headbuf == NULL);
 	KASSERT(jp->jp_nextbuf == NULL);
+	KASSERT(jp->jp_committing == false);
+	cv_destroy(jp->jp_commitcv);
+	lock_destroy(jp->jp_commitlock);
 	cv_destroy(jp->jp_nextcv);
 	lock_destroy(jp->jp_lock);
 	kfree(jp);
@@ -2163,6 +2302,12 @@ sfs_jphys_startwriting(struct sfs_fs *sfs)
 	jp->jp_firstlsns[jp->jp_headjblock] = jp->jp_headfirstlsn;
 	jp->jp_oldestjblock = jp->jp_headjblock;
 
+	spinlock_acquire(&sfs_jstats_lock);
+	if (sfs_jstats_since == 0) {
+		sfs_jstats_since = clock_ticks();
+	}
+	spinlock_release(&sfs_jstats_lock);
+
 	jp->jp_writermode = true;
 	return 0;
 }
@@ -2237,7 +2382,9 @@ sfs_jphys_stopwriting(struct sfs_fs *sfs)
 void sfs_txstartcb(struct sfs_fs *sfs, sfs_lsn_t newlsn, struct sfs_jphys_writecontext *ctx) {
 	(void) ctx;
 
-	struct tx *tx = kmalloc(sizeof(struct tx));
+	struct tx *tx = kcache_alloc(tx_cache);
+	if(tx == NULL)
+		panic("Out of memory for transactions");
 	tx->sfs = sfs;
 	tx->tid = newlsn;
 
@@ -2267,7 +2414,7 @@ void sfs_txendcb(struct sfs_fs *sfs, sfs_lsn_t newlsn, struct sfs_jphys_writecon
 		KASSERT(tx != NULL);
 
 		if(tx == curthread->tx) {
-			kfree(tx);
+			kcache_free(tx_cache, tx);
 			txarray_remove(txs, i);
 			break;
 		}
@@ -2285,21 +2432,31 @@ void sfs_txstart(struct sfs_fs *sfs, uint8_t type) {
 	(void) lsn;
 }
 
+// checkpoint once this fraction of the journal has been used since the last one
+#define SFS_CHECKPOINT_DIVISOR 4
+
 // *** Transactions cannot be nested. Enforce in the calling function.
 void sfs_txend(struct sfs_fs *sfs, uint8_t type) {
-	static uint64_t count = 0;
-	count++;
-
-	if(count % 4 == 0)			// this could be tuned much more, but whatever
-		sfs_sync_freemap(sfs);
-
 	struct sfs_jphys_tx rec = {curthread->tx->tid, type};
 	uint64_t lsn = sfs_jphys_write(sfs, sfs_txendcb, NULL, SFS_JPHYS_TXEND, &rec, sizeof(rec));
 	if(lsn == 0)
 		return;
 
-	if(count % 4 == 0)
+	// no flush here: the record goes out with the head block, or with the
+	// first write-back or sync that needs it (see sfs_jphys_flushall)
+	spinlock_acquire(&sfs_jstats_lock);
+	sfs_jstats_commits++;
+	spinlock_release(&sfs_jstats_lock);
+
+	uint32_t limit = sfs->sfs_sb.sb_journalblocks / SFS_CHECKPOINT_DIVISOR;
+	if(sfs_jphys_takeodometer(sfs->sfs_jphys, limit)) {
+		spinlock_acquire(&sfs_jstats_lock);
+		sfs_jstats_checkpoints++;
+		spinlock_release(&sfs_jstats_lock);
+
+		sfs_sync_freemap(sfs);
 		sfs_checkpoint(sfs);
+	}
 }
 
 // perform a rolling checkpoint
@@ -2343,7 +2500,7 @@ void sfs_checkpoint(struct sfs_fs *sfs) {
 		sfs_jphys_trim(sfs, lsn);
 		sfs_jphys_flush(sfs, lsn);
 	}
-	sfs_jphys_clearodometer(sfs->sfs_jphys);	// I don't use this elsewhere, but I'll update it just in case
+	sfs_jphys_clearodometer(sfs->sfs_jphys);	// sfs_txend checkpoints again when this fills up
 }
 
 // NULL buf pointer means the freemap was modified, otherwise it's a normal buf
@@ -0,0 +1,250 @@
+/*
+ * SFS filesystem
+ *
+ * Sequential read-ahead.
+ *
+ * sfs_io tells us about each file read. A read that picks up where
+ * the last one on the same vnode left off grows that vnode's window,
+ * up to SFS_RA_MAXWINDOW blocks; anything else turns read-ahead off
+ * until the reader goes sequential again. Once the reader gets
+ * within half a window of what has already been asked for, the next
+ * stretch is queued for the read-ahead thread, which fills the page
+ * cache pages covering it the same way a read would. File data thus
+ * lives only in the page cache; the buffer cache is left to metadata.
+ * The reader never waits for any of this.
+ *
+ * Requests are best-effort: if the queue is full they're dropped and
+ * the next sequential read asks again.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <vfs.h>
+#include <buf.h>
+#include <vm.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/* Window size limits, in blocks. */
+#define SFS_RA_MINWINDOW	4
+#define SFS_RA_MAXWINDOW	64
+
+/* Number of requests that can be waiting for the thread. */
+#define SFS_RA_QUEUE		16
+
+struct sfs_rareq {
+	struct sfs_vnode *rr_sv;	/* file, with a reference held */
+	uint32_t rr_fileblock;		/* first file block */
+	unsigned rr_nblocks;		/* number of blocks */
+};
+
+static struct lock *sfs_ra_lock;
+static struct cv *sfs_ra_cv;
+static struct sfs_rareq sfs_ra_queue[SFS_RA_QUEUE];
+static unsigned sfs_ra_head, sfs_ra_count;
+static struct sfs_fs *sfs_ra_busyfs;	/* fs the thread is working on */
+
+/*
+ * Read ahead for one request: bring each page it covers into the
+ * page cache, a page at a time under the vnode lock so readers only
+ * ever wait for one page. Pages already cached are left alone, and
+ * the page cache counts which of the new ones get used. Stops at the
+ * first error; whoever reads the page next will see it again.
+ */
+static
+void
+sfs_readahead_do(struct sfs_rareq *rr)
+{
+	struct sfs_vnode *sv = rr->rr_sv;
+	uint32_t pgno, endpg;
+	int result;
+
+	KASSERT(rr->rr_nblocks <= SFS_RA_MAXWINDOW);
+
+	pgno = rr->rr_fileblock / (PAGE_SIZE / SFS_BLOCKSIZE);
+	endpg = DIVROUNDUP(rr->rr_fileblock + rr->rr_nblocks,
+			   PAGE_SIZE / SFS_BLOCKSIZE);
+	for (; pgno < endpg; pgno++) {
+		reserve_buffers(SFS_BLOCKSIZE);
+		lock_acquire(sv->sv_lock);
+		result = sfs_readaheadpage(sv, pgno);
+		lock_release(sv->sv_lock);
+		unreserve_buffers(SFS_BLOCKSIZE);
+		if (result) {
+			break;
+		}
+	}
+}
+
+/*
+ * The read-ahead thread.
+ */
+static
+void
+sfs_readahead_thread(void *unused1, unsigned long unused2)
+{
+	struct sfs_rareq rr;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		lock_acquire(sfs_ra_lock);
+		while (sfs_ra_count == 0) {
+			cv_wait(sfs_ra_cv, sfs_ra_lock);
+		}
+		rr = sfs_ra_queue[sfs_ra_head];
+		sfs_ra_head = (sfs_ra_head + 1) % SFS_RA_QUEUE;
+		sfs_ra_count--;
+		sfs_ra_busyfs = rr.rr_sv->sv_absvn.vn_fs->fs_data;
+		lock_release(sfs_ra_lock);
+
+		sfs_readahead_do(&rr);
+		VOP_DECREF(&rr.rr_sv->sv_absvn);
+
+		lock_acquire(sfs_ra_lock);
+		sfs_ra_busyfs = NULL;
+		cv_broadcast(sfs_ra_cv, sfs_ra_lock);
+		lock_release(sfs_ra_lock);
+	}
+}
+
+/*
+ * Queue a request. Drops it and returns false if the queue is full.
+ */
+static
+bool
+sfs_readahead_queue(struct sfs_vnode *sv, uint32_t fileblock,
+		    unsigned nblocks)
+{
+	struct sfs_rareq *rr;
+
+	lock_acquire(sfs_ra_lock);
+	if (sfs_ra_count == SFS_RA_QUEUE) {
+		lock_release(sfs_ra_lock);
+		return false;
+	}
+	rr = &sfs_ra_queue[(sfs_ra_head + sfs_ra_count) % SFS_RA_QUEUE];
+	VOP_INCREF(&sv->sv_absvn);
+	rr->rr_sv = sv;
+	rr->rr_fileblock = fileblock;
+	rr->rr_nblocks = nblocks;
+	sfs_ra_count++;
+	cv_signal(sfs_ra_cv, sfs_ra_lock);
+	lock_release(sfs_ra_lock);
+	return true;
+}
+
+/*
+ * Called by sfs_io after reading file blocks FIRST through END-1 of
+ * a file that has FILEBLOCKS blocks. The vnode must be locked.
+ */
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t first, uint32_t end,
+	      uint32_t fileblocks)
+{
+	uint32_t start, stop;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (first != sv->sv_ranext && first + 1 != sv->sv_ranext) {
+		/* random access; stop reading ahead */
+		sv->sv_rawindow = 0;
+		sv->sv_raend = end;
+		sv->sv_ranext = end;
+		return;
+	}
+
+	if (end > sv->sv_ranext) {
+		/* moved forward sequentially */
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RA_MINWINDOW;
+		}
+		else if (sv->sv_rawindow < SFS_RA_MAXWINDOW) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	sv->sv_ranext = end;
+
+	/* wait until we've used up half of what was read ahead */
+	start = sv->sv_raend > end ? sv->sv_raend : end;
+	if (start - end >= sv->sv_rawindow / 2) {
+		return;
+	}
+	stop = end + sv->sv_rawindow;
+	if (stop > fileblocks) {
+		stop = fileblocks;
+	}
+	if (start >= stop) {
+		return;
+	}
+	if (sfs_readahead_queue(sv, start, stop - start)) {
+		sv->sv_raend = stop;
+	}
+}
+
+/*
+ * Drop queued requests for SFS and wait for the thread to be done
+ * with it, so the vnodes involved can go away. Called on unmount.
+ */
+void
+sfs_readahead_forget(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *drop[SFS_RA_QUEUE];
+	struct sfs_rareq *rr;
+	unsigned i, n, keep, ndrop;
+
+	lock_acquire(sfs_ra_lock);
+	n = sfs_ra_count;
+	keep = ndrop = 0;
+	for (i=0; i<n; i++) {
+		rr = &sfs_ra_queue[(sfs_ra_head + i) % SFS_RA_QUEUE];
+		if (rr->rr_sv->sv_absvn.vn_fs->fs_data == sfs) {
+			drop[ndrop++] = rr->rr_sv;
+		}
+		else {
+			sfs_ra_queue[(sfs_ra_head + keep) % SFS_RA_QUEUE] = *rr;
+			keep++;
+		}
+	}
+	sfs_ra_count = keep;
+	while (sfs_ra_busyfs == sfs) {
+		cv_wait(sfs_ra_cv, sfs_ra_lock);
+	}
+	lock_release(sfs_ra_lock);
+
+	/* may reclaim, so not with the queue locked */
+	for (i=0; i<ndrop; i++) {
+		VOP_DECREF(&drop[i]->sv_absvn);
+	}
+}
+
+/*
+ * Set up the queue and start the thread. Called once, on first mount.
+ */
+void
+sfs_readahead_bootstrap(void)
+{
+	int result;
+
+	sfs_ra_lock = lock_create("sfs readahead");
+	if (sfs_ra_lock == NULL) {
+		panic("sfs: Could not create readahead lock\n");
+	}
+	sfs_ra_cv = cv_create("sfs readahead");
+	if (sfs_ra_cv == NULL) {
+		panic("sfs: Could not create readahead cv\n");
+	}
+	sfs_ra_head = 0;
+	sfs_ra_count = 0;
+	sfs_ra_busyfs = NULL;
+
+	result = thread_fork("sfs readahead", NULL, sfs_readahead_thread,
+			     NULL, 0);
+	if (result) {
+		panic("sfs: Could not start readahead thread: %s\n",
+		      strerror(result));
+	}
+}
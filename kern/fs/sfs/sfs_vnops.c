@@ -49,7 +49,8 @@
  * Locking protocol for sfs:
  *    The following locks exist:
  *       vnode locks (sv_lock)
- *       vnode table lock (sfs_vnlock)
+ *       vnode table locks (sfs_vnhash[].vb_lock)
+ *       vnode count lock (sfs_vnlock)
  *       freemap lock (sfs_freemaplock)
  *       rename lock (sfs_renamelock)
  *       buffer lock
@@ -57,6 +58,7 @@
  *    Ordering constraints:
  *       rename lock       before  vnode locks
  *       vnode locks       before  vnode table lock
+ *       vnode table lock  before  vnode count lock
  *       vnode table lock  before  freemap lock
  *       vnode locks       before  buffer locks (for inode blocks)
  *       buffer locks      before  freemap lock
@@ -403,14 +405,29 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap() to get a page of the file. sfs_getpage() does the
+ * work.
+ *
+ * Locking: gets/releases vnode lock.
+ *
+ * Requires up to 2 buffers.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v, off_t pos, unsigned long *ret)
 {
-	(void)v;
-	return ENOSYS;
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	reserve_buffers(SFS_BLOCKSIZE);
+	lock_acquire(sv->sv_lock);
+
+	result = sfs_getpage(sv, pos, ret);
+
+	lock_release(sv->sv_lock);
+	unreserve_buffers(SFS_BLOCKSIZE);
+
+	return result;
 }
 
 /*
@@ -531,7 +548,7 @@ sfs_namefile(struct vnode *vv, struct uio *uio)
 	while (1) {
 		lock_acquire(sv->sv_lock);
 		/* not allowed to lock child since we're going up the tree */
-		result = sfs_lookonce(sv, "..", &parent, NULL);
+		result = sfs_lookonce(sv, "..", &parent, NULL, NULL);
 		lock_release(sv->sv_lock);
 
 		if (result) {
@@ -1001,7 +1018,7 @@ sfs_rmdir(struct vnode *v, const char *name)
 		goto die_linkcount;
 	}
 
-	result = sfs_lookonce(sv, name, &victim, &slot);
+	result = sfs_lookonce(sv, name, &victim, &slot, NULL);
 	if (result) {
 		goto die_linkcount;
 	}
@@ -1139,7 +1156,7 @@ sfs_remove(struct vnode *dir, const char *name)
 	}
 
 	/* Look for the file and fetch a vnode for it. */
-	result = sfs_lookonce(sv, name, &victim, &slot);
+	result = sfs_lookonce(sv, name, &victim, &slot, NULL);
 	if (result) {
 		goto out_loadsv;
 	}
@@ -1234,7 +1251,7 @@ check_parent(struct sfs_vnode *lookfor, struct sfs_vnode *failon,
 		}
 
 		lock_acquire(child->sv_lock);
-		result = sfs_lookonce(child, "..", &up, NULL);
+		result = sfs_lookonce(child, "..", &up, NULL, NULL);
 		lock_release(child->sv_lock);
 
 		if (result) {
@@ -1332,7 +1349,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 * make sure they haven't disappeared and to find slots.
 	 */
 	lock_acquire(dir1->sv_lock);
-	result = sfs_lookonce(dir1, name1, &obj1, NULL);
+	result = sfs_lookonce(dir1, name1, &obj1, NULL, NULL);
 	lock_release(dir1->sv_lock);
 
 	if (result) {
@@ -1340,7 +1357,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	}
 
 	lock_acquire(dir2->sv_lock);
-	result = sfs_lookonce(dir2, name2, &obj2, NULL);
+	result = sfs_lookonce(dir2, name2, &obj2, NULL, NULL);
 	lock_release(dir2->sv_lock);
 
 	if (result && result != ENOENT) {
@@ -1483,7 +1500,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		VOP_DECREF(&obj2->sv_absvn);
 		obj2 = NULL;
 	}
-	result = sfs_lookonce(dir2, name2, &obj2, &slot2);
+	result = sfs_lookonce(dir2, name2, &obj2, &slot2, NULL);
 	if (result==0) {
 		KASSERT(obj2 != NULL);
 		lock_acquire(obj2->sv_lock);
@@ -1502,10 +1519,10 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	else if (result==ENOENT) {
 		/*
 		 * sfs_lookonce returns a null vnode and an empty slot
-		 * with ENOENT in order to make our life easier.
+		 * with ENOENT in order to make our life easier. (The
+		 * slot is -1 if the name's index bucket is full.)
 		 */
 		KASSERT(obj2==NULL);
-		KASSERT(slot2>=0);
 	}
 
 	if (!found_dir1) {
@@ -1523,7 +1540,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	KASSERT(lock_do_i_hold(dir1->sv_lock));
 	VOP_DECREF(&obj1->sv_absvn);
 	obj1 = NULL;
-	result = sfs_lookonce(dir1, name1, &obj1, &slot1);
+	result = sfs_lookonce(dir1, name1, &obj1, &slot1, NULL);
 	if (result) {
 		goto out1;
 	}
@@ -1579,9 +1596,12 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		nested = false;
 	}
 
-	/* At this point we should have valid slots in both dirs. */
+	/*
+	 * At this point we should have valid slots in both dirs,
+	 * except for a target whose index bucket is full.
+	 */
 	KASSERT(slot1>=0);
-	KASSERT(slot2>=0);
+	KASSERT(slot2>=0 || obj2==NULL);
 
 	if (obj2 != NULL) {
 		/*
@@ -1669,14 +1689,21 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 	 * At this point the target should be nonexistent and we have
 	 * a slot in the target directory we can use. Create a link
 	 * there. Do it by hand instead of using sfs_dir_link to avoid
-	 * duplication of effort.
+	 * duplication of effort, unless there was no slot because the
+	 * name's bucket in dir2's index is full; sfs_dir_link splits it.
 	 */
 	KASSERT(obj2==NULL);
 
-	bzero(&sd, sizeof(sd));
-	sd.sfd_ino = obj1->sv_ino;
-	strcpy(sd.sfd_name, name2);
-	result = sfs_writedir(dir2, slot2, &sd);
+	if (slot2 < 0) {
+		result = sfs_dir_link(dir2, name2, obj1->sv_ino, &slot2);
+	}
+	else {
+		bzero(&sd, sizeof(sd));
+		sd.sfd_ino = obj1->sv_ino;
+		strcpy(sd.sfd_name, name2);
+		vfs_nc_remove(&dir2->sv_absvn, name2);
+		result = sfs_writedir(dir2, slot2, &sd);
+	}
 	if (result) {
 		goto out4;
 	}
@@ -1708,6 +1735,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 			      sd.sfd_ino, dir1->sv_ino);
 		}
 		sd.sfd_ino = dir2->sv_ino;
+		vfs_nc_remove(&obj1->sv_absvn, "..");
 		result = sfs_writedir(obj1, DOTDOTSLOT, &sd);
 		if (result) {
 			goto recover1;
@@ -1733,6 +1761,17 @@ sfs_rename(struct vnode *absdir1, const char *name1,
 		sfs_dinode_mark_dirty(dir2);
 	}
 
+	if (dir1 == dir2) {
+		/*
+		 * If linking name2 split its bucket, name1's entry may
+		 * have moved, and name2 may now be in its old slot.
+		 */
+		result = sfs_dir_findname(dir1, name1, NULL, &slot1, NULL);
+		if (result) {
+			goto recover2;
+		}
+	}
+
 	result = sfs_dir_unlink(dir1, slot1);
 	if (result) {
 		goto recover2;
@@ -1745,6 +1784,7 @@ sfs_rename(struct vnode *absdir1, const char *name1,
     recover2:
 		if (obj1->sv_type == SFS_TYPE_DIR) {
 			sd.sfd_ino = dir1->sv_ino;
+			vfs_nc_remove(&obj1->sv_absvn, "..");
 			result2 = sfs_writedir(obj1, DOTDOTSLOT, &sd);
 			if (result2) {
 				recovermsg(sfs->sfs_sb.sb_volname,
@@ -1825,6 +1865,7 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_vnode *next;
+	struct vfs_ncdrop ncdrop;
 	char *s;
 	int result;
 
@@ -1846,8 +1887,9 @@ sfs_lookparent_internal(struct vnode *v, char *path, struct vnode **ret,
 		s++;
 
 		lock_acquire(sv->sv_lock);
-		result = sfs_lookonce(sv, path, &next, NULL);
+		result = sfs_lookonce(sv, path, &next, NULL, &ncdrop);
 		lock_release(sv->sv_lock);
+		vfs_nc_release(&ncdrop);
 
 		if (result) {
 			VOP_DECREF(&sv->sv_absvn);
@@ -1910,6 +1952,7 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct vnode *dirv;
 	struct sfs_vnode *dir;
 	struct sfs_vnode *final;
+	struct vfs_ncdrop ncdrop;
 	int result;
 	char name[SFS_NAMELEN];
 
@@ -1924,9 +1967,10 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	dir = dirv->vn_data;
 	lock_acquire(dir->sv_lock);
 
-	result = sfs_lookonce(dir, name, &final, NULL);
+	result = sfs_lookonce(dir, name, &final, NULL, &ncdrop);
 
 	lock_release(dir->sv_lock);
+	vfs_nc_release(&ncdrop);
 	VOP_DECREF(dirv);
 
 	if (result) {
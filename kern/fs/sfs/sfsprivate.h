@@ -32,6 +32,7 @@
 
 #include <uio.h> /* for uio_rw */
 struct buf; /* in buf.h */
+struct vfs_ncdrop; /* in vfs.h */
 
 
 //#define SFS_VERBOSE_RECOVERY
@@ -66,9 +67,12 @@ extern const struct vnode_ops sfs_dirops;
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock, struct buf **bufret);
+int sfs_balloc(struct sfs_fs *sfs, struct sfs_vnode *sv,
+	       daddr_t *diskblock, struct buf **bufret);
 void sfs_bfree_prelocked(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
+void sfs_bunreserve(struct sfs_fs *sfs, struct sfs_vnode *sv);
+void sfs_bcount(struct sfs_fs *sfs);
 bool sfs_freemap_locked(struct sfs_fs *sfs);
 void sfs_lock_freemap(struct sfs_fs *sfs);
 void sfs_unlock_freemap(struct sfs_fs *sfs);
@@ -92,7 +96,7 @@ int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
 int sfs_dir_checkempty(struct sfs_vnode *sv);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
-		int *slot);
+		int *slot, struct vfs_ncdrop *ncdrop);
 
 /* Functions in sfs_inode.c */
 int sfs_dinode_load(struct sfs_vnode *sv);
@@ -109,10 +113,22 @@ int sfs_getroot(struct fs *fs, struct vnode **ret);
 int sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct fs *fs, daddr_t block, void *fsbufdata,
 		   void *data, size_t len);
+int sfs_readblocks(struct fs *fs, daddr_t block, void **data, unsigned n,
+		   size_t len);
+int sfs_writeblocks(struct fs *fs, daddr_t block, void **fsbufdata,
+		    void **data, unsigned n, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
+int sfs_getpage(struct sfs_vnode *sv, off_t pos, unsigned long *ret);
+int sfs_readaheadpage(struct sfs_vnode *sv, uint32_t pgno);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
+/* Functions in sfs_readahead.c */
+void sfs_readahead(struct sfs_vnode *sv, uint32_t first, uint32_t end,
+		   uint32_t fileblocks);
+void sfs_readahead_forget(struct sfs_fs *sfs);
+void sfs_readahead_bootstrap(void);
+
 /* Functions in sfs_fsops.c needed elsewhere */
 int sfs_sync_freemap(struct sfs_fs *sfs);
 
@@ -141,6 +157,7 @@ sfs_lsn_t sfs_jphys_peeknextlsn(struct sfs_fs *sfs);
 void sfs_jphys_trim(struct sfs_fs *sfs, sfs_lsn_t taillsn);
 uint32_t sfs_jphys_getodometer(struct sfs_jphys *jp);
 void sfs_jphys_clearodometer(struct sfs_jphys *jp);
+bool sfs_jphys_takeodometer(struct sfs_jphys *jp, uint32_t limit);
 /* reader interface */
 bool sfs_jiter_done(struct sfs_jiter *ji);
 unsigned sfs_jiter_type(struct sfs_jiter *ji);
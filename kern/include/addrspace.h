@@ -37,11 +37,44 @@
 
 #include <vm.h>
 #include <spinlock.h>
+#include <platform/maxcpus.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
 
 
+/*
+ * A segment of the executable, loaded lazily: each page is read from the
+ * file (or zero-filled, past the part the file backs) the first time it's
+ * touched, and is an ordinary page from then on. Not locked, like
+ * mmap regions below.
+ */
+struct lazy_region {
+	vaddr_t lr_vaddr;		// start of the segment (not necessarily page-aligned)
+	size_t lr_memsize;		// size in memory
+	struct vnode *lr_vnode;		// file, with a reference held (NULL until as_load_region())
+	off_t lr_offset;		// file offset of lr_vaddr
+	size_t lr_filesize;		// bytes of the segment in the file; the rest is zeros
+	int lr_prot;			// PROT_* bits
+	struct lazy_region *lr_next;
+};
+
+/*
+ * A mapping of part of a file made with mmap(). Regions don't overlap
+ * and are kept sorted by address. Like heap_top, they're only touched
+ * by the thread running in the address space (or by whoever destroys
+ * it), so they aren't locked.
+ */
+struct mmap_region {
+	vaddr_t mr_start;		// first page
+	vaddr_t mr_end;			// end of the last page
+	struct vnode *mr_vnode;		// file, with a reference held
+	off_t mr_offset;		// file offset mapped at mr_start
+	int mr_prot;			// PROT_* bits
+	bool mr_shared;			// MAP_SHARED (otherwise MAP_PRIVATE)
+	struct mmap_region *mr_next;
+};
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -64,6 +97,13 @@ struct addrspace {
         struct wchan *addr_wchan;
         vaddr_t heap_bottom;
         vaddr_t heap_top;
+        uint32_t asids[MAXCPUS];	// ASID (with generation) on each CPU, 0 if none
+        vaddr_t pf_last;		// last page swapped in by a fault
+        vaddr_t pf_next;		// page expected to be swapped in next if a scan continues
+        int pf_dir;			// direction of the current scan (1 or -1), 0 if none
+        unsigned pf_window;		// pages to read around the next fault in the scan
+        struct lazy_region *regions;	// executable segments
+        struct mmap_region *mmaps;	// file mappings, sorted by address
 #endif
 };
 
@@ -94,6 +134,10 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_load_region - give the region defined at VADDR its contents:
+ *                FILESIZE bytes of file V from OFFSET, followed by
+ *                zeros. They're read in as pages are touched.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -104,10 +148,31 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_bootstrap - set up the object caches address spaces and page
+ *                tables come from. Called by vm_bootstrap.
+ *
+ *    as_region_fault - fill in the page of a lazy region LR for VADDR
+ *                the first time it's touched.
+ *
+ *    as_find_region - find the lazy region containing VADDR, or NULL.
+ *
+ *    as_prefault - fault in any pages behind a user buffer that have
+ *                to be read from a file (in lazy regions or mmap
+ *                regions) and haven't been, pinning the mapped file
+ *                pages. Used before file system calls that move data
+ *                to or from user memory while holding vnode locks,
+ *                since faulting those pages in needs the same locks.
+ *                May shorten the buffer, to pin a bounded number of
+ *                pages.
+ *
+ *    as_unpin - let go of the pages as_prefault pinned, after the
+ *                file system call.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
 
+void              as_bootstrap(void);
 struct addrspace *as_create(void);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
@@ -119,10 +184,20 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_load_region(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t filesize);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+struct lazy_region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+int               as_region_fault(struct addrspace *as, struct lazy_region *lr,
+                                  vaddr_t vaddr);
+int               as_prefault(struct addrspace *as, userptr_t buf, size_t *len,
+                              bool write);
+void              as_unpin(struct addrspace *as, userptr_t buf, size_t len);
+
 
 /*
  * Functions in loadelf.c
@@ -134,4 +209,34 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
 
 
+/*
+ * Functions in mmap.c:
+ *
+ *    mmap_add      - map LEN bytes of file V from OFFSET somewhere
+ *                    between the heap and the stack, and hand back
+ *                    the address.
+ *
+ *    mmap_remove   - unmap whatever is mapped from VADDR to
+ *                    VADDR+LEN, writing back dirty shared pages.
+ *
+ *    mmap_find     - find the region containing VADDR, or NULL.
+ *
+ *    mmap_fault    - map in the file page for VADDR in region MR.
+ *
+ *    mmap_copy     - give NEW the same regions as OLD (for fork).
+ *
+ *    mmap_destroy  - unmap everything (before the address space goes).
+ */
+
+int               mmap_add(struct addrspace *as, struct vnode *v, size_t len,
+                           off_t offset, int prot, bool shared,
+                           vaddr_t *ret);
+int               mmap_remove(struct addrspace *as, vaddr_t vaddr, size_t len);
+struct mmap_region *mmap_find(struct addrspace *as, vaddr_t vaddr);
+int               mmap_fault(struct addrspace *as, struct mmap_region *mr,
+                             vaddr_t vaddr);
+int               mmap_copy(struct addrspace *old, struct addrspace *new);
+void              mmap_destroy(struct addrspace *as);
+
+
 #endif /* _ADDRSPACE_H_ */
@@ -77,11 +77,20 @@ struct buf; /* Opaque. */
  *      will skip over it until it's released; the file system is
  *      responsible for writing out any managed buffers it's holding.
  *
+ * buffer_readthrough copies a block into caller memory, from the
+ * cache if the block is there and from disk (without caching it)
+ * otherwise. It is for caches above this one, like the page cache.
+ * buffer_readthrough_run does the same for a run of consecutive
+ * blocks, reading the uncached ones with as few requests as it can.
+ *
  * buffer_flush looks for an existing buffer and writes it out (if
  * dirty) immediately without returning it.
  *
  * buffer_drop looks for an existing buffer and invalidates it
  * immediately without returning it.
+ *
+ * Writes are clustered automatically: when the cache writes back a
+ * dirty buffer it takes its dirty neighbors along.
  */
 
 int buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret);
@@ -90,6 +99,10 @@ int buffer_get_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 			 struct buf **ret);
 int buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 			  struct buf **ret);
+int buffer_readthrough(struct fs *fs, daddr_t block, size_t size,
+		       void *data);
+int buffer_readthrough_run(struct fs *fs, daddr_t block, unsigned nblocks,
+			   size_t size, void **data);
 int buffer_flush(struct fs *fs, daddr_t block, size_t size);
 void buffer_drop(struct fs *fs, daddr_t block, size_t size);
 
@@ -157,6 +170,13 @@ int sync_fs_buffers(struct fs *fs);
  */
 void drop_fs_buffers(struct fs *fs);
 
+/*
+ * For the VM system, when memory is short: free up to NBYTES of
+ * buffers that are neither busy nor dirty. The cache grows back as
+ * it's used.
+ */
+void buffer_shrink(size_t nbytes);
+
 /*
  * Starvation/deadlock avoidance logic.
  *
@@ -57,11 +57,44 @@ void hardclock_bootstrap(void);
 void hardclock(void);
 
 /*
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU once a second by the timer code.
  */
 void timerclock(void);
 
+/*
+ * Timeouts: call a function at a point in the future, to hardclock
+ * resolution. Callbacks run in interrupt context on CPU 0 and must
+ * not sleep.
+ *
+ *     timeout_init   - set up a timeout to call FUNC(ARG).
+ *     timeout_at     - fire when clock_ticks() reaches TICK.
+ *     timeout_after  - fire MS milliseconds from now.
+ *     timeout_cancel - disarm; returns true if the callback won't run.
+ *
+ * Arming a pending timeout moves it. The struct timeout belongs to
+ * the caller and must stay put until it has fired or been cancelled.
+ */
+struct timeout {
+	struct timeout *to_next;	/* wheel links (private) */
+	struct timeout **to_pprev;
+	unsigned to_expires;		/* tick it fires on */
+	bool to_pending;		/* armed and not yet run */
+	void (*to_func)(void *);	/* callback */
+	void *to_arg;			/* argument for callback */
+};
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg);
+void timeout_at(struct timeout *to, unsigned tick);
+void timeout_after(struct timeout *to, unsigned ms);
+bool timeout_cancel(struct timeout *to);
+
+/*
+ * clock_ticks() returns the number of hardclocks since boot;
+ * clock_mstoticks() converts milliseconds to hardclocks, rounding up.
+ */
+unsigned clock_ticks(void);
+unsigned clock_mstoticks(unsigned ms);
+
 /*
  * gettime() may be used to fetch the current time of day.
  */
@@ -83,7 +116,8 @@ void timespec_sub(const struct timespec *t1,
 
 /*
  * clocksleep() suspends execution for the requested number of seconds,
- * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * like userlevel sleep(3). (Don't confuse it with wchan_sleep.) For
+ * finer-grained sleeps see thread_sleep_ms and thread_sleep_until.
  */
 void clocksleep(int seconds);
 
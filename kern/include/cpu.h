@@ -33,6 +33,7 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <thread.h>	/* for SCHED_LEVELS */
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
@@ -67,10 +68,17 @@ struct cpu {
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;		// Low priority runqueue
-	struct threadlist c_mp_runqueue;	// Mid priority runqueue (sleep or io)
-	struct threadlist c_hp_runqueue;	// High priority runqueue (sleep and io)
+	struct threadlist c_runqueues[SCHED_LEVELS];	/* One per MLFQ level */
+	unsigned c_epoch;		/* Boost epoch of the queued threads */
 	struct spinlock c_runqueue_lock;
+	unsigned c_stolen;		/* Threads other cpus stole from us */
+
+	/*
+	 * Work stealing statistics.
+	 * Accessed only by this cpu.
+	 */
+	unsigned c_steals;		/* Threads stolen from other cpus */
+	unsigned c_steal_misses;	/* Steal attempts that found nothing */
 
 	/*
 	 * Accessed by other cpus.
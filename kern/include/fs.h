@@ -45,6 +45,9 @@ struct fs {
 	const struct fs_ops *fs_ops;
 };
 
+/* Largest run of blocks passed to fsop_readblocks/fsop_writeblocks. */
+#define FS_MAXCLUSTER 16
+
 /*
  * Abstract operations on a file system:
  *
@@ -54,6 +57,8 @@ struct fs {
  *      fsop_unmount    - Attempt unmount of filesystem.
  *      fsop_readblock  - Read block from storage.
  *      fsop_writeblock - Write block to storage.
+ *      fsop_readblocks - Read a run of consecutive blocks from storage.
+ *      fsop_writeblocks - Write a run of consecutive blocks to storage.
  *      fsop_attachbuf  - Hook for initializing fs-specific buffer state.
  *      fsop_detachbuf  - Hook for cleaning up fs-specific buffer state.
  *
@@ -87,6 +92,13 @@ struct fs {
  * The third argument (bufdata) to fsop_writeblock is the FS-specific
  * metadata previously set with buffer_set_fsdata, or NULL if none was
  * ever set.
+ *
+ * fsop_readblocks and fsop_writeblocks are the same for N consecutive
+ * blocks starting at the given block, with one data pointer (and for
+ * writes, one bufdata pointer) per block; the buffer cache uses them
+ * to move a whole cluster in one device request. N is at most
+ * FS_MAXCLUSTER. They may be NULL, in which case the buffer cache
+ * does one block at a time.
  */
 struct fs_ops {
 	int           (*fsop_sync)(struct fs *);
@@ -96,6 +108,10 @@ struct fs_ops {
 	int           (*fsop_readblock)(struct fs *, daddr_t, void *, size_t);
 	int           (*fsop_writeblock)(struct fs *, daddr_t, void *bufdata,
 					void *, size_t);
+	int           (*fsop_readblocks)(struct fs *, daddr_t, void **,
+					 unsigned, size_t);
+	int           (*fsop_writeblocks)(struct fs *, daddr_t, void **bufdata,
+					  void **, unsigned, size_t);
 	int           (*fsop_attachbuf)(struct fs *, daddr_t, struct buf *);
 	void          (*fsop_detachbuf)(struct fs *, daddr_t, struct buf *);
 };
@@ -112,6 +128,11 @@ struct fs_ops {
 #define FSOP_WRITEBLOCK(fs,bn,fsdata,ptr,sz) \
 				((fs)->fs_ops->fsop_writeblock(fs,bn,fsdata, \
 							       ptr,sz))
+#define FSOP_READBLOCKS(fs,bn,ptrs,n,sz) \
+				((fs)->fs_ops->fsop_readblocks(fs,bn,ptrs,n,sz))
+#define FSOP_WRITEBLOCKS(fs,bn,fsdatas,ptrs,n,sz) \
+				((fs)->fs_ops->fsop_writeblocks(fs,bn,fsdatas, \
+								ptrs,n,sz))
 #define FSOP_ATTACHBUF(fs, blk, buf) ((fs)->fs_ops->fsop_attachbuf(fs,blk,buf))
 #define FSOP_DETACHBUF(fs, blk, buf) ((fs)->fs_ops->fsop_detachbuf(fs,blk,buf))
 
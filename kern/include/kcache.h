@@ -0,0 +1,41 @@
+#ifndef _KCACHE_H_
+#define _KCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A kcache hands out objects of one type. Objects are carved out of
+ * whole pages (slabs), so they aren't rounded up to a kmalloc size
+ * class, and each cpu keeps a few free objects of its own so the
+ * common case takes no lock.
+ *
+ * The optional constructor is run when an object is first carved out
+ * of a slab, and the destructor only when its slab is given back to
+ * the VM system. In between, objects keep their constructed state:
+ * kcache_free must be given an object in the same state the
+ * constructor left it in, and kcache_alloc returns one in that state.
+ * Objects of a page or more get a page-aligned run of pages each.
+ *
+ *     kcache_create  - make a cache NAME of objects of SIZE bytes.
+ *                      CTOR returns 0 or an error code; either
+ *                      function may be NULL.
+ *     kcache_alloc   - get an object, or NULL if out of memory.
+ *     kcache_free    - give an object back.
+ *     kcache_printstats - print usage of every cache ("kc" in the
+ *                      kernel menu).
+ *
+ * Constructors and destructors may sleep; they're never called with
+ * spinlocks held.
+ */
+
+struct kcache;	/* Opaque. */
+
+struct kcache *kcache_create(const char *name, size_t size,
+			     int (*ctor)(void *obj),
+			     void (*dtor)(void *obj));
+void *kcache_alloc(struct kcache *kc);
+void kcache_free(struct kcache *kc, void *obj);
+void kcache_printstats(void);
+
+
+#endif /* _KCACHE_H_ */
@@ -54,6 +54,16 @@
 /* Number of bits in a block */
 #define SFS_BITSPERBLOCK (SFS_BLOCKSIZE * CHAR_BIT)
 
+/*
+ * Directory name index. An indexed directory is a hash table of
+ * blocks: sfi_dirbuckets maps the low sfi_dirdepth bits of a name's
+ * hash to the directory block that holds it. Directories without
+ * SFS_DIR_INDEXED are plain arrays of entries, searched linearly.
+ */
+#define SFS_DIR_INDEXED   0x1           /* sfi_dirflags: has a name index */
+#define SFS_DIRDEPTH_MAX  7             /* max depth of a name index */
+#define SFS_DIRBUCKETS    (1 << SFS_DIRDEPTH_MAX) /* size of bucket table */
+
 /* Utility macro */
 #define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)
 
@@ -91,7 +101,10 @@ struct sfs_dinode {
 	uint32_t sfi_indirect;			/* Indirect block */
 	uint32_t sfi_dindirect;   /* Double indirect block */
 	uint32_t sfi_tindirect;   /* Triple indirect block */
-	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint16_t sfi_dirflags;			/* SFS_DIR_* (directories only) */
+	uint16_t sfi_dirdepth;			/* Depth of the name index */
+	uint16_t sfi_dirbuckets[SFS_DIRBUCKETS];	/* Block of each bucket */
+	uint32_t sfi_waste[128-6-SFS_NDIRECT-SFS_DIRBUCKETS/2];	/* unused space, set to 0 */
 };
 
 /*
@@ -60,6 +60,24 @@ struct sfs_vnode {
 	struct buf *sv_dinobuf;		/* buffer holding dinode */
 	uint32_t sv_dinobufcount;	/* # times dinobuf has been loaded */
 	struct lock *sv_lock;		/* lock for vnode */
+	uint32_t sv_ranext;		/* block a sequential read starts at */
+	uint32_t sv_rawindow;		/* read-ahead window, in blocks */
+	uint32_t sv_raend;		/* read ahead up to here */
+	daddr_t sv_allocnext;		/* where the next block should go */
+	daddr_t sv_resvstart;		/* preallocated blocks start here */
+	unsigned sv_resvlen;		/* # of preallocated blocks */
+	struct sfs_vnode *sv_hashnext;	/* next in vnode table chain */
+};
+
+/*
+ * In-memory vnode table: a hash table on inode number, with a lock
+ * per chain.
+ */
+#define SFS_VNHASH_SIZE 64
+
+struct sfs_vnbucket {
+	struct lock *vb_lock;		/* lock for this chain */
+	struct sfs_vnode *vb_head;	/* vnodes loaded into memory */
 };
 
 /* 
@@ -80,10 +98,13 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnbucket sfs_vnhash[SFS_VNHASH_SIZE]; /* vnode table */
+	unsigned sfs_nvnodes;		/* # vnodes in the table */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
-	struct lock *sfs_vnlock;		/* lock for vnode table */
+	unsigned *sfs_freecount;	/* free blocks per freemap block */
+	struct bitmap *sfs_resvmap;	/* preallocated blocks (in memory) */
+	struct lock *sfs_vnlock;		/* lock for sfs_nvnodes */
 	struct lock *sfs_freemaplock;	/* lock for freemap/superblock */
 	struct lock *sfs_renamelock;	/* lock for sfs_rename() */
 	struct sfs_vnode *purgatory;	/* purgatory sfs_vnode */
@@ -112,6 +133,7 @@ DEFARRAY(tx, VFSINLINE);
 
 struct txarray *txs;			// global transaction table
 struct lock *tx_lock;	// lock to protect transaction table
+struct kcache *tx_cache;	// struct tx allocations
 
 
 /*
@@ -130,5 +152,10 @@ struct lock *sfs_data_lock;			// lock to protect sfs_data list
  */
 int sfs_mount(const char *device);
 
+/*
+ * Print journal statistics (for the menu)
+ */
+void sfs_printstats(void);
+
 
 #endif /* _SFS_H_ */
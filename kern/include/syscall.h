@@ -58,6 +58,7 @@ __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_rem);
 
 int sys_open(char* kbuf, int flags, int *retval);	// syscall.c converts userptr_t to kernel pointer before calling
 													// so that the kernel can use sys_open
@@ -75,6 +76,8 @@ int sys_execv(const userptr_t program, userptr_t argv);
 int sys_waitpid(pid_t pid, int *status, int *retval);
 void sys__exit(int exitcode, int codetype);
 int sys_sbrk(intptr_t amount, int *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd, off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
 
 int sys_sync(void);
 int sys_mkdir(userptr_t path, mode_t mode);
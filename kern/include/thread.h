@@ -55,27 +55,27 @@ struct cpu;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
-/* Number of context switches per thread per epoch */
-#define DEPRIORITIZE_THRESHOLD 16
-
-/* Starvation prevention */
-#define HARDCLOCK_MOD 8
-#define LOW_MOD 8
-#define MED_MOD 3
-/* 
-	These definitions make the following priorities first choice every cycle of 8 (HARDCLOCK_MOD)
-
-	0		1		2		3		4		5		6		7
-	low 	high 	high	med 	high 	high 	med 	high
-
-	low is chosen on multiples of LOW_MOD, med on other multiples of MED_MOD, and high otherwise 
-
-	This scheme is intended both to prevent starvation and give lower priority threads the opportunity
-	to complete actions that escalate their priority. Otherwise unintended behavior happens when the first
-	thread enters the high priority queue.
-*/
-
-
+/*
+ * Scheduler tuning (multilevel feedback queue).
+ *
+ * Each cpu has SCHED_LEVELS run queues; level 0 runs first. A thread
+ * at level L may run for SCHED_QUANTUM(L) hardclocks (counted across
+ * sleeps, so it can't stay on top by blocking just before its slice
+ * runs out) before it's moved down a level. Every
+ * SCHED_BOOST_HARDCLOCKS all threads go back to level 0 so CPU-bound
+ * threads at the bottom can't starve.
+ */
+#define SCHED_LEVELS 4
+#define SCHED_QUANTUM(level) (1U << (level))	/* 1, 2, 4, 8 hardclocks */
+#define SCHED_BOOST_HARDCLOCKS 100		/* boost about once a second */
+
+/* Per-thread accounting, in hardclocks. */
+struct thread_acct {
+	unsigned ta_run;		/* time spent running */
+	unsigned ta_wait;		/* time spent ready on a run queue */
+	unsigned ta_queued;		/* when it was last put on a run queue */
+	unsigned ta_demotions;		/* times it used up a whole time slice */
+};
 
 /* States a thread can be in. */
 typedef enum {
@@ -106,9 +106,11 @@ struct thread {
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
-	bool io_priority;		// set true by certain IO system calls
-	bool sleep_priority;	// set true by wchan_sleep
-	int switches_left;		// used to deprioritize threads over time
+	unsigned t_level;		// MLFQ level, 0 is the highest priority
+	unsigned t_used;		// hardclocks used at this level
+	unsigned t_epoch;		// boost epoch t_level belongs to
+	struct thread_acct t_acct;	// run/wait time accounting
+	bool t_pinned;			// affinity hint: don't let other cpus steal this thread
 
 	/*
 	 * Interrupt state fields.
@@ -134,10 +136,21 @@ struct thread {
 	/* VFS */
 	bool t_did_reserve_buffers;	/* reserve_buffers() in effect */
 	struct tx *tx;		// current transaction
+	unsigned t_ioclass;		/* IOCLASS_* for disk requests */
 
 	/* add more here as needed */
 };
 
+/*
+ * Disk I/O classes (t_ioclass), most urgent first. Disk drivers that
+ * queue requests serve a more urgent class ahead of a less urgent one,
+ * up to a deadline.
+ */
+#define IOCLASS_SWAP		0	/* paging */
+#define IOCLASS_JOURNAL		1	/* journal writes */
+#define IOCLASS_NORMAL		2	/* everything else */
+#define IOCLASS_COUNT		3
+
 /*
  * Array of threads.
  */
@@ -198,10 +211,30 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
+ * Charge the current thread for a hardclock, and yield if its time
+ * slice is up or a higher priority thread is waiting. Called from the
  * timer interrupt.
  */
-void thread_consider_migration(void);
+void thread_tick(void);
+
+/*
+ * Set or clear the current thread's affinity hint. A pinned thread
+ * stays on the cpu it's running on; idle cpus won't steal it.
+ */
+void thread_pin(bool pinned);
+
+/*
+ * Timed sleeps, to hardclock resolution. thread_sleep_until sleeps
+ * until clock_ticks() reaches TICK; thread_sleep_ms sleeps for MS
+ * milliseconds. Sleepers are woken individually by the timer wheel.
+ */
+void thread_sleep_until(unsigned tick);
+void thread_sleep_ms(unsigned ms);
+
+/*
+ * Print per-cpu scheduler statistics. ("sched" in the kernel menu.)
+ */
+void thread_printstats(void);
 
 
 #endif /* _THREAD_H_ */
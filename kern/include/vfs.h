@@ -115,6 +115,38 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Name cache (see vfsnamecache.c), for filesystems to remember what
+ * looking up single names in directories found.
+ *
+ *    vfs_nc_lookup   - Look up NAME in DIR. If the cache knows, returns
+ *                      true and hands back a reference to the vnode,
+ *                      or NULL if the name doesn't exist.
+ *    vfs_nc_enter    - Record that NAME in DIR is VN (NULL: no such name).
+ *                      Hands back in DROP the references of the entry
+ *                      it recycled, if any.
+ *    vfs_nc_release  - Drop the references in DROP. Since this may
+ *                      reclaim vnodes, do it after letting go of the
+ *                      directory's lock.
+ *    vfs_nc_remove   - Forget NAME in DIR; call on any change to it.
+ *    vfs_nc_purgedir - Forget everything about a directory being removed.
+ *    vfs_nc_purgefs  - Forget everything on a filesystem.
+ */
+
+struct vfs_ncdrop {
+	struct vnode *ncd_dir;
+	struct vnode *ncd_vn;
+};
+
+void vfs_nc_bootstrap(void);
+bool vfs_nc_lookup(struct vnode *dir, const char *name, struct vnode **ret);
+void vfs_nc_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		  struct vfs_ncdrop *drop);
+void vfs_nc_release(struct vfs_ncdrop *drop);
+void vfs_nc_remove(struct vnode *dir, const char *name);
+void vfs_nc_purgedir(struct vnode *dir);
+void vfs_nc_purgefs(struct fs *fs);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because lookup may destroy pathnames, these all may too.
@@ -47,6 +47,9 @@
 #include <thread.h>
 #include <mips/tlb.h>
 
+struct fs;
+struct vnode;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -54,11 +57,12 @@
 
 union metadata {
 	struct {
-		unsigned int swap : 20, : 5;	// address in swap
-		unsigned int recent : 1;		// recently evicted from TLB
-		unsigned int tlb : 1;			// currently in TLB
+		unsigned int swap : 20;			// address in swap
+		unsigned int order : 5;			// buddy order + 1 if first page of a free block, else 0
+		unsigned int walk : 1;			// file page: its mappers are being walked, so they can't change
+		unsigned int wback : 1;			// file page: being written back from its frame
 		unsigned int dirty : 1;			// dirty page
-		unsigned int contig : 1;		// end of kernel allocation
+		unsigned int contig : 1;		// end of kernel allocation (or user page of a whole large page)
 		unsigned int kernel : 1;		// belongs to kernel
 		unsigned int s_pres : 1;		// present in swap
 		unsigned int busy : 1;			// busy
@@ -69,49 +73,193 @@ union metadata {
 struct core_map_entry {
 	vaddr_t va;				// virtual address of the page
 	struct addrspace *as;	// address space for the virtual address
-	uint32_t reserved;		// reserved to make nicely aligned 16 byte entries
-							// could put other stuff here, like a refcount if you
-							// implemented copy on write
+	uint32_t refcount;		// number of address spaces mapping the page
+							// (more than 1 means it's shared copy on write)
 	union metadata md;		// 4 bytes of metadata
 };
 
+// Address spaces other than core_map[cmi].as that share a copy-on-write page.
+// They all map it at the same virtual address, since they were forked from each other.
+// File pages have no owner, so for them the list holds every mapping, each with
+// its own address and the vnode its mmap() region holds.
+struct cow_sharer {
+	struct addrspace *as;
+	vaddr_t va;				// (file pages only)
+	struct vnode *vn;		// (file pages only)
+	struct cow_sharer *next;
+};
+
+// Page cache: file pages share the core map with user pages (see pcache.c).
+// A file page's CME has its kernel address as va and no address space, and
+// its key is in pcache_entries. Its refcount is the number of PTEs mapping it
+// (with mmap()), and cow_sharers lists them so it can be unmapped everywhere
+// to evict it.
+struct pcache_entry {
+	struct fs *fs;		// file system, or NULL if the frame isn't a file page
+	uint32_t ino;		// file
+	uint32_t pgno;		// page index within the file
+	long next;			// next core map index in the hash chain, or -1
+	uint32_t pins;		// system calls that need it to stay mapped (see as_prefault())
+	bool ra;			// read ahead and not used yet (see pcache_get_ahead())
+};
+#define CMI_IS_FILE(cmi) (pcache_entries[cmi].fs != NULL)
+#define CMI_IS_MAPPED_FILE(cmi) (CMI_IS_FILE(cmi) && core_map[cmi].refcount > 0)
+
+// Per-CME TLB state. These are bytes of their own rather than metadata bits so
+// that tlb_miss() can set them without the core map spinlock: a byte store
+// can't undo a concurrent update of the metadata word. Whoever changes them
+// otherwise holds the core map spinlock.
+union tlb_state {
+	struct {
+		uint8_t tlb;		// currently in TLB
+		uint8_t recent;		// recently evicted from TLB
+	};
+	uint16_t all;	// for zeroing the state in one instruction
+};
+
 struct core_map_entry *core_map;
 unsigned long ncmes;				// number of core map entries
 unsigned long clock;				// pointer to clock hand for page eviction algorithm
 struct spinlock core_map_splk;
+struct cow_sharer **cow_sharers;	// per-CME list of extra sharers (NULL if not shared)
+struct wchan *cow_wchan;			// for waiting on busy shared pages, protected by core_map_splk
+struct kcache *pt_cache;			// page tables (see as_bootstrap())
+struct pcache_entry *pcache_entries;	// per-CME page cache key, protected by core_map_splk
+struct wchan *pcache_wchan;			// for waiting on busy file pages, protected by core_map_splk
+union tlb_state *tlb_states;		// per-CME TLB state (see above)
+
+// Free frames are kept in buddy free lists, one per order, so allocation doesn't
+// scan the core map. A free block of order k is 2^k free frames starting at a
+// core map index aligned to 2^k; the list links live in its first frame.
+#define BUDDY_ORDERS 20
+struct free_block {
+	long next;		// core map index of the next free block of this order, or -1
+	long prev;		// core map index of the previous one, or -1
+};
 
 // stat tracking
 unsigned long nfree;	// number of free physical pages
 unsigned long ndirty;	// number of dirty physical pages
+unsigned long nfdirty;	// number of dirty mapped file pages (not counted in ndirty)
 unsigned long nswap;	// number of pages in swap
+unsigned long npf_issued;	// pages read from swap ahead of a fault
+unsigned long npf_hits;		// prefetched pages that were then used
+unsigned long npf_misses;	// prefetched pages evicted or freed without being used
 
 struct vnode *swap_vnode;
-struct bitmap *swap_bitmap;
-struct lock *swap_lk;			// protects access to swap_bitmap and swap_vnode
+struct bitmap *swap_bitmap;		// protected by core_map_splk
+uint16_t *swap_refs;			// number of PTEs/CMEs referring to each swap index (core_map_splk)
 unsigned long swap_size;
 
+// Dirty mapped file pages can't be evicted until they're written back, so a
+// process writing through shared mappings writes some back itself once more
+// than 1/FDIRTY_DENOM of memory is dirty file pages (see perms_fault()).
+#define FDIRTY_DENOM 4
+
+// Swap I/O goes through a queue served by worker threads (see swapio.c)
+#define SWAP_WORKERS 2		// number of swap worker threads
+#define SWAP_CLUSTER 8		// max pages moved by one VOP_READ/VOP_WRITE on swap_vnode
+#define SWAP_BATCH 16		// max pages the write-back daemon submits at once
+
+struct swap_batch {
+	unsigned pending;			// requests not completed yet (protected by the swap queue)
+};
+
+struct swap_req {
+	struct addrspace *as;		// owner of the page; its CME is busy until completion
+	vaddr_t va;					// virtual address of the page
+	unsigned long cmi;			// frame read into or written from
+	unsigned swapi;				// swap index
+	bool write;					// page-out (else page-in)
+	struct swap_batch *batch;	// NULL if the submitter sleeps on as->addr_wchan until 'done'
+	bool done;					// set under as->addr_splk on completion
+	struct swap_req *next;		// queue link
+};
+
+// Swap-in read-around: on a fault in a sequential (or reverse) scan, up to
+// prefetch_window neighbouring pages whose swap indices continue the faulting
+// page's are read in the same transfer. Set with 'ra' from the kernel menu.
+#define PREFETCH_MAX (SWAP_CLUSTER - 1)
+unsigned prefetch_window;
+
+// Large pages: with 'lp on' from the kernel menu, the first fault on an aligned
+// LPAGE_SIZE stretch of stack or heap backs all of it with one buddy block of
+// contiguous frames, instead of a frame per fault. The MIPS TLB only has 4K
+// pages, so each page still gets its own TLB entry. The frames of a whole large
+// page have md.contig set; swapping out, freeing or copying on write any one of
+// them splits the large page back into ordinary pages. The counters are
+// protected by the core map spinlock.
+#define LPAGE_ORDER 4
+#define LPAGE_PAGES (1 << LPAGE_ORDER)
+#define LPAGE_SIZE (LPAGE_PAGES * PAGE_SIZE)
+bool lpage_enabled;
+unsigned long nlp_allocs;		// large pages allocated
+unsigned long nlp_fallbacks;	// faults that wanted a large page but got no free block
+unsigned long nlp_splits;		// large pages split by swap-out, free or copy on write
+unsigned long nlp_hits;			// TLB misses on pages of whole large pages
+
 /* Initialization function */
 void vm_bootstrap(void);
 void swap_bootstrap(void);
 int print_core_map(int nargs, char **args);	// accessed with 'cm' from the kernel menu
+int prefetch_cmd(int nargs, char **args);		// accessed with 'ra' from the kernel menu
+int lpage_cmd(int nargs, char **args);		// accessed with 'lp' from the kernel menu
 
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 int perms_fault(struct addrspace *as, vaddr_t faultaddress);
-int tlb_miss(struct addrspace *as, vaddr_t faultaddress);
+int tlb_miss(struct addrspace *as, vaddr_t faultaddress, bool write);
+
+/* Buddy allocator for free frames; see vm.c */
+// *** Assume the core map spinlock is held
+long frame_alloc(unsigned order);							// returns a core map index or -1
+void frame_take(unsigned long cmi);							// take a specific free frame
+void frame_free(unsigned long cmi, unsigned long npages);	// frames must have cleared CMEs
+
+// *** Assumes the core map spinlock (and 'as' spinlock, unless 'as' is NULL) is held
+long find_cmi(struct addrspace *as);	// a free frame, evicting a page if there are none
+
+/* Page cache; see pcache.c */
+void pcache_bootstrap(void);
+unsigned long pcache_get(struct fs *fs, uint32_t ino, uint32_t pgno, bool *fresh);
+long pcache_get_ahead(struct fs *fs, uint32_t ino, uint32_t pgno);
+void pcache_release(unsigned long cmi);
+void pcache_discard(unsigned long cmi);
+void pcache_write(struct fs *fs, uint32_t ino, off_t pos, const void *data, size_t len, const void *src);
+void pcache_truncate(struct fs *fs, uint32_t ino, off_t len);
+void pcache_purge(struct fs *fs);
+void pcache_printstats(void);
+// *** Assume the core map spinlock is held
+void pcache_steal(unsigned long cmi);
+void pcache_map(unsigned long cmi);
+void pcache_unmap(unsigned long cmi);
+bool pcache_needs_wback(unsigned long cmi);
 
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+// Kernel pages are never swapped, so md.swap of a kernel heap page holds a tag
+// for kmalloc (its subpage size class + 1, or 0). The tag must be cleared before
+// free_kpages. Reading it is unlocked; the caller must own a block on the page.
+void kpage_settag(vaddr_t addr, unsigned tag);
+unsigned kpage_tag(vaddr_t addr);
+
 /* Allocate/free user pages */
 // See mipsvm.c for which spinlocks must/must not be held when calling these
-int alloc_upage(struct addrspace *as, vaddr_t vaddr, uint8_t perms, bool as_splk); // 'perms' is nonzero from as_define_region
+int alloc_upage(struct addrspace *as, vaddr_t vaddr, uint8_t perms, bool as_splk); // 'perms' holds PROT_ bits, or 0 for stack/heap
 int alloc_upages(struct addrspace *as, vaddr_t vaddr, unsigned npages, uint8_t perms);
+int alloc_upage_file(struct addrspace *as, vaddr_t vaddr, uint8_t perms, struct vnode *v, off_t pos, size_t pgoff, size_t len);
 void free_upage(struct addrspace *as, vaddr_t vaddr, bool as_splk);
 void free_upages(struct addrspace *as, vaddr_t vaddr, unsigned npages);
 
-// deep copy all pages in the page table hierarchy in 'old' to 'new'
+/* Map/look at file pages in user address spaces; see mipsvm.c */
+void map_fpage(struct addrspace *as, vaddr_t vaddr, unsigned long cmi, uint8_t perms, struct vnode *v);
+int fpage_sync(struct addrspace *as, vaddr_t vaddr);
+int fpage_pin(struct addrspace *as, vaddr_t vaddr, bool write, bool *pinned);
+void fpage_unpin(struct addrspace *as, vaddr_t vaddr);
+
+// copy on write all pages in the page table hierarchy in 'old' to 'new'
 void pth_copy(struct addrspace *old, struct addrspace *new);
 
 /* Swap in/out pages */
@@ -120,12 +268,25 @@ void swap_in(struct addrspace *as, vaddr_t vaddr);
 void swap_copy_in(struct addrspace *as, vaddr_t vaddr, unsigned long cmi);
 void swap_out(unsigned long cmi, struct addrspace *other_as);
 void swap_copy_out(struct addrspace *as, unsigned long cmi);
+void swap_prepare_out(struct addrspace *as, unsigned long cmi, struct swap_req *req, struct swap_batch *batch);
+void swap_io_done(struct swap_req *req);	// called by swap workers with no spinlocks held
+
+/* Swap I/O queue */
+void swap_io_bootstrap(void);
+void swap_submit(struct swap_req *reqs, unsigned n);
+void swap_batch_wait(struct swap_batch *batch);
+void swap_io_printstats(void);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *ts);
 
-/* Invalidate the entire TLB; used in as_activate() */
+/* Invalidate the entire TLB; used when a CPU runs out of ASIDs */
 void invalidate_tlb(void);
 
+/* Address space IDs; see mipsvm.c */
+void asid_activate(struct addrspace *as);			// used in as_activate()
+bool asid_live(struct addrspace *as, unsigned cpunum);
+void tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+
 
 #endif /* _VM_H_ */
@@ -42,6 +42,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
@@ -115,6 +116,7 @@ boot(void)
 	/* Early initialization. */
 	ram_bootstrap();
 	vm_bootstrap();
+	wchan_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
@@ -45,6 +45,7 @@
 #include <syscall.h>
 #include <test.h>
 #include <vm.h>
+#include <kcache.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -475,6 +476,18 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kcache_printstats();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -519,6 +532,32 @@ cmd_bufstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_SFS
+static
+int
+cmd_sfsstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_printstats();
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -629,9 +668,14 @@ static const char *mainmenu[] = {
 	"[ut1-5] ASST1 UNIT TESTING          ",
 #endif
 	"[kh] Kernel heap stats              ",
+	"[kc] Object cache stats             ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
 	"[buf] Print buffer cache stats      ",
+#if OPT_SFS
+	"[jstats] Print SFS journal stats    ",
+#endif
+	"[sched] Print scheduler stats       ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -679,6 +723,8 @@ static struct {
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
 	{ "cm", 	print_core_map },
+	{ "ra", 	prefetch_cmd },
+	{ "lp", 	lpage_cmd },
 
 #if OPT_SYNCHPROBS
 	/* in-kernel synchronization problem(s) */
@@ -689,9 +735,14 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "kc",         cmd_kcachestats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
 	{ "buf",        cmd_bufstats },
+#if OPT_SFS
+	{ "jstats",     cmd_sfsstats },
+#endif
+	{ "sched",      cmd_schedstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
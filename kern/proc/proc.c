@@ -50,7 +50,9 @@
 #include <vnode.h>
 #include <wchan.h>
 #include <vfs.h>
+#include <kcache.h>
 
+static struct kcache *proc_cache;
 
 /*
  * Helper function for proc_create(). Iterates through procs, and sets
@@ -94,7 +96,7 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kcache_alloc(proc_cache);
 	if (proc == NULL)
 		goto err1;
 
@@ -133,7 +135,7 @@ proc_create(const char *name)
 	err3:
 		kfree(proc->p_name);
 	err2:
-		kfree(proc);
+		kcache_free(proc_cache, proc);
 	err1:
 		return NULL;
 }
@@ -247,7 +249,7 @@ proc_destroy(struct proc *proc)
 	procarray_destroy(proc->p_children); 
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kcache_free(proc_cache, proc);
 }
 
 /*
@@ -256,6 +258,11 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = kcache_create("proc", sizeof(struct proc), NULL, NULL);
+	if(proc_cache == NULL) {
+		panic("kcache_create for proc_cache failed\n");
+	}
+
 	procs = procarray_create();		// create global procs struct
 	if(procs == NULL) {
 		panic("procarray_create for procs failed\n");
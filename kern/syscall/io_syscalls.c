@@ -20,11 +20,19 @@
 #include <copyinout.h>
 #include <kern/seek.h>
 #include <stat.h>
+#include <kcache.h>
+
+static struct kcache *vfile_cache;
 
 /*
  * Initialize the vfiles array, including stdin, stdout, and stderr.
  */
 void vfiles_init(void) {
+	vfile_cache = kcache_create("vfile", sizeof(struct vfile), NULL, NULL);
+	if(vfile_cache == NULL) {
+		panic("kcache_create for vfile_cache failed\n");
+	}
+
 	vfiles = vfilearray_create();
 	if(vfiles == NULL) {
 		panic("vfilearray_create for vfiles failed\n");
@@ -106,7 +114,7 @@ int sys_open(char* pathname, int flags, int *retval) {
 		goto err1;
 	}
 
-	struct vfile *vf = kmalloc(sizeof(struct vfile));
+	struct vfile *vf = kcache_alloc(vfile_cache);
 	if(vf == NULL) {	// not enough memory to kmalloc
 		err = ENOMEM;
 		goto err1;
@@ -140,8 +148,6 @@ int sys_open(char* pathname, int flags, int *retval) {
 
 	if(retval != NULL)		// allow kernel to ignore return value for convenience
 		*retval = fd;
-	
-	curthread->io_priority = true;		// for scheduling
 
 	return 0;
 
@@ -155,7 +161,7 @@ int sys_open(char* pathname, int flags, int *retval) {
 	err3:
 		kfree(vf->vf_name);
 	err2:
-		kfree(vf);
+		kcache_free(vfile_cache, vf);
 	err1:
 		return err;
 }
@@ -166,6 +172,11 @@ int sys_read(int fd, userptr_t buf, size_t buflen, int *retval) {
 	if((VFILES(CUR_FDS(fd))->vf_flags & O_ACCMODE) == O_WRONLY)	// reads not permitted
 		return EBADF;
 
+	size_t len = buflen;
+	int err = as_prefault(curproc->p_addrspace, buf, &len, true);	// can't fault into the file system
+	if(err != 0)													// while it's doing the read
+		return err;
+
 	struct iovec iov;
 	struct uio uio;
 
@@ -173,15 +184,17 @@ int sys_read(int fd, userptr_t buf, size_t buflen, int *retval) {
 	spinlock_acquire(&VFILES(CUR_FDS(fd))->vf_lock); // protect access to vf_offset
 
 	off_t off = VFILES(CUR_FDS(fd))->vf_offset;
-	uio_uinit(&iov, &uio, buf, buflen, off, UIO_READ);
+	uio_uinit(&iov, &uio, buf, len, off, UIO_READ);
 
 	spinlock_release(&VFILES(CUR_FDS(fd))->vf_lock);
 
 
 	lock_acquire(VFILES(CUR_FDS(fd))->io_lock);
-	int err = VOP_READ(VFILES(CUR_FDS(fd))->vf_vnode, &uio);
+	err = VOP_READ(VFILES(CUR_FDS(fd))->vf_vnode, &uio);
 	lock_release(VFILES(CUR_FDS(fd))->io_lock);
 
+	as_unpin(curproc->p_addrspace, buf, len);
+
 	if(err != 0)
 		return err;
 
@@ -197,8 +210,6 @@ int sys_read(int fd, userptr_t buf, size_t buflen, int *retval) {
 		spinlock_release(&VFILES(CUR_FDS(fd))->vf_lock);
 	}
 
-	curthread->io_priority = true;		// for scheduling
-
 	return 0;
 }
 
@@ -208,6 +219,11 @@ int sys_write(int fd, const userptr_t buf, size_t buflen, int *retval) {
 	if((VFILES(CUR_FDS(fd))->vf_flags & O_ACCMODE) == O_RDONLY)		// writes not permitted
 		return EBADF;
 
+	size_t len = buflen;
+	int err = as_prefault(curproc->p_addrspace, buf, &len, false);	// see sys_read()
+	if(err != 0)
+		return err;
+
 	struct iovec iov;
 	struct uio uio;
 
@@ -215,15 +231,17 @@ int sys_write(int fd, const userptr_t buf, size_t buflen, int *retval) {
 	spinlock_acquire(&VFILES(CUR_FDS(fd))->vf_lock); 	// protect access to vf_offset
 
 	off_t off = VFILES(CUR_FDS(fd))->vf_offset;
-	uio_uinit(&iov, &uio, buf, buflen, off, UIO_WRITE);
+	uio_uinit(&iov, &uio, buf, len, off, UIO_WRITE);
 
 	spinlock_release(&VFILES(CUR_FDS(fd))->vf_lock);
 
 
 	lock_acquire(VFILES(CUR_FDS(fd))->io_lock);
-	int err = VOP_WRITE(VFILES(CUR_FDS(fd))->vf_vnode, &uio);
+	err = VOP_WRITE(VFILES(CUR_FDS(fd))->vf_vnode, &uio);
 	lock_release(VFILES(CUR_FDS(fd))->io_lock);
 
+	as_unpin(curproc->p_addrspace, buf, len);
+
 	if(err != 0)
 		return err;
 
@@ -238,8 +256,6 @@ int sys_write(int fd, const userptr_t buf, size_t buflen, int *retval) {
 		spinlock_release(&VFILES(CUR_FDS(fd))->vf_lock);
 	}
 
-	curthread->io_priority = true;		// for scheduling
-
 	return 0;
 }
 int sys_lseek(int fd, off_t pos, int whence, int *retval, int *retval2) {
@@ -297,8 +313,6 @@ int sys_lseek(int fd, off_t pos, int whence, int *retval, int *retval2) {
 	if(retval2 != NULL)
 		*retval2 = vf->vf_offset;	// combine these two in syscall.c
 
-	curthread->io_priority = true;		// for scheduling
-
 	return 0;
 }
 
@@ -326,7 +340,7 @@ int sys_close(int fd) {
 		vfs_close(vf->vf_vnode);
 		spinlock_cleanup(&vf->vf_lock);
 		lock_destroy(vf->io_lock);
-		kfree(vf);
+		kcache_free(vfile_cache, vf);
 
 		spinlock_acquire(&gf_lock);
 		vfilearray_set(vfiles, index, NULL);
@@ -368,8 +382,6 @@ int sys_dup2(int oldfd, int newfd, int *retval) {
 	if(retval != NULL)
 		*retval = newfd;
 
-	curthread->io_priority = true;		// for scheduling
-
 	return 0;
 }
 
@@ -387,8 +399,6 @@ int sys_chdir(const userptr_t pathname) {
 
 	kfree(kbuf);
 
-	curthread->io_priority = true;		// for scheduling
-
 	return err;		// 0 upon success
 }
 
@@ -396,9 +406,15 @@ int sys___getcwd(userptr_t buf, size_t buflen, int *retval) {
 	struct iovec iov;
 	struct uio uio;
 
-	uio_uinit(&iov, &uio, buf, buflen, 0, UIO_READ);
+	size_t len = buflen;
+	int err = as_prefault(curproc->p_addrspace, buf, &len, true);	// see sys_read()
+	if(err != 0)
+		return err;
+
+	uio_uinit(&iov, &uio, buf, len, 0, UIO_READ);
 
-	int err = vfs_getcwd(&uio);	// read working directory to user space
+	err = vfs_getcwd(&uio);	// read working directory to user space
+	as_unpin(curproc->p_addrspace, buf, len);
 	if(err != 0)
 		return err;
 
@@ -59,6 +59,8 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include <stat.h>
+#include "opt-dumbvm.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -81,8 +83,6 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
-	struct iovec iov;
-	struct uio u;
 	int result;
 
 	if (filesize > memsize) {
@@ -93,6 +93,31 @@ load_segment(struct addrspace *as, struct vnode *v,
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
+#if !OPT_DUMBVM
+	/*
+	 * Nothing is read here: the VM system reads each page of the
+	 * segment from the file the first time it's touched. Check
+	 * that the file is long enough now, though, since there's
+	 * nobody to report a short read to later.
+	 */
+	struct stat st;
+
+	(void)is_executable;
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset < 0 || offset + filesize > st.st_size) {
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	return as_load_region(as, v, offset, vaddr, filesize);
+#else
+	struct iovec iov;
+	struct uio u;
+
 	iov.iov_ubase = (userptr_t)vaddr;
 	iov.iov_len = memsize;		 // length of the memory space
 	u.uio_iov = &iov;
@@ -143,6 +168,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 
 	return result;
+#endif /* OPT_DUMBVM */
 }
 
 /*
@@ -45,6 +45,7 @@
 #include <copyinout.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <addrspace.h>
 #include <syscall.h>
 
 /*
@@ -299,21 +300,30 @@ sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval)
 	/* all directories should be seekable */
 	KASSERT(VOP_ISSEEKABLE(file->vf_vnode));
 
+	/* map in any file pages behind the buffer first (see sys_read) */
+	size_t len = buflen;
+	err = as_prefault(curproc->p_addrspace, buf, &len, true);
+	if (err) {
+		return err;
+	}
+
 	spinlock_acquire(&file->vf_lock);
 
 	/* Dirs shouldn't be openable for write at all, but be safe... */
 	if ((file->vf_flags & O_ACCMODE) == O_WRONLY) {
 		spinlock_release(&file->vf_lock);
+		as_unpin(curproc->p_addrspace, buf, len);
 		return EBADF;
 	}
 
 	/* set up a uio with the buffer, its size, and the current offset */
-	uio_uinit(&iov, &useruio, buf, buflen, file->vf_offset, UIO_READ);
+	uio_uinit(&iov, &useruio, buf, len, file->vf_offset, UIO_READ);
 
 	/* do the read */
 	err = VOP_GETDIRENTRY(file->vf_vnode, &useruio);
 	if (err) {
 		spinlock_release(&file->vf_lock);
+		as_unpin(curproc->p_addrspace, buf, len);
 		return err;
 	}
 
@@ -322,12 +332,15 @@ sys_getdirentry(int fd, userptr_t buf, size_t buflen, int *retval)
 
 	spinlock_release(&file->vf_lock);
 
+	/* let go of the pages as_prefault pinned */
+	as_unpin(curproc->p_addrspace, buf, len);
+
 	/*
 	 * the amount read is the size of the buffer originally, minus
 	 * how much is left in it. Note: it is not correct to use
 	 * uio_offset for this!
 	 */
-	*retval = buflen - useruio.uio_resid;
+	*retval = len - useruio.uio_resid;
 
 	return 0;
 }
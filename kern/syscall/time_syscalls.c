@@ -28,8 +28,10 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <clock.h>
 #include <copyinout.h>
+#include <thread.h>
 #include <syscall.h>
 
 /*
@@ -56,3 +58,45 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the interval in *user_req, rounded up to whole hardclocks
+ * (plus one, since the current tick is already partly gone). Nothing
+ * interrupts the sleep, so the time remaining is always zero.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec ts;
+	uint64_t ticks;
+	int result;
+
+	result = copyin(user_req, &ts, sizeof(ts));
+	if (result) {
+		return result;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	if (ts.tv_sec > 0x3fffffff / HZ) {
+		ticks = 0x3fffffff;
+	}
+	else {
+		ticks = (uint64_t)ts.tv_sec * HZ +
+			((uint64_t)ts.tv_nsec * HZ + 999999999) / 1000000000;
+	}
+	if (ticks > 0) {
+		thread_sleep_until(clock_ticks() + (unsigned)ticks + 1);
+	}
+
+	if (user_rem != NULL) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		result = copyout(&ts, user_rem, sizeof(ts));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
@@ -1,17 +1,22 @@
 /*
  * VM-related system calls.
  *
- * Includes sbrk().
+ * Includes sbrk(), mmap() and munmap().
  */
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <vm.h>
 #include <addrspace.h>
 #include <syscall.h>
 #include <current.h>
 #include <proc.h>
+#include <limits.h>
+#include <vnode.h>
+#include <vfs.h>
 
 
 int sys_sbrk(intptr_t amount, int *retval) {
@@ -46,4 +51,54 @@ int sys_sbrk(intptr_t amount, int *retval) {
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+
+// 'addr' is only a hint, and we don't take hints (see mmap_add())
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd, off_t offset, int *retval) {
+	(void) addr;
+
+	if(len == 0 || offset < 0 || offset % PAGE_SIZE != 0)
+		return EINVAL;
+	if((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0)
+		return EINVAL;
+	if((flags & MAP_TYPE) != MAP_SHARED && (flags & MAP_TYPE) != MAP_PRIVATE)
+		return EINVAL;
+	if(flags & ~MAP_TYPE)	// no MAP_FIXED
+		return EINVAL;
+
+	if(fd < 0 || fd >= OPEN_MAX || CUR_FDS(fd) < 0)	// invalid fd
+		return EBADF;
+
+	struct vfile *file = VFILES(CUR_FDS(fd));
+	bool shared = (flags & MAP_TYPE) == MAP_SHARED;
+
+	if((file->vf_flags & O_ACCMODE) == O_WRONLY)	// the file has to be readable
+		return EACCES;
+	if(shared && (prot & PROT_WRITE) && (file->vf_flags & O_ACCMODE) != O_RDWR)
+		return EACCES;								// and writeable, to write to it
+
+	// make sure the file can be mapped at all by getting its first page
+	// (which the first fault will most likely want anyway)
+	unsigned long cmi;
+	int err = VOP_MMAP(file->vf_vnode, offset, &cmi);
+	if(err != 0)
+		return err;
+	pcache_release(cmi);
+
+	vaddr_t start;
+	err = mmap_add(curproc->p_addrspace, file->vf_vnode, len, offset, prot, shared, &start);
+	if(err != 0)
+		return err;
+
+	*retval = start;
+	return 0;
+}
+
+
+int sys_munmap(userptr_t addr, size_t len) {
+	if((vaddr_t) addr % PAGE_SIZE != 0)
+		return EINVAL;
+
+	return mmap_remove(curproc->p_addrspace, (vaddr_t) addr, len);
+}
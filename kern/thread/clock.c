@@ -29,8 +29,8 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spinlock.h>
 #include <cpu.h>
-#include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
@@ -38,9 +38,13 @@
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * Timed callbacks are kept in a hierarchical timer wheel that CPU 0
+ * advances from hardclock(), so their resolution is one hardclock
+ * (1/HZ seconds). Level 0 has a slot for each of the next TW_SIZE
+ * ticks; each slot of level N covers TW_SIZE times as many ticks as
+ * a slot of level N-1. When level 0 wraps around, the next slot of
+ * level 1 is redistributed ("cascaded") into the levels below it, and
+ * so on up. Adding and cancelling a timeout are O(1).
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -51,13 +55,21 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Timer wheel geometry. Four levels of 64 slots cover 2^24 ticks
+ * (about 46 hours at HZ=100); anything further out is parked in the
+ * last slot of the top level and re-cascaded until it comes due.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+#define TW_BITS		6
+#define TW_SIZE		(1U << TW_BITS)
+#define TW_MASK		(TW_SIZE - 1)
+#define TW_LEVELS	4
+#define TW_MAXDELTA	((1U << (TW_BITS * TW_LEVELS)) - 1)
+
+static struct spinlock timer_lock;
+static struct timeout *timer_wheel[TW_LEVELS][TW_SIZE];
+static volatile unsigned timer_ticks;	/* hardclocks counted by CPU 0 */
 
 /*
  * Setup.
@@ -65,24 +77,232 @@ static struct spinlock lbolt_lock;
 void
 hardclock_bootstrap(void)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	unsigned i, j;
+
+	spinlock_init(&timer_lock);
+	for (i=0; i<TW_LEVELS; i++) {
+		for (j=0; j<TW_SIZE; j++) {
+			timer_wheel[i][j] = NULL;
+		}
+	}
+	timer_ticks = 0;
+}
+
+/*
+ * Timeout list handling. Lists are doubly linked through to_pprev so
+ * a timeout can be removed without knowing which slot it's in.
+ */
+static
+void
+timeout_link(struct timeout *to, struct timeout **head)
+{
+	to->to_next = *head;
+	if (to->to_next != NULL) {
+		to->to_next->to_pprev = &to->to_next;
+	}
+	to->to_pprev = head;
+	*head = to;
+}
+
+static
+void
+timeout_unlink(struct timeout *to)
+{
+	*to->to_pprev = to->to_next;
+	if (to->to_next != NULL) {
+		to->to_next->to_pprev = to->to_pprev;
+	}
+	to->to_next = NULL;
+	to->to_pprev = NULL;
+}
+
+/*
+ * Put a timeout in the wheel. BASE is the next tick that will be
+ * processed; to_expires must not be before it. Call with timer_lock
+ * held.
+ */
+static
+void
+timeout_insert(struct timeout *to, unsigned base)
+{
+	unsigned delta, level, slot;
+
+	KASSERT(spinlock_do_i_hold(&timer_lock));
+
+	delta = to->to_expires - base;
+	if (delta > TW_MAXDELTA) {
+		delta = TW_MAXDELTA;
+	}
+	for (level = 0; level < TW_LEVELS - 1; level++) {
+		if (delta < (1U << (TW_BITS * (level + 1)))) {
+			break;
+		}
+	}
+	slot = ((base + delta) >> (TW_BITS * level)) & TW_MASK;
+	timeout_link(to, &timer_wheel[level][slot]);
+}
+
+/*
+ * Redistribute one slot of a higher level at tick NOW.
+ */
+static
+void
+timeout_cascade(unsigned level, unsigned slot, unsigned now)
+{
+	struct timeout *list, *to;
+
+	list = timer_wheel[level][slot];
+	timer_wheel[level][slot] = NULL;
+	while (list != NULL) {
+		to = list;
+		list = to->to_next;
+		timeout_insert(to, now);
+	}
+}
+
+/*
+ * Advance the wheel by one tick and run whatever came due. Called by
+ * CPU 0 from hardclock().
+ *
+ * The due timeouts are moved to a private list first; they stay
+ * pending while they're on it, so timeout_cancel and timeout_at
+ * still work on them until the moment each one is run. Callbacks are
+ * called with no spinlocks held, but in interrupt context: they must
+ * not sleep.
+ */
+static
+void
+timeout_tick(void)
+{
+	struct timeout *expired, *to;
+	void (*func)(void *);
+	void *arg;
+	unsigned now, level;
+
+	spinlock_acquire(&timer_lock);
+	now = ++timer_ticks;
+	for (level = 1; level < TW_LEVELS; level++) {
+		if ((now & ((1U << (TW_BITS * level)) - 1)) != 0) {
+			break;
+		}
+		timeout_cascade(level, (now >> (TW_BITS * level)) & TW_MASK,
+				now);
+	}
+
+	expired = timer_wheel[0][now & TW_MASK];
+	timer_wheel[0][now & TW_MASK] = NULL;
+	if (expired != NULL) {
+		expired->to_pprev = &expired;
+	}
+	while (expired != NULL) {
+		to = expired;
+		KASSERT(to->to_expires == now);
+		timeout_unlink(to);
+		to->to_pending = false;
+		func = to->to_func;
+		arg = to->to_arg;
+
+		spinlock_release(&timer_lock);
+		func(arg);
+		spinlock_acquire(&timer_lock);
+	}
+	spinlock_release(&timer_lock);
+}
+
+/*
+ * Timeout interface.
+ */
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *arg)
+{
+	to->to_next = NULL;
+	to->to_pprev = NULL;
+	to->to_expires = 0;
+	to->to_pending = false;
+	to->to_func = func;
+	to->to_arg = arg;
+}
+
+/*
+ * Arrange for TO to fire when the tick count reaches TICK. A tick
+ * that has already passed fires on the next hardclock. If TO is
+ * already pending it is moved.
+ */
+void
+timeout_at(struct timeout *to, unsigned tick)
+{
+	unsigned base;
+
+	spinlock_acquire(&timer_lock);
+	if (to->to_pending) {
+		timeout_unlink(to);
+	}
+	base = timer_ticks + 1;
+	if ((int)(tick - base) < 0) {
+		tick = base;
+	}
+	to->to_expires = tick;
+	to->to_pending = true;
+	timeout_insert(to, base);
+	spinlock_release(&timer_lock);
+}
+
+/*
+ * Arrange for TO to fire MS milliseconds from now, rounded up to
+ * whole hardclocks.
+ */
+void
+timeout_after(struct timeout *to, unsigned ms)
+{
+	timeout_at(to, timer_ticks + clock_mstoticks(ms));
+}
+
+/*
+ * Cancel TO. Returns true if it was pending, in which case its
+ * callback will not be called. If it returns false the callback has
+ * already run or is running now.
+ */
+bool
+timeout_cancel(struct timeout *to)
+{
+	bool pending;
+
+	spinlock_acquire(&timer_lock);
+	pending = to->to_pending;
+	if (pending) {
+		timeout_unlink(to);
+		to->to_pending = false;
 	}
+	spinlock_release(&timer_lock);
+	return pending;
+}
+
+/*
+ * Number of hardclocks since boot, as counted by the timer wheel.
+ */
+unsigned
+clock_ticks(void)
+{
+	return timer_ticks;
+}
+
+/*
+ * Convert milliseconds to hardclocks, rounding up.
+ */
+unsigned
+clock_mstoticks(unsigned ms)
+{
+	return ((uint64_t)ms * HZ + 999) / 1000;
 }
 
 /*
  * This is called once per second, on one processor, by the timer
- * code.
+ * code. Timed waits all go through the timer wheel now, so there's
+ * nothing for it to do.
  */
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
 }
 
 /*
@@ -97,13 +317,14 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	if (curcpu->c_number == 0) {
+		timeout_tick();
 	}
+	/* Idle cpus pull work themselves; see thread_steal(). */
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	thread_tick();
 }
 
 /*
@@ -112,10 +333,7 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	if (num_secs > 0) {
+		thread_sleep_ms(num_secs * 1000);
 	}
-	spinlock_release(&lbolt_lock);
 }
@@ -50,6 +50,8 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <clock.h>
+#include <kcache.h>
 
 #include "opt-synchprobs.h"
 
@@ -71,6 +73,19 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Scheduler clock. Counted in hardclocks by cpu 0; the epoch goes up
+ * every SCHED_BOOST_HARDCLOCKS, which puts every thread back at the
+ * top level of the MLFQ.
+ */
+static volatile unsigned sched_ticks;
+static volatile unsigned sched_epoch;
+
+/* Object caches for threads, their stacks, and wait channels. */
+static struct kcache *thread_cache;
+static struct kcache *stack_cache;
+static struct kcache *wchan_cache;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -122,14 +137,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kcache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kcache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -143,9 +158,11 @@ thread_create(const char *name)
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
-	thread->io_priority = false;
-	thread->sleep_priority = false;
-	thread->switches_left = DEPRIORITIZE_THRESHOLD;
+	thread->t_level = 0;
+	thread->t_used = 0;
+	thread->t_epoch = sched_epoch;
+	bzero(&thread->t_acct, sizeof(thread->t_acct));
+	thread->t_pinned = false;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -154,6 +171,7 @@ thread_create(const char *name)
 
 	/* VFS fields */
 	thread->t_did_reserve_buffers = false;
+	thread->t_ioclass = IOCLASS_NORMAL;
 	thread->tx = NULL;
 
 	/* If you add to struct thread, be sure to initialize here */
@@ -175,6 +193,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -190,10 +209,14 @@ cpu_create(unsigned hardware_number)
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
-	threadlist_init(&c->c_mp_runqueue);
-	threadlist_init(&c->c_hp_runqueue);
+	for (i=0; i<SCHED_LEVELS; i++) {
+		threadlist_init(&c->c_runqueues[i]);
+	}
+	c->c_epoch = sched_epoch;
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_stolen = 0;
+	c->c_steals = 0;
+	c->c_steal_misses = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -221,7 +244,7 @@ cpu_create(unsigned hardware_number)
 		/*c->c_curthread->t_stack = ... */
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		c->c_curthread->t_stack = kcache_alloc(stack_cache);
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -287,7 +310,7 @@ thread_destroy(struct thread *thread)
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
+		kcache_free(stack_cache, thread->t_stack);
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
@@ -296,7 +319,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kcache_free(thread_cache, thread);
 }
 
 /*
@@ -326,6 +349,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *tl;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -340,9 +366,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<SCHED_LEVELS; i++) {
+		tl = &curcpu->c_runqueues[i];
+		tl->tl_count = 0;
+		tl->tl_head.tln_next = &tl->tl_tail;
+		tl->tl_tail.tln_prev = &tl->tl_head;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -385,6 +414,13 @@ thread_bootstrap(void)
 {
 	cpuarray_init(&allcpus);
 
+	thread_cache = kcache_create("thread", sizeof(struct thread),
+				     NULL, NULL);
+	stack_cache = kcache_create("thread stack", STACK_SIZE, NULL, NULL);
+	if (thread_cache == NULL || stack_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -454,6 +490,52 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Put a ready thread on the run queue for its MLFQ level on cpu C,
+ * whose runqueue lock must be held. A thread that hasn't been queued
+ * since the last priority boost starts over at the top level.
+ */
+static
+void
+thread_enqueue(struct cpu *c, struct thread *t)
+{
+	if (t->t_epoch != sched_epoch) {
+		t->t_epoch = sched_epoch;
+		t->t_level = 0;
+		t->t_used = 0;
+	}
+	t->t_acct.ta_queued = sched_ticks;
+	threadlist_addtail(&c->c_runqueues[t->t_level], t);
+}
+
+/*
+ * Take a thread off a run queue, charging it for the time it waited.
+ */
+static
+void
+thread_dequeued(struct thread *t)
+{
+	t->t_acct.ta_wait += sched_ticks - t->t_acct.ta_queued;
+}
+
+/*
+ * Return true if cpu C has a thread queued at LEVEL or above. This is
+ * unlocked, so it's only a hint.
+ */
+static
+bool
+thread_queued_above(struct cpu *c, unsigned level)
+{
+	unsigned i;
+
+	for (i=0; i<=level && i<SCHED_LEVELS; i++) {
+		if (!threadlist_isempty(&c->c_runqueues[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -478,7 +560,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	thread_enqueue(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -493,6 +575,78 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Work stealing.
+ *
+ * Called by a cpu with nothing on its run queues (from the idle loop in
+ * thread_switch, without the runqueue lock). Picks the cpu with the most
+ * queued threads, counting without locks since it's only a heuristic,
+ * and takes the first thread it would have run from its highest
+ * nonempty MLFQ level. Threads pinned with thread_pin() are left
+ * alone. Returns the stolen thread, now belonging to curcpu, or NULL.
+ *
+ * Only one runqueue lock is held at a time, so there's no lock
+ * ordering between cpus to worry about.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, level, n, most, numcpus;
+
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self || c->c_isidle) {
+			/* An idle cpu will run its own threads shortly. */
+			continue;
+		}
+		n = 0;
+		for (level=0; level<SCHED_LEVELS; level++) {
+			n += c->c_runqueues[level].tl_count;
+		}
+		if (n > most) {
+			most = n;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	for (level=0; level<SCHED_LEVELS; level++) {
+		THREADLIST_FORALL(t, victim->c_runqueues[level]) {
+			/*
+			 * The victim's curthread can be on its run queue
+			 * while it's still switching away from it (see the
+			 * comments in thread_switch); never take that one.
+			 */
+			if (t->t_pinned || t == victim->c_curthread) {
+				continue;
+			}
+			threadlist_remove(&victim->c_runqueues[level], t);
+			thread_dequeued(t);
+			t->t_cpu = curcpu->c_self;
+			victim->c_stolen++;
+			spinlock_release(&victim->c_runqueue_lock);
+
+			DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+			      t->t_name, victim->c_number, curcpu->c_number);
+			curcpu->c_steals++;
+			return t;
+		}
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	curcpu->c_steal_misses++;
+	return NULL;
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -518,7 +672,7 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	newthread->t_stack = kcache_alloc(stack_cache);
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -574,6 +728,7 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *cur, *next;
+	unsigned i;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -599,8 +754,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing at our level or above is
+	 * waiting, just keep running.
+	 */
+	if (newstate == S_READY &&
+	    !thread_queued_above(curcpu->c_self, cur->t_level)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -611,24 +770,8 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	    case S_RUN:
 			panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
-	    	if(cur->io_priority || cur->sleep_priority)
-	    		cur->switches_left--;
-	    	if(cur->switches_left == 0) {	// deprioritize thread
-	    		cur->io_priority = false;
-	    		cur->sleep_priority = false;
-	    		cur->switches_left = DEPRIORITIZE_THRESHOLD;
-	    		thread_make_runnable(cur, true /*have lock*/);
-	    	}
-	    	else if(cur->io_priority && cur->sleep_priority) {
-	    		threadlist_addtail(&curcpu->c_hp_runqueue, cur);
-	    	}
-	    	else if(cur->io_priority || cur->sleep_priority) {
-	    		threadlist_addtail(&curcpu->c_mp_runqueue, cur);
-	    	}
-	    	else {
-				thread_make_runnable(cur, true /*have lock*/);
-	    	}
-			break;
+		thread_make_runnable(cur, true /*have lock*/);
+		break;
 	    case S_SLEEP:
 			cur->t_wchan_name = wc->wc_name;
 			/*
@@ -667,44 +810,25 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 */
 
 	/* The current cpu is now idle. */
-
-	int which = curcpu->c_hardclocks % HARDCLOCK_MOD;	// prevent starvation, weight priorities
-
 	curcpu->c_isidle = true;
-
-	struct threadlist *choice1, *choice2, *choice3;
-
-	if(which % LOW_MOD == 0) {
-		choice1 = &curcpu->c_runqueue;
-		choice2 = &curcpu->c_hp_runqueue;
-		choice3 = &curcpu->c_mp_runqueue;
-	}
-	else if(which % MED_MOD == 0) {			// space out threads from the same queue
-		choice1 = &curcpu->c_mp_runqueue;	// (as opposed to which == 1 || which == 2, etc)
-		choice2 = &curcpu->c_runqueue;
-		choice3 = &curcpu->c_hp_runqueue;
-	}
-	else {
-		choice1 = &curcpu->c_hp_runqueue;
-		choice2 = &curcpu->c_mp_runqueue;
-		choice3 = &curcpu->c_runqueue;
-	}
-
-	next = threadlist_remhead(choice1);	// check for first choice
-	if(next == NULL) {
-		next = threadlist_remhead(choice2);		// check for second choice
-		if(next == NULL) {
-			next = threadlist_remhead(choice3);		// check for third choice
+	do {
+		next = NULL;
+		for (i=0; i<SCHED_LEVELS && next == NULL; i++) {
+			next = threadlist_remhead(&curcpu->c_runqueues[i]);
 		}
-	}
-	while(next == NULL) {	// all queues are empty
-		next = threadlist_remhead(&curcpu->c_runqueue);
-		if (next == NULL) {
+		if (next != NULL) {
+			thread_dequeued(next);
+		}
+		else {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				/* Try again after the next interrupt. */
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
-	}
+	} while (next == NULL);
 	curcpu->c_isidle = false;
 
 	/*
@@ -877,139 +1001,190 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is called periodically from hardclock(). The MLFQ levels take
+ * care of ordering; all that's left to do here is the periodic boost.
+ * Once the epoch changes, move every thread queued on this cpu up to
+ * level 0, keeping them in priority order. (Sleeping threads are
+ * boosted by thread_enqueue when they wake up.)
  */
-
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+	unsigned level;
+
+	if (curcpu->c_epoch == sched_epoch) {
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	curcpu->c_epoch = sched_epoch;
+	THREADLIST_FORALL(t, curcpu->c_runqueues[0]) {
+		t->t_epoch = sched_epoch;
+		t->t_used = 0;
+	}
+	for (level=1; level<SCHED_LEVELS; level++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueues[level]))
+		       != NULL) {
+			t->t_epoch = sched_epoch;
+			t->t_level = 0;
+			t->t_used = 0;
+			threadlist_addtail(&curcpu->c_runqueues[0], t);
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Called from hardclock() on every tick. Charges the current thread
+ * for the tick; when it has used up its level's time slice it moves
+ * down a level and yields to others at that level, and it yields
+ * right away if something at a higher level is waiting.
  */
 void
-thread_consider_migration(void)
+thread_tick(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct thread *cur;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+	if (curcpu->c_number == 0) {
+		sched_ticks++;
+		if (sched_ticks % SCHED_BOOST_HARDCLOCKS == 0) {
+			sched_epoch++;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	if (curcpu->c_isidle) {
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	cur = curthread;
+	cur->t_acct.ta_run++;
+
+	if (cur->t_epoch != sched_epoch) {
+		cur->t_epoch = sched_epoch;
+		cur->t_level = 0;
+		cur->t_used = 0;
+	}
+
+	cur->t_used++;
+	if (cur->t_used >= SCHED_QUANTUM(cur->t_level)) {
+		if (cur->t_level < SCHED_LEVELS - 1) {
+			cur->t_level++;
+		}
+		cur->t_used = 0;
+		cur->t_acct.ta_demotions++;
+		thread_yield();
 	}
+	else if (cur->t_level > 0 &&
+		 thread_queued_above(curcpu->c_self, cur->t_level - 1)) {
+		thread_yield();
+	}
+}
+
+/*
+ * Thread affinity.
+ *
+ * Threads move between cpus only when an idle cpu steals them (see
+ * thread_steal). Pinning the current thread keeps it where it is.
+ */
+void
+thread_pin(bool pinned)
+{
+	int spl;
+
+	spl = splhigh();
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	curthread->t_pinned = pinned;
 	spinlock_release(&curcpu->c_runqueue_lock);
+	splx(spl);
+}
+
+/*
+ * What thread_printstats copies out of a cpu's run queues, so it can
+ * print without holding the cpu's run queue lock. Only the first
+ * PRINTSTATS_THREADS threads of each cpu are copied.
+ */
+#define PRINTSTATS_THREADS	8
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+struct thread_acctsnap {
+	char ts_name[17];
+	unsigned ts_level;
+	struct thread_acct ts_acct;
+};
+
+static
+void
+thread_snapacct(struct thread_acctsnap *snap, unsigned *num, unsigned *more,
+		struct thread *t)
+{
+	if (*num == PRINTSTATS_THREADS) {
+		(*more)++;
+		return;
+	}
+	snprintf(snap[*num].ts_name, sizeof(snap[*num].ts_name), "%s",
+		 t->t_name);
+	snap[*num].ts_level = t->t_level;
+	snap[*num].ts_acct = t->t_acct;
+	(*num)++;
+}
+
+/*
+ * Print per-cpu scheduler statistics, and the accounting records of
+ * the threads that are running or ready to run.
+ */
+void
+thread_printstats(void)
+{
+	struct thread_acctsnap snap[PRINTSTATS_THREADS];
+	unsigned queued[SCHED_LEVELS];
+	unsigned steals, misses, stolen, nsnap, more;
+	unsigned i, j, level, numcpus, cpunum;
+	struct cpu *c;
+	struct thread *t;
+	int spl;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+		nsnap = more = 0;
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+		spl = splhigh();
+		spinlock_acquire(&c->c_runqueue_lock);
+		cpunum = c->c_number;
+		for (level=0; level<SCHED_LEVELS; level++) {
+			queued[level] = c->c_runqueues[level].tl_count;
+		}
+		steals = c->c_steals;
+		misses = c->c_steal_misses;
+		stolen = c->c_stolen;
+		if (!c->c_isidle) {
+			thread_snapacct(snap, &nsnap, &more, c->c_curthread);
+		}
+		for (level=0; level<SCHED_LEVELS; level++) {
+			THREADLIST_FORALL(t, c->c_runqueues[level]) {
+				thread_snapacct(snap, &nsnap, &more, t);
 			}
 		}
 		spinlock_release(&c->c_runqueue_lock);
-	}
+		splx(spl);
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+		kprintf("cpu%u: queued", cpunum);
+		for (level=0; level<SCHED_LEVELS; level++) {
+			kprintf(" %u", queued[level]);
+		}
+		kprintf(" (by level), stole %u, missed %u, lost %u\n",
+			steals, misses, stolen);
+		for (j=0; j<nsnap; j++) {
+			kprintf("    %-16s level %u, ran %u, waited %u, "
+				"demoted %u\n", snap[j].ts_name,
+				snap[j].ts_level, snap[j].ts_acct.ta_run,
+				snap[j].ts_acct.ta_wait,
+				snap[j].ts_acct.ta_demotions);
+		}
+		if (more > 0) {
+			kprintf("    ...and %u more\n", more);
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
-
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1018,6 +1193,43 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Wait channels come from wchan_cache; their thread lists are set up
+ * once by the constructor and stay set up while they're in the cache.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_init(&wc->wc_threads);
+	wc->wc_name = NULL;
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+/*
+ * Called early in boot, before anything creates a wait channel.
+ */
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = kcache_create("wchan", sizeof(struct wchan),
+				    wchan_ctor, wchan_dtor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -1031,25 +1243,24 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kcache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 
 	return wc;
 }
 
 /*
- * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * Destroy a wait channel. Must be empty and unlocked. The thread list
+ * stays initialized in the cache; the destructor cleans it up.
  */
 void
 wchan_destroy(struct wchan *wc)
 {
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	kcache_free(wchan_cache, wc);
 }
 
 /*
@@ -1071,8 +1282,6 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 	/* must not hold other spinlocks */
 	KASSERT(curcpu->c_spinlocks == 1);
 
-	curthread->sleep_priority = true;
-
 	thread_switch(S_SLEEP, wc, lk);
 	spinlock_acquire(lk);
 }
@@ -1156,6 +1365,79 @@ wchan_isempty(struct wchan *wc, struct spinlock *lk)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Timed sleeps.
+ *
+ * Each sleeper waits on its own wait channel, on its own stack, so
+ * the timeout wakes exactly the thread it belongs to rather than
+ * everyone sleeping on a shared channel.
+ */
+struct timedsleep {
+	struct wchan ts_wchan;
+	struct spinlock ts_lock;
+	bool ts_done;
+};
+
+/*
+ * Timeout callback. Once ts_lock is released the sleeper may return
+ * and take the struct with it, so don't touch it after that.
+ */
+static
+void
+thread_sleep_wake(void *data)
+{
+	struct timedsleep *ts = data;
+
+	spinlock_acquire(&ts->ts_lock);
+	ts->ts_done = true;
+	wchan_wakeall(&ts->ts_wchan, &ts->ts_lock);
+	spinlock_release(&ts->ts_lock);
+}
+
+/*
+ * Sleep until clock_ticks() reaches TICK.
+ */
+void
+thread_sleep_until(unsigned tick)
+{
+	struct timedsleep ts;
+	struct timeout to;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	if ((int)(tick - clock_ticks()) <= 0) {
+		return;
+	}
+
+	ts.ts_wchan.wc_name = "timedsleep";
+	threadlist_init(&ts.ts_wchan.wc_threads);
+	spinlock_init(&ts.ts_lock);
+	ts.ts_done = false;
+
+	timeout_init(&to, thread_sleep_wake, &ts);
+	timeout_at(&to, tick);
+
+	spinlock_acquire(&ts.ts_lock);
+	while (!ts.ts_done) {
+		wchan_sleep(&ts.ts_wchan, &ts.ts_lock);
+	}
+	spinlock_release(&ts.ts_lock);
+
+	spinlock_cleanup(&ts.ts_lock);
+	threadlist_cleanup(&ts.ts_wchan.wc_threads);
+}
+
+/*
+ * Sleep for MS milliseconds, to hardclock resolution.
+ */
+void
+thread_sleep_ms(unsigned ms)
+{
+	thread_sleep_until(clock_ticks() + clock_mstoticks(ms));
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Machine-independent IPI handling
  */
@@ -1229,42 +1511,42 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
  * Send a TLB shootdown IPI to all CPUs.
  */
 // *** Assumes no spinlocks are held
+// Only cpus where the address space has a live ASID can have the entry,
+// so the others aren't bothered.
 void
 ipi_broadcast_tlbshootdown(const struct tlbshootdown *ts)
 {
-	int result = tlb_probe(ts->oldentryhi, 0);	// if the entry is on this cpu's TLB, we don't need an IPI
-	if(result >= 0)
-		tlb_write(TLBHI_INVALID(result), TLBLO_INVALID(), result);
-	else {
-		spinlock_acquire(&ts_splk);
+	spinlock_acquire(&ts_splk);
 
-		while(ts_count != -1) {		// if someone else is issuing a shootdown, go to sleep so you can be interrupted
-			wchan_sleep(ts_wchan, &ts_splk);
-		}
+	while(ts_count != -1) {		// if someone else is issuing a shootdown, go to sleep so you can be interrupted
+		wchan_sleep(ts_wchan, &ts_splk);
+	}
 
-		unsigned i;
-		struct cpu *c;
-		unsigned num = cpuarray_num(&allcpus);
+	tlb_invalidate(ts->as, ts->oldentryhi);	// this cpu's TLB (interrupts are off while we hold ts_splk)
 
-		ts_count = num - 1;	// all other cpus will have to acknowledge receival
+	unsigned i;
+	struct cpu *c;
+	unsigned num = cpuarray_num(&allcpus);
 
-		for (i=0; i < num; i++) {
-			c = cpuarray_get(&allcpus, i);
-			if (c != curcpu->c_self) {
-				ipi_tlbshootdown(c, ts);
-			}
-		}
+	ts_count = 0;	// every cpu we send to will have to acknowledge receival
 
-		while(ts_count != 0) {	// wait until the shootdown is acknowledged
-			wchan_sleep(ts_wchan, &ts_splk);
+	for (i=0; i < num; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && asid_live(ts->as, c->c_number)) {
+			ts_count++;
+			ipi_tlbshootdown(c, ts);
 		}
+	}
 
-		ts_count = -1;
+	while(ts_count != 0) {	// wait until the shootdown is acknowledged
+		wchan_sleep(ts_wchan, &ts_splk);
+	}
 
-		wchan_wakeall(ts_wchan, &ts_splk);	// trigger potential waiting shootdowns
+	ts_count = -1;
 
-		spinlock_release(&ts_splk);
-	}
+	wchan_wakeall(ts_wchan, &ts_splk);	// trigger potential waiting shootdowns
+
+	spinlock_release(&ts_splk);
 }
 
 /*
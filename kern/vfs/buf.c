@@ -79,9 +79,9 @@ DEFARRAY(buf, static __UNUSED inline);
  */
 struct buf {
 	/* maintenance */
-	unsigned b_tableindex;	/* index into {de,at}tached_buffers */
-	unsigned b_dirtyindex;	/* index into dirty_buffers */
-	unsigned b_bucketindex;	/* index into buffer_hash bucket */
+	unsigned b_tableindex;	/* index into detached_buffers/bs_attached */
+	unsigned b_dirtyindex;	/* index into bs_dirty */
+	unsigned b_bucketindex;	/* index into bs_hash bucket */
 	unsigned b_dirtyepoch;	/* when we became dirty */
 
 	/* status flags */
@@ -91,9 +91,12 @@ struct buf {
 	unsigned b_dirty:1;	/* data needs to be written to disk */
 	unsigned b_fsmanaged:1;	/* managed by file system */
 	struct thread *b_holder; /* who did buffer_mark_busy() */
+	struct cv *b_busycv;	/* waiters for b_busy to clear */
+	unsigned b_refs;	/* pointers held across sleeps */
 	struct timespec b_timestamp; /* when it became dirty */
 
 	/* key */
+	struct bufshard *b_shard; /* shard the key hashes to */
 	struct fs *b_fs;	/* file system buffer belongs to */
 	daddr_t b_physblock;	/* physical block number */
 
@@ -113,72 +116,93 @@ struct bufhash {
 };
 
 /*
- * Global state.
- *
- * The main table of buffers is attached_buffers[]. This is an
- * LRU-ordered array. All buffers in attached_buffers[] should be
- * attached (that is, they are associated with a specific fs and
- * block), and should also be in buffer_hash.
+ * One shard of the buffer cache.
  *
- * Buffers that are dirty *also* appear in dirty_buffers[]; this array
- * is ordered by how recently the buffer was *first* modified.
+ * The cache is split by key hash into BUFFER_SHARDS shards, each with
+ * its own lock, so operations on unrelated blocks don't all line up
+ * behind one lock. An attached buffer lives in exactly one shard (the
+ * one its key hashes to, b_shard) and is protected by that shard's
+ * lock. No code ever holds more than one shard lock at a time.
  *
- * Buffers that are not attached appear (only) in detached_buffers[],
- * which is not ordered.
+ * The main table of each shard is bs_attached[]. This is an
+ * LRU-ordered array. All buffers in bs_attached[] should be attached
+ * (that is, they are associated with a specific fs and block), and
+ * should also be in bs_hash.
  *
- * Space in all three arrays is preallocated when buffers are created
- * so insert ops won't fail on the fly.
+ * Buffers that are dirty *also* appear in bs_dirty[]; this array is
+ * ordered by how recently the buffer was *first* modified.
  *
- * The ordered arrays (attached_buffers and dirty_buffers) are
+ * Space in both arrays is preallocated when a buffer is attached to
+ * the shard so insert ops won't fail on the fly. They are
  * preallocated with extra space (and may contain NULL entries) and
  * are compacted only when the extra space runs out.
- */
-
-static struct bufhash buffer_hash;
-
-static struct bufarray attached_buffers;
-static unsigned attached_buffers_first;   /* hint for first empty element */
-static unsigned attached_buffers_thresh;  /* size limit before compacting */
+ *
+ * The generations are incremented whenever the corresponding table
+ * is compacted so syncs in progress know they need to restart from
+ * the beginning of it.
+ */
+struct bufshard {
+	struct lock *bs_lock;
+	struct bufhash bs_hash;
+
+	struct bufarray bs_attached;
+	unsigned bs_attached_first;	/* hint for first empty element */
+	unsigned bs_attached_thresh;	/* size limit before compacting */
+	unsigned bs_attached_generation;
+	unsigned bs_attached_count;
+
+	struct bufarray bs_dirty;
+	unsigned bs_dirty_first;	/* hint for first empty element */
+	unsigned bs_dirty_thresh;	/* size limit before compacting */
+	unsigned bs_dirty_generation;
+	unsigned bs_dirty_count;
+
+	unsigned bs_busy_count;
+
+	/* counters for buffer_printstats */
+	unsigned bs_total_gets;
+	unsigned bs_valid_gets;
+	unsigned bs_read_gets;
+	unsigned bs_total_writeouts;
+	unsigned bs_cluster_writeouts;	/* buffers written in clusters */
+	unsigned bs_cluster_writes;	/* ...and the requests that took */
+	unsigned bs_total_evictions;
+	unsigned bs_dirty_evictions;
+};
 
-static struct bufarray dirty_buffers;
-static unsigned dirty_buffers_first;      /* hint for first empty element */
-static unsigned dirty_buffers_thresh;     /* size limit before compacting */
+/* Number of buffer cache shards. */
+#define BUFFER_SHARDS		16
 
-static struct bufarray detached_buffers;
+static struct bufshard buffer_shards[BUFFER_SHARDS];
 
 /*
- * Epochs and generations.
+ * Global state.
  *
- * The dirty_epoch is incremented whenever an explicit sync call is
- * made, and is used to know when to stop syncing. The
- * dirty_buffers_generation, conversely, is incremented whenever the
- * dirty_buffers table is compacted so syncs in progress know they
- * need to restart from the beginning of it. The attached_buffers
- * generation is the same, but for the attached_buffers table.
- */
-
-static unsigned dirty_epoch;
-static unsigned dirty_buffers_generation;
-static unsigned attached_buffers_generation;
-
-/*
- * Counters.
+ * Buffers that are not attached appear (only) in detached_buffers[],
+ * which is not ordered. Its space is preallocated when buffers are
+ * created.
+ *
+ * This, the buffer totals, and the reservation count are protected
+ * by buffer_pool_lock. The pool lock may be taken while holding a
+ * shard lock, but not the other way around.
  */
 
-static unsigned attached_buffers_count;
-static unsigned busy_buffers_count;
-static unsigned dirty_buffers_count;
+static struct bufarray detached_buffers;
 
 static unsigned num_reserved_buffers;
 static unsigned num_total_buffers;
 static unsigned max_total_buffers;
 
-static unsigned num_total_gets;
-static unsigned num_valid_gets;
-static unsigned num_read_gets;
-static unsigned num_total_writeouts;
-static unsigned num_total_evictions;
-static unsigned num_dirty_evictions;
+static struct lock *buffer_pool_lock;
+static struct cv *buffer_reserve_cv;
+
+/*
+ * The dirty_epoch is incremented whenever an explicit sync call is
+ * made, and is used to know when to stop syncing. It is bumped under
+ * buffer_pool_lock and read without it; a buffer that gets dirtied
+ * right as a sync starts just gets written by that sync.
+ */
+static unsigned dirty_epoch;
 
 /*
  * Syncer state. (This is file-static so it's easily visible from the
@@ -188,18 +212,6 @@ static bool syncer_under_load;
 static bool syncer_needs_help;
 static struct thread *syncer_thread;
 
-/*
- * Lock
- */
-
-static struct lock *buffer_lock;
-
-/*
- * CVs
- */
-static struct cv *buffer_busy_cv;
-static struct cv *buffer_reserve_cv;
-
 /*
  * Magic numbers (also search the code for "voodoo:")
  *
@@ -212,11 +224,21 @@ static struct cv *buffer_reserve_cv;
 /* Number of buffers to reserve for each file system operation. */
 #define RESERVE_BUFFERS		8
 
-/* Factor for choosing attached_buffers_thresh. */
+/*
+ * Blocks per I/O cluster. Each aligned group of this many blocks
+ * hashes to a single shard, so the buffers of a cluster can be
+ * gathered under one shard lock.
+ */
+#define BUFFER_CLUSTER		FS_MAXCLUSTER
+
+/* Most buffers the syncer sorts and writes per shard per round. */
+#define SYNCER_BATCH		32
+
+/* Factor for choosing bs_attached_thresh. */
 #define ATTACHED_THRESH_NUM	3
 #define ATTACHED_THRESH_DENOM	2
 
-/* Factor for choosing dirty_buffers_thresh. */
+/* Factor for choosing bs_dirty_thresh. */
 #define DIRTY_THRESH_NUM	5
 #define DIRTY_THRESH_DENOM	4
 
@@ -237,6 +259,10 @@ static struct cv *buffer_reserve_cv;
 /* Buffer age at which the syncer considers itself in trouble. (seconds) */
 #define SYNCER_HELP_AGE		8
 
+/* How long the syncer rests between runs, when idle and when not. (ms) */
+#define SYNCER_IDLE_MS		1000
+#define SYNCER_DIRTY_MS		250
+
 #if 0
 /* Threshold proportion (of bufs dirty) for starting the syncer */
 #define SYNCER_DIRTY_NUM	1
@@ -267,25 +293,22 @@ static void buffer_release_internal(struct buf *b);
 // state invariants
 
 /*
- * Check consistency of the global state.
+ * Check consistency of a shard. The shard must be locked.
  */
 static
 void
-bufcheck(void)
+bufcheck(struct bufshard *s)
 {
-	KASSERT(attached_buffers_count <= bufarray_num(&attached_buffers));
-	KASSERT(attached_buffers_first <= bufarray_num(&attached_buffers));
-	KASSERT(bufarray_num(&attached_buffers) <= attached_buffers_thresh);
+	KASSERT(s->bs_attached_count <= bufarray_num(&s->bs_attached));
+	KASSERT(s->bs_attached_first <= bufarray_num(&s->bs_attached));
+	KASSERT(bufarray_num(&s->bs_attached) <= s->bs_attached_thresh);
 
-	KASSERT(dirty_buffers_count <= bufarray_num(&dirty_buffers));
-	KASSERT(dirty_buffers_first <= bufarray_num(&dirty_buffers));
-	KASSERT(bufarray_num(&dirty_buffers) <= dirty_buffers_thresh);
+	KASSERT(s->bs_dirty_count <= bufarray_num(&s->bs_dirty));
+	KASSERT(s->bs_dirty_first <= bufarray_num(&s->bs_dirty));
+	KASSERT(bufarray_num(&s->bs_dirty) <= s->bs_dirty_thresh);
 
-	KASSERT(bufarray_num(&detached_buffers) + attached_buffers_count
-		== num_total_buffers);
-	// This is not true any more, because busy_buffers_count now
-	// includes buffers marked busy by syncing.
-	//KASSERT(busy_buffers_count <= num_reserved_buffers);
+	// The detached + attached == total check that used to be here
+	// can't be made per shard, as buffers move between shards.
 	KASSERT(num_reserved_buffers <= max_total_buffers);
 	KASSERT(num_total_buffers <= max_total_buffers);
 }
@@ -435,6 +458,29 @@ buffer_hashfunc(struct fs *fs, daddr_t physblock)
 	return val;
 }
 
+/*
+ * Pick the shard for a key. This hashes the cluster number rather
+ * than the block number, so all blocks of an aligned cluster land in
+ * the same shard; the bucket within the shard uses the whole block
+ * number.
+ */
+static
+struct bufshard *
+buffer_keyshard(struct fs *fs, daddr_t physblock)
+{
+	unsigned hash;
+
+	hash = buffer_hashfunc(fs, physblock / BUFFER_CLUSTER);
+	return &buffer_shards[hash % BUFFER_SHARDS];
+}
+
+static
+unsigned
+bufhash_bucket(struct bufhash *bh, struct fs *fs, daddr_t physblock)
+{
+	return buffer_hashfunc(fs, physblock) % bh->bh_numbuckets;
+}
+
 /*
  * Add a buffer to a bufhash.
  */
@@ -442,12 +488,11 @@ static
 int
 bufhash_add(struct bufhash *bh, struct buf *b)
 {
-	unsigned hash, bn;
+	unsigned bn;
 
 	KASSERT(b->b_bucketindex == INVALID_INDEX);
 
-	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, b->b_fs, b->b_physblock);
 	return bufarray_add(&bh->bh_buckets[bn], b, &b->b_bucketindex);
 }
 
@@ -458,10 +503,9 @@ static
 void
 bufhash_remove(struct bufhash *bh, struct buf *b)
 {
-	unsigned hash, bn;
+	unsigned bn;
 
-	hash = buffer_hashfunc(b->b_fs, b->b_physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, b->b_fs, b->b_physblock);
 
 	KASSERT(bufarray_get(&bh->bh_buckets[bn], b->b_bucketindex) == b);
 	bufarray_set(&bh->bh_buckets[bn], b->b_bucketindex, NULL);
@@ -477,12 +521,11 @@ static
 struct buf *
 bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t physblock)
 {
-	unsigned hash, bn;
+	unsigned bn;
 	unsigned num, i;
 	struct buf *b;
 
-	hash = buffer_hashfunc(fs, physblock);
-	bn = hash % bh->bh_numbuckets;
+	bn = bufhash_bucket(bh, fs, physblock);
 
 	num = bufarray_num(&bh->bh_buckets[bn]);
 	for (i=0; i<num; i++) {
@@ -500,67 +543,67 @@ bufhash_get(struct bufhash *bh, struct fs *fs, daddr_t physblock)
 // buffer tables
 
 /*
- * Preallocate the buffer lists so adding things to them on the fly
- * can't blow up.
+ * Preallocate a shard's buffer lists so adding things to them on the
+ * fly can't blow up. NEWCOUNT is the number of buffers about to be
+ * attached to the shard. The lists only ever grow.
  */
 static
 int
-preallocate_buffer_arrays(unsigned newtotal)
+preallocate_shard_arrays(struct bufshard *s, unsigned newcount)
 {
 	int result;
 	unsigned newathresh, newdthresh;
 
-	newathresh = (newtotal*ATTACHED_THRESH_NUM)/ATTACHED_THRESH_DENOM;
-	newdthresh = (newtotal*DIRTY_THRESH_NUM)/DIRTY_THRESH_DENOM;
-
-	result = bufarray_preallocate(&detached_buffers, newtotal);
-	if (result) {
-		return result;
-	}
+	newathresh = (newcount*ATTACHED_THRESH_NUM)/ATTACHED_THRESH_DENOM;
+	newdthresh = (newcount*DIRTY_THRESH_NUM)/DIRTY_THRESH_DENOM;
 
-	result = bufarray_preallocate(&attached_buffers, newathresh);
-	if (result) {
-		return result;
+	if (newathresh > s->bs_attached_thresh) {
+		result = bufarray_preallocate(&s->bs_attached, newathresh);
+		if (result) {
+			return result;
+		}
+		s->bs_attached_thresh = newathresh;
 	}
-	attached_buffers_thresh = newathresh;
 
-	result = bufarray_preallocate(&dirty_buffers, newdthresh);
-	if (result) {
-		return result;
+	if (newdthresh > s->bs_dirty_thresh) {
+		result = bufarray_preallocate(&s->bs_dirty, newdthresh);
+		if (result) {
+			return result;
+		}
+		s->bs_dirty_thresh = newdthresh;
 	}
-	dirty_buffers_thresh = newdthresh;
 
 	return 0;
 }
 
 /*
- * Go through the attached_buffers array and close up gaps.
+ * Go through a shard's attached array and close up gaps.
  */
 static
 void
-compact_attached_buffers(void)
+compact_attached_buffers(struct bufshard *s)
 {
-	bufarray_compact(&attached_buffers, &attached_buffers_first,
+	bufarray_compact(&s->bs_attached, &s->bs_attached_first,
 			 buf_fixup_tableindex);
-	KASSERT(attached_buffers_count == bufarray_num(&attached_buffers));
+	KASSERT(s->bs_attached_count == bufarray_num(&s->bs_attached));
 
 	/* it does not matter if this overflows */
-	attached_buffers_generation++;
+	s->bs_attached_generation++;
 }
 
 /*
- * Go through the dirty_buffers array and close up gaps.
+ * Go through a shard's dirty array and close up gaps.
  */
 static
 void
-compact_dirty_buffers(void)
+compact_dirty_buffers(struct bufshard *s)
 {
-	bufarray_compact(&dirty_buffers, &dirty_buffers_first,
+	bufarray_compact(&s->bs_dirty, &s->bs_dirty_first,
 			 buf_fixup_dirtyindex);
-	KASSERT(dirty_buffers_count == bufarray_num(&dirty_buffers));
+	KASSERT(s->bs_dirty_count == bufarray_num(&s->bs_dirty));
 
 	/* it does not matter if this overflows */
-	dirty_buffers_generation++;
+	s->bs_dirty_generation++;
 }
 
 /*
@@ -574,6 +617,8 @@ buffer_remove_detached(void)
 	unsigned num;
 	int result;
 
+	lock_acquire(buffer_pool_lock);
+	b = NULL;
 	num = bufarray_num(&detached_buffers);
 	if (num > 0) {
 		b = bufarray_get(&detached_buffers, num-1);
@@ -583,11 +628,10 @@ buffer_remove_detached(void)
 		/* shrink array (should not fail) */
 		result = bufarray_setsize(&detached_buffers, num-1);
 		KASSERT(result == 0);
-
-		return b;
 	}
+	lock_release(buffer_pool_lock);
 
-	return NULL;
+	return b;
 }
 
 /*
@@ -603,18 +647,47 @@ buffer_insert_detached(struct buf *b)
 	KASSERT(b->b_busy == 0);
 	KASSERT(b->b_tableindex == INVALID_INDEX);
 
+	lock_acquire(buffer_pool_lock);
 	result = bufarray_add(&detached_buffers, b, &b->b_tableindex);
 	/* arrays are preallocated to avoid failure here */
 	KASSERT(result == 0);
+	lock_release(buffer_pool_lock);
+}
+
+/*
+ * Take or drop a reference to a buffer. Code that keeps a pointer to
+ * a buffer while it sleeps (waiting for the buffer, or with its shard
+ * unlocked) holds one of these, so buffer_shrink won't free the
+ * buffer under it. The count is protected by buffer_pool_lock, as the
+ * buffer may change shards while it's held.
+ */
+static
+void
+buffer_ref(struct buf *b)
+{
+	lock_acquire(buffer_pool_lock);
+	b->b_refs++;
+	lock_release(buffer_pool_lock);
+}
+
+static
+void
+buffer_unref(struct buf *b)
+{
+	lock_acquire(buffer_pool_lock);
+	KASSERT(b->b_refs > 0);
+	b->b_refs--;
+	lock_release(buffer_pool_lock);
 }
 
 /*
- * Remove a buffer from the attached (LRU) list.
+ * Remove a buffer from its shard's attached (LRU) list.
  */
 static
 void
 buffer_remove_attached(struct buf *b, unsigned expected_busy)
 {
+	struct bufshard *s = b->b_shard;
 	unsigned ix;
 
 	KASSERT(b->b_attached == 1);
@@ -622,51 +695,53 @@ buffer_remove_attached(struct buf *b, unsigned expected_busy)
 
 	ix = b->b_tableindex;
 
-	KASSERT(bufarray_get(&attached_buffers, ix) == b);
+	KASSERT(bufarray_get(&s->bs_attached, ix) == b);
 
 	/* Remove from table, leave NULL behind (compact lazily, later) */
-	bufarray_set(&attached_buffers, ix, NULL);
+	bufarray_set(&s->bs_attached, ix, NULL);
 	b->b_tableindex = INVALID_INDEX;
 
 	/* cache the first empty slot  */
-	if (ix < attached_buffers_first) {
-		attached_buffers_first = ix;
+	if (ix < s->bs_attached_first) {
+		s->bs_attached_first = ix;
 	}
 
-	attached_buffers_count--;
+	s->bs_attached_count--;
 }
 
 /*
- * Put a buffer into the attached (LRU) list, always at the end.
+ * Put a buffer into its shard's attached (LRU) list, always at the end.
  */
 static
 void
 buffer_insert_attached(struct buf *b)
 {
+	struct bufshard *s = b->b_shard;
 	unsigned num;
 	int result;
 
 	KASSERT(b->b_attached == 1);
 	KASSERT(b->b_tableindex == INVALID_INDEX);
 
-	num = bufarray_num(&attached_buffers);
-	if (num >= attached_buffers_thresh) {
-		compact_attached_buffers();
+	num = bufarray_num(&s->bs_attached);
+	if (num >= s->bs_attached_thresh) {
+		compact_attached_buffers(s);
 	}
 
-	result = bufarray_add(&attached_buffers, b, &b->b_tableindex);
+	result = bufarray_add(&s->bs_attached, b, &b->b_tableindex);
 	/* arrays are preallocated to avoid failure here */
 	KASSERT(result == 0);
-	attached_buffers_count++;
+	s->bs_attached_count++;
 }
 
 /*
- * Get a buffer out of the dirty list.
+ * Get a buffer out of its shard's dirty list.
  */
 static
 void
 buffer_remove_dirty(struct buf *b)
 {
+	struct bufshard *s = b->b_shard;
 	unsigned ix;
 
 	KASSERT(b->b_attached == 1);
@@ -675,25 +750,26 @@ buffer_remove_dirty(struct buf *b)
 
 	ix = b->b_dirtyindex;
 
-	KASSERT(bufarray_get(&dirty_buffers, ix) == b);
+	KASSERT(bufarray_get(&s->bs_dirty, ix) == b);
 
 	/* Remove from table, leave NULL behind (compact lazily, later) */
-	bufarray_set(&dirty_buffers, ix, NULL);
+	bufarray_set(&s->bs_dirty, ix, NULL);
 	b->b_dirtyindex = INVALID_INDEX;
 
 	/* cache the first empty slot  */
-	if (ix < dirty_buffers_first) {
-		dirty_buffers_first = ix;
+	if (ix < s->bs_dirty_first) {
+		s->bs_dirty_first = ix;
 	}
 }
 
 /*
- * Put a buffer into the dirty list.
+ * Put a buffer into its shard's dirty list.
  */
 static
 void
 buffer_insert_dirty(struct buf *b)
 {
+	struct bufshard *s = b->b_shard;
 	unsigned num;
 	int result;
 
@@ -701,12 +777,12 @@ buffer_insert_dirty(struct buf *b)
 	KASSERT(b->b_busy == 1);
 	KASSERT(b->b_dirtyindex == INVALID_INDEX);
 
-	num = bufarray_num(&dirty_buffers);
-	if (num >= dirty_buffers_thresh) {
-		compact_dirty_buffers();
+	num = bufarray_num(&s->bs_dirty);
+	if (num >= s->bs_dirty_thresh) {
+		compact_dirty_buffers(s);
 	}
 
-	result = bufarray_add(&dirty_buffers, b, &b->b_dirtyindex);
+	result = bufarray_add(&s->bs_dirty, b, &b->b_dirtyindex);
 	/* arrays are preallocated to avoid failure here */
 	KASSERT(result == 0);
 }
@@ -715,7 +791,8 @@ buffer_insert_dirty(struct buf *b)
 // ops on buffers
 
 /*
- * Create a fresh buffer.
+ * Create a fresh buffer. The caller has already counted it in
+ * num_total_buffers.
  */
 static
 struct buf *
@@ -724,7 +801,9 @@ buffer_create(void)
 	struct buf *b;
 	int result;
 
-	result = preallocate_buffer_arrays(num_total_buffers+1);
+	lock_acquire(buffer_pool_lock);
+	result = bufarray_preallocate(&detached_buffers, num_total_buffers);
+	lock_release(buffer_pool_lock);
 	if (result) {
 		return NULL;
 	}
@@ -740,6 +819,13 @@ buffer_create(void)
 		return NULL;
 	}
 
+	b->b_busycv = cv_create("bufbusy");
+	if (b->b_busycv == NULL) {
+		kfree(b->b_data);
+		kfree(b);
+		return NULL;
+	}
+
 	b->b_tableindex = INVALID_INDEX;
 	b->b_dirtyindex = INVALID_INDEX;
 	b->b_bucketindex = INVALID_INDEX;
@@ -750,22 +836,24 @@ buffer_create(void)
 	b->b_dirty = 0;
 	b->b_fsmanaged = 0;
 	b->b_holder = NULL;
+	b->b_refs = 0;
 	b->b_timestamp.tv_sec = 0;
 	b->b_timestamp.tv_nsec = 0;
+	b->b_shard = NULL;
 	b->b_fs = NULL;
 	b->b_physblock = 0;
 	b->b_size = ONE_TRUE_BUFFER_SIZE;
 	b->b_fsdata = NULL;
-	num_total_buffers++;
 	return b;
 }
 
 /*
- * Attach a buffer to a given key (fs and block number)
+ * Attach a buffer to a given key (fs and block number), which must
+ * hash to shard S.
  */
 static
 int
-buffer_attach(struct buf *b, struct fs *fs, daddr_t block)
+buffer_attach(struct bufshard *s, struct buf *b, struct fs *fs, daddr_t block)
 {
 	int result;
 
@@ -774,17 +862,25 @@ buffer_attach(struct buf *b, struct fs *fs, daddr_t block)
 	KASSERT(b->b_valid == 0);
 	KASSERT(b->b_busy == 0);
 	KASSERT(b->b_fsdata == NULL);
+	KASSERT(s == buffer_keyshard(fs, block));
+
+	result = preallocate_shard_arrays(s, s->bs_attached_count + 1);
+	if (result) {
+		return result;
+	}
+
 	b->b_attached = 1;
 	b->b_fs = fs;
 	b->b_physblock = block;
 
-	result = bufhash_add(&buffer_hash, b);
+	result = bufhash_add(&s->bs_hash, b);
 	if (result) {
 		b->b_attached = 0;
 		b->b_fs = NULL;
 		b->b_physblock = 0;
 		return result;
 	}
+	b->b_shard = s;
 	return 0;
 }
 
@@ -795,9 +891,11 @@ static
 void
 buffer_detach(struct buf *b)
 {
+	struct bufshard *s = b->b_shard;
+
 	KASSERT(b->b_attached == 1);
 	KASSERT(b->b_busy == 0);
-	bufhash_remove(&buffer_hash, b);
+	bufhash_remove(&s->bs_hash, b);
 
 	if (b->b_fsdata != NULL) {
 		kprintf("vfs: %s left behind fs-specific buffer data\n",
@@ -805,44 +903,55 @@ buffer_detach(struct buf *b)
 		b->b_fsdata = NULL;
 	}
 	b->b_attached = 0;
+	b->b_shard = NULL;
 	b->b_fs = NULL;
 	b->b_physblock = 0;
-	cv_broadcast(buffer_busy_cv, buffer_lock);
+	cv_broadcast(b->b_busycv, s->bs_lock);
 }
 
 /*
- * Mark a buffer busy, waiting if necessary.
+ * Mark a buffer busy, waiting if necessary. The buffer's shard must
+ * be locked.
  *
  * Returns EDEADBUF if the buffer gets detached (or worse, detached
  * and reattached) under us, which can happen if it gets released and
  * then gets evicted before we wake up. If it gets detached and
  * reattached to the same block, we won't notice, but in that case we
  * probably don't care either.
+ *
+ * Once the buffer has left S we no longer hold the lock that covers
+ * it, so check b_shard first; the key fields are only looked at while
+ * they are ours to look at.
  */
 static
 int
 buffer_mark_busy(struct buf *b)
 {
+	struct bufshard *s = b->b_shard;
 	struct fs *fs;
 	daddr_t block;
 
 	KASSERT(b->b_holder != curthread);
+	KASSERT(s != NULL);
 	fs = b->b_fs;
 	block = b->b_physblock;
-	while (b->b_busy) {
-		if (!b->b_attached || fs != b->b_fs ||
-		    block != b->b_physblock) {
-			return EDEADBUF;
+	if (b->b_busy) {
+		/* keep it from being freed while we sleep */
+		buffer_ref(b);
+		while (b->b_busy) {
+			cv_wait(b->b_busycv, s->bs_lock);
+			if (b->b_shard != s || fs != b->b_fs ||
+			    block != b->b_physblock) {
+				buffer_unref(b);
+				return EDEADBUF;
+			}
 		}
-		cv_wait(buffer_busy_cv, buffer_lock);
-	}
-	if (!b->b_attached || fs != b->b_fs || block != b->b_physblock) {
-		return EDEADBUF;
+		buffer_unref(b);
 	}
 	b->b_busy = 1;
 	KASSERT(b->b_fsmanaged == 0);
 	b->b_holder = curthread;
-	busy_buffers_count++;
+	s->bs_busy_count++;
 	return 0;
 }
 
@@ -853,6 +962,8 @@ static
 void
 buffer_unmark_busy(struct buf *b)
 {
+	struct bufshard *s = b->b_shard;
+
 	KASSERT(b->b_busy != 0);
 	b->b_busy = 0;
 	if (b->b_fsmanaged) {
@@ -862,8 +973,8 @@ buffer_unmark_busy(struct buf *b)
 		KASSERT(b->b_holder == curthread);
 	}
 	b->b_holder = NULL;
-	busy_buffers_count--;
-	cv_broadcast(buffer_busy_cv, buffer_lock);
+	s->bs_busy_count--;
+	cv_broadcast(b->b_busycv, s->bs_lock);
 }
 
 /*
@@ -873,9 +984,10 @@ static
 int
 buffer_readin(struct buf *b)
 {
+	struct bufshard *s = b->b_shard;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
+	KASSERT(lock_do_i_hold(s->bs_lock));
 	KASSERT(b->b_attached);
 	KASSERT(b->b_busy);
 	KASSERT(b->b_fs != NULL);
@@ -884,9 +996,9 @@ buffer_readin(struct buf *b)
 		return 0;
 	}
 
-	lock_release(buffer_lock);
+	lock_release(s->bs_lock);
 	result = FSOP_READBLOCK(b->b_fs, b->b_physblock, b->b_data, b->b_size);
-	lock_acquire(buffer_lock);
+	lock_acquire(s->bs_lock);
 	if (result == 0) {
 		b->b_valid = 1;
 	}
@@ -908,10 +1020,11 @@ static
 int
 buffer_writeout_internal(struct buf *b)
 {
+	struct bufshard *s = b->b_shard;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(lock_do_i_hold(s->bs_lock));
+	bufcheck(s);
 
 	KASSERT(b->b_attached);
 	KASSERT(b->b_valid);
@@ -922,13 +1035,13 @@ buffer_writeout_internal(struct buf *b)
 		return 0;
 	}
 
-	num_total_writeouts++;
-	lock_release(buffer_lock);
+	s->bs_total_writeouts++;
+	lock_release(s->bs_lock);
 	result = FSOP_WRITEBLOCK(b->b_fs, b->b_physblock, b->b_fsdata,
 				 b->b_data, b->b_size);
-	lock_acquire(buffer_lock);
+	lock_acquire(s->bs_lock);
 	if (result == 0) {
-		dirty_buffers_count--;
+		s->bs_dirty_count--;
 		b->b_dirty = 0;
 		buffer_remove_dirty(b);
 	}
@@ -938,11 +1051,113 @@ buffer_writeout_internal(struct buf *b)
 int
 buffer_writeout(struct buf *b)
 {
+	struct bufshard *s = b->b_shard;
 	int result;
 
-	lock_acquire(buffer_lock);
+	/* b is busy, so it can't change shards */
+	lock_acquire(s->bs_lock);
 	result = buffer_writeout_internal(b);
-	lock_release(buffer_lock);
+	lock_release(s->bs_lock);
+	return result;
+}
+
+/*
+ * Check whether the buffer for BLOCK can join a write cluster: it
+ * must be cached, valid, dirty, and not in anyone's hands.
+ */
+static
+bool
+buffer_cluster_candidate(struct bufshard *s, struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	b = bufhash_get(&s->bs_hash, fs, block);
+	if (b == NULL) {
+		return false;
+	}
+	/* fsmanaged buffers are always busy */
+	return b->b_valid && b->b_dirty && !b->b_busy;
+}
+
+/*
+ * I/O: buffer to disk, taking along the dirty buffers on either side
+ * of it within its cluster so the whole run goes out in one
+ * FSOP_WRITEBLOCKS. The run stops at the first neighbor that isn't a
+ * buffer_cluster_candidate. The neighbors are marked busy for the
+ * duration of the I/O.
+ *
+ * Otherwise the same as buffer_writeout_internal, which this falls
+ * back to for a run of one or when the fs doesn't do multi-block
+ * writes.
+ */
+static
+int
+buffer_writeout_cluster(struct buf *b)
+{
+	struct bufshard *s = b->b_shard;
+	struct buf *run[BUFFER_CLUSTER];
+	void *fsdata[BUFFER_CLUSTER];
+	void *data[BUFFER_CLUSTER];
+	struct fs *fs;
+	daddr_t lo, hi, first, last;
+	unsigned n, i;
+	int result;
+
+	KASSERT(lock_do_i_hold(s->bs_lock));
+	KASSERT(b->b_attached);
+	KASSERT(b->b_valid);
+	KASSERT(b->b_busy);
+
+	fs = b->b_fs;
+	if (!b->b_dirty || fs->fs_ops->fsop_writeblocks == NULL) {
+		return buffer_writeout_internal(b);
+	}
+
+	lo = b->b_physblock - b->b_physblock % BUFFER_CLUSTER;
+	hi = lo + BUFFER_CLUSTER - 1;
+	first = last = b->b_physblock;
+	while (first > lo && buffer_cluster_candidate(s, fs, first - 1)) {
+		first--;
+	}
+	while (last < hi && buffer_cluster_candidate(s, fs, last + 1)) {
+		last++;
+	}
+	if (first == last) {
+		return buffer_writeout_internal(b);
+	}
+
+	n = last - first + 1;
+	for (i=0; i<n; i++) {
+		if (first + i == b->b_physblock) {
+			run[i] = b;
+		}
+		else {
+			run[i] = bufhash_get(&s->bs_hash, fs, first + i);
+			result = buffer_mark_busy(run[i]);
+			/* wasn't busy, so no wait and no EDEADBUF */
+			KASSERT(result == 0);
+		}
+		fsdata[i] = run[i]->b_fsdata;
+		data[i] = run[i]->b_data;
+	}
+
+	s->bs_total_writeouts += n;
+	s->bs_cluster_writeouts += n;
+	s->bs_cluster_writes++;
+	lock_release(s->bs_lock);
+	result = FSOP_WRITEBLOCKS(fs, first, fsdata, data, n, b->b_size);
+	lock_acquire(s->bs_lock);
+
+	for (i=0; i<n; i++) {
+		if (result == 0) {
+			s->bs_dirty_count--;
+			run[i]->b_dirty = 0;
+			buffer_remove_dirty(run[i]);
+		}
+		if (run[i] != b) {
+			buffer_unmark_busy(run[i]);
+		}
+	}
 	return result;
 }
 
@@ -987,13 +1202,15 @@ buffer_is_valid(struct buf *b)
 void
 buffer_mark_dirty(struct buf *b)
 {
+	struct bufshard *s = b->b_shard;
+
 	KASSERT(b->b_busy);
 	KASSERT(b->b_valid);
 
-	lock_acquire(buffer_lock);
+	lock_acquire(s->bs_lock);
 	if (b->b_dirty) {
 		/* nothing to do */
-		lock_release(buffer_lock);
+		lock_release(s->bs_lock);
 		return;
 	}
 
@@ -1004,9 +1221,9 @@ buffer_mark_dirty(struct buf *b)
 	/* XXX: should we avoid putting fsmanaged buffers on the dirty list? */
 
 	buffer_insert_dirty(b);
-	dirty_buffers_count++;
+	s->bs_dirty_count++;
 	/* Here we might prod the syncer, but currently it doesn't need it */
-	lock_release(buffer_lock);
+	lock_release(s->bs_lock);
 }
 
 /*
@@ -1061,12 +1278,12 @@ buffer_sync(struct buf *b)
 		return 0;
 	}
 
-	result = buffer_writeout_internal(b);
+	result = buffer_writeout_cluster(b);
 	/*
 	 * The caller needs to be able to distinguish buffer_mark_busy
 	 * failing (which requires specific handling) from any failure
 	 * that can happen writing the buffer out. Therefore,
-	 * buffer_writeout_internal isn't allowed to return EDEADBUF.
+	 * buffer_writeout_cluster isn't allowed to return EDEADBUF.
 	 */
 	KASSERT(result != EDEADBUF);
 
@@ -1076,11 +1293,11 @@ buffer_sync(struct buf *b)
 }
 
 /*
- * Write out one buffer from the dirty_buffers queue.
+ * Write out one buffer from a shard's dirty queue.
  *
  * If the syncer has signalled for help, this is called on every
- * buffer_get until the dirty_buffers queue gets back to a manageable
- * state.
+ * buffer_get until the dirty queues get back to a manageable
+ * state. Each get works on the shard it already has locked.
  *
  * We don't attempt to sync buffers that are currently busy, because
  * that might deadlock; we'll let the syncer deal with those.
@@ -1090,14 +1307,14 @@ buffer_sync(struct buf *b)
  */
 static
 void
-sync_one_old_buffer(void)
+sync_one_old_buffer(struct bufshard *s)
 {
 	unsigned i;
 	struct buf *b;
 	int result;
 
-	for (i=0; i < bufarray_num(&dirty_buffers); i++) {
-		b = bufarray_get(&dirty_buffers, i);
+	for (i=0; i < bufarray_num(&s->bs_dirty); i++) {
+		b = bufarray_get(&s->bs_dirty, i);
 		if (b == NULL) {
 			continue;
 		}
@@ -1126,12 +1343,14 @@ sync_one_old_buffer(void)
  * Clean out a buffer for reuse and detach it.
  *
  * Does not put it on the detached list; the caller should do that if
- * desired.
+ * desired. The buffer's shard must be locked, and is still locked on
+ * return even though the buffer is no longer in it.
  */
 static
 void
 buffer_clean(struct buf *b)
 {
+	struct bufshard *s = b->b_shard;
 	int result;
 
 	KASSERT(b->b_busy == 0);
@@ -1139,27 +1358,29 @@ buffer_clean(struct buf *b)
 	/* not busy, won't sleep, can't fail */
 	KASSERT(result == 0);
 
-	lock_release(buffer_lock);
+	lock_release(s->bs_lock);
 	FSOP_DETACHBUF(b->b_fs, b->b_physblock, b);
-	lock_acquire(buffer_lock);
+	lock_acquire(s->bs_lock);
 	buffer_unmark_busy(b);
 
 	buffer_remove_attached(b, 0);
 	b->b_valid = 0;
 	if (b->b_dirty) {
 		b->b_dirty = 0;
-		dirty_buffers_count--;
+		s->bs_dirty_count--;
 		buffer_remove_dirty(b);
 	}
 	buffer_detach(b);
 }
 
 /*
- * Evict a buffer.
+ * Evict a buffer from shard S, which must be locked.
+ *
+ * Returns EAGAIN if the shard has nothing that can be evicted.
  */
 static
 int
-buffer_evict(struct buf **ret)
+buffer_evict(struct bufshard *s, struct buf **ret)
 {
 	unsigned num, i;
 	struct buf *b, *db;
@@ -1170,7 +1391,7 @@ buffer_evict(struct buf **ret)
 	 */
 
  tryagain:
-	num = bufarray_num(&attached_buffers);
+	num = bufarray_num(&s->bs_attached);
 	b = db = NULL;
 	for (i=0; i<num; i++) {
 		if (i >= num/2 && db != NULL) {
@@ -1180,7 +1401,7 @@ buffer_evict(struct buf **ret)
 			 */
 			break;
 		}
-		b = bufarray_get(&attached_buffers, i);
+		b = bufarray_get(&s->bs_attached, i);
 		if (b == NULL) {
 			continue;
 		}
@@ -1204,17 +1425,16 @@ buffer_evict(struct buf **ret)
 		b = db;
 	}
 	if (b == NULL) {
-		/* No buffers at all...? */
-		kprintf("buffer_evict: no targets!?\n");
+		/* Nothing here; the caller will try another shard */
 		return EAGAIN;
 	}
 
 	/*
 	 * Flush the buffer out if necessary.
 	 */
-	num_total_evictions++;
+	s->bs_total_evictions++;
 	if (b->b_dirty) {
-		num_dirty_evictions++;
+		s->bs_dirty_evictions++;
 		KASSERT(b->b_busy == 0);
 		/* lock may be released here */
 		result = buffer_sync(b);
@@ -1243,180 +1463,391 @@ buffer_evict(struct buf **ret)
 	return 0;
 }
 
+/*
+ * Take a detached buffer that nothing refers to out of the pool, and
+ * out of num_total_buffers, so it can be destroyed. Returns NULL if
+ * there is none, or if the cache is down to the reserved buffers.
+ */
 static
 struct buf *
-buffer_find(struct fs *fs, daddr_t physblock)
+buffer_remove_unused(void)
 {
-	return bufhash_get(&buffer_hash, fs, physblock);
+	struct buf *b;
+	unsigned num, i;
+
+	lock_acquire(buffer_pool_lock);
+	b = NULL;
+	if (num_total_buffers > num_reserved_buffers) {
+		num = bufarray_num(&detached_buffers);
+		for (i=0; i<num; i++) {
+			b = bufarray_get(&detached_buffers, i);
+			KASSERT(b->b_tableindex == i);
+			if (b->b_refs == 0) {
+				bufarray_remove_unordered(&detached_buffers, i,
+							  buf_fixup_tableindex);
+				b->b_tableindex = INVALID_INDEX;
+				num_total_buffers--;
+				break;
+			}
+			b = NULL;
+		}
+	}
+	lock_release(buffer_pool_lock);
+
+	return b;
 }
 
 /*
- * Find a buffer for the given block, if one already exists; otherwise
- * attach one but don't bother to read it in. Set fsmanaged mode if
- * FSMANAGED is true.
+ * Destroy a buffer from buffer_remove_unused, giving its memory back.
  */
 static
-int
-buffer_get_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
-		    struct buf **ret)
+void
+buffer_destroy(struct buf *b)
 {
-	struct buf *b;
-	int result;
-
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(b->b_attached == 0);
+	KASSERT(b->b_busy == 0);
+	KASSERT(b->b_refs == 0);
+	KASSERT(b->b_tableindex == INVALID_INDEX);
 
-	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
-	if (!fsmanaged) {
-		KASSERT(curthread->t_did_reserve_buffers == true);
-	}
+	cv_destroy(b->b_busycv);
+	kfree(b->b_data);
+	kfree(b);
+}
 
-	if (!fsmanaged && syncer_needs_help) {
-		sync_one_old_buffer();
+/*
+ * Detach the least recently used buffer that is neither busy nor
+ * dirty from any shard and put it in the detached pool. Returns
+ * false if there isn't one.
+ */
+static
+bool
+buffer_shrink_one(void)
+{
+	struct bufshard *s;
+	struct buf *b;
+	unsigned num, i, j;
+
+	for (i=0; i<BUFFER_SHARDS; i++) {
+		s = &buffer_shards[i];
+		lock_acquire(s->bs_lock);
+		num = bufarray_num(&s->bs_attached);
+		for (j=0; j<num; j++) {
+			b = bufarray_get(&s->bs_attached, j);
+			if (b != NULL && !b->b_busy && !b->b_dirty) {
+				KASSERT(b->b_fsmanaged == 0);
+				/* lock may be released here */
+				buffer_clean(b);
+				lock_release(s->bs_lock);
+				buffer_insert_detached(b);
+				return true;
+			}
+		}
+		lock_release(s->bs_lock);
 	}
+	return false;
+}
 
-	num_total_gets++;
+/*
+ * Give memory back to the VM system when it runs short: destroy up to
+ * NBYTES worth of buffers that hold nothing the file systems need,
+ * i.e. detached buffers and then clean ones that aren't busy, least
+ * recently used first. File data is cached in the page cache anyway,
+ * which has a better claim on the memory than a second copy here.
+ * The cache grows back, up to max_total_buffers, as it's used, but
+ * never shrinks below the buffers reserved by operations in progress.
+ *
+ * Buffers go through the detached pool on the way out and are only
+ * freed once no one holds a reference (see buffer_ref). A buffer that
+ * is still referenced just stays in the pool for reuse.
+ */
+void
+buffer_shrink(size_t nbytes)
+{
+	struct buf *b;
+	unsigned want, done, tries;
 
-again:
-	b = buffer_find(fs, block);
-	if (b != NULL) {
-		result = buffer_mark_busy(b);
-		if (result) {
-			KASSERT(result == EDEADBUF);
-			goto again;
-		}
-		num_valid_gets++;
-		buffer_remove_attached(b, 1);
+	want = nbytes / ONE_TRUE_BUFFER_SIZE;
+	done = 0;
 
-		/* move it to the tail (recent end) of the LRU list */
-		buffer_insert_attached(b);
-	}
-	else {
-		b = buffer_remove_detached();
-		if (b == NULL && num_total_buffers < max_total_buffers) {
-			/* Can create a new buffer... */
-			b = buffer_create();
-		}
-		if (b == NULL) {
-			result = buffer_evict(&b);
-			if (result) {
-				return result;
-			}
-			KASSERT(b != NULL);
+	for (tries = 0; done < want && tries < 2 * want; tries++) {
+		b = buffer_remove_unused();
+		if (b != NULL) {
+			buffer_destroy(b);
+			done++;
+			continue;
 		}
-
-		KASSERT(b->b_size == ONE_TRUE_BUFFER_SIZE);
-		result = buffer_attach(b, fs, block);
-		if (result) {
-			buffer_insert_detached(b);
-			return result;
+		lock_acquire(buffer_pool_lock);
+		if (num_total_buffers <= num_reserved_buffers) {
+			lock_release(buffer_pool_lock);
+			return;
 		}
-		KASSERT(b->b_busy == 0);
-		result = buffer_mark_busy(b);
-		/* b wasn't busy, so we didn't wait and it didn't disappear */
-		KASSERT(result == 0);
-
-		/* move it to the tail (recent end) of the LRU list */
-		buffer_insert_attached(b);
-
-		/*
-		 * Call the FS's buffer attach routine. We do this
-		 * after buffer_attach (rather than in it) so we can
-		 * do it safely with the buffer marked busy and
-		 * without holding buffer_lock, as buffer_lock isn't
-		 * supposed to be exposed to file system code.
-		 *
-		 * Note: b_fsmanaged, if requested, hasn't been set
-		 * yet.  There's some chance that this might confuse
-		 * FS code, in which case it should be set here
-		 * instead; I haven't done this because that requires
-		 * duplicating the code.
-		 */
-
-		lock_release(buffer_lock);
-		result = FSOP_ATTACHBUF(b->b_fs, block, b);
-		lock_acquire(buffer_lock);
-		if (result) {
-			buffer_unmark_busy(b);
-			buffer_insert_detached(b);
-			return result;
+		lock_release(buffer_pool_lock);
+		if (!buffer_shrink_one()) {
+			/* everything left is busy or dirty */
+			return;
 		}
 	}
-
-	/* crosscheck that we got what we asked for */
-	KASSERT(b->b_fs == fs && b->b_physblock == block);
-
-
-	if (fsmanaged) {
-		b->b_fsmanaged = 1;
-	}
-
-	*ret = b;
-	return 0;
 }
 
 /*
- * Same as buffer_get_internal but does a read so the resulting buffer
- * always contains valid data.
+ * Get a detached buffer to attach to a new key in shard HOME: from
+ * the detached pool, by creating one, or by evicting one. Eviction
+ * tries HOME first, so each shard mostly recycles its own least
+ * recently used buffers, and then moves on to the other shards.
+ *
+ * Called with no shard locked.
  */
 static
 int
-buffer_read_internal(struct fs *fs, daddr_t block, size_t size, bool fsmanaged,
-		     struct buf **ret)
+buffer_get_spare(struct bufshard *home, struct buf **ret)
 {
+	struct bufshard *s;
+	struct buf *b;
+	unsigned start, i;
+	bool create;
 	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
+	b = buffer_remove_detached();
+	if (b != NULL) {
+		*ret = b;
+		return 0;
+	}
 
-	result = buffer_get_internal(fs, block, size, fsmanaged, ret);
-	if (result) {
-		lock_release(buffer_lock);
-		*ret = NULL;
-		return result;
+	lock_acquire(buffer_pool_lock);
+	create = num_total_buffers < max_total_buffers;
+	if (create) {
+		/* claim the slot now; another thread may be creating too */
+		num_total_buffers++;
 	}
+	lock_release(buffer_pool_lock);
 
-	if (!(*ret)->b_valid) {
-		num_read_gets++;
-		/* may lose (and then re-acquire) lock here */
-		result = buffer_readin(*ret);
-		if (result) {
-			buffer_release_internal(*ret);
-			*ret = NULL;
-			return result;
+	if (create) {
+		b = buffer_create();
+		if (b != NULL) {
+			*ret = b;
+			return 0;
+		}
+		lock_acquire(buffer_pool_lock);
+		num_total_buffers--;
+		lock_release(buffer_pool_lock);
+	}
+
+	start = home - buffer_shards;
+	for (i=0; i<BUFFER_SHARDS; i++) {
+		s = &buffer_shards[(start + i) % BUFFER_SHARDS];
+		lock_acquire(s->bs_lock);
+		result = buffer_evict(s, &b);
+		lock_release(s->bs_lock);
+		if (result == 0) {
+			*ret = b;
+			return 0;
 		}
 	}
 
-	return 0;
+	/* No buffers at all...? */
+	kprintf("buffer_evict: no targets!?\n");
+	return EAGAIN;
 }
 
 /*
- * Find a buffer for the given block, if one already exists; otherwise
- * attach one but don't bother to read it in.
+ * Attach the spare buffer B (from buffer_get_spare) to the given
+ * block in shard S, which must be locked and must not already have a
+ * buffer for the block. On success B is marked busy for the caller;
+ * on failure it goes back to the detached pool.
  */
+static
 int
-buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
+buffer_attach_spare(struct bufshard *s, struct buf *b,
+		    struct fs *fs, daddr_t block)
 {
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_get_internal(fs, block, size, false/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
-
-	return result;
-}
-
-/*
+	KASSERT(b->b_size == ONE_TRUE_BUFFER_SIZE);
+	result = buffer_attach(s, b, fs, block);
+	if (result) {
+		buffer_insert_detached(b);
+		return result;
+	}
+	KASSERT(b->b_busy == 0);
+	result = buffer_mark_busy(b);
+	/* b wasn't busy, so we didn't wait and it didn't disappear */
+	KASSERT(result == 0);
+
+	/* move it to the tail (recent end) of the LRU list */
+	buffer_insert_attached(b);
+
+	/*
+	 * Call the FS's buffer attach routine. We do this after
+	 * buffer_attach (rather than in it) so we can do it safely
+	 * with the buffer marked busy and without holding the shard
+	 * lock, as buffer cache locks aren't supposed to be exposed
+	 * to file system code.
+	 *
+	 * Note: b_fsmanaged, if requested, hasn't been set yet.
+	 * There's some chance that this might confuse FS code, in
+	 * which case it should be set here instead; I haven't done
+	 * this because that requires duplicating the code.
+	 */
+
+	lock_release(s->bs_lock);
+	result = FSOP_ATTACHBUF(b->b_fs, block, b);
+	lock_acquire(s->bs_lock);
+	if (result) {
+		buffer_unmark_busy(b);
+		buffer_remove_attached(b, 0);
+		buffer_detach(b);
+		buffer_insert_detached(b);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Find a buffer for the given block, if one already exists; otherwise
+ * attach one but don't bother to read it in. Set fsmanaged mode if
+ * FSMANAGED is true. S is the block's shard, and must be locked.
+ */
+static
+int
+buffer_get_internal(struct bufshard *s, struct fs *fs, daddr_t block,
+		    size_t size, bool fsmanaged, struct buf **ret)
+{
+	struct buf *b, *spare;
+	int result;
+
+	KASSERT(lock_do_i_hold(s->bs_lock));
+	bufcheck(s);
+
+	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+	if (!fsmanaged) {
+		KASSERT(curthread->t_did_reserve_buffers == true);
+	}
+
+	if (!fsmanaged && syncer_needs_help) {
+		sync_one_old_buffer(s);
+	}
+
+	s->bs_total_gets++;
+	spare = NULL;
+
+again:
+	b = bufhash_get(&s->bs_hash, fs, block);
+	if (b != NULL) {
+		result = buffer_mark_busy(b);
+		if (result) {
+			KASSERT(result == EDEADBUF);
+			goto again;
+		}
+		s->bs_valid_gets++;
+		buffer_remove_attached(b, 1);
+
+		/* move it to the tail (recent end) of the LRU list */
+		buffer_insert_attached(b);
+
+		if (spare != NULL) {
+			/* someone attached the block while we were out */
+			buffer_insert_detached(spare);
+		}
+	}
+	else if (spare == NULL) {
+		/*
+		 * Find a buffer to use with the shard unlocked, since
+		 * that may mean evicting from another shard. Somebody
+		 * else may attach the block meanwhile, so look again.
+		 */
+		lock_release(s->bs_lock);
+		result = buffer_get_spare(s, &spare);
+		lock_acquire(s->bs_lock);
+		if (result) {
+			return result;
+		}
+		goto again;
+	}
+	else {
+		b = spare;
+		result = buffer_attach_spare(s, b, fs, block);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* crosscheck that we got what we asked for */
+	KASSERT(b->b_fs == fs && b->b_physblock == block);
+
+
+	if (fsmanaged) {
+		b->b_fsmanaged = 1;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Same as buffer_get_internal but does a read so the resulting buffer
+ * always contains valid data.
+ */
+static
+int
+buffer_read_internal(struct bufshard *s, struct fs *fs, daddr_t block,
+		     size_t size, bool fsmanaged, struct buf **ret)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(s->bs_lock));
+
+	result = buffer_get_internal(s, fs, block, size, fsmanaged, ret);
+	if (result) {
+		*ret = NULL;
+		return result;
+	}
+
+	if (!(*ret)->b_valid) {
+		s->bs_read_gets++;
+		/* may lose (and then re-acquire) lock here */
+		result = buffer_readin(*ret);
+		if (result) {
+			buffer_release_internal(*ret);
+			*ret = NULL;
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Find a buffer for the given block, if one already exists; otherwise
+ * attach one but don't bother to read it in.
+ */
+int
+buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
+{
+	struct bufshard *s = buffer_keyshard(fs, block);
+	int result;
+
+	lock_acquire(s->bs_lock);
+	result = buffer_get_internal(s, fs, block, size, false/*fsmanaged*/,
+				     ret);
+	lock_release(s->bs_lock);
+
+	return result;
+}
+
+/*
  * Same as buffer_get but does a read so the resulting buffer always
  * contains valid data.
  */
 int
 buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
 {
+	struct bufshard *s = buffer_keyshard(fs, block);
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_read_internal(fs, block, size, false/*fsmanaged*/,ret);
-	lock_release(buffer_lock);
+	lock_acquire(s->bs_lock);
+	result = buffer_read_internal(s, fs, block, size, false/*fsmanaged*/,
+				      ret);
+	lock_release(s->bs_lock);
 
 	return result;
 }
@@ -1428,11 +1859,13 @@ int
 buffer_get_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 		     struct buf **ret)
 {
+	struct bufshard *s = buffer_keyshard(fs, block);
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_get_internal(fs, block, size, true/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
+	lock_acquire(s->bs_lock);
+	result = buffer_get_internal(s, fs, block, size, true/*fsmanaged*/,
+				     ret);
+	lock_release(s->bs_lock);
 
 	return result;
 }
@@ -1444,15 +1877,143 @@ int
 buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 		      struct buf **ret)
 {
+	struct bufshard *s = buffer_keyshard(fs, block);
 	int result;
 
-	lock_acquire(buffer_lock);
-	result = buffer_read_internal(fs, block, size, true/*fsmanaged*/, ret);
-	lock_release(buffer_lock);
+	lock_acquire(s->bs_lock);
+	result = buffer_read_internal(s, fs, block, size, true/*fsmanaged*/,
+				      ret);
+	lock_release(s->bs_lock);
 
 	return result;
 }
 
+/*
+ * Copy a block into DATA for a cache layered above this one: from the
+ * buffer if the block is cached (it may be newer than the disk), and
+ * otherwise straight from the disk without caching it here too.
+ */
+int
+buffer_readthrough(struct fs *fs, daddr_t block, size_t size, void *data)
+{
+	struct bufshard *s = buffer_keyshard(fs, block);
+	struct buf *b;
+	int result;
+
+	lock_acquire(s->bs_lock);
+	b = bufhash_get(&s->bs_hash, fs, block);
+	if (b == NULL) {
+		lock_release(s->bs_lock);
+		return FSOP_READBLOCK(fs, block, data, size);
+	}
+	result = buffer_read_internal(s, fs, block, size, false/*fsmanaged*/,
+				      &b);
+	if (result == 0) {
+		memcpy(data, b->b_data, size);
+		buffer_release_internal(b);
+	}
+	lock_release(s->bs_lock);
+
+	return result;
+}
+
+/*
+ * For buffer_readthrough_run: read the N consecutive uncached blocks
+ * starting at BLOCK into DATA, with one request if the fs can do runs.
+ * S is the blocks' shard, and must be locked; like buffer_readthrough,
+ * this releases the lock for the I/O so the rest of the shard isn't
+ * held up behind it.
+ */
+static
+int
+buffer_readthrough_uncached(struct bufshard *s, struct fs *fs,
+			    daddr_t block, unsigned n, size_t size,
+			    void **data)
+{
+	unsigned i;
+	int result;
+
+	if (n == 0) {
+		return 0;
+	}
+	lock_release(s->bs_lock);
+	if (fs->fs_ops->fsop_readblocks != NULL) {
+		result = FSOP_READBLOCKS(fs, block, data, n, size);
+	}
+	else {
+		result = 0;
+		for (i=0; i<n && result == 0; i++) {
+			result = FSOP_READBLOCK(fs, block + i, data[i], size);
+		}
+	}
+	lock_acquire(s->bs_lock);
+	return result;
+}
+
+/*
+ * buffer_readthrough for the NBLOCKS consecutive blocks starting at
+ * BLOCK, into DATA[0] through DATA[NBLOCKS-1]: cached blocks are
+ * copied from their buffers, and each run of consecutive uncached
+ * ones is read from disk with one request.
+ *
+ * The shard lock is dropped while uncached runs are read, and nothing
+ * stops a buffer from being created for a block of a run once the run
+ * has been looked at, so the caller has to keep the blocks from being
+ * written meanwhile (e.g. by holding the lock of the file they belong
+ * to).
+ */
+int
+buffer_readthrough_run(struct fs *fs, daddr_t block, unsigned nblocks,
+		       size_t size, void **data)
+{
+	struct bufshard *s;
+	struct buf *b;
+	daddr_t blk, end, runstart;
+	int result;
+
+	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
+
+	result = 0;
+	blk = block;
+	end = block + nblocks;
+	while (blk < end && result == 0) {
+		/* the rest of this cluster is all in one shard */
+		s = buffer_keyshard(fs, blk);
+		lock_acquire(s->bs_lock);
+
+		runstart = blk;
+		do {
+			if (bufhash_get(&s->bs_hash, fs, blk) != NULL) {
+				/* read what's before it first */
+				result = buffer_readthrough_uncached(s, fs,
+					runstart, blk - runstart, size,
+					data + (runstart - block));
+				if (result == 0) {
+					result = buffer_read_internal(s, fs,
+						blk, size, false/*fsmanaged*/,
+						&b);
+				}
+				if (result == 0) {
+					memcpy(data[blk - block], b->b_data,
+					       size);
+					buffer_release_internal(b);
+				}
+				runstart = blk + 1;
+			}
+			blk++;
+		} while (result == 0 && blk < end &&
+			 blk % BUFFER_CLUSTER != 0);
+
+		if (result == 0) {
+			result = buffer_readthrough_uncached(s, fs, runstart,
+				blk - runstart, size,
+				data + (runstart - block));
+		}
+		lock_release(s->bs_lock);
+	}
+	return result;
+}
+
 /*
  * Shortcut combination of buffer_get and buffer_writeout that writes
  * out any existing buffer if it's dirty and otherwise does nothing.
@@ -1464,15 +2025,16 @@ buffer_read_fsmanaged(struct fs *fs, daddr_t block, size_t size,
 int
 buffer_flush(struct fs *fs, daddr_t block, size_t size)
 {
+	struct bufshard *s = buffer_keyshard(fs, block);
 	struct buf *b;
 	int result = 0;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	lock_acquire(s->bs_lock);
+	bufcheck(s);
 
 	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
 
-	b = buffer_find(fs, block);
+	b = bufhash_get(&s->bs_hash, fs, block);
 	if (b == NULL) {
 		goto done;
 	}
@@ -1506,7 +2068,7 @@ buffer_flush(struct fs *fs, daddr_t block, size_t size)
 
 	buffer_unmark_busy(b);
 done:
-	lock_release(buffer_lock);
+	lock_release(s->bs_lock);
 	return result;
 }
 
@@ -1517,15 +2079,16 @@ done:
 void
 buffer_drop(struct fs *fs, daddr_t block, size_t size)
 {
+	struct bufshard *s = buffer_keyshard(fs, block);
 	struct buf *b;
 	int result;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	lock_acquire(s->bs_lock);
+	bufcheck(s);
 
 	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
 
-	b = buffer_find(fs, block);
+	b = bufhash_get(&s->bs_hash, fs, block);
 	if (b != NULL) {
 		/*
 		 * While the FS shouldn't ever drop a buffer that it's also
@@ -1536,7 +2099,7 @@ buffer_drop(struct fs *fs, daddr_t block, size_t size)
 		result = buffer_mark_busy(b);
 		if (result == EDEADBUF) {
 			/* someone else already dropped it */
-			lock_release(buffer_lock);
+			lock_release(s->bs_lock);
 			return;
 		}
 		KASSERT(result == 0);
@@ -1545,15 +2108,17 @@ buffer_drop(struct fs *fs, daddr_t block, size_t size)
 		buffer_clean(b);
 		buffer_insert_detached(b);
 	}
-	lock_release(buffer_lock);
+	lock_release(s->bs_lock);
 }
 
 static
 void
 buffer_release_internal(struct buf *b)
 {
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	struct bufshard *s = b->b_shard;
+
+	KASSERT(lock_do_i_hold(s->bs_lock));
+	bufcheck(s);
 
 	if (!b->b_fsmanaged) {
 		/* buffers must be released while still reserved */
@@ -1580,9 +2145,12 @@ buffer_release_internal(struct buf *b)
 void
 buffer_release(struct buf *b)
 {
-	lock_acquire(buffer_lock);
+	/* b is busy, so it can't change shards until released */
+	struct bufshard *s = b->b_shard;
+
+	lock_acquire(s->bs_lock);
 	buffer_release_internal(b);
-	lock_release(buffer_lock);
+	lock_release(s->bs_lock);
 }
 
 /*
@@ -1591,12 +2159,14 @@ buffer_release(struct buf *b)
 void
 buffer_release_and_invalidate(struct buf *b)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
+	struct bufshard *s = b->b_shard;
+
+	lock_acquire(s->bs_lock);
+	bufcheck(s);
 
 	b->b_valid = 0;
 	buffer_release_internal(b);
-	lock_release(buffer_lock);
+	lock_release(s->bs_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1621,32 +2191,25 @@ buffer_set_fsdata(struct buf *buf, void *newfsd)
 ////////////////////////////////////////////////////////////
 // explicit sync
 
+/*
+ * Sync one shard's share of sync_fs_buffers.
+ */
+static
 int
-sync_fs_buffers(struct fs *fs)
+sync_shard_fs_buffers(struct bufshard *s, struct fs *fs, unsigned my_epoch)
 {
 	unsigned i;
 	struct buf *b;
-	unsigned my_epoch, my_generation;
+	unsigned my_generation;
 	int result;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
-
-	my_epoch = dirty_epoch++;
-	if (dirty_epoch == 0) {
-		/*
-		 * Handling this instead of dying is not that
-		 * difficult, but for OS/161 it's not really worth the
-		 * trouble.
-		 */
-		panic("vfs: buffer cache syncer epoch wrapped around\n");
-	}
-
-	my_generation = dirty_buffers_generation;
+	lock_acquire(s->bs_lock);
+	bufcheck(s);
 
+	my_generation = s->bs_dirty_generation;
 	/* Don't cache the array size; it might change as we work. */
-	for (i=0; i<bufarray_num(&dirty_buffers); i++) {
-		b = bufarray_get(&dirty_buffers, i);
+	for (i=0; i<bufarray_num(&s->bs_dirty); i++) {
+		b = bufarray_get(&s->bs_dirty, i);
 		if (b == NULL || b->b_fs != fs) {
 			continue;
 		}
@@ -1673,20 +2236,48 @@ sync_fs_buffers(struct fs *fs)
 			 */
 		}
 		else if (result) {
-			lock_release(buffer_lock);
+			lock_release(s->bs_lock);
 			return result;
 		}
 
-		if (my_generation != dirty_buffers_generation) {
+		if (my_generation != s->bs_dirty_generation) {
 			/* compact_dirty_buffers ran; restart loop */
 			i = 0;
-			my_generation = dirty_buffers_generation;
+			my_generation = s->bs_dirty_generation;
 			/* compensate for the i++ */
 			i--;
 		}
 	}
 
-	lock_release(buffer_lock);
+	lock_release(s->bs_lock);
+	return 0;
+}
+
+int
+sync_fs_buffers(struct fs *fs)
+{
+	unsigned i;
+	unsigned my_epoch;
+	int result;
+
+	lock_acquire(buffer_pool_lock);
+	my_epoch = dirty_epoch++;
+	if (dirty_epoch == 0) {
+		/*
+		 * Handling this instead of dying is not that
+		 * difficult, but for OS/161 it's not really worth the
+		 * trouble.
+		 */
+		panic("vfs: buffer cache syncer epoch wrapped around\n");
+	}
+	lock_release(buffer_pool_lock);
+
+	for (i=0; i<BUFFER_SHARDS; i++) {
+		result = sync_shard_fs_buffers(&buffer_shards[i], fs, my_epoch);
+		if (result) {
+			return result;
+		}
+	}
 	return 0;
 }
 
@@ -1704,42 +2295,47 @@ sync_fs_buffers(struct fs *fs)
 void
 drop_fs_buffers(struct fs *fs)
 {
-	unsigned i;
+	struct bufshard *s;
+	unsigned i, j;
 	struct buf *b;
 	unsigned my_generation;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
+	for (j=0; j<BUFFER_SHARDS; j++) {
+		s = &buffer_shards[j];
+		lock_acquire(s->bs_lock);
+		bufcheck(s);
 
-	my_generation = attached_buffers_generation;
-	/* Don't cache the array size; it might change as we work. */
-	for (i=0; i<bufarray_num(&attached_buffers); i++) {
-		b = bufarray_get(&attached_buffers, i);
-		if (b == NULL || b->b_fs != fs) {
-			continue;
-		}
+		my_generation = s->bs_attached_generation;
+		/* Don't cache the array size; it might change as we work. */
+		for (i=0; i<bufarray_num(&s->bs_attached); i++) {
+			b = bufarray_get(&s->bs_attached, i);
+			if (b == NULL || b->b_fs != fs) {
+				continue;
+			}
 
-		KASSERT(b->b_valid);
-		if (b->b_dirty) {
-			panic("drop_fs_buffers: buffer did not get synced\n");
-		}
-		if (b->b_busy) {
-			panic("drop_fs_buffers: buffer is busy\n");
-		}
+			KASSERT(b->b_valid);
+			if (b->b_dirty) {
+				panic("drop_fs_buffers: buffer did not get "
+				      "synced\n");
+			}
+			if (b->b_busy) {
+				panic("drop_fs_buffers: buffer is busy\n");
+			}
 
-		buffer_clean(b);
-		buffer_insert_detached(b);
+			buffer_clean(b);
+			buffer_insert_detached(b);
 
-		if (my_generation != attached_buffers_generation) {
-			/* compact_attached_buffers ran; restart loop */
-			i = 0;
-			my_generation = attached_buffers_generation;
-			/* compensate for the i++ */
-			i--;
+			if (my_generation != s->bs_attached_generation) {
+				/* compact_attached_buffers ran; restart */
+				i = 0;
+				my_generation = s->bs_attached_generation;
+				/* compensate for the i++ */
+				i--;
+			}
 		}
-	}
 
-	lock_release(buffer_lock);
+		lock_release(s->bs_lock);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1752,17 +2348,19 @@ drop_fs_buffers(struct fs *fs)
  * avoid data loss in a crash.
  *
  * Pursuant to this, there are two work functions, one for working
- * the queue of least-recently-used buffers (attached_buffers) and
- * one for working the queue of old dirty buffers (dirty_buffers).
+ * the queue of least-recently-used buffers (bs_attached) and one for
+ * working the queue of old dirty buffers (bs_dirty). Each works on
+ * one shard; the syncer makes a pass over all the shards, holding
+ * one shard lock at a time.
  *
  * We balance work between them as follows:
- *    - Under normal circumstances, we work attached_buffers first and
- *      then dirty_buffers.
+ *    - Under normal circumstances, we work bs_attached first and
+ *      then bs_dirty.
  *    - Each of the work functions has a goal after which it stops;
  *      but it limits itself to some fixed maximum number of buffers
  *      before returning, in order to bound the amount of time before
  *      the outer loop reconsiders the situation.
- *    - Under write load, we switch to working dirty_buffers first, in
+ *    - Under write load, we switch to working bs_dirty first, in
  *      order to attempt to bound data loss in a crash. Because client
  *      threads will fall back to synchronous evictions from the LRU
  *      list, under these conditions the syncer should concentrate on
@@ -1771,12 +2369,106 @@ drop_fs_buffers(struct fs *fs)
  *      write out old buffers.
  *    - "Write load" and "heavy write load" are defined by whether the
  *      syncer is managing to keep up with the dirty buffer load; or
- *      more precisely, by how far behind it is on dirty_buffers
+ *      more precisely, by how far behind it is on bs_dirty
  *      relative to where it wants to be.
  */
 
 /*
- * Sync buffers from the LRU list (attached_buffers)
+ * The syncer picks buffers to write while holding the shard lock,
+ * sorts them by disk address, and then writes them out, so writeback
+ * sweeps across the disk and dirty neighbors get written as clusters
+ * (see buffer_writeout_cluster) instead of one at a time in whatever
+ * order they happen to sit in the tables.
+ *
+ * The shard lock is dropped for each write, so the keys are saved to
+ * recheck each buffer before writing it, and the batch holds a
+ * reference to each buffer so none of them can be freed meanwhile.
+ */
+struct syncent {
+	struct buf *se_buf;
+	struct fs *se_fs;
+	daddr_t se_block;
+};
+
+static
+bool
+syncent_before(const struct syncent *a, const struct syncent *b)
+{
+	if (a->se_fs != b->se_fs) {
+		return (uintptr_t)a->se_fs < (uintptr_t)b->se_fs;
+	}
+	return a->se_block < b->se_block;
+}
+
+static
+void
+sync_batch(struct bufshard *s, struct syncent *batch, unsigned num)
+{
+	struct syncent tmp;
+	struct buf *b;
+	unsigned i, j;
+	int result;
+
+	KASSERT(lock_do_i_hold(s->bs_lock));
+
+	/* insertion sort; the batch is small */
+	for (i=1; i<num; i++) {
+		tmp = batch[i];
+		for (j=i; j>0 && syncent_before(&tmp, &batch[j-1]); j--) {
+			batch[j] = batch[j-1];
+		}
+		batch[j] = tmp;
+	}
+
+	/* everything in the batch is still in S, so nothing is freed yet */
+	lock_acquire(buffer_pool_lock);
+	for (i=0; i<num; i++) {
+		batch[i].se_buf->b_refs++;
+	}
+	lock_release(buffer_pool_lock);
+
+	for (i=0; i<num; i++) {
+		b = batch[i].se_buf;
+		if (b->b_shard != s || b->b_fs != batch[i].se_fs ||
+		    b->b_physblock != batch[i].se_block) {
+			/* evicted while we were writing earlier ones */
+			continue;
+		}
+		if (!b->b_dirty || b->b_fsmanaged) {
+			/* went out with a cluster, or the fs took it */
+			continue;
+		}
+
+		/* This can sleep */
+		result = buffer_sync(b);
+		if (result == EDEADBUF) {
+			/*
+			 * The buffer was invalidated/evicted while we
+			 * were waiting to mark it busy. It no longer
+			 * needs syncing, so carry on.
+			 */
+		}
+		else if (result) {
+			/*
+			 * XXX we should probably do something to
+			 * avoid retrying it over and over.
+			 */
+			kprintf("syncer: %s: block %u: Warning: %s\n",
+				FSOP_GETVOLNAME(batch[i].se_fs),
+				batch[i].se_block, strerror(result));
+		}
+	}
+
+	lock_acquire(buffer_pool_lock);
+	for (i=0; i<num; i++) {
+		KASSERT(batch[i].se_buf->b_refs > 0);
+		batch[i].se_buf->b_refs--;
+	}
+	lock_release(buffer_pool_lock);
+}
+
+/*
+ * Sync buffers from a shard's LRU list (bs_attached)
  *
  * When activated, we write out:
  *    - any of the N least recently used buffers that are dirty;
@@ -1786,7 +2478,11 @@ drop_fs_buffers(struct fs *fs)
  * Any buffers that can still be allocated (max_total_buffers -
  * num_total_buffers) are counted as very old clean buffers, so at
  * first we don't sync anything at all until one of the time limits
- * kicks in.
+ * kicks in. N, K, and the unallocated buffers are divided evenly among
+ * the shards.
+ *
+ * At most SYNCER_BATCH buffers are written per call; if there were
+ * more, we return false and the syncer comes back for them.
  *
  * Note that "age" (via b_timestamp) is the time since the buffer
  * means was first marked dirty, which may differ substantially
@@ -1794,73 +2490,52 @@ drop_fs_buffers(struct fs *fs)
  */
 static
 bool
-sync_lru_buffers(void)
+sync_lru_buffers(struct bufshard *s)
 {
-	struct timespec started, now, age;
+	struct syncent batch[SYNCER_BATCH];
+	struct timespec now, age;
 	unsigned sync_always; /* N */
 	unsigned sync_ifold; /* N + K */
 	unsigned seenbuffers;
-	unsigned my_generation;
-	unsigned loops;
-	unsigned i;
+	unsigned num, i;
 	struct buf *b;
 	bool finished;
-	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(lock_do_i_hold(s->bs_lock));
+	bufcheck(s);
 	/* this might not be true if sync_old_buffers ran first */
-	/*KASSERT(dirty_buffers_count > 0);*/
+	/*KASSERT(s->bs_dirty_count > 0);*/
 
-	gettime(&started);
-	finished = false;
+	gettime(&now);
+	finished = true;
 
-	sync_always = SCALE(max_total_buffers, SYNCER_ALWAYS);
-	sync_ifold = SCALE(max_total_buffers, SYNCER_IFOLD);
+	sync_always = SCALE(max_total_buffers, SYNCER_ALWAYS) / BUFFER_SHARDS;
+	sync_ifold = SCALE(max_total_buffers, SYNCER_IFOLD) / BUFFER_SHARDS;
 	seenbuffers = 0;
 
 	/*
 	 * Buffers not allocated yet are buffers we have effectively
-	 * already processed.
+	 * already processed. (num_total_buffers is read unlocked; it
+	 * only needs to be roughly right.)
 	 */
-	seenbuffers += max_total_buffers - num_total_buffers;
+	seenbuffers += (max_total_buffers - num_total_buffers) / BUFFER_SHARDS;
 
-	my_generation = attached_buffers_generation;
-	loops = 0;
-	i = 0;
-	while (1) {
-		/* Don't cache the array size; it might change as we work. */
-		if (i >= bufarray_num(&attached_buffers)) {
-			/* no more buffers to look at */
-			finished = true;
-			break;
-		}
+	num = 0;
+	for (i=0; i<bufarray_num(&s->bs_attached); i++) {
 		if (seenbuffers >= sync_ifold) {
 			/* checked enough */
-			finished = true;
 			break;
 		}
 
-		b = bufarray_get(&attached_buffers, i);
-		i++;
+		b = bufarray_get(&s->bs_attached, i);
 		if (b == NULL) {
 			continue;
 		}
 		seenbuffers++;
-		if (!b->b_dirty) {
+		if (!b->b_dirty || b->b_fsmanaged) {
 			continue;
 		}
 
-		gettime(&now);
-		timespec_sub(&started, &now, &age);
-		if (age.tv_sec > 0) {
-			/*
-			 * Return back to the outer syncer loop if
-			 * we've been running for more than 1 second.
-			 */
-			break;
-		}
-
 		if (seenbuffers >= sync_always) {
 			timespec_sub(&now, &b->b_timestamp, &age);
 			if (age.tv_sec < 1) {
@@ -1869,39 +2544,17 @@ sync_lru_buffers(void)
 			}
 		}
 
-		/* This can sleep */
-		result = buffer_sync(b);
-		if (result == EDEADBUF) {
-			/*
-			 * The buffer was invalidated/evicted while we
-			 * were waiting to mark it busy. It no longer
-			 * needs syncing, so carry on.
-			 */
-		}
-		else if (result) {
-			/*
-			 * XXX we should probably do something to
-			 * avoid retrying it over and over.
-			 */
-			kprintf("syncer: %s: block %u: Warning: %s\n",
-				FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
-				strerror(result));
-		}
-
-		if (my_generation != attached_buffers_generation) {
-			/* compact_attached_buffers ran; restart loop */
-			loops++;
-			if (loops > 15) {
-				/* limit 15 tries, then go on */
-				break;
-			}
-			i = 0;
-			seenbuffers = 0;
-			seenbuffers += max_total_buffers - num_total_buffers;
-			my_generation = attached_buffers_generation;
-			continue;
+		if (num == SYNCER_BATCH) {
+			finished = false;
+			break;
 		}
+		batch[num].se_buf = b;
+		batch[num].se_fs = b->b_fs;
+		batch[num].se_block = b->b_physblock;
+		num++;
 	}
+
+	sync_batch(s, batch, num);
 	return finished;
 }
 
@@ -1961,52 +2614,36 @@ syncer_adjust_state(unsigned age)
 }
 
 /*
- * Sync buffers from the age-sorted list of dirty buffers.
+ * Sync buffers from a shard's age-sorted list of dirty buffers.
  *
- * We write out any dirty buffers that are older than two seconds.
+ * We write out any dirty buffers that are older than two seconds, at
+ * most SYNCER_BATCH per call as for sync_lru_buffers.
  */
 static
 bool
-sync_old_buffers(void)
+sync_old_buffers(struct bufshard *s)
 {
-	struct timespec started, now, age;
-	unsigned my_generation;
-	unsigned i;
+	struct syncent batch[SYNCER_BATCH];
+	struct timespec now, age;
+	unsigned num, i;
 	struct buf *b;
 	bool finished;
-	int result;
 
-	KASSERT(lock_do_i_hold(buffer_lock));
-	bufcheck();
+	KASSERT(lock_do_i_hold(s->bs_lock));
+	bufcheck(s);
 	/* this might not be true if sync_lru_buffers ran first */
-	/*KASSERT(dirty_buffers_count > 0);*/
+	/*KASSERT(s->bs_dirty_count > 0);*/
 
-	gettime(&started);
-	finished = false;
+	gettime(&now);
+	finished = true;
 
-	my_generation = dirty_buffers_generation;
-	i = 0;
-	while (1) {
-		/* Don't cache the array size; it might change as we work. */
-		if (i >= bufarray_num(&dirty_buffers)) {
-			finished = true;
-			break;
-		}
-		b = bufarray_get(&dirty_buffers, i);
-		i++;
+	num = 0;
+	for (i=0; i<bufarray_num(&s->bs_dirty); i++) {
+		b = bufarray_get(&s->bs_dirty, i);
 		if (b == NULL) {
 			continue;
 		}
 		KASSERT(b->b_dirty);
-		gettime(&now);
-		timespec_sub(&started, &now, &age);
-		if (age.tv_sec > 0) {
-			/*
-			 * If we've been running for more than one
-			 * second, return to the outer syncer loop.
-			 */
-			break;
-		}
 		timespec_sub(&now, &b->b_timestamp, &age);
 		if (age.tv_sec < SYNCER_TARGET_AGE) {
 			/*
@@ -2016,87 +2653,111 @@ sync_old_buffers(void)
 			 * out, all the rest will be newer too. So we
 			 * can stop iterating.
 			 */
-			finished = true;
 			break;
 		}
 
 		/* If we're seeing sufficiently old buffers, take steps */
 		syncer_adjust_state(age.tv_sec);
 
-		result = buffer_sync(b);
-		if (result == EDEADBUF) {
-			/* as above */
-		}
-		else if (result) {
-			/*
-			 * XXX we should probably do something to
-			 * avoid retrying it over and over.
-			 */
-			kprintf("syncer: %s: block %u: Warning: %s\n",
-				FSOP_GETVOLNAME(b->b_fs), b->b_physblock,
-				strerror(result));
-		}
-
-		if (my_generation != dirty_buffers_generation) {
-			/* compact_dirty_buffers ran; restart loop */
-			i = 0;
-			my_generation = dirty_buffers_generation;
+		if (b->b_fsmanaged) {
 			continue;
 		}
+		if (num == SYNCER_BATCH) {
+			finished = false;
+			break;
+		}
+		batch[num].se_buf = b;
+		batch[num].se_fs = b->b_fs;
+		batch[num].se_block = b->b_physblock;
+		num++;
 	}
-	if (finished && syncer_under_load) {
-		/* If we finished, the age of the "next" buffer is 0. */
-		syncer_adjust_state(0);
-	}
+
+	sync_batch(s, batch, num);
 	return finished;
 }
 
 /*
- * If OS/161 had a more powerful clock system, we might arrange to run
- * the syncer either when enough buffers become dirty or every second
- * or two when dirty buffers exist. But we don't really have the
- * facilities for that, so instead we'll just run once a second.
+ * Total dirty buffers, for deciding how long the syncer rests. This
+ * reads the shard counts without their locks, so it's only a hint.
+ */
+static
+unsigned
+buffer_dirty_count(void)
+{
+	unsigned i, count;
+
+	count = 0;
+	for (i=0; i<BUFFER_SHARDS; i++) {
+		count += buffer_shards[i].bs_dirty_count;
+	}
+	return count;
+}
+
+/*
+ * The syncer runs once a second when nothing is dirty, and every
+ * SYNCER_DIRTY_MS when dirty buffers exist, so writeback is spread
+ * out instead of bunched up at second boundaries.
  */
 static
 void
 syncer(void *x1, unsigned long x2)
 {
+	struct bufshard *s;
 	bool lru_finished, old_finished;
+	unsigned i;
 
 	(void)x1;
 	(void)x2;
 
-	lock_acquire(buffer_lock);
 	syncer_thread = curthread;
 
 	lru_finished = true;
 	old_finished = true;
 	while (1) {
 		if (lru_finished && old_finished) {
-			lock_release(buffer_lock);
-			clocksleep(1);
-			lock_acquire(buffer_lock);
+			thread_sleep_ms(buffer_dirty_count() > 0 ?
+					SYNCER_DIRTY_MS : SYNCER_IDLE_MS);
 		}
 
-		if (syncer_needs_help) {
-			old_finished = sync_old_buffers();
-			lru_finished = false;
-		}
-		else if (syncer_under_load) {
-			old_finished = sync_old_buffers();
-			lru_finished = sync_lru_buffers();
-		}
-		else if (dirty_buffers_count > 0) {
-			lru_finished = sync_lru_buffers();
-			old_finished = sync_old_buffers();
+		lru_finished = true;
+		old_finished = true;
+		for (i=0; i<BUFFER_SHARDS; i++) {
+			s = &buffer_shards[i];
+			lock_acquire(s->bs_lock);
+			if (syncer_needs_help) {
+				if (!sync_old_buffers(s)) {
+					old_finished = false;
+				}
+				lru_finished = false;
+			}
+			else if (syncer_under_load) {
+				if (!sync_old_buffers(s)) {
+					old_finished = false;
+				}
+				if (!sync_lru_buffers(s)) {
+					lru_finished = false;
+				}
+			}
+			else if (s->bs_dirty_count > 0) {
+				if (!sync_lru_buffers(s)) {
+					lru_finished = false;
+				}
+				if (!sync_old_buffers(s)) {
+					old_finished = false;
+				}
+			}
+			lock_release(s->bs_lock);
 		}
-		else {
-			lru_finished = true;
-			old_finished = true;
+
+		if (old_finished && syncer_under_load) {
+			/*
+			 * If every shard finished, the age of the
+			 * "next" buffer is 0.
+			 */
+			syncer_adjust_state(0);
 		}
 	}
 	syncer_thread = NULL;
-	lock_release(buffer_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -2125,20 +2786,18 @@ reserve_buffers(size_t size)
 {
 	unsigned count = RESERVE_BUFFERS;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
-
+	lock_acquire(buffer_pool_lock);
 	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
 
 	/* All buffer reservations must be done up front, all at once. */
 	KASSERT(curthread->t_did_reserve_buffers == false);
 
 	while (num_reserved_buffers + count > max_total_buffers) {
-		cv_wait(buffer_reserve_cv, buffer_lock);
+		cv_wait(buffer_reserve_cv, buffer_pool_lock);
 	}
 	num_reserved_buffers += count;
 	curthread->t_did_reserve_buffers = true;
-	lock_release(buffer_lock);
+	lock_release(buffer_pool_lock);
 }
 
 /*
@@ -2149,9 +2808,7 @@ unreserve_buffers(size_t size)
 {
 	unsigned count = RESERVE_BUFFERS;
 
-	lock_acquire(buffer_lock);
-	bufcheck();
-
+	lock_acquire(buffer_pool_lock);
 	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
 
 	KASSERT(curthread->t_did_reserve_buffers == true);
@@ -2159,39 +2816,35 @@ unreserve_buffers(size_t size)
 
 	curthread->t_did_reserve_buffers = false;
 	num_reserved_buffers -= count;
-	cv_broadcast(buffer_reserve_cv, buffer_lock);
+	cv_broadcast(buffer_reserve_cv, buffer_pool_lock);
 
-	lock_release(buffer_lock);
+	lock_release(buffer_pool_lock);
 }
 
 void
 reserve_fsmanaged_buffers(unsigned count, size_t size)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
-
+	lock_acquire(buffer_pool_lock);
 	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
 
 	while (num_reserved_buffers + count > max_total_buffers) {
-		cv_wait(buffer_reserve_cv, buffer_lock);
+		cv_wait(buffer_reserve_cv, buffer_pool_lock);
 	}
 	num_reserved_buffers += count;
-	lock_release(buffer_lock);
+	lock_release(buffer_pool_lock);
 }
 
 void
 unreserve_fsmanaged_buffers(unsigned count, size_t size)
 {
-	lock_acquire(buffer_lock);
-	bufcheck();
-
+	lock_acquire(buffer_pool_lock);
 	KASSERT(size == ONE_TRUE_BUFFER_SIZE);
 	KASSERT(count <= num_reserved_buffers);
 
 	num_reserved_buffers -= count;
-	cv_broadcast(buffer_reserve_cv, buffer_lock);
+	cv_broadcast(buffer_reserve_cv, buffer_pool_lock);
 
-	lock_release(buffer_lock);
+	lock_release(buffer_pool_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -2200,25 +2853,51 @@ unreserve_fsmanaged_buffers(unsigned count, size_t size)
 void
 buffer_printstats(void)
 {
-	lock_acquire(buffer_lock);
+	struct bufshard *s;
+	unsigned attached, busy, dirty;
+	unsigned gets, hits, reads, writeouts, evictions, dirtyevictions;
+	unsigned clusterbufs, clusterios;
+	unsigned detached, total, reserved;
+	unsigned i;
 
-	kprintf("Buffers: %u of %u allocated\n",
-		num_total_buffers, max_total_buffers);
-	kprintf("   %u detached, %u attached\n",
-		bufarray_num(&detached_buffers), attached_buffers_count);
-	kprintf("   %u reserved\n", num_reserved_buffers);
-	kprintf("   %u busy\n", busy_buffers_count);
-	kprintf("   %u dirty\n", dirty_buffers_count);
+	attached = busy = dirty = 0;
+	gets = hits = reads = writeouts = evictions = dirtyevictions = 0;
+	clusterbufs = clusterios = 0;
+
+	for (i=0; i<BUFFER_SHARDS; i++) {
+		s = &buffer_shards[i];
+		lock_acquire(s->bs_lock);
+		attached += s->bs_attached_count;
+		busy += s->bs_busy_count;
+		dirty += s->bs_dirty_count;
+		gets += s->bs_total_gets;
+		hits += s->bs_valid_gets;
+		reads += s->bs_read_gets;
+		writeouts += s->bs_total_writeouts;
+		evictions += s->bs_total_evictions;
+		dirtyevictions += s->bs_dirty_evictions;
+		clusterbufs += s->bs_cluster_writeouts;
+		clusterios += s->bs_cluster_writes;
+		lock_release(s->bs_lock);
+	}
+
+	lock_acquire(buffer_pool_lock);
+	detached = bufarray_num(&detached_buffers);
+	total = num_total_buffers;
+	reserved = num_reserved_buffers;
+	lock_release(buffer_pool_lock);
+
+	kprintf("Buffers: %u of %u allocated\n", total, max_total_buffers);
+	kprintf("   %u detached, %u attached\n", detached, attached);
+	kprintf("   %u reserved\n", reserved);
+	kprintf("   %u busy\n", busy);
+	kprintf("   %u dirty\n", dirty);
 
 	kprintf("Buffer operations:\n");
-	kprintf("   %u gets (%u hits, %u reads)\n",
-		num_total_gets, num_valid_gets, num_read_gets);
-	kprintf("   %u writeouts\n",
-		num_total_writeouts);
-	kprintf("   %u evictions (%u when dirty)\n",
-		num_total_evictions, num_dirty_evictions);
-
-	lock_release(buffer_lock);
+	kprintf("   %u gets (%u hits, %u reads)\n", gets, hits, reads);
+	kprintf("   %u writeouts (%u in %u clusters)\n",
+		writeouts, clusterbufs, clusterios);
+	kprintf("   %u evictions (%u when dirty)\n", evictions, dirtyevictions);
 }
 
 ////////////////////////////////////////////////////////////
@@ -2227,12 +2906,11 @@ buffer_printstats(void)
 void
 buffer_bootstrap(void)
 {
+	struct bufshard *s;
 	size_t max_buffer_mem;
+	unsigned i, numbuckets;
 	int result;
 
-	attached_buffers_count = 0;
-	dirty_buffers_count = 0;
-
 	num_reserved_buffers = 0;
 	num_total_buffers = 0;
 
@@ -2245,34 +2923,53 @@ buffer_bootstrap(void)
 		(unsigned long) max_total_buffers,
 		(unsigned long) max_buffer_mem/1024);
 
-	num_total_gets = 0;
-	num_valid_gets = 0;
-	num_read_gets = 0;
-	num_total_writeouts = 0;
-	num_total_evictions = 0;
-	num_dirty_evictions = 0;
-
 	bufarray_init(&detached_buffers);
-	bufarray_init(&attached_buffers);
-	bufarray_init(&dirty_buffers);
-	attached_buffers_first = 0;
-	attached_buffers_thresh = 0;
-	dirty_buffers_first = 0;
-	dirty_buffers_thresh = 0;
-
-	result = bufhash_init(&buffer_hash, max_total_buffers/16);
-	if (result) {
-		panic("Creating buffer_hash failed\n");
-	}
 
-	buffer_lock = lock_create("buffer cache lock");
-	if (buffer_lock == NULL) {
-		panic("Creating buffer cache lock failed\n");
+	numbuckets = max_total_buffers/16/BUFFER_SHARDS;
+	if (numbuckets == 0) {
+		numbuckets = 1;
 	}
 
-	buffer_busy_cv = cv_create("bufbusy");
-	if (buffer_busy_cv == NULL) {
-		panic("Creating buffer_busy_cv failed\n");
+	for (i=0; i<BUFFER_SHARDS; i++) {
+		s = &buffer_shards[i];
+
+		result = bufhash_init(&s->bs_hash, numbuckets);
+		if (result) {
+			panic("Creating buffer_hash failed\n");
+		}
+
+		s->bs_lock = lock_create("buffer cache shard");
+		if (s->bs_lock == NULL) {
+			panic("Creating buffer cache lock failed\n");
+		}
+
+		bufarray_init(&s->bs_attached);
+		s->bs_attached_first = 0;
+		s->bs_attached_thresh = 0;
+		s->bs_attached_generation = 0;
+		s->bs_attached_count = 0;
+
+		bufarray_init(&s->bs_dirty);
+		s->bs_dirty_first = 0;
+		s->bs_dirty_thresh = 0;
+		s->bs_dirty_generation = 0;
+		s->bs_dirty_count = 0;
+
+		s->bs_busy_count = 0;
+
+		s->bs_total_gets = 0;
+		s->bs_valid_gets = 0;
+		s->bs_read_gets = 0;
+		s->bs_total_writeouts = 0;
+		s->bs_cluster_writeouts = 0;
+		s->bs_cluster_writes = 0;
+		s->bs_total_evictions = 0;
+		s->bs_dirty_evictions = 0;
+	}
+
+	buffer_pool_lock = lock_create("buffer pool lock");
+	if (buffer_pool_lock == NULL) {
+		panic("Creating buffer pool lock failed\n");
 	}
 
 	buffer_reserve_cv = cv_create("bufreserve");
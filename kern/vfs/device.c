@@ -237,15 +237,17 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Devices have no pages in the page cache, so none of them
+ * can be mapped.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, off_t pos, unsigned long *ret)
 {
 	(void)v;
-	return ENOSYS;
+	(void)pos;
+	(void)ret;
+	return ENODEV;
 }
 
 /*
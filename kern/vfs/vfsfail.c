@@ -83,23 +83,29 @@ vopfail_uio_nosys(struct vnode *vn, struct uio *uio)
 // mmap
 
 int
-vopfail_mmap_isdir(struct vnode *vn /*add stuff */)
+vopfail_mmap_isdir(struct vnode *vn, off_t pos, unsigned long *ret)
 {
 	(void)vn;
+	(void)pos;
+	(void)ret;
 	return EISDIR;
 }
 
 int
-vopfail_mmap_perm(struct vnode *vn /*add stuff */)
+vopfail_mmap_perm(struct vnode *vn, off_t pos, unsigned long *ret)
 {
 	(void)vn;
+	(void)pos;
+	(void)ret;
 	return EPERM;
 }
 
 int
-vopfail_mmap_nosys(struct vnode *vn /*add stuff */)
+vopfail_mmap_nosys(struct vnode *vn, off_t pos, unsigned long *ret)
 {
 	(void)vn;
+	(void)pos;
+	(void)ret;
 	return ENOSYS;
 }
 
@@ -112,6 +112,7 @@ vfs_bootstrap(void)
 	txs = NULL;
 
 	vfs_initbootfs();
+	vfs_nc_bootstrap();
 	devnull_create();
 	semfs_bootstrap();
 }
@@ -618,6 +619,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* let go of the vnodes the name cache is holding */
+	vfs_nc_purgefs(kd->kd_fs);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -709,6 +713,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_nc_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -0,0 +1,311 @@
+/*
+ * VFS name cache.
+ *
+ * Remembers what looking up a single name in a directory found: the
+ * vnode the name refers to, or nothing (a negative entry) if it isn't
+ * there. Entries are keyed by (directory vnode, name) and hold a
+ * reference to both vnodes, so cached directories and files stay
+ * loaded and a hit never has to go to the filesystem. The cache is a
+ * fixed pool of entries; when it's full the least recently used one
+ * is recycled.
+ *
+ * A filesystem that enters names is responsible for keeping them
+ * right: it must call vfs_nc_remove whenever a name in a directory
+ * is added, removed, or changed, and vfs_nc_purgedir when a directory
+ * is removed. Entries and invalidations for a directory should be
+ * made while holding whatever lock serializes changes to it. Entries
+ * for a filesystem are dropped before it is unmounted.
+ *
+ * Recycling an entry to make a new one lets go of what the old entry
+ * held, which may be the last reference to a vnode. Reclaiming that
+ * vnode can't be done under the directory lock the new entry is made
+ * with, so vfs_nc_enter hands the references back for the caller to
+ * drop later with vfs_nc_release.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#define NC_SIZE		256	/* entries in the cache */
+#define NC_HASHSIZE	64	/* hash chains */
+#define NC_NAMELEN	32	/* longer names aren't cached */
+
+struct nc_entry {
+	struct vnode *nc_dir;		/* directory, or NULL if unused */
+	struct vnode *nc_vn;		/* what the name is, or NULL */
+	char nc_name[NC_NAMELEN];
+	struct nc_entry *nc_hashnext;	/* hash chain */
+	struct nc_entry *nc_lrunext;	/* LRU list, most recent first */
+	struct nc_entry *nc_lruprev;
+};
+
+static struct nc_entry nc_entries[NC_SIZE];
+static struct nc_entry *nc_hash[NC_HASHSIZE];
+static struct nc_entry nc_lru;		/* LRU list head; unused at the tail */
+static struct spinlock nc_lock = SPINLOCK_INITIALIZER;
+
+static
+unsigned
+nc_hashfn(struct vnode *dir, const char *name)
+{
+	uint32_t hash = (uint32_t)(uintptr_t)dir;
+
+	for (; *name != 0; name++) {
+		hash = (hash ^ (unsigned char)*name) * 16777619U;
+	}
+	return hash % NC_HASHSIZE;
+}
+
+static
+void
+nc_lru_unlink(struct nc_entry *e)
+{
+	e->nc_lruprev->nc_lrunext = e->nc_lrunext;
+	e->nc_lrunext->nc_lruprev = e->nc_lruprev;
+}
+
+static
+void
+nc_lru_insert(struct nc_entry *e, struct nc_entry *after)
+{
+	e->nc_lruprev = after;
+	e->nc_lrunext = after->nc_lrunext;
+	after->nc_lrunext->nc_lruprev = e;
+	after->nc_lrunext = e;
+}
+
+/*
+ * Find the entry for NAME in DIR. Must hold nc_lock.
+ */
+static
+struct nc_entry *
+nc_find(struct vnode *dir, const char *name)
+{
+	struct nc_entry *e;
+
+	for (e = nc_hash[nc_hashfn(dir, name)]; e != NULL; e = e->nc_hashnext) {
+		if (e->nc_dir == dir && !strcmp(e->nc_name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry out of use and hand back the references it held,
+ * which the caller must drop after releasing nc_lock. Must hold
+ * nc_lock.
+ */
+static
+void
+nc_drop(struct nc_entry *e, struct vnode **dir, struct vnode **vn)
+{
+	struct nc_entry **ep;
+
+	KASSERT(e->nc_dir != NULL);
+
+	for (ep = &nc_hash[nc_hashfn(e->nc_dir, e->nc_name)]; *ep != e;
+	     ep = &(*ep)->nc_hashnext) {
+		KASSERT(*ep != NULL);
+	}
+	*ep = e->nc_hashnext;
+
+	*dir = e->nc_dir;
+	*vn = e->nc_vn;
+	e->nc_dir = NULL;
+	e->nc_vn = NULL;
+
+	nc_lru_unlink(e);
+	nc_lru_insert(e, nc_lru.nc_lruprev);
+}
+
+/*
+ * Drop the references nc_drop handed back.
+ */
+static
+void
+nc_release(struct vnode *dir, struct vnode *vn)
+{
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+}
+
+/*
+ * Set up the (initially empty) cache.
+ */
+void
+vfs_nc_bootstrap(void)
+{
+	unsigned i;
+
+	nc_lru.nc_lrunext = nc_lru.nc_lruprev = &nc_lru;
+	for (i=0; i<NC_SIZE; i++) {
+		nc_entries[i].nc_dir = NULL;
+		nc_entries[i].nc_vn = NULL;
+		nc_lru_insert(&nc_entries[i], nc_lru.nc_lruprev);
+	}
+}
+
+/*
+ * Look up NAME in DIR. Returns false if the cache doesn't know.
+ * Otherwise returns true and hands back in RET either a new reference
+ * to the vnode NAME refers to, or NULL if it doesn't exist.
+ */
+bool
+vfs_nc_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct nc_entry *e;
+
+	spinlock_acquire(&nc_lock);
+
+	e = nc_find(dir, name);
+	if (e == NULL) {
+		spinlock_release(&nc_lock);
+		return false;
+	}
+
+	if (e->nc_vn != NULL) {
+		VOP_INCREF(e->nc_vn);
+	}
+	*ret = e->nc_vn;
+
+	nc_lru_unlink(e);
+	nc_lru_insert(e, &nc_lru);
+
+	spinlock_release(&nc_lock);
+	return true;
+}
+
+/*
+ * Record that NAME in DIR refers to VN, or to nothing if VN is NULL.
+ * The references of the entry recycled for it, if any, go in DROP.
+ */
+void
+vfs_nc_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	     struct vfs_ncdrop *drop)
+{
+	struct nc_entry *e;
+	unsigned h;
+
+	drop->ncd_dir = NULL;
+	drop->ncd_vn = NULL;
+
+	if (strlen(name) >= NC_NAMELEN) {
+		return;
+	}
+
+	spinlock_acquire(&nc_lock);
+
+	if (nc_find(dir, name) != NULL) {
+		/* Somebody beat us to it */
+		spinlock_release(&nc_lock);
+		return;
+	}
+
+	/* Recycle the least recently used entry */
+	e = nc_lru.nc_lruprev;
+	if (e->nc_dir != NULL) {
+		nc_drop(e, &drop->ncd_dir, &drop->ncd_vn);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	e->nc_dir = dir;
+	e->nc_vn = vn;
+	strcpy(e->nc_name, name);
+
+	h = nc_hashfn(dir, name);
+	e->nc_hashnext = nc_hash[h];
+	nc_hash[h] = e;
+
+	nc_lru_unlink(e);
+	nc_lru_insert(e, &nc_lru);
+
+	spinlock_release(&nc_lock);
+}
+
+/*
+ * Drop the references vfs_nc_enter handed back.
+ */
+void
+vfs_nc_release(struct vfs_ncdrop *drop)
+{
+	nc_release(drop->ncd_dir, drop->ncd_vn);
+	drop->ncd_dir = NULL;
+	drop->ncd_vn = NULL;
+}
+
+/*
+ * Forget what NAME in DIR is.
+ */
+void
+vfs_nc_remove(struct vnode *dir, const char *name)
+{
+	struct nc_entry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	spinlock_acquire(&nc_lock);
+	e = nc_find(dir, name);
+	if (e != NULL) {
+		nc_drop(e, &olddir, &oldvn);
+	}
+	spinlock_release(&nc_lock);
+
+	nc_release(olddir, oldvn);
+}
+
+/*
+ * Drop every entry that DIR or FS (whichever isn't NULL) appears in.
+ */
+static
+void
+nc_purge(struct vnode *dir, struct fs *fs)
+{
+	struct nc_entry *e;
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	for (i=0; i<NC_SIZE; i++) {
+		e = &nc_entries[i];
+		olddir = oldvn = NULL;
+
+		spinlock_acquire(&nc_lock);
+		if (e->nc_dir != NULL &&
+		    (dir != NULL ? (e->nc_dir == dir || e->nc_vn == dir) :
+		     e->nc_dir->vn_fs == fs)) {
+			nc_drop(e, &olddir, &oldvn);
+		}
+		spinlock_release(&nc_lock);
+
+		nc_release(olddir, oldvn);
+	}
+}
+
+/*
+ * Forget everything about the directory DIR, which is going away:
+ * the names in it, and the name it had.
+ */
+void
+vfs_nc_purgedir(struct vnode *dir)
+{
+	KASSERT(dir != NULL);
+	nc_purge(dir, NULL);
+}
+
+/*
+ * Forget everything on the filesystem FS, so it can be unmounted.
+ */
+void
+vfs_nc_purgefs(struct fs *fs)
+{
+	KASSERT(fs != NULL);
+	nc_purge(NULL, fs);
+}
@@ -29,11 +29,15 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
 #include <wchan.h>
+#include <spl.h>
+#include <kcache.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -41,38 +45,76 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+static struct kcache *as_cache;
+static struct kcache *ptd_cache;
+
+// Address spaces keep their wchan and spinlock while they sit in as_cache
+static int as_ctor(void *obj) {
+	struct addrspace *as = obj;
+
+	as->addr_wchan = wchan_create("addrspace wchan");
+	if(as->addr_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&as->addr_splk);
+	return 0;
+}
+
+static void as_dtor(void *obj) {
+	struct addrspace *as = obj;
+
+	spinlock_cleanup(&as->addr_splk);
+	wchan_destroy(as->addr_wchan);
+}
+
+// Page directories are zero when constructed, and as_destroy frees every
+// page table before giving one back, so they come out of ptd_cache zeroed
+static int ptd_ctor(void *obj) {
+	bzero(obj, sizeof(struct page_table_directory));
+	return 0;
+}
+
+void
+as_bootstrap(void)
+{
+	as_cache = kcache_create("addrspace", sizeof(struct addrspace), as_ctor, as_dtor);
+	ptd_cache = kcache_create("page directory", sizeof(struct page_table_directory), ptd_ctor, NULL);
+	pt_cache = kcache_create("page table", sizeof(struct page_table), NULL, NULL);
+	if(as_cache == NULL || ptd_cache == NULL || pt_cache == NULL) {
+		panic("as_bootstrap: kcache_create failed\n");
+	}
+}
+
 struct addrspace *
 as_create(void)
 {
 	struct addrspace *as;
 
-	as = kmalloc(sizeof(struct addrspace));
+	as = kcache_alloc(as_cache);
 	if (as == NULL) {
 		goto err1;
 	}
 
-	as->ptd = kmalloc(sizeof(struct page_table_directory));
+	as->ptd = kcache_alloc(ptd_cache);
 	if(as->ptd == NULL) {
 		goto err2;
 	}
-	bzero(as->ptd, sizeof(struct page_table_directory));
-
-	as->addr_wchan = wchan_create("addrspace wchan");
-	if(as->addr_wchan == NULL) {
-		goto err3;
-	}
-
-	spinlock_init(&as->addr_splk);
 
 	as->heap_bottom = 0;
 	as->heap_top = 0;
+	bzero(as->asids, sizeof(as->asids));
+
+	as->pf_last = 0;
+	as->pf_next = 0;
+	as->pf_dir = 0;
+	as->pf_window = 0;
+	as->regions = NULL;
+	as->mmaps = NULL;
 
 	return as;
 
-	err3:
-		kfree(as->ptd);
 	err2:
-		kfree(as);
+		kcache_free(as_cache, as);
 	err1:
 		return NULL;
 }
@@ -87,7 +129,28 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	pth_copy(old, new);	// deep copy the address space
+	struct lazy_region **lp = &new->regions;
+	for(struct lazy_region *lr = old->regions; lr != NULL; lr = lr->lr_next) {
+		struct lazy_region *copy = kmalloc(sizeof(struct lazy_region));
+		if(copy == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		if(lr->lr_vnode != NULL)
+			VOP_INCREF(lr->lr_vnode);
+		*copy = *lr;
+		copy->lr_next = NULL;
+		*lp = copy;
+		lp = &copy->lr_next;
+	}
+
+	int err = mmap_copy(old, new);
+	if(err != 0) {
+		as_destroy(new);
+		return err;
+	}
+
+	pth_copy(old, new);	// copy on write the address space
 	new->heap_bottom = old->heap_bottom;
 	new->heap_top = old->heap_top;
 
@@ -98,13 +161,21 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-	free_upages(as, 0, USERSPACETOP / PAGE_SIZE);	// free all pages in user space
-	kfree(as->ptd);	// free the page directory itself
+	mmap_destroy(as);	// write back shared mappings while their pages are still there
+	free_upages(as, 0, USERSPACETOP / PAGE_SIZE);	// free all pages in user space (leaves the ptd zeroed)
+	kcache_free(ptd_cache, as->ptd);	// free the page directory itself
+
+	while(as->regions != NULL) {
+		struct lazy_region *lr = as->regions;
+		as->regions = lr->lr_next;
+		if(lr->lr_vnode != NULL)
+			VOP_DECREF(lr->lr_vnode);
+		kfree(lr);
+	}
 
 	// at this point, no other threads can reach 'as'
-	spinlock_cleanup(&as->addr_splk);
-	wchan_destroy(as->addr_wchan);
-	kfree(as);
+	// its wchan and spinlock stay with it in the cache
+	kcache_free(as_cache, as);
 }
 
 void
@@ -121,7 +192,9 @@ as_activate(void)
 		return;
 	}
 
-	invalidate_tlb();	// flush mappings from another address space
+	int spl = splhigh();
+	asid_activate(as);	// entries from other address spaces don't match our ASID,
+	splx(spl);			// so there's no need to flush them
 }
 
 void
@@ -138,37 +211,68 @@ as_deactivate(void)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. They're
+ * carried into the PTE of each page; the TLB can only enforce write
+ * permission, though.
+ *
+ * Nothing is allocated here: the segment's pages are zero-filled (or
+ * read in, after as_load_region()) the first time they're touched.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
-	(void) readable;
-	(void) writeable;
-	(void) executable;
+	vaddr_t end = ROUND_UP(vaddr + memsize, PAGE_SIZE) * PAGE_SIZE;	// permissions have to be at page granularity,
+																		// and you can't round down for obvious reasons
 
-	vaddr &= PAGE_FRAME;
-	uint8_t perms = 1;		// tells alloc_upages to allow allocations outside of heap/stack
-
-	unsigned npages = ROUND_UP(memsize, PAGE_SIZE);	// permissions have to be at page granularity,
-													// and you can't round down for obvious reasons
-
-	if(vaddr + npages * PAGE_SIZE > USERSTACKBOTTOM - USERHEAPSIZE)	// disallow mappings that infringe on the heap
+	if(end < vaddr || end > USERSTACKBOTTOM - USERHEAPSIZE)	// disallow mappings that infringe on the heap
 		return EINVAL;
 
-	int err = alloc_upages(as, vaddr, npages, perms);
-	if(err != 0)
-		return err;
+	struct lazy_region *lr = kmalloc(sizeof(struct lazy_region));
+	if(lr == NULL)
+		return ENOMEM;
 
-	as->heap_bottom = vaddr + npages * PAGE_SIZE;	// heap will end up starting on top of the last mapped region
+	lr->lr_vaddr = vaddr;
+	lr->lr_memsize = memsize;
+	lr->lr_vnode = NULL;
+	lr->lr_offset = 0;
+	lr->lr_filesize = 0;
+	lr->lr_prot = (readable ? PROT_READ : 0) | (writeable ? PROT_WRITE : 0) | (executable ? PROT_EXEC : 0);
+	lr->lr_next = as->regions;
+	as->regions = lr;
+
+	as->heap_bottom = end;	// heap will end up starting on top of the last mapped region
 	as->heap_top = as->heap_bottom;
 
 	return 0;
 }
 
+/*
+ * Give the region defined at VADDR its contents: FILESIZE bytes of V
+ * from OFFSET, then zeros. Called by load_elf instead of reading the
+ * segment in.
+ */
+int
+as_load_region(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t filesize)
+{
+	struct lazy_region *lr;
+
+	for(lr = as->regions; lr != NULL; lr = lr->lr_next) {
+		if(lr->lr_vaddr == vaddr)
+			break;
+	}
+	if(lr == NULL || lr->lr_vnode != NULL || filesize > lr->lr_memsize)
+		return EINVAL;
+
+	VOP_INCREF(v);
+	lr->lr_vnode = v;
+	lr->lr_offset = offset;
+	lr->lr_filesize = filesize;
+
+	return 0;
+}
+
 int
 as_prepare_load(struct addrspace *as)
 {
@@ -203,3 +307,120 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+// Find the lazy region containing the page at 'vaddr', or NULL.
+struct lazy_region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	vaddr &= PAGE_FRAME;
+
+	for(struct lazy_region *lr = as->regions; lr != NULL; lr = lr->lr_next) {
+		if(vaddr + PAGE_SIZE > lr->lr_vaddr && vaddr < lr->lr_vaddr + lr->lr_memsize)
+			return lr;
+	}
+	return NULL;
+}
+
+// *** Assumes no spinlocks are held
+// Fill in the page at 'vaddr' of 'lr' the first time it's touched: the part
+// the file backs is read in, and the rest is zeros.
+int
+as_region_fault(struct addrspace *as, struct lazy_region *lr, vaddr_t vaddr)
+{
+	vaddr &= PAGE_FRAME;
+
+	vaddr_t lo = vaddr > lr->lr_vaddr ? vaddr : lr->lr_vaddr;
+	vaddr_t hi = vaddr + PAGE_SIZE;
+	if(hi > lr->lr_vaddr + lr->lr_filesize)
+		hi = lr->lr_vaddr + lr->lr_filesize;
+
+	if(lr->lr_prot == PROT_NONE)
+		return EFAULT;
+
+	if(lo >= hi)	// all BSS
+		return alloc_upage_file(as, vaddr, lr->lr_prot, NULL, 0, 0, 0);
+
+	return alloc_upage_file(as, vaddr, lr->lr_prot, lr->lr_vnode, lr->lr_offset + (lo - lr->lr_vaddr),
+							lo - vaddr, hi - lo);
+}
+
+#define PREFAULT_PIN_DENOM 8
+
+// *** Assumes no spinlocks are held
+// Fault in the pages behind the '*len' bytes at 'buf' that have to come from a
+// file, so moving data to or from them (into them if 'write') doesn't fault into
+// the file system while it holds vnode locks. Once a page of an executable is
+// read in it belongs to the address space, and eviction writes it to swap (even
+// if it's read-only) instead of dropping it, so bringing it back is a swap read,
+// not a file system read. Mapped file pages can be evicted, so they're pinned
+// until as_unpin(); at most 1/PREFAULT_PIN_DENOM of memory is, so '*len' may
+// come back shorter, for a short read or write.
+int
+as_prefault(struct addrspace *as, userptr_t buf, size_t *len, bool write)
+{
+	if(as == NULL || *len == 0)
+		return 0;
+
+	vaddr_t start = (vaddr_t) buf & PAGE_FRAME;
+	vaddr_t end = (vaddr_t) buf + *len;
+	if(end < start || end > USERSPACETOP)	// copyin/copyout will deal with it
+		end = USERSPACETOP;
+
+	for(struct lazy_region *lr = as->regions; lr != NULL; lr = lr->lr_next) {
+		vaddr_t lo = start > lr->lr_vaddr ? start : lr->lr_vaddr & PAGE_FRAME;
+		vaddr_t hi = end < lr->lr_vaddr + lr->lr_filesize ? end : lr->lr_vaddr + lr->lr_filesize;
+
+		for(vaddr_t va = lo; va < hi; va += PAGE_SIZE) {
+			int err = tlb_miss(as, va, false);
+			if(err != 0)
+				return err;
+		}
+	}
+
+	unsigned long npins = 0;
+
+	for(struct mmap_region *mr = as->mmaps; mr != NULL && mr->mr_start < end; mr = mr->mr_next) {
+		vaddr_t lo = start > mr->mr_start ? start : mr->mr_start;
+		vaddr_t hi = end < mr->mr_end ? end : mr->mr_end;
+
+		for(vaddr_t va = lo; va < hi; va += PAGE_SIZE) {
+			if(npins >= ncmes / PREFAULT_PIN_DENOM) {	// leave the rest for next time
+				*len = va > (vaddr_t) buf ? va - (vaddr_t) buf : 0;
+				return *len == 0 ? ENOMEM : 0;
+			}
+
+			bool pinned;
+			int err = fpage_pin(as, va, write, &pinned);
+			if(err != 0) {
+				as_unpin(as, buf, va > (vaddr_t) buf ? va - (vaddr_t) buf : 0);
+				return err;
+			}
+			if(pinned)
+				npins++;
+		}
+	}
+	return 0;
+}
+
+// *** Assumes no spinlocks are held
+// Let go of the mapped file pages as_prefault() pinned for 'len' bytes at 'buf'
+// (the length it handed back).
+void
+as_unpin(struct addrspace *as, userptr_t buf, size_t len)
+{
+	if(as == NULL || len == 0)
+		return;
+
+	vaddr_t start = (vaddr_t) buf & PAGE_FRAME;
+	vaddr_t end = (vaddr_t) buf + len;
+	if(end < start || end > USERSPACETOP)
+		end = USERSPACETOP;
+
+	for(struct mmap_region *mr = as->mmaps; mr != NULL && mr->mr_start < end; mr = mr->mr_next) {
+		vaddr_t lo = start > mr->mr_start ? start : mr->mr_start;
+		vaddr_t hi = end < mr->mr_end ? end : mr->mr_end;
+
+		for(vaddr_t va = lo; va < hi; va += PAGE_SIZE) {
+			fpage_unpin(as, va);
+		}
+	}
+}
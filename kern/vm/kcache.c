@@ -0,0 +1,555 @@
+/*
+ * Object caches (slab allocator). See kcache.h for the interface.
+ *
+ * Small objects live in one-page slabs: the objects start at the
+ * beginning of the page and the slab header, with a stack of the
+ * indices of the free objects, sits at the end. The slab an object
+ * belongs to is found by rounding its address down to the page. Free
+ * objects aren't linked through their own memory, since that would
+ * clobber their constructed state.
+ *
+ * Objects too big to fit two to a page get pages of their own, and a
+ * few constructed spares are kept on a stack in the cache instead of
+ * slabs.
+ *
+ * In front of either sits a small per-cpu stack of free objects, used
+ * with interrupts off. It's refilled from and flushed to the slab
+ * layer a batch at a time, so kc_lock is taken once per batch.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <kcache.h>
+#include <platform/maxcpus.h>
+
+#define KCACHE_ALIGN	 8	/* object alignment */
+#define KCACHE_BATCH	 8	/* objects moved to or from a cpu at once */
+#define KCACHE_PAGEBATCH 2	/* the same, for objects with their own pages */
+#define KCACHE_SPARES	 8	/* spare page objects kept constructed */
+#define KCACHE_EMPTY	 1	/* empty slabs kept before giving pages back */
+
+struct kslab {
+	struct kslab *ks_next;		/* on kc_partial or kc_empty */
+	struct kslab *ks_prev;
+	unsigned ks_nfree;		/* entries in ks_free */
+	uint16_t ks_free[];		/* indices of the free objects */
+};
+
+#define KSLAB_PAGE(ks)	((vaddr_t)(ks) & PAGE_FRAME)
+
+struct kcache_cpu {
+	unsigned kcc_count;
+	void *kcc_objs[2 * KCACHE_BATCH];
+	unsigned kcc_hits;		/* allocations served from here */
+	unsigned kcc_misses;		/* allocations that had to refill */
+};
+
+struct kcache {
+	const char *kc_name;
+	size_t kc_size;			/* object size, rounded up */
+	unsigned kc_npages;		/* pages per object if it has its own */
+	unsigned kc_perslab;		/* objects per slab */
+	vaddr_t kc_hdroff;		/* offset of struct kslab in its page */
+	unsigned kc_batch;		/* per-cpu refill/flush size */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct kcache *kc_nextcache;	/* on kcache_list */
+
+	/* Slab layer; protected by kc_lock. */
+	struct spinlock kc_lock;
+	struct kslab *kc_partial;	/* slabs with some objects free */
+	struct kslab *kc_empty;		/* slabs with all objects free */
+	unsigned kc_nempty;
+	void *kc_spares[KCACHE_SPARES];	/* for objects with their own pages */
+	unsigned kc_nspares;
+	unsigned kc_nslabs;		/* slabs (or page objects) we have */
+	unsigned kc_out;		/* objects out of the slab layer */
+	unsigned kc_grows;		/* slabs made */
+	unsigned kc_reaps;		/* slabs given back */
+
+	/* Per-cpu fronts, indexed by c_number. */
+	struct kcache_cpu kc_cpus[MAXCPUS];
+};
+
+static struct spinlock kcache_list_lock = SPINLOCK_INITIALIZER;
+static struct kcache *kcache_list;
+
+////////////////////////////////////////////////////////////
+// slab lists
+
+static
+void
+kslab_push(struct kslab **head, struct kslab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *head;
+	if (*head != NULL) {
+		(*head)->ks_prev = ks;
+	}
+	*head = ks;
+}
+
+static
+void
+kslab_remove(struct kslab **head, struct kslab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(*head == ks);
+		*head = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+////////////////////////////////////////////////////////////
+// slab layer
+
+/*
+ * Run the destructor on the first N objects starting at BASE.
+ */
+static
+void
+kcache_destruct(struct kcache *kc, vaddr_t base, unsigned n)
+{
+	unsigned i;
+
+	if (kc->kc_dtor == NULL) {
+		return;
+	}
+	for (i=0; i<n; i++) {
+		kc->kc_dtor((void *)(base + i * kc->kc_size));
+	}
+}
+
+/*
+ * Get pages for one object (if objects have their own pages) or one
+ * slab's worth, and construct the objects. Called without kc_lock.
+ * Returns 0 on failure.
+ */
+static
+vaddr_t
+kcache_newpage(struct kcache *kc)
+{
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(kc->kc_npages > 0 ? kc->kc_npages : 1);
+	if (page == 0) {
+		return 0;
+	}
+	if (kc->kc_ctor != NULL) {
+		for (i=0; i<kc->kc_perslab; i++) {
+			if (kc->kc_ctor((void *)(page + i * kc->kc_size))) {
+				kcache_destruct(kc, page, i);
+				free_kpages(page);
+				return 0;
+			}
+		}
+	}
+	return page;
+}
+
+/*
+ * Make a new slab and put it on the empty list.
+ */
+static
+int
+kcache_grow(struct kcache *kc)
+{
+	struct kslab *ks;
+	vaddr_t page;
+	unsigned i;
+
+	KASSERT(kc->kc_npages == 0);
+
+	page = kcache_newpage(kc);
+	if (page == 0) {
+		return ENOMEM;
+	}
+
+	ks = (struct kslab *)(page + kc->kc_hdroff);
+	ks->ks_nfree = kc->kc_perslab;
+	for (i=0; i<kc->kc_perslab; i++) {
+		/* hand out the lowest addresses first */
+		ks->ks_free[i] = kc->kc_perslab - 1 - i;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kslab_push(&kc->kc_empty, ks);
+	kc->kc_nempty++;
+	kc->kc_nslabs++;
+	kc->kc_grows++;
+	spinlock_release(&kc->kc_lock);
+
+	return 0;
+}
+
+/*
+ * Take a free object from the slab layer, or return NULL if there
+ * isn't one. Call with kc_lock held.
+ */
+static
+void *
+kcache_take(struct kcache *kc)
+{
+	struct kslab *ks;
+	unsigned index;
+
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	if (kc->kc_npages > 0) {
+		if (kc->kc_nspares == 0) {
+			return NULL;
+		}
+		kc->kc_out++;
+		return kc->kc_spares[--kc->kc_nspares];
+	}
+
+	ks = kc->kc_partial;
+	if (ks == NULL) {
+		ks = kc->kc_empty;
+		if (ks == NULL) {
+			return NULL;
+		}
+		kslab_remove(&kc->kc_empty, ks);
+		kc->kc_nempty--;
+		kslab_push(&kc->kc_partial, ks);
+	}
+
+	KASSERT(ks->ks_nfree > 0);
+	index = ks->ks_free[--ks->ks_nfree];
+	if (ks->ks_nfree == 0) {
+		/* full slabs aren't on any list */
+		kslab_remove(&kc->kc_partial, ks);
+	}
+	kc->kc_out++;
+	return (void *)(KSLAB_PAGE(ks) + index * kc->kc_size);
+}
+
+/*
+ * Give an object back to its slab. If that leaves the slab empty and
+ * we already have enough empty slabs, take it off the lists and
+ * return it so the caller can give it back to the VM system once
+ * kc_lock is released. Call with kc_lock held.
+ */
+static
+struct kslab *
+kcache_put(struct kcache *kc, void *obj)
+{
+	struct kslab *ks;
+	vaddr_t page, offset;
+	unsigned index;
+
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+	KASSERT(kc->kc_npages == 0);
+
+	page = (vaddr_t)obj & PAGE_FRAME;
+	offset = (vaddr_t)obj - page;
+	index = offset / kc->kc_size;
+	if (offset % kc->kc_size != 0 || index >= kc->kc_perslab) {
+		panic("kcache_free: %s: invalid object %p\n", kc->kc_name, obj);
+	}
+
+	ks = (struct kslab *)(page + kc->kc_hdroff);
+	KASSERT(ks->ks_nfree < kc->kc_perslab);
+	if (ks->ks_nfree == 0) {
+		kslab_push(&kc->kc_partial, ks);
+	}
+	ks->ks_free[ks->ks_nfree++] = index;
+	kc->kc_out--;
+
+	if (ks->ks_nfree < kc->kc_perslab) {
+		return NULL;
+	}
+
+	kslab_remove(&kc->kc_partial, ks);
+	if (kc->kc_nempty < KCACHE_EMPTY) {
+		kslab_push(&kc->kc_empty, ks);
+		kc->kc_nempty++;
+		return NULL;
+	}
+	kc->kc_nslabs--;
+	kc->kc_reaps++;
+	return ks;
+}
+
+/*
+ * Get up to N objects from the slab layer, growing it if need be.
+ * Returns how many we got; 0 means we're out of memory.
+ */
+static
+unsigned
+kcache_refill(struct kcache *kc, void **objs, unsigned n)
+{
+	unsigned got;
+	vaddr_t page;
+	void *obj;
+
+	while (1) {
+		got = 0;
+		spinlock_acquire(&kc->kc_lock);
+		while (got < n && (obj = kcache_take(kc)) != NULL) {
+			objs[got++] = obj;
+		}
+		spinlock_release(&kc->kc_lock);
+
+		if (got > 0) {
+			return got;
+		}
+
+		if (kc->kc_npages > 0) {
+			page = kcache_newpage(kc);
+			if (page == 0) {
+				return 0;
+			}
+			spinlock_acquire(&kc->kc_lock);
+			kc->kc_nslabs++;
+			kc->kc_grows++;
+			kc->kc_out++;
+			spinlock_release(&kc->kc_lock);
+			objs[0] = (void *)page;
+			return 1;
+		}
+
+		/* Someone else may get to the new slab first; if so, retry. */
+		if (kcache_grow(kc)) {
+			return 0;
+		}
+	}
+}
+
+/*
+ * Give N objects back to the slab layer, and any slabs (or page
+ * objects) that leaves surplus back to the VM system.
+ */
+static
+void
+kcache_release(struct kcache *kc, void **objs, unsigned n)
+{
+	struct kslab *reap, *ks;
+	unsigned i, ndead;
+
+	reap = NULL;
+	ndead = 0;
+
+	spinlock_acquire(&kc->kc_lock);
+	for (i=0; i<n; i++) {
+		if (kc->kc_npages > 0) {
+			kc->kc_out--;
+			if (kc->kc_nspares < KCACHE_SPARES) {
+				kc->kc_spares[kc->kc_nspares++] = objs[i];
+			}
+			else {
+				objs[ndead++] = objs[i];
+				kc->kc_nslabs--;
+				kc->kc_reaps++;
+			}
+		}
+		else {
+			ks = kcache_put(kc, objs[i]);
+			if (ks != NULL) {
+				ks->ks_next = reap;
+				reap = ks;
+			}
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	for (i=0; i<ndead; i++) {
+		kcache_destruct(kc, (vaddr_t)objs[i], 1);
+		free_kpages((vaddr_t)objs[i]);
+	}
+	while (reap != NULL) {
+		ks = reap;
+		reap = ks->ks_next;
+		kcache_destruct(kc, KSLAB_PAGE(ks), kc->kc_perslab);
+		free_kpages(KSLAB_PAGE(ks));
+	}
+}
+
+////////////////////////////////////////////////////////////
+// interface
+
+struct kcache *
+kcache_create(const char *name, size_t size,
+	      int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kcache *kc;
+	size_t hdrsize;
+	unsigned n;
+
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	bzero(kc, sizeof(*kc));
+
+	kc->kc_name = name;
+	kc->kc_size = ROUNDUP(size, KCACHE_ALIGN);
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+
+	hdrsize = sizeof(struct kslab) + sizeof(uint16_t);
+	if (kc->kc_size + hdrsize > PAGE_SIZE / 2) {
+		/* Fewer than two would fit; give each its own pages. */
+		kc->kc_npages = DIVROUNDUP(kc->kc_size, PAGE_SIZE);
+		kc->kc_perslab = 1;
+		kc->kc_hdroff = 0;
+		kc->kc_batch = KCACHE_PAGEBATCH;
+	}
+	else {
+		n = (PAGE_SIZE - sizeof(struct kslab)) /
+			(kc->kc_size + sizeof(uint16_t));
+		kc->kc_npages = 0;
+		kc->kc_perslab = n;
+		kc->kc_hdroff = (PAGE_SIZE - sizeof(struct kslab) -
+				 n * sizeof(uint16_t)) & ~(vaddr_t)(KCACHE_ALIGN - 1);
+		KASSERT(n * kc->kc_size <= kc->kc_hdroff);
+		kc->kc_batch = KCACHE_BATCH;
+	}
+
+	spinlock_acquire(&kcache_list_lock);
+	kc->kc_nextcache = kcache_list;
+	kcache_list = kc;
+	spinlock_release(&kcache_list_lock);
+
+	return kc;
+}
+
+void *
+kcache_alloc(struct kcache *kc)
+{
+	struct kcache_cpu *kcc;
+	void *objs[KCACHE_BATCH];
+	void *obj;
+	unsigned n, i;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		/* Early in boot; no per-cpu fronts yet. */
+		return kcache_refill(kc, &obj, 1) ? obj : NULL;
+	}
+
+	spl = splhigh();
+	kcc = &kc->kc_cpus[curcpu->c_number];
+	if (kcc->kcc_count > 0) {
+		obj = kcc->kcc_objs[--kcc->kcc_count];
+		kcc->kcc_hits++;
+		splx(spl);
+		return obj;
+	}
+	kcc->kcc_misses++;
+	splx(spl);
+
+	/* Refilling can sleep, so we might come back on another cpu. */
+	n = kcache_refill(kc, objs, kc->kc_batch);
+	if (n == 0) {
+		return NULL;
+	}
+	obj = objs[--n];
+
+	spl = splhigh();
+	kcc = &kc->kc_cpus[curcpu->c_number];
+	for (i=0; i<n && kcc->kcc_count < 2 * kc->kc_batch; i++) {
+		kcc->kcc_objs[kcc->kcc_count++] = objs[i];
+	}
+	splx(spl);
+
+	if (i < n) {
+		kcache_release(kc, objs + i, n - i);
+	}
+	return obj;
+}
+
+void
+kcache_free(struct kcache *kc, void *obj)
+{
+	struct kcache_cpu *kcc;
+	void *objs[KCACHE_BATCH];
+	unsigned n, i;
+	int spl;
+
+	KASSERT(obj != NULL);
+
+	if (!CURCPU_EXISTS()) {
+		kcache_release(kc, &obj, 1);
+		return;
+	}
+
+	n = 0;
+	spl = splhigh();
+	kcc = &kc->kc_cpus[curcpu->c_number];
+	if (kcc->kcc_count == 2 * kc->kc_batch) {
+		/* Full; send the coldest batch back to the slabs. */
+		n = kc->kc_batch;
+		for (i=0; i<n; i++) {
+			objs[i] = kcc->kcc_objs[i];
+		}
+		for (i=n; i<kcc->kcc_count; i++) {
+			kcc->kcc_objs[i - n] = kcc->kcc_objs[i];
+		}
+		kcc->kcc_count -= n;
+	}
+	kcc->kcc_objs[kcc->kcc_count++] = obj;
+	splx(spl);
+
+	if (n > 0) {
+		kcache_release(kc, objs, n);
+	}
+}
+
+/*
+ * Print usage for every cache. The per-cpu counts are read without
+ * locking, so they're approximate.
+ */
+void
+kcache_printstats(void)
+{
+	struct kcache *kc;
+	unsigned i, cached, hits, misses, out, total, nslabs, grows, reaps;
+
+	kprintf("Object caches:\n");
+	kprintf("  %-16s %5s %6s %6s %6s %6s %5s %6s %6s\n",
+		"name", "size", "inuse", "cpu", "total", "slabs", "hit%",
+		"grows", "reaps");
+
+	spinlock_acquire(&kcache_list_lock);
+	for (kc = kcache_list; kc != NULL; kc = kc->kc_nextcache) {
+		cached = hits = misses = 0;
+		for (i=0; i<MAXCPUS; i++) {
+			cached += kc->kc_cpus[i].kcc_count;
+			hits += kc->kc_cpus[i].kcc_hits;
+			misses += kc->kc_cpus[i].kcc_misses;
+		}
+
+		spinlock_acquire(&kc->kc_lock);
+		out = kc->kc_out;
+		nslabs = kc->kc_nslabs;
+		grows = kc->kc_grows;
+		reaps = kc->kc_reaps;
+		spinlock_release(&kc->kc_lock);
+
+		total = nslabs * kc->kc_perslab;
+		kprintf("  %-16s %5lu %6u %6u %6u %6u %4u%% %6u %6u\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			out > cached ? out - cached : 0, cached, total,
+			nslabs, 100 * hits / (hits + misses > 0 ?
+					      hits + misses : 1),
+			grows, reaps);
+	}
+	spinlock_release(&kcache_list_lock);
+}
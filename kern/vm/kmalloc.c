@@ -29,8 +29,11 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <vm.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -160,16 +163,75 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole subpage allocator. Most kmalloc and
+ * kfree calls don't get this far; they're served from the per-cpu
+ * magazines below, which refill from and flush to here in batches.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
 ////////////////////////////////////////
 
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu has two magazines (small stacks of free blocks) for each
+ * size class, used with only interrupts off. When both are empty, or
+ * both full, one is traded with the depot, which keeps a few full
+ * magazines per size class under its own spinlock. Only when the
+ * depot can't help do we go to the subpage allocator, and then for a
+ * magazine's worth of blocks at once.
+ *
+ * kfree finds a block's size class from its page's tag in the core
+ * map (see kpage_settag), without searching.
+ *
+ * The magazines are left out with GUARDS or LABELS, since blocks
+ * sitting in them would bypass those checks.
+ */
+
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
+#define KMAG_ROUNDS	15	/* most blocks a magazine can hold */
+#define KDEPOT_MAGS	4	/* full magazines per size class in the depot */
+
+/* Magazine capacity per size class; fewer of the big blocks. */
+static const unsigned kmag_cap[NSIZES] = { 15, 15, 15, 15, 15, 8, 4, 2 };
+
+struct kmagazine {
+	unsigned km_count;
+	void *km_rounds[KMAG_ROUNDS];
+};
+
+struct kmag_class {
+	struct kmagazine *kc_loaded;	/* magazine in use */
+	struct kmagazine *kc_prev;	/* swapped in when kc_loaded runs out */
+	struct kmagazine kc_mags[2];
+
+	/* statistics */
+	unsigned kc_hits;		/* kmallocs served from the magazines */
+	unsigned kc_depot;		/* kmallocs that reloaded from the depot */
+	unsigned kc_misses;		/* kmallocs that went to the subpage allocator */
+	unsigned kc_frees;		/* kfrees into the magazines */
+	unsigned kc_flushes;		/* magazines flushed to the subpage allocator */
+};
+
+struct kmag_depot {
+	struct spinlock kd_lock;
+	unsigned kd_count;
+	struct kmagazine kd_full[KDEPOT_MAGS];
+};
+
+/* Indexed by c_number; only that cpu touches its entries. */
+static struct kmag_class kmag_cpus[MAXCPUS][NSIZES];
+
+static struct kmag_depot kmag_depots[NSIZES] = {
+	[0 ... NSIZES-1] = { .kd_lock = SPINLOCK_INITIALIZER },
+};
+
+////////////////////////////////////////
+
 /*
  * We can only allocate whole pages of pageref structure at a time.
  * This is a struct type for such a page.
@@ -794,6 +856,43 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+#ifdef MAGAZINES
+/*
+ * Print the magazine hit rates for each size class, summed over cpus.
+ * The per-cpu counters are read without locking.
+ */
+static
+void
+kmag_printstats(void)
+{
+	unsigned blktype, i, depot;
+	unsigned hits, reloads, misses, frees, flushes, total;
+
+	kprintf("Magazine layer:\n");
+	kprintf("  size    allocs  magazine  depot  subpage     frees"
+		" flushed  depot\n");
+	for (blktype=0; blktype<NSIZES; blktype++) {
+		hits = reloads = misses = frees = flushes = 0;
+		for (i=0; i<MAXCPUS; i++) {
+			hits += kmag_cpus[i][blktype].kc_hits;
+			reloads += kmag_cpus[i][blktype].kc_depot;
+			misses += kmag_cpus[i][blktype].kc_misses;
+			frees += kmag_cpus[i][blktype].kc_frees;
+			flushes += kmag_cpus[i][blktype].kc_flushes;
+		}
+		depot = kmag_depots[blktype].kd_count;
+		total = hits + reloads + misses;
+		if (total == 0) {
+			total = 1;
+		}
+		kprintf("  %4lu %9u %8u%% %5u%% %7u%% %9u %7u %6u\n",
+			(unsigned long) sizes[blktype], hits + reloads + misses,
+			100 * hits / total, 100 * reloads / total,
+			100 * misses / total, frees, flushes, depot);
+	}
+}
+#endif
+
 /*
  * Print the whole heap.
  */
@@ -812,6 +911,10 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	kmag_printstats();
+#endif
 }
 
 ////////////////////////////////////////
@@ -971,6 +1074,7 @@ subpage_kmalloc(size_t sz
 		return NULL;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
+	kpage_settag(prpage, blktype + 1);
 #ifdef CHECKBEEF
 	/* deadbeef the whole page, as it probably starts zeroed */
 	fill_deadbeef((void *)prpage, PAGE_SIZE);
@@ -981,6 +1085,7 @@ subpage_kmalloc(size_t sz
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
+		kpage_settag(prpage, 0);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
 		return NULL;
@@ -1144,6 +1249,7 @@ subpage_kfree(void *ptr)
 		freepageref(pr);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
+		kpage_settag(prpage, 0);
 		free_kpages(prpage);
 	}
 	else {
@@ -1159,6 +1265,235 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+#ifdef MAGAZINES
+
+/*
+ * Take up to N free blocks of type BLKTYPE into BLOCKS with one trip
+ * through kmalloc_spinlock. If no page has any, get one block from
+ * subpage_kmalloc, which makes a new page. Returns the number taken.
+ */
+static
+unsigned
+subpage_kmalloc_batch(unsigned blktype, void **blocks, unsigned n)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+	struct freelist *fl;
+	unsigned got = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
+
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+
+		prpage = PR_PAGEADDR(pr);
+		while (pr->nfree > 0 && got < n) {
+			KASSERT(pr->freelist_offset < PAGE_SIZE);
+			fl = (struct freelist *)(prpage + pr->freelist_offset);
+			blocks[got++] = fl;
+			fl = fl->next;
+			pr->nfree--;
+
+			if (fl != NULL) {
+				KASSERT(pr->nfree > 0);
+				KASSERT((vaddr_t)fl - prpage < PAGE_SIZE);
+				pr->freelist_offset = (vaddr_t)fl - prpage;
+			}
+			else {
+				KASSERT(pr->nfree == 0);
+				pr->freelist_offset = INVALID_OFFSET;
+			}
+		}
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+
+	if (got == 0) {
+		blocks[0] = subpage_kmalloc(sizes[blktype]);
+		if (blocks[0] != NULL) {
+			got = 1;
+		}
+	}
+	return got;
+}
+
+/*
+ * Get the current cpu's magazines for BLKTYPE. Call with interrupts
+ * off so we stay on this cpu.
+ */
+static
+struct kmag_class *
+kmag_getclass(unsigned blktype)
+{
+	struct kmag_class *kc;
+
+	kc = &kmag_cpus[curcpu->c_number][blktype];
+	if (kc->kc_loaded == NULL) {
+		kc->kc_loaded = &kc->kc_mags[0];
+		kc->kc_prev = &kc->kc_mags[1];
+	}
+	return kc;
+}
+
+static
+void
+kmag_swap(struct kmag_class *kc)
+{
+	struct kmagazine *m;
+
+	m = kc->kc_loaded;
+	kc->kc_loaded = kc->kc_prev;
+	kc->kc_prev = m;
+}
+
+/*
+ * Allocate a block of type BLKTYPE through the magazines.
+ */
+static
+void *
+kmag_alloc(unsigned blktype)
+{
+	struct kmag_class *kc;
+	struct kmag_depot *kd;
+	struct kmagazine *m;
+	void *blocks[KMAG_ROUNDS];
+	void *ret;
+	unsigned n, i;
+	int spl;
+
+	spl = splhigh();
+	kc = kmag_getclass(blktype);
+	if (kc->kc_loaded->km_count == 0 && kc->kc_prev->km_count > 0) {
+		kmag_swap(kc);
+	}
+	m = kc->kc_loaded;
+
+	if (m->km_count > 0) {
+		kc->kc_hits++;
+	}
+	else {
+		/* Both empty; reload from the depot if it has a full one. */
+		kd = &kmag_depots[blktype];
+		spinlock_acquire(&kd->kd_lock);
+		if (kd->kd_count > 0) {
+			kd->kd_count--;
+			*m = kd->kd_full[kd->kd_count];
+		}
+		spinlock_release(&kd->kd_lock);
+
+		if (m->km_count > 0) {
+			kc->kc_depot++;
+		}
+		else {
+			kc->kc_misses++;
+			splx(spl);
+
+			/*
+			 * Refill from the subpage allocator. This can
+			 * sleep, so we might be on another cpu after.
+			 */
+			n = subpage_kmalloc_batch(blktype, blocks,
+						  kmag_cap[blktype]);
+			if (n == 0) {
+				return NULL;
+			}
+			ret = blocks[--n];
+
+			spl = splhigh();
+			m = kmag_getclass(blktype)->kc_loaded;
+			for (i=0; i<n && m->km_count < kmag_cap[blktype]; i++) {
+				m->km_rounds[m->km_count++] = blocks[i];
+			}
+			splx(spl);
+
+			/* Anything that didn't fit goes back. */
+			for (; i<n; i++) {
+				subpage_kfree(blocks[i]);
+			}
+			return ret;
+		}
+	}
+
+	ret = m->km_rounds[--m->km_count];
+	splx(spl);
+	return ret;
+}
+
+/*
+ * Free a block of type BLKTYPE through the magazines.
+ */
+static
+void
+kmag_free(void *ptr, unsigned blktype)
+{
+	struct kmag_class *kc;
+	struct kmag_depot *kd;
+	struct kmagazine *m;
+	void *blocks[KMAG_ROUNDS];
+	unsigned cap, n, i;
+	int spl;
+
+	/* Check for proper positioning and alignment */
+	if (((vaddr_t)ptr % PAGE_SIZE) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	cap = kmag_cap[blktype];
+	n = 0;
+
+	spl = splhigh();
+	kc = kmag_getclass(blktype);
+	if (kc->kc_loaded->km_count == cap && kc->kc_prev->km_count < cap) {
+		kmag_swap(kc);
+	}
+	m = kc->kc_loaded;
+
+	if (m->km_count == cap) {
+		/* Both full; hand one to the depot if it has room. */
+		kd = &kmag_depots[blktype];
+		spinlock_acquire(&kd->kd_lock);
+		if (kd->kd_count < KDEPOT_MAGS) {
+			kd->kd_full[kd->kd_count] = *m;
+			kd->kd_count++;
+			m->km_count = 0;
+		}
+		spinlock_release(&kd->kd_lock);
+
+		if (m->km_count == cap) {
+			/* Depot's full too; flush it below. */
+			for (n=0; n<cap; n++) {
+				blocks[n] = m->km_rounds[n];
+			}
+			m->km_count = 0;
+			kc->kc_flushes++;
+		}
+	}
+
+	m->km_rounds[m->km_count++] = ptr;
+	kc->kc_frees++;
+	splx(spl);
+
+	for (i=0; i<n; i++) {
+		subpage_kfree(blocks[i]);
+	}
+}
+
+#endif /* MAGAZINES */
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1198,6 +1533,12 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
+#ifdef MAGAZINES
+	if (CURCPU_EXISTS()) {
+		return kmag_alloc(blocktype(sz));
+	}
+#endif
+
 #ifdef LABELS
 	return subpage_kmalloc(sz, label);
 #else
@@ -1214,9 +1555,21 @@ kfree(void *ptr)
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
+#ifdef MAGAZINES
+	unsigned tag;
+#endif
+
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+#ifdef MAGAZINES
+	tag = kpage_tag((vaddr_t)ptr);
+	if (tag != 0 && CURCPU_EXISTS()) {
+		kmag_free(ptr, tag - 1);
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
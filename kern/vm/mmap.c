@@ -0,0 +1,220 @@
+/*
+ * File mappings made with mmap().
+ *
+ * A region only records which part of which file is mapped where; nothing is
+ * mapped in until it's touched. tlb_miss() calls mmap_fault() for untouched
+ * pages in a region, which gets the file page from the page cache (through
+ * VOP_MMAP) and maps that very frame, read only. Shared mappings then write to
+ * it directly (perms_fault() marks it dirty), and private mappings copy it on
+ * their first write, like copy on write after fork. Dirty pages of shared
+ * mappings are written back through VOP_WRITE, straight from the page, when
+ * they're unmapped (or the process exits), so they go through the file
+ * system's usual write path.
+ *
+ * Mappings are placed between the top of the space the heap can grow into and
+ * the bottom of the stack, from the top down.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <vnode.h>
+#include <vm.h>
+#include <addrspace.h>
+
+#define MMAP_TOP USERSTACKBOTTOM
+
+
+// Find the region containing 'vaddr', or NULL.
+struct mmap_region *mmap_find(struct addrspace *as, vaddr_t vaddr) {
+	for(struct mmap_region *mr = as->mmaps; mr != NULL && mr->mr_start <= vaddr; mr = mr->mr_next) {
+		if(vaddr < mr->mr_end)
+			return mr;
+	}
+	return NULL;
+}
+
+
+// *** Assumes no spinlocks are held
+// Map 'len' bytes of 'v' from 'offset' (page-aligned) in the highest gap that
+// fits, and return its address in 'ret'.
+int mmap_add(struct addrspace *as, struct vnode *v, size_t len, off_t offset,
+		int prot, bool shared, vaddr_t *ret) {
+
+	if(len == 0 || len > MMAP_TOP)
+		return len == 0 ? EINVAL : ENOMEM;
+
+	vaddr_t size = ROUND_UP(len, PAGE_SIZE) * PAGE_SIZE;
+	vaddr_t gap = as->heap_bottom + USERHEAPSIZE;	// bottom of the current gap
+	struct mmap_region **lp = &as->mmaps;
+	struct mmap_region **link = NULL;				// where the new region goes
+	vaddr_t start = 0;
+
+	while(true) {	// the last gap that fits is the highest
+		vaddr_t gap_end = *lp == NULL ? MMAP_TOP : (*lp)->mr_start;
+		if(gap_end >= gap && gap_end - gap >= size) {
+			start = gap_end - size;
+			link = lp;
+		}
+		if(*lp == NULL)
+			break;
+		gap = (*lp)->mr_end;
+		lp = &(*lp)->mr_next;
+	}
+
+	if(link == NULL)
+		return ENOMEM;
+
+	struct mmap_region *mr = kmalloc(sizeof(struct mmap_region));
+	if(mr == NULL)
+		return ENOMEM;
+
+	VOP_INCREF(v);
+	mr->mr_start = start;
+	mr->mr_end = start + size;
+	mr->mr_vnode = v;
+	mr->mr_offset = offset;
+	mr->mr_prot = prot;
+	mr->mr_shared = shared;
+	mr->mr_next = *link;
+	*link = mr;
+
+	*ret = start;
+	return 0;
+}
+
+
+// *** Assumes no spinlocks are held
+// Write dirty pages of 'mr' between 'start' and 'end' back to the file.
+// Returns the first error, but tries every page.
+static int mmap_writeback(struct addrspace *as, struct mmap_region *mr, vaddr_t start, vaddr_t end) {
+	if(!mr->mr_shared || !(mr->mr_prot & PROT_WRITE))
+		return 0;
+
+	int result = 0;
+
+	for(vaddr_t va = start; va < end; va += PAGE_SIZE) {
+		int err = fpage_sync(as, va);
+		if(err != 0 && result == 0)
+			result = err;
+	}
+
+	return result;
+}
+
+
+// *** Assumes no spinlocks are held
+// Unmap everything between 'vaddr' (page-aligned) and 'vaddr' + 'len'. Regions
+// partly in the range are trimmed, or split in two if the range is in the middle.
+int mmap_remove(struct addrspace *as, vaddr_t vaddr, size_t len) {
+	if(len == 0 || vaddr >= MMAP_TOP || len > MMAP_TOP - vaddr)
+		return EINVAL;
+
+	vaddr_t end = vaddr + ROUND_UP(len, PAGE_SIZE) * PAGE_SIZE;
+	struct mmap_region **lp = &as->mmaps;
+	int result = 0;
+
+	while(*lp != NULL && (*lp)->mr_start < end) {
+		struct mmap_region *mr = *lp;
+
+		if(mr->mr_end <= vaddr) {
+			lp = &mr->mr_next;
+			continue;
+		}
+
+		vaddr_t lo = vaddr > mr->mr_start ? vaddr : mr->mr_start;
+		vaddr_t hi = end < mr->mr_end ? end : mr->mr_end;
+
+		if(lo > mr->mr_start && hi < mr->mr_end) {	// a hole in the middle
+			struct mmap_region *tail = kmalloc(sizeof(struct mmap_region));
+			if(tail == NULL)
+				return ENOMEM;
+
+			VOP_INCREF(mr->mr_vnode);
+			*tail = *mr;
+			tail->mr_start = hi;
+			tail->mr_offset = mr->mr_offset + (hi - mr->mr_start);
+			mr->mr_end = hi;
+			mr->mr_next = tail;
+		}
+
+		int err = mmap_writeback(as, mr, lo, hi);
+		if(err != 0 && result == 0)
+			result = err;
+		free_upages(as, lo, (hi - lo) / PAGE_SIZE);
+
+		if(lo == mr->mr_start && hi == mr->mr_end) {
+			*lp = mr->mr_next;
+			VOP_DECREF(mr->mr_vnode);
+			kfree(mr);
+			continue;
+		}
+
+		if(lo == mr->mr_start) {
+			mr->mr_offset += hi - mr->mr_start;
+			mr->mr_start = hi;
+		}
+		else {
+			mr->mr_end = lo;
+		}
+		lp = &mr->mr_next;
+	}
+
+	return result;
+}
+
+
+// *** Assumes no spinlocks are held
+// Map in the file page for 'vaddr' in 'mr'.
+int mmap_fault(struct addrspace *as, struct mmap_region *mr, vaddr_t vaddr) {
+	unsigned long cmi;
+
+	if(mr->mr_prot == PROT_NONE)
+		return EFAULT;
+
+	vaddr &= PAGE_FRAME;
+
+	int err = VOP_MMAP(mr->mr_vnode, mr->mr_offset + (vaddr - mr->mr_start), &cmi);
+	if(err != 0)
+		return err;
+
+	map_fpage(as, vaddr, cmi, mr->mr_prot, mr->mr_vnode);
+	return 0;
+}
+
+
+// *** Assumes no spinlocks are held
+// Give 'new' the regions of 'old'. The pages themselves come with pth_copy().
+int mmap_copy(struct addrspace *old, struct addrspace *new) {
+	struct mmap_region **lp = &new->mmaps;
+
+	for(struct mmap_region *mr = old->mmaps; mr != NULL; mr = mr->mr_next) {
+		struct mmap_region *copy = kmalloc(sizeof(struct mmap_region));
+		if(copy == NULL)
+			return ENOMEM;	// as_destroy() cleans up what was copied
+
+		VOP_INCREF(mr->mr_vnode);
+		*copy = *mr;
+		copy->mr_next = NULL;
+		*lp = copy;
+		lp = &copy->mr_next;
+	}
+	return 0;
+}
+
+
+// *** Assumes no spinlocks are held
+// Unmap every region, writing back what's dirty.
+void mmap_destroy(struct addrspace *as) {
+	while(as->mmaps != NULL) {
+		struct mmap_region *mr = as->mmaps;
+
+		mmap_writeback(as, mr, mr->mr_start, mr->mr_end);	// nobody to tell if this fails
+		free_upages(as, mr->mr_start, (mr->mr_end - mr->mr_start) / PAGE_SIZE);
+
+		as->mmaps = mr->mr_next;
+		VOP_DECREF(mr->mr_vnode);
+		kfree(mr);
+	}
+}
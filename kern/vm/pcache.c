@@ -0,0 +1,446 @@
+/*
+ * Page cache.
+ *
+ * Pages of file data live in core map frames just like user pages, so file
+ * data and anonymous memory draw on the same frames and the clock in
+ * choose_page_to_swap() evicts whichever has gone unused. A file page is
+ * keyed by (fs, inode number, page index) rather than by vnode, so it
+ * outlives the vnode and a file that's opened again is still cached.
+ *
+ * The file system fills fresh pages itself (pcache_get() hands back a busy
+ * page and says whether it needs filling) and writes through them: file
+ * writes still go through the buffer cache and the journal, and
+ * pcache_write() copies the new data into the page if there is one. So file
+ * pages are never dirty, and evicting one is just forgetting it.
+ *
+ * The exception is pages mapped into user address spaces with mmap(). Their
+ * refcount is the number of PTEs mapping them; evicting one takes it away
+ * from every mapper first (see swap_out()), and they fault it back in through
+ * the page cache. Writes through a shared mapping dirty the page, which keeps
+ * it from being evicted until it's written back through the file system
+ * straight from the frame, by fpage_write() in mipsvm.c: when a shared
+ * mapping is unmapped (see mmap.c), or earlier to make room. The page is
+ * marked clean and write-protected in every mapper's TLB before the write, so
+ * anything written during it dirties the page again. pcache_write() knows the
+ * data came from the page itself and leaves it alone. A mapped page that the
+ * file is truncated past is taken out of the hash table but left to its
+ * mappers, and freed by the last of them.
+ *
+ * Read-ahead fills pages with pcache_get_ahead(), which marks them until
+ * someone asks for them, so the stats can say how much of it was used.
+ *
+ * Everything here is protected by the core map spinlock.
+ */
+
+#include <vm.h>
+#include <wchan.h>
+
+#define PCACHE_ORPHAN (-2)		// pcache_entry.next of a page that's been unhashed
+
+static long *pcache_hash;				// bucket heads (core map index or -1)
+static unsigned long pcache_nbuckets;	// a power of two
+
+// stat tracking, protected by core_map_splk
+static unsigned long npcache;			// number of file pages
+static unsigned long pcache_hits, pcache_misses, pcache_evictions;
+static unsigned long pcache_ra_pages, pcache_ra_hits, pcache_ra_waste;
+
+
+void pcache_bootstrap(void) {
+	pcache_nbuckets = 1;
+	while(pcache_nbuckets < ncmes / 4)
+		pcache_nbuckets *= 2;
+
+	pcache_hash = kmalloc(pcache_nbuckets * sizeof(long));
+	if(pcache_hash == NULL) {
+		panic("kmalloc of pcache_hash failed\n");
+	}
+	for(unsigned long i = 0; i < pcache_nbuckets; i++)
+		pcache_hash[i] = -1;
+
+	pcache_wchan = wchan_create("pcache_wchan");
+	if(pcache_wchan == NULL) {
+		panic("wchan_create of pcache_wchan failed\n");
+	}
+
+	npcache = 0;
+	pcache_hits = 0;
+	pcache_misses = 0;
+	pcache_evictions = 0;
+	pcache_ra_pages = 0;
+	pcache_ra_hits = 0;
+	pcache_ra_waste = 0;
+}
+
+
+static unsigned long pcache_bucket(struct fs *fs, uint32_t ino, uint32_t pgno) {
+	unsigned long h = ((vaddr_t) fs >> 4) ^ (ino * 2654435761U) ^ pgno;
+	return h & (pcache_nbuckets - 1);
+}
+
+
+// *** Assumes the core map spinlock is held
+// Returns the core map index of a cached page, or -1
+static long pcache_lookup(struct fs *fs, uint32_t ino, uint32_t pgno) {
+	long cmi = pcache_hash[pcache_bucket(fs, ino, pgno)];
+
+	while(cmi != -1) {
+		struct pcache_entry *pe = &pcache_entries[cmi];
+		if(pe->fs == fs && pe->ino == ino && pe->pgno == pgno)
+			return cmi;
+		cmi = pe->next;
+	}
+	return -1;
+}
+
+
+// *** Assumes the core map spinlock is held
+// Take the file page at 'cmi' out of the hash table so lookups can't find it.
+static void pcache_unhash(unsigned long cmi) {
+	struct pcache_entry *pe = &pcache_entries[cmi];
+	long *lp = &pcache_hash[pcache_bucket(pe->fs, pe->ino, pe->pgno)];
+
+	KASSERT(pe->next != PCACHE_ORPHAN);
+
+	while(*lp != (long) cmi) {
+		KASSERT(*lp != -1);
+		lp = &pcache_entries[*lp].next;
+	}
+	*lp = pe->next;
+	pe->next = PCACHE_ORPHAN;
+
+	npcache--;
+}
+
+
+// *** Assumes the core map spinlock is held
+// *** Assumes the page is busy (so it's ours) or not busy at all
+// Forget the file page at 'cmi', leaving its frame claimed but empty.
+static void pcache_forget(unsigned long cmi) {
+	struct pcache_entry *pe = &pcache_entries[cmi];
+
+	KASSERT(CMI_IS_FILE(cmi));
+	KASSERT(core_map[cmi].as == NULL);
+	KASSERT(core_map[cmi].refcount == 0);
+	KASSERT(pe->pins == 0);
+
+	if(pe->next != PCACHE_ORPHAN)
+		pcache_unhash(cmi);
+	if(pe->ra)
+		pcache_ra_waste++;		// read ahead for nothing
+
+	pe->fs = NULL;
+	pe->ino = 0;
+	pe->pgno = 0;
+	pe->next = -1;
+	pe->ra = false;
+
+	core_map[cmi].va = 0;
+	core_map[cmi].refcount = 0;
+	core_map[cmi].md.all = 0;
+	tlb_states[cmi].all = 0;
+}
+
+
+// *** Assumes the core map spinlock is held
+// *** Assumes the page is busy (so it's ours) or not busy at all
+// Evict the file page at 'cmi' for its frame. Like swap_out(), it leaves the
+// frame empty and claimed by the caller.
+void pcache_steal(unsigned long cmi) {
+	pcache_forget(cmi);
+	pcache_evictions++;
+}
+
+
+// *** Assumes the core map spinlock is held
+// *** Assumes the frame at 'cmi' is claimed and busy
+// Make the empty frame at 'cmi' page 'pgno' of file 'ino' on 'fs', busy.
+static void pcache_insert(unsigned long cmi, struct fs *fs, uint32_t ino, uint32_t pgno) {
+	struct pcache_entry *pe = &pcache_entries[cmi];
+	unsigned long b = pcache_bucket(fs, ino, pgno);
+
+	KASSERT(core_map[cmi].va == 0);
+	KASSERT(core_map[cmi].as == NULL);
+
+	core_map[cmi].va = PADDR_TO_KVADDR(CMI_TO_PADDR(cmi));
+	core_map[cmi].refcount = 0;
+	core_map[cmi].md.all = 0;
+	core_map[cmi].md.busy = 1;
+	tlb_states[cmi].all = 0;
+
+	pe->fs = fs;
+	pe->ino = ino;
+	pe->pgno = pgno;
+	pe->next = pcache_hash[b];
+	pe->ra = false;
+	pcache_hash[b] = cmi;
+
+	npcache++;
+}
+
+
+// *** Assumes no spinlocks are held
+// Find page 'pgno' of file 'ino' on 'fs', adding an empty page if it isn't
+// cached. Returns the page's core map index with the page busy; '*fresh' is
+// set if the caller has to fill it. Let go with pcache_release(), or with
+// pcache_discard() if filling it failed.
+unsigned long pcache_get(struct fs *fs, uint32_t ino, uint32_t pgno, bool *fresh) {
+	long cmi, new = -1;
+
+	spinlock_acquire(&core_map_splk);
+
+	while(true) {
+		cmi = pcache_lookup(fs, ino, pgno);
+		if(cmi != -1 && core_map[cmi].md.busy) {
+			wchan_sleep(pcache_wchan, &core_map_splk);
+			continue;
+		}
+		if(cmi != -1 || new != -1)
+			break;
+
+		new = find_cmi(NULL);			// may let go of the spinlock to evict something,
+		core_map[new].md.busy = 1;		// so claim the frame and look again
+	}
+
+	if(cmi != -1) {
+		if(new != -1) {				// someone else read it in while we were evicting
+			core_map[new].md.busy = 0;
+			frame_free(new, 1);
+		}
+		core_map[cmi].md.busy = 1;
+		tlb_states[cmi].recent = 1;	// a second chance from the clock
+		pcache_hits++;
+		if(pcache_entries[cmi].ra) {
+			pcache_entries[cmi].ra = false;
+			pcache_ra_hits++;
+		}
+		*fresh = false;
+	}
+	else {
+		cmi = new;
+		pcache_insert(cmi, fs, ino, pgno);
+		pcache_misses++;
+		*fresh = true;
+	}
+
+	spinlock_release(&core_map_splk);
+	return cmi;
+}
+
+
+// *** Assumes no spinlocks are held
+// pcache_get() for read-ahead: returns -1 right away if page 'pgno' of file
+// 'ino' on 'fs' is cached (busy or not), and otherwise adds an empty page,
+// busy, for the caller to fill. Until someone gets the page with pcache_get(),
+// it counts as read ahead and not used yet.
+long pcache_get_ahead(struct fs *fs, uint32_t ino, uint32_t pgno) {
+	long cmi, new = -1;
+
+	spinlock_acquire(&core_map_splk);
+
+	while(true) {
+		cmi = pcache_lookup(fs, ino, pgno);
+		if(cmi != -1 || new != -1)
+			break;
+
+		new = find_cmi(NULL);			// may let go of the spinlock, as in pcache_get()
+		core_map[new].md.busy = 1;
+	}
+
+	if(cmi != -1) {
+		if(new != -1) {
+			core_map[new].md.busy = 0;
+			frame_free(new, 1);
+		}
+		cmi = -1;
+	}
+	else {
+		cmi = new;
+		pcache_insert(cmi, fs, ino, pgno);
+		pcache_entries[cmi].ra = true;
+		pcache_ra_pages++;
+	}
+
+	spinlock_release(&core_map_splk);
+	return cmi;
+}
+
+
+// *** Assumes no spinlocks are held
+void pcache_release(unsigned long cmi) {
+	spinlock_acquire(&core_map_splk);
+
+	KASSERT(CMI_IS_FILE(cmi));
+	KASSERT(core_map[cmi].md.busy == 1);
+
+	core_map[cmi].md.busy = 0;
+	if(pcache_entries[cmi].next == PCACHE_ORPHAN && core_map[cmi].refcount == 0) {
+		pcache_forget(cmi);		// truncated away while we had it, and unmapped
+		frame_free(cmi, 1);
+	}
+	wchan_wakeall(pcache_wchan, &core_map_splk);
+
+	spinlock_release(&core_map_splk);
+}
+
+
+// *** Assumes no spinlocks are held
+// Let go of a page from pcache_get() that couldn't be filled, and drop it.
+void pcache_discard(unsigned long cmi) {
+	spinlock_acquire(&core_map_splk);
+
+	KASSERT(core_map[cmi].md.busy == 1);
+
+	pcache_forget(cmi);
+	frame_free(cmi, 1);
+	wchan_wakeall(pcache_wchan, &core_map_splk);
+
+	spinlock_release(&core_map_splk);
+}
+
+
+// *** Assumes no spinlocks are held
+// Copy 'len' bytes of newly written file data at 'pos' into the cached page,
+// if there is one. The data can't cross a page boundary. 'src' is where the
+// writer got the data from if it's kernel memory, or NULL: if that's the page
+// itself (a mapped page being written back), it's already up to date, and
+// copying 'data' over it could undo writes made through a mapping since.
+void pcache_write(struct fs *fs, uint32_t ino, off_t pos, const void *data, size_t len, const void *src) {
+	uint32_t pgno = pos / PAGE_SIZE;
+	size_t pgoff = pos % PAGE_SIZE;
+	long cmi;
+
+	KASSERT(pgoff + len <= PAGE_SIZE);
+
+	spinlock_acquire(&core_map_splk);
+
+	while(true) {
+		cmi = pcache_lookup(fs, ino, pgno);
+		if(cmi != -1 && src != NULL && (vaddr_t) src - core_map[cmi].va < PAGE_SIZE)
+			cmi = -1;
+		if(cmi == -1 || !core_map[cmi].md.busy)
+			break;
+		wchan_sleep(pcache_wchan, &core_map_splk);
+	}
+
+	if(cmi != -1) {
+		memcpy((char *) PADDR_TO_KVADDR(CMI_TO_PADDR(cmi)) + pgoff, data, len);
+		tlb_states[cmi].recent = 1;
+	}
+
+	spinlock_release(&core_map_splk);
+}
+
+
+// *** Assumes no spinlocks are held
+// Drop cached pages of 'fs' from page 'first' on, of file 'ino' if 'anyino'
+// is false or of every file if it's true.
+static void pcache_drop(struct fs *fs, bool anyino, uint32_t ino, uint32_t first) {
+	spinlock_acquire(&core_map_splk);
+
+	for(unsigned long i = 0; i < ncmes && npcache > 0; i++) {
+		struct pcache_entry *pe = &pcache_entries[i];
+
+		while(pe->fs == fs && (anyino || pe->ino == ino) && pe->pgno >= first
+				&& pe->next != PCACHE_ORPHAN) {
+			if(core_map[i].md.busy) {	// recheck whatever's there after waiting
+				wchan_sleep(pcache_wchan, &core_map_splk);
+				continue;
+			}
+			if(core_map[i].refcount > 0) {	// still mapped, so leave it to its mappers
+				pcache_unhash(i);
+				break;
+			}
+			pcache_forget(i);
+			frame_free(i, 1);
+		}
+	}
+
+	spinlock_release(&core_map_splk);
+}
+
+
+// *** Assumes no spinlocks are held
+// The file is being cut down to 'len' bytes (or removed, with 0): drop its
+// pages from the one holding byte 'len' on, so nothing cached can outlive
+// the blocks it came from.
+void pcache_truncate(struct fs *fs, uint32_t ino, off_t len) {
+	pcache_drop(fs, false, ino, len / PAGE_SIZE);
+}
+
+
+// *** Assumes no spinlocks are held
+// Drop every cached page of 'fs' (when it's unmounted).
+void pcache_purge(struct fs *fs) {
+	pcache_drop(fs, true, 0, 0);
+}
+
+
+// *** Assumes the core map spinlock is held
+// *** Assumes the page is busy from pcache_get()
+// A PTE now maps the file page at 'cmi'; count it and let go of the page.
+void pcache_map(unsigned long cmi) {
+	KASSERT(CMI_IS_FILE(cmi));
+	KASSERT(core_map[cmi].md.busy == 1);
+
+	core_map[cmi].refcount++;
+	core_map[cmi].md.busy = 0;
+	wchan_wakeall(pcache_wchan, &core_map_splk);
+}
+
+
+// *** Assumes the core map spinlock is held
+// A PTE mapping the file page at 'cmi' is going away (or a write-back that
+// held the page like one is done). Once nothing maps the page it's clean (the
+// shared mappings wrote it back) and can be evicted, or freed if the file was
+// truncated past it.
+void pcache_unmap(unsigned long cmi) {
+	KASSERT(CMI_IS_FILE(cmi));
+	KASSERT(core_map[cmi].refcount > 0);
+
+	core_map[cmi].refcount--;
+	if(core_map[cmi].refcount > 0)
+		return;
+
+	KASSERT(cow_sharers[cmi] == NULL);
+
+	if(core_map[cmi].md.dirty) {
+		core_map[cmi].md.dirty = 0;
+		nfdirty--;
+	}
+	tlb_states[cmi].tlb = 0;
+
+	if(pcache_entries[cmi].next == PCACHE_ORPHAN && !core_map[cmi].md.busy) {
+		pcache_forget(cmi);
+		frame_free(cmi, 1);
+	}
+}
+
+
+// *** Assumes the core map spinlock is held
+// Whether the mapped file page at 'cmi' has to be written back: it's been
+// written through a mapping and the file hasn't been truncated past it.
+bool pcache_needs_wback(unsigned long cmi) {
+	KASSERT(CMI_IS_MAPPED_FILE(cmi));
+
+	return core_map[cmi].md.dirty && pcache_entries[cmi].next != PCACHE_ORPHAN;
+}
+
+
+void pcache_printstats(void) {
+	unsigned long pages, hits, misses, evictions, ra_pages, ra_hits, ra_waste;
+
+	spinlock_acquire(&core_map_splk);
+	pages = npcache;
+	hits = pcache_hits;
+	misses = pcache_misses;
+	evictions = pcache_evictions;
+	ra_pages = pcache_ra_pages;
+	ra_hits = pcache_ra_hits;
+	ra_waste = pcache_ra_waste;
+	spinlock_release(&core_map_splk);
+
+	kprintf("Page Cache: %lu pages\n", pages);
+	kprintf("Page Cache Hits: %lu\nPage Cache Misses: %lu\nPage Cache Evictions: %lu\n", hits, misses, evictions);
+	kprintf("Page Cache Read-ahead: %lu pages (%lu hits, %lu wasted)\n\n", ra_pages, ra_hits, ra_waste);
+}
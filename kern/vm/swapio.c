@@ -0,0 +1,233 @@
+/*
+ * Swap I/O queue.
+ *
+ * Page-ins and page-outs are queued as swap_reqs and carried out by a few
+ * worker threads, so faults on different pages don't line up behind one
+ * disk operation. A worker takes a request plus any queued requests in the
+ * same direction for adjacent swap indices and moves them with a single
+ * VOP_READ/VOP_WRITE. Completion is handled by swap_io_done() in the
+ * machine dependent code, which updates the CME/PTE and wakes addr_wchan.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <wchan.h>
+#include <current.h>
+#include <thread.h>
+#include <vnode.h>
+#include <uio.h>
+
+static struct spinlock swapq_splk;
+static struct swap_req *swapq_head;		// FIFO of queued requests, protected by swapq_splk
+static struct swap_req *swapq_tail;
+static struct wchan *swapq_wchan;		// workers wait here for requests
+static struct wchan *swap_batch_wchan;	// for waiting on a swap_batch
+
+// stat tracking, protected by swapq_splk
+static unsigned long swap_reads, swap_writes;			// pages
+static unsigned long swap_read_ios, swap_write_ios;		// VOP calls
+
+
+// *** Assumes the queue spinlock is held
+static void swapq_remove(struct swap_req *req, struct swap_req *prev) {
+	if(prev == NULL)
+		swapq_head = req->next;
+	else
+		prev->next = req->next;
+	if(swapq_tail == req)
+		swapq_tail = prev;
+	req->next = NULL;
+}
+
+// *** Assumes the queue spinlock is held
+// Takes a request off the queue (page-ins first, since someone is faulting on them)
+// along with queued requests in the same direction for adjacent swap indices.
+// 'cluster' is filled in order of swap index. Returns the number of requests taken.
+static unsigned swapq_take_cluster(struct swap_req **cluster) {
+	struct swap_req *req, *prev, *seed = NULL, *seed_prev = NULL;
+	unsigned n, i;
+
+	for(prev = NULL, req = swapq_head; req != NULL; prev = req, req = req->next) {
+		if(!req->write) {
+			seed = req;
+			seed_prev = prev;
+			break;
+		}
+	}
+	if(seed == NULL) {
+		seed = swapq_head;
+		seed_prev = NULL;
+	}
+
+	swapq_remove(seed, seed_prev);
+	cluster[0] = seed;
+	n = 1;
+
+	bool grew = true;
+	while(grew && n < SWAP_CLUSTER) {
+		grew = false;
+		for(prev = NULL, req = swapq_head; req != NULL; prev = req, req = req->next) {
+			if(req->write != seed->write)
+				continue;
+
+			if(req->swapi + 1 == cluster[0]->swapi) {
+				swapq_remove(req, prev);
+				for(i = n; i > 0; i--)
+					cluster[i] = cluster[i - 1];
+				cluster[0] = req;
+			}
+			else if(req->swapi == cluster[n - 1]->swapi + 1) {
+				swapq_remove(req, prev);
+				cluster[n] = req;
+			}
+			else
+				continue;
+
+			n++;
+			grew = true;
+			break;
+		}
+	}
+
+	return n;
+}
+
+
+static void swap_worker(void *a, unsigned long b) {
+	(void) a;
+	(void) b;
+
+	struct swap_req *cluster[SWAP_CLUSTER];
+	struct swap_batch *batches[SWAP_CLUSTER];
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio uio;
+	unsigned n, i;
+	int err;
+
+	// paging goes ahead of other disk traffic
+	curthread->t_ioclass = IOCLASS_SWAP;
+
+	while(true) {
+		spinlock_acquire(&swapq_splk);
+		while(swapq_head == NULL)
+			wchan_sleep(swapq_wchan, &swapq_splk);
+		n = swapq_take_cluster(cluster);
+		spinlock_release(&swapq_splk);
+
+		for(i = 0; i < n; i++) {
+			iov[i].iov_kbase = (void *) PADDR_TO_KVADDR(CMI_TO_PADDR(cluster[i]->cmi));
+			iov[i].iov_len = PAGE_SIZE;
+		}
+		uio.uio_iov = iov;
+		uio.uio_iovcnt = n;
+		uio.uio_offset = (off_t) cluster[0]->swapi * PAGE_SIZE;
+		uio.uio_resid = n * PAGE_SIZE;
+		uio.uio_segflg = UIO_SYSSPACE;
+		uio.uio_rw = cluster[0]->write ? UIO_WRITE : UIO_READ;
+		uio.uio_space = NULL;
+
+		if(cluster[0]->write) {
+			err = VOP_WRITE(swap_vnode, &uio);
+			if(err != 0)
+				panic("Write to swap failed\n");
+		}
+		else {
+			err = VOP_READ(swap_vnode, &uio);
+			if(err != 0)
+				panic("Read from swap failed\n");
+		}
+
+		for(i = 0; i < n; i++) {
+			batches[i] = cluster[i]->batch;	// synchronous requests are gone after completion
+			swap_io_done(cluster[i]);
+		}
+
+		spinlock_acquire(&swapq_splk);
+		for(i = 0; i < n; i++) {
+			if(batches[i] != NULL && --batches[i]->pending == 0)
+				wchan_wakeall(swap_batch_wchan, &swapq_splk);
+		}
+		if(uio.uio_rw == UIO_WRITE) {
+			swap_writes += n;
+			swap_write_ios++;
+		}
+		else {
+			swap_reads += n;
+			swap_read_ios++;
+		}
+		spinlock_release(&swapq_splk);
+	}
+}
+
+
+void swap_io_bootstrap(void) {
+	spinlock_init(&swapq_splk);
+	swapq_head = NULL;
+	swapq_tail = NULL;
+
+	swapq_wchan = wchan_create("swapq_wchan");
+	if(swapq_wchan == NULL) {
+		panic("wchan_create of swapq_wchan failed\n");
+	}
+
+	swap_batch_wchan = wchan_create("swap_batch_wchan");
+	if(swap_batch_wchan == NULL) {
+		panic("wchan_create of swap_batch_wchan failed\n");
+	}
+
+	for(int i = 0; i < SWAP_WORKERS; i++) {
+		int result = thread_fork("swap worker", NULL, swap_worker, NULL, 0);
+		if(result) {
+			panic("swap worker thread_fork failed: %s\n", strerror(result));
+		}
+	}
+}
+
+
+// *** May be called with the address space and core map spinlocks held
+// Queue 'n' requests. Requests with a batch are counted in it;
+// otherwise the submitter waits for 'done' on the address space's wchan.
+void swap_submit(struct swap_req *reqs, unsigned n) {
+	unsigned i;
+
+	spinlock_acquire(&swapq_splk);
+	for(i = 0; i < n; i++) {
+		reqs[i].done = false;
+		reqs[i].next = NULL;
+		if(reqs[i].batch != NULL)
+			reqs[i].batch->pending++;
+
+		if(swapq_tail == NULL)
+			swapq_head = &reqs[i];
+		else
+			swapq_tail->next = &reqs[i];
+		swapq_tail = &reqs[i];
+	}
+	wchan_wakeall(swapq_wchan, &swapq_splk);
+	spinlock_release(&swapq_splk);
+}
+
+
+// *** Assumes no spinlocks are held
+void swap_batch_wait(struct swap_batch *batch) {
+	spinlock_acquire(&swapq_splk);
+	while(batch->pending > 0)
+		wchan_sleep(swap_batch_wchan, &swapq_splk);
+	spinlock_release(&swapq_splk);
+}
+
+
+void swap_io_printstats(void) {
+	unsigned long r, w, rios, wios;
+
+	spinlock_acquire(&swapq_splk);
+	r = swap_reads;
+	w = swap_writes;
+	rios = swap_read_ios;
+	wios = swap_write_ios;
+	spinlock_release(&swapq_splk);
+
+	kprintf("Swap Reads: %lu pages in %lu transfers\n", r, rios);
+	kprintf("Swap Writes: %lu pages in %lu transfers\n\n", w, wios);
+}
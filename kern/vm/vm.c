@@ -7,6 +7,16 @@
 #include <wchan.h>
 #include <bitmap.h>
 
+static long free_lists[BUDDY_ORDERS];	// first free block of each order, or -1
+
+// fragmentation stats, protected by core_map_splk
+static unsigned long buddy_splits;		// blocks split to satisfy a smaller request
+static unsigned long buddy_merges;		// buddies coalesced when freeing
+static unsigned long kpages_scans;		// alloc_kpages calls the free lists couldn't satisfy
+static unsigned long kpages_evicted;	// user pages evicted by those calls
+
+#define FREE_BLOCK(cmi) ((struct free_block *) ((vaddr_t) core_map + (cmi) * PAGE_SIZE))
+
 
 // It's relevant to note that our core map starts at the core map's page;
 // the kernel's code is not referenced in the array. This should reduce
@@ -18,9 +28,17 @@ void vm_bootstrap(void) {
 	unsigned long i;
 
 	ncmes = (ramsize - start) / PAGE_SIZE;
-	unsigned long npages = ROUND_UP(ncmes * sizeof(struct core_map_entry), PAGE_SIZE);
+	// the copy on write sharer lists, page cache keys and TLB states live right after the core map
+	unsigned long npages = ROUND_UP(ncmes * (sizeof(struct core_map_entry) + sizeof(struct cow_sharer *)
+				+ sizeof(struct pcache_entry) + sizeof(union tlb_state)), PAGE_SIZE);
 	//unsigned long npages = ((ncmes * sizeof(struct core_map_entry) - 1) / PAGE_SIZE) + 1;
 	core_map = (struct core_map_entry *) PADDR_TO_KVADDR(ram_stealmem(npages));
+	cow_sharers = (struct cow_sharer **) (core_map + ncmes);
+	bzero(cow_sharers, ncmes * sizeof(struct cow_sharer *));
+	pcache_entries = (struct pcache_entry *) (cow_sharers + ncmes);
+	bzero(pcache_entries, ncmes * sizeof(struct pcache_entry));
+	tlb_states = (union tlb_state *) (pcache_entries + ncmes);
+	bzero(tlb_states, ncmes * sizeof(union tlb_state));
 
 	for(i = 0; i < npages; i++) {
 		core_map[i].va = ((vaddr_t) core_map) + i * PAGE_SIZE;
@@ -28,9 +46,133 @@ void vm_bootstrap(void) {
 	}
 	spinlock_init(&core_map_splk);
 
-	nfree = ncmes - npages;
+	for(i = 0; i < BUDDY_ORDERS; i++)
+		free_lists[i] = -1;
+
+	nfree = 0;
 	ndirty = 0;
+	nfdirty = 0;
 	nswap = 0;
+
+	spinlock_acquire(&core_map_splk);
+	frame_free(npages, ncmes - npages);
+	spinlock_release(&core_map_splk);
+
+	as_bootstrap();		// kmalloc works from here on
+	pcache_bootstrap();
+}
+
+
+static void free_list_push(unsigned long cmi, unsigned order) {
+	struct free_block *fb = FREE_BLOCK(cmi);
+
+	fb->prev = -1;
+	fb->next = free_lists[order];
+	if(fb->next != -1)
+		FREE_BLOCK(fb->next)->prev = cmi;
+	free_lists[order] = cmi;
+	core_map[cmi].md.order = order + 1;
+}
+
+static void free_list_remove(unsigned long cmi, unsigned order) {
+	struct free_block *fb = FREE_BLOCK(cmi);
+
+	KASSERT(core_map[cmi].md.order == order + 1);
+
+	if(fb->prev != -1)
+		FREE_BLOCK(fb->prev)->next = fb->next;
+	else
+		free_lists[order] = fb->next;
+	if(fb->next != -1)
+		FREE_BLOCK(fb->next)->prev = fb->prev;
+	core_map[cmi].md.order = 0;
+}
+
+// Takes 2^order free frames off the free lists, splitting a bigger block if needed.
+// The frames must be claimed (va or busy set) before the core map spinlock is released.
+// *** Assumes the core map spinlock is held
+long frame_alloc(unsigned order) {
+	unsigned k;
+
+	for(k = order; k < BUDDY_ORDERS && free_lists[k] == -1; k++);
+	if(k == BUDDY_ORDERS)
+		return -1;
+
+	long cmi = free_lists[k];
+	free_list_remove(cmi, k);
+
+	while(k > order) {		// split, keeping the lower half
+		k--;
+		free_list_push(cmi + (1UL << k), k);
+		buddy_splits++;
+	}
+
+	nfree -= 1UL << order;
+	return cmi;
+}
+
+// Takes one particular free frame off the free lists (for alloc_kpages's fallback).
+// *** Assumes the core map spinlock is held
+void frame_take(unsigned long cmi) {
+	unsigned k;
+	unsigned long head = cmi;
+
+	for(k = 0; k < BUDDY_ORDERS; k++) {		// find the free block containing cmi
+		head = cmi & ~((1UL << k) - 1);
+		if(core_map[head].md.order == k + 1)
+			break;
+	}
+	KASSERT(k < BUDDY_ORDERS);
+
+	free_list_remove(head, k);
+
+	while(k > 0) {			// split, giving back the half without cmi
+		k--;
+		if(cmi < head + (1UL << k)) {
+			free_list_push(head + (1UL << k), k);
+		}
+		else {
+			free_list_push(head, k);
+			head += 1UL << k;
+		}
+		buddy_splits++;
+	}
+
+	nfree--;
+}
+
+// Puts frames back on the free lists, coalescing with free buddies.
+// *** Assumes the core map spinlock is held
+void frame_free(unsigned long cmi, unsigned long npages) {
+	unsigned long end = cmi + npages;
+
+	for(unsigned long j = cmi; j < end; j++) {
+		KASSERT(core_map[j].va == 0);
+		KASSERT(core_map[j].md.all == 0);
+	}
+
+	while(cmi < end) {
+		unsigned k = 0;		// largest aligned block that fits
+
+		while(k + 1 < BUDDY_ORDERS && (cmi & ((1UL << (k + 1)) - 1)) == 0 && cmi + (1UL << (k + 1)) <= end)
+			k++;
+
+		unsigned long head = cmi;
+		cmi += 1UL << k;
+		nfree += 1UL << k;
+
+		while(k + 1 < BUDDY_ORDERS) {
+			unsigned long buddy = head ^ (1UL << k);
+			if(buddy + (1UL << k) > ncmes || core_map[buddy].md.order != k + 1)
+				break;
+			free_list_remove(buddy, k);
+			head &= buddy;
+			k++;
+			buddy_merges++;
+		}
+
+		free_list_push(head, k);
+	}
 }
 
 // 'cm' in the kernel menu
@@ -40,15 +182,51 @@ int print_core_map(int nargs, char **args) {
 	(void) args;
 	unsigned long nkernel = 0;
 	unsigned long nuser = 0;
+	unsigned long nfile = 0;
+	unsigned long nshared = 0;
 	for(unsigned long i = 0; i < ncmes; i++) {
 		struct core_map_entry cme = core_map[i];
 		if(cme.md.kernel)
 			nkernel++;
+		else if(CMI_IS_FILE(i))
+			nfile++;
 		else if(cme.va)
 			nuser++;
-		kprintf("%lu: vaddr: %p, as: %p, c:%d, b:%d\n", i, (void *) cme.va, cme.as, cme.md.contig, cme.md.busy);
+		if(cme.refcount > 1)
+			nshared++;
+		kprintf("%lu: vaddr: %p, as: %p, c:%d, b:%d, r:%u\n", i, (void *) cme.va, cme.as, cme.md.contig, cme.md.busy, cme.refcount);
 	}
-	kprintf("\nKernel Pages: %lu\nUser Pages: %lu\nTotal Pages: %lu\n\n", nkernel, nuser, nkernel + nuser);
+	kprintf("\nKernel Pages: %lu\nUser Pages: %lu\nFile Pages: %lu\nShared Pages: %lu\nTotal Pages: %lu\n\n",
+			nkernel, nuser, nfile, nshared, nkernel + nuser + nfile);
+
+	// fragmentation: free blocks per buddy order
+	unsigned long nblocks[BUDDY_ORDERS] = {0};
+	unsigned long free_pages, splits, merges, scans, evicted;
+	unsigned largest = 0;
+
+	spinlock_acquire(&core_map_splk);
+	for(unsigned k = 0; k < BUDDY_ORDERS; k++) {
+		for(long b = free_lists[k]; b != -1; b = FREE_BLOCK(b)->next)
+			nblocks[k]++;
+		if(nblocks[k])
+			largest = k + 1;
+	}
+	free_pages = nfree;
+	splits = buddy_splits;
+	merges = buddy_merges;
+	scans = kpages_scans;
+	evicted = kpages_evicted;
+	spinlock_release(&core_map_splk);
+
+	kprintf("Free Pages: %lu\nFree Blocks by Order:", free_pages);
+	for(unsigned k = 0; k < largest; k++)
+		kprintf(" %u:%lu", k, nblocks[k]);
+	kprintf("\nLargest Free Block: %lu pages\n", largest ? 1UL << (largest - 1) : 0);
+	kprintf("Buddy Splits: %lu\nBuddy Merges: %lu\n", splits, merges);
+	kprintf("Kernel Allocation Scans: %lu\nPages Evicted by Scans: %lu\n\n", scans, evicted);
+
+	swap_io_printstats();
+	pcache_printstats();
 
 	unsigned int i;
 	for(i = 1; i < swap_size; i++) {
@@ -86,8 +264,10 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 			return perms_fault(as, faultaddress);
 
 		case VM_FAULT_WRITE:
+			return tlb_miss(as, faultaddress, true);
+
 		case VM_FAULT_READ:
-			return tlb_miss(as, faultaddress);
+			return tlb_miss(as, faultaddress, false);
 
 		default:
 			return EINVAL;
@@ -95,6 +275,64 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 }
 
 
+// 'ra [window]' in the kernel menu
+// prints swap read-around stats, and sets the largest read-around window if given one
+int prefetch_cmd(int nargs, char **args) {
+	if(nargs > 2) {
+		kprintf("Usage: ra [window]\n");
+		return EINVAL;
+	}
+	if(nargs == 2) {
+		int window = atoi(args[1]);
+		if(window < 0 || window > PREFETCH_MAX) {
+			kprintf("ra: window must be between 0 and %d\n", PREFETCH_MAX);
+			return EINVAL;
+		}
+		prefetch_window = window;
+	}
+
+	spinlock_acquire(&core_map_splk);
+	unsigned long issued = npf_issued;
+	unsigned long hits = npf_hits;
+	unsigned long misses = npf_misses;
+	spinlock_release(&core_map_splk);
+
+	kprintf("Read-around Window: %u\n", prefetch_window);
+	kprintf("Pages Prefetched: %lu\nPrefetch Hits: %lu\nPrefetch Misses: %lu\n", issued, hits, misses);
+	if(hits + misses > 0)
+		kprintf("Hit Rate: %lu%%\n", 100 * hits / (hits + misses));
+	kprintf("\n");
+
+	return 0;
+}
+
+
+// 'lp [on|off]' in the kernel menu
+// prints large page stats, and turns large pages for stack and heap on or off if told to
+int lpage_cmd(int nargs, char **args) {
+	if(nargs > 2 || (nargs == 2 && strcmp(args[1], "on") != 0 && strcmp(args[1], "off") != 0)) {
+		kprintf("Usage: lp [on|off]\n");
+		return EINVAL;
+	}
+	if(nargs == 2)
+		lpage_enabled = strcmp(args[1], "on") == 0;
+
+	spinlock_acquire(&core_map_splk);
+	unsigned long allocs = nlp_allocs;
+	unsigned long fallbacks = nlp_fallbacks;
+	unsigned long splits = nlp_splits;
+	unsigned long hits = nlp_hits;
+	spinlock_release(&core_map_splk);
+
+	kprintf("Large Pages: %s\n", lpage_enabled ? "on" : "off");
+	kprintf("Large Pages Allocated: %lu\nFallbacks to Small Pages: %lu\nLarge Pages Split: %lu\n", allocs, fallbacks, splits);
+	kprintf("TLB Misses on Large Pages: %lu\n", hits);
+	kprintf("\n");
+
+	return 0;
+}
+
+
 // alloc_kpages is more readable with this, and macros don't incur overhead from function calls 
 // (though that might be compiled out with inlining)
 
@@ -110,19 +348,34 @@ int vm_fault(int faulttype, vaddr_t faultaddress) {
 // *** Assumes no spinlocks are held
 vaddr_t alloc_kpages(unsigned npages) {
 
+	unsigned long i, j, start;
+	unsigned order = 0;
+
+	while((1UL << order) < npages)
+		order++;
+
+	spinlock_acquire(&core_map_splk);
+
+	// the free lists hand back a power of two, so return the tail we don't need
+	long cmi = order < BUDDY_ORDERS ? frame_alloc(order) : -1;
+	if(cmi != -1) {
+		start = cmi;
+		frame_free(start + npages, (1UL << order) - npages);
+		goto claim;
+	}
+
 	/*
-	 *	L0: contiguous free non-busy pages
-	 *	L1:	contiguous non-kernel non-tlb non-busy pages
-	 *	L2: contiguous non-kernel non-busy pages
+	 *	Fall back to scanning for a chain we can evict.
+	 *	L0: contiguous free non-busy pages (free memory may be fragmented across buddies)
+	 *	L1:	contiguous non-kernel non-tlb non-busy pages (not counting mapped file pages)
+	 *	L2: contiguous non-kernel non-busy pages (ditto)
 	 */
 
 	unsigned long starts[3] = {0};			// start index of max chain found so far
 	unsigned long lengths[3] = {0};			// max chain length found so far
 	unsigned long candidates[3] = {0};		// length of currently tracked candidate
 
-	unsigned long i;
-
-	spinlock_acquire(&core_map_splk);
+	kpages_scans++;
 
 	// find candidate chains of contiguous memory
 
@@ -140,8 +393,8 @@ vaddr_t alloc_kpages(unsigned npages) {
 			}
 			else {	// page isn't free
 				TERMINATE_CHAIN(0);
-				if(core_map[i].md.kernel == 0) {	// page is user-allocated
-					if(core_map[i].md.tlb == 0) {	// page isn't in TLB
+				if(core_map[i].md.kernel == 0 && !CMI_IS_MAPPED_FILE(i)) {	// page can be evicted
+					if(tlb_states[i].tlb == 0) {	// page isn't in TLB
 						candidates[1]++;
 					}
 					else {	// page is in TLB
@@ -149,7 +402,7 @@ vaddr_t alloc_kpages(unsigned npages) {
 					}
 					candidates[2]++;
 				}
-				else {	// page is kernel-allocated
+				else {	// page is kernel-allocated (or a mapped file page)
 					TERMINATE_CHAIN(1);
 					TERMINATE_CHAIN(2);
 				}
@@ -170,22 +423,30 @@ vaddr_t alloc_kpages(unsigned npages) {
 		}
 	}
 	if(i == 3) {
+		spinlock_release(&core_map_splk);
 		return 0;
 	}
 
-	vaddr_t ret = ((vaddr_t) core_map) + (starts[i] * PAGE_SIZE);
-	unsigned long j;
+	start = starts[i];
 
-	for(j = starts[i]; j < starts[i] + lengths[i]; j++) {
+	for(j = start; j < start + npages; j++) {
 		KASSERT(core_map[j].md.busy == 0);
+		if(core_map[j].va == 0)
+			frame_take(j);
 		core_map[j].md.busy = 1;	// protect the pages we've chosen so another thread
 									// won't swoop in and take them from under us
 									// (especially bad if it's another alloc_kpages, because then
 									// our contiguous chain has an unswappable block in the middle)
 	}
 
-	for(j = starts[i]; j < starts[i] + lengths[i]; j++) {
-		if(core_map[j].va != 0) {
+	for(j = start; j < start + npages; j++) {
+		if(core_map[j].va != 0 && CMI_IS_FILE(j)) {	// file pages are clean; just drop them
+			pcache_steal(j);
+			core_map[j].md.busy = 1;
+			wchan_wakeall(pcache_wchan, &core_map_splk);
+			kpages_evicted++;
+		}
+		else if(core_map[j].va != 0) {
 			spinlock_release(&core_map_splk);
 
 			struct addrspace *other_as = core_map[j].as;
@@ -197,19 +458,23 @@ vaddr_t alloc_kpages(unsigned npages) {
 
 			core_map[j].md.busy = 0;
 			wchan_wakeall(core_map[j].as->addr_wchan, &core_map[j].as->addr_splk);
+			if(core_map[j].refcount > 1)
+				wchan_wakeall(cow_wchan, &core_map_splk);
 
 			swap_out(j, other_as);
 			core_map[j].md.busy = 1;
+			kpages_evicted++;
 
 			spinlock_release(&other_as->addr_splk);
 		}
-		else
-			nfree--;
+	}
 
+claim:
+	for(j = start; j < start + npages; j++) {
 		KASSERT(core_map[j].va == 0);
 		KASSERT(core_map[j].md.kernel == 0);
 		KASSERT(core_map[j].as == NULL);
-		KASSERT(core_map[j].md.busy == 1);
+		KASSERT(core_map[j].md.order == 0);
 
 		core_map[j].va = ((vaddr_t) core_map) + j * PAGE_SIZE;
 		core_map[j].md.kernel = 1;
@@ -221,6 +486,8 @@ vaddr_t alloc_kpages(unsigned npages) {
 
 	spinlock_release(&core_map_splk);
 
+	vaddr_t ret = ((vaddr_t) core_map) + (start * PAGE_SIZE);
+
 	KASSERT(ret > (vaddr_t)core_map);
 	KASSERT(ret % PAGE_SIZE == 0);
 	KASSERT(ret < (vaddr_t)core_map + ncmes * PAGE_SIZE);
@@ -234,7 +501,8 @@ void free_kpages(vaddr_t addr) {
 	KASSERT(addr > (vaddr_t) core_map && addr < (vaddr_t) MIPS_KSEG1);
 
 	unsigned long i = (addr - (vaddr_t)core_map) / PAGE_SIZE;	// index in core_map
-	
+	unsigned long start = i;
+
 	spinlock_acquire(&core_map_splk);
 
 	while(core_map[i].md.contig == 0) {		// free non-final pages
@@ -244,7 +512,6 @@ void free_kpages(vaddr_t addr) {
 		core_map[i].va = 0;
 		core_map[i].md.kernel = 0;
 		i++;
-		nfree++;
 	}
 	KASSERT(core_map[i].va != 0);
 	KASSERT(core_map[i].md.kernel == 1);
@@ -252,7 +519,29 @@ void free_kpages(vaddr_t addr) {
 	core_map[i].va = 0;						// free the final page
 	core_map[i].md.kernel = 0;
 	core_map[i].md.contig = 0;
-	nfree++;
+
+	frame_free(start, i + 1 - start);
 
 	spinlock_release(&core_map_splk);
+}
+
+
+void kpage_settag(vaddr_t addr, unsigned tag) {
+	unsigned long i = (addr - (vaddr_t)core_map) / PAGE_SIZE;
+
+	KASSERT(i < ncmes);
+
+	spinlock_acquire(&core_map_splk);
+	KASSERT(core_map[i].md.kernel == 1);
+	core_map[i].md.swap = tag;
+	spinlock_release(&core_map_splk);
+}
+
+
+unsigned kpage_tag(vaddr_t addr) {
+	unsigned long i = (addr - (vaddr_t)core_map) / PAGE_SIZE;
+
+	if(i >= ncmes || !core_map[i].md.kernel)
+		return 0;
+	return core_map[i].md.swap;
 }
\ No newline at end of file
@@ -40,12 +40,16 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
+/* Returned by mmap() on error. */
+#define MAP_FAILED ((void *)-1)
+
 
 /*
  * Prototypes for OS/161 system calls.
@@ -68,6 +72,8 @@
  *     remove:   stdio.h
  *     rename:   stdio.h
  *     time:     time.h
+ *     mmap:     sys/mman.h
+ *     munmap:   sys/mman.h
  *
  * Also note that the prototypes for open() and mkdir() contain, for
  * compatibility with Unix, an extra argument that is not meaningful
@@ -141,12 +147,16 @@ int chdir(const char *path);
 
 /* Optional. */
 void *sbrk(__intptr_t change);
+void *mmap(void *addr, size_t len, int prot, int flags, int filehandle,
+	   off_t offset);
+int munmap(void *addr, size_t len);
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
 ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
 ssize_t __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
@@ -1184,6 +1184,9 @@ dumpinode(uint32_t ino, const char *name)
 	dumpvalf("Type", "%u (%s)", SWAP16(sfi.sfi_type), typename);
 	dumpvalf("Size", "%u", SWAP32(sfi.sfi_size));
 	dumpvalf("Link count", "%u", SWAP16(sfi.sfi_linkcount));
+	if (SWAP16(sfi.sfi_dirflags) & SFS_DIR_INDEXED) {
+		dumpvalf("Name index depth", "%u", SWAP16(sfi.sfi_dirdepth));
+	}
 	printf("\n");
 
         printf("    Direct blocks:\n");
@@ -254,6 +254,7 @@ writerootdir(void)
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(2);
 	sfi.sfi_direct[0] = SWAP32(rootdir_data_block);
+	sfi.sfi_dirflags = SWAP16(SFS_DIR_INDEXED);	/* one bucket, block 0 */
 
 	/* Write it out */
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
@@ -288,6 +289,7 @@ writepurgdir(void)
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(2);
 	sfi.sfi_direct[0] = SWAP32(purgdir_data_block);
+	sfi.sfi_dirflags = SWAP16(SFS_DIR_INDEXED);	/* one bucket, block 0 */
 
 	/* Write it out */
 	diskwrite(&sfi, SFS_PURGDIR_INO);
@@ -393,6 +393,14 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 		}
 	}
 
+	if (sfsdir_checkindex(&sfi, direntries, ndirentries)) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: Invalid name index (removed)",
+		      pathsofar);
+		sfi.sfi_dirflags &= ~SFS_DIR_INDEXED;
+		sfs_writeinode(ino, &sfi);
+	}
+
 	for (i=0; i<ndirentries; i++) {
 		if (direntries[i].sfd_ino == SFS_NOINO) {
 			/* nothing */
@@ -297,6 +297,19 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	/*
+	 * Renaming or adding entries above may have put them in the
+	 * wrong index bucket; if so, fall back to a linear directory.
+	 */
+
+	if (sfsdir_checkindex(&sfi, direntries, ndirentries)) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: Invalid name index (removed)",
+		      pathsofar);
+		sfi.sfi_dirflags &= ~SFS_DIR_INDEXED;
+		ichanged = 1;
+	}
+
 	/*
 	 * Write back anything that changed, clean up, and return.
 	 */
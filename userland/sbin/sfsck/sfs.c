@@ -99,6 +99,12 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	sfi->sfi_dirflags = SWAP16(sfi->sfi_dirflags);
+	sfi->sfi_dirdepth = SWAP16(sfi->sfi_dirdepth);
+	for (i=0; i<SFS_DIRBUCKETS; i++) {
+		sfi->sfi_dirbuckets[i] = SWAP16(sfi->sfi_dirbuckets[i]);
+	}
 }
 
 static
@@ -464,3 +470,83 @@ sfsdir_tryadd(struct sfs_direntry *d, int nd, const char *name, uint32_t ino)
 	}
 	return -1;
 }
+
+/*
+ * Hash a name for the directory name index. This must match
+ * sfs_dir_hash() in the kernel.
+ */
+static
+uint32_t
+sfsdir_hash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	if (!strcmp(name, ".") || !strcmp(name, "..")) {
+		return 0;
+	}
+	for (; *name != 0; name++) {
+		hash = (hash ^ (unsigned char)*name) * 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Check the name index of the directory SFI, whose ND entries are in
+ * D. Each bucket has to own exactly the table slots that agree with
+ * it in the low bits of the hash (however many bits it uses), and
+ * every entry has to be in the bucket its name hashes to.
+ *
+ * Returns 0 if the index is good or there isn't one, and nonzero
+ * otherwise.
+ */
+int
+sfsdir_checkindex(const struct sfs_dinode *sfi,
+		  const struct sfs_direntry *d, unsigned nd)
+{
+	const unsigned perblock = SFS_BLOCKSIZE / sizeof(struct sfs_direntry);
+	unsigned nblocks, nslots, sharers, localmask, i, j;
+	uint32_t hash;
+
+	if ((sfi->sfi_dirflags & SFS_DIR_INDEXED) == 0 || nd == 0) {
+		return 0;
+	}
+	if (sfi->sfi_dirdepth > SFS_DIRDEPTH_MAX) {
+		return -1;
+	}
+	nblocks = SFS_ROUNDUP(nd, perblock) / perblock;
+	nslots = 1U << sfi->sfi_dirdepth;
+
+	for (i=0; i<nslots; i++) {
+		if (sfi->sfi_dirbuckets[i] >= nblocks) {
+			return -1;
+		}
+		sharers = 0;
+		for (j=0; j<nslots; j++) {
+			if (sfi->sfi_dirbuckets[j] == sfi->sfi_dirbuckets[i]) {
+				sharers++;
+			}
+		}
+		if ((sharers & (sharers - 1)) != 0) {
+			return -1;
+		}
+		/* a bucket in N slots uses depth - log2(N) bits */
+		localmask = nslots / sharers - 1;
+		for (j=0; j<nslots; j++) {
+			if (sfi->sfi_dirbuckets[j] == sfi->sfi_dirbuckets[i] &&
+			    (j & localmask) != (i & localmask)) {
+				return -1;
+			}
+		}
+	}
+
+	for (i=0; i<nd; i++) {
+		if (d[i].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		hash = sfsdir_hash(d[i].sfd_name) & (nslots - 1);
+		if (sfi->sfi_dirbuckets[hash] != i / perblock) {
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -77,5 +77,9 @@ int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 /* Sort a directory by creating a permutation vector. */
 void sfsdir_sort(struct sfs_direntry *d, unsigned nd, int *vector);
 
+/* Check a directory's name index, if it has one. */
+int sfsdir_checkindex(const struct sfs_dinode *sfi,
+		      const struct sfs_direntry *d, unsigned nd);
+
 
 #endif /* SFS_H */
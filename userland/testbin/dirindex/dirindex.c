@@ -0,0 +1,204 @@
+/*
+ * dirindex.c
+ *
+ *	Tests SFS directory name indexing.
+ *
+ *	First, renames a file to a new name inside a directory whose
+ *	only bucket is full, so that adding the new name has to split
+ *	the bucket; afterwards the old name must be gone and the new
+ *	name must still be the same file. This is done in a number of
+ *	fresh directories so that the entries get shuffled different
+ *	ways.
+ *
+ *	Then creates enough files in one directory to fill more blocks
+ *	than the index has buckets, checks that every one can be found,
+ *	and removes them again.
+ *
+ *	Works in the current directory.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+/* entries per directory block, counting . and .. */
+#define PERBLOCK	8
+#define RENAMETRIALS	32
+/* more than 128 blocks' worth */
+#define BIGCOUNT	(PERBLOCK * 128 + 200)
+
+static
+void
+makefile(const char *name, const char *contents)
+{
+	int fd;
+
+	fd = open(name, O_WRONLY|O_CREAT|O_EXCL, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", name);
+	}
+	if (contents != NULL &&
+	    write(fd, contents, strlen(contents)) != (ssize_t)strlen(contents)) {
+		err(1, "%s: write", name);
+	}
+	close(fd);
+}
+
+static
+void
+checkfile(const char *name, const char *contents)
+{
+	char buf[64];
+	ssize_t len;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	len = read(fd, buf, sizeof(buf) - 1);
+	if (len < 0) {
+		err(1, "%s: read", name);
+	}
+	close(fd);
+	buf[len] = 0;
+	if (strcmp(buf, contents) != 0) {
+		errx(1, "%s: contains \"%s\", expected \"%s\"",
+		     name, buf, contents);
+	}
+}
+
+static
+void
+checkgone(const char *name)
+{
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd >= 0) {
+		errx(1, "%s: still exists", name);
+	}
+	if (errno != ENOENT) {
+		err(1, "%s: open", name);
+	}
+}
+
+static
+void
+renametest(void)
+{
+	char dir[32], name[32], newname[32];
+	int trial, i;
+
+	printf("Renaming inside full directories...\n");
+
+	for (trial = 0; trial < RENAMETRIALS; trial++) {
+		snprintf(dir, sizeof(dir), "ren%d", trial);
+		if (mkdir(dir, 0775)) {
+			err(1, "%s: mkdir", dir);
+		}
+		if (chdir(dir)) {
+			err(1, "%s: chdir", dir);
+		}
+
+		/* . and .. plus these fill the first block */
+		for (i = 0; i < PERBLOCK - 2; i++) {
+			snprintf(name, sizeof(name), "f%d-%d", trial, i);
+			makefile(name, name);
+		}
+
+		i = trial % (PERBLOCK - 2);
+		snprintf(name, sizeof(name), "f%d-%d", trial, i);
+		snprintf(newname, sizeof(newname), "renamed%d", trial);
+		if (rename(name, newname)) {
+			err(1, "%s/%s: rename to %s", dir, name, newname);
+		}
+		checkgone(name);
+		checkfile(newname, name);
+
+		/* all the others must be intact */
+		for (i = 0; i < PERBLOCK - 2; i++) {
+			if (i == trial % (PERBLOCK - 2)) {
+				continue;
+			}
+			snprintf(name, sizeof(name), "f%d-%d", trial, i);
+			checkfile(name, name);
+			if (remove(name)) {
+				err(1, "%s/%s: remove", dir, name);
+			}
+		}
+		if (remove(newname)) {
+			err(1, "%s/%s: remove", dir, newname);
+		}
+
+		if (chdir("..")) {
+			err(1, "..: chdir");
+		}
+		if (rmdir(dir)) {
+			err(1, "%s: rmdir", dir);
+		}
+	}
+
+	printf("Passed rename test.\n");
+}
+
+static
+void
+bigdirtest(void)
+{
+	char name[32];
+	int i;
+
+	printf("Creating %d files in one directory...\n", BIGCOUNT);
+
+	if (mkdir("bigdir", 0775)) {
+		err(1, "bigdir: mkdir");
+	}
+	if (chdir("bigdir")) {
+		err(1, "bigdir: chdir");
+	}
+
+	for (i = 0; i < BIGCOUNT; i++) {
+		snprintf(name, sizeof(name), "file%d", i);
+		makefile(name, NULL);
+	}
+
+	for (i = 0; i < BIGCOUNT; i++) {
+		snprintf(name, sizeof(name), "file%d", i);
+		checkfile(name, "");
+	}
+	checkgone("nosuchfile");
+
+	for (i = 0; i < BIGCOUNT; i++) {
+		snprintf(name, sizeof(name), "file%d", i);
+		if (remove(name)) {
+			err(1, "%s: remove", name);
+		}
+	}
+	for (i = 0; i < BIGCOUNT; i += 97) {
+		snprintf(name, sizeof(name), "file%d", i);
+		checkgone(name);
+	}
+
+	if (chdir("..")) {
+		err(1, "..: chdir");
+	}
+	if (rmdir("bigdir")) {
+		err(1, "bigdir: rmdir");
+	}
+
+	printf("Passed big directory test.\n");
+}
+
+int
+main(void)
+{
+	renametest();
+	bigdirtest();
+	return 0;
+}
@@ -0,0 +1,310 @@
+/*
+ * mmaptest.c
+ *
+ *	Tests mmap() and munmap() of files.
+ *
+ *	Maps a small file shared and checks that it reads the same as
+ *	the file, writes to it, unmaps it, and checks with read() that
+ *	the writes made it to the file. Then does the same with a
+ *	private mapping and checks that the writes did NOT reach the
+ *	file, and with a shared mapping in a child that exits without
+ *	unmapping, which must still write back.
+ *
+ *	Last, maps a file larger than RAM (8M by default, or the size
+ *	in megabytes given as the argument), writes every page through
+ *	the mapping, and checks every page through the mapping and
+ *	then, after unmapping, with read(). Dirty file pages have to be
+ *	written back and evicted for this to finish.
+ *
+ *	Works in the current directory.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGESIZE	4096
+#define SMALLPAGES	8
+#define BIGMEGS		8
+
+#define SMALLFILE	"mmaptest.small"
+#define BIGFILE		"mmaptest.big"
+
+static char pagebuf[PAGESIZE];
+
+/*
+ * The byte that belongs at offset POS of a file whose contents were
+ * made with seed SEED.
+ */
+static
+char
+patbyte(unsigned seed, unsigned pos)
+{
+	return (char)(seed + pos * 7 + pos / PAGESIZE);
+}
+
+static
+void
+fillpage(char *page, unsigned seed, unsigned pgno)
+{
+	unsigned i;
+
+	for (i=0; i<PAGESIZE; i++) {
+		page[i] = patbyte(seed, pgno * PAGESIZE + i);
+	}
+}
+
+/*
+ * Check one page against the pattern; WHAT says where it came from.
+ */
+static
+void
+checkpage(const char *page, unsigned seed, unsigned pgno, const char *what)
+{
+	unsigned i;
+
+	for (i=0; i<PAGESIZE; i++) {
+		if (page[i] != patbyte(seed, pgno * PAGESIZE + i)) {
+			errx(1, "%s: page %u byte %u is wrong", what, pgno, i);
+		}
+	}
+}
+
+/*
+ * Create NAME with NPAGES pages of pattern SEED.
+ */
+static
+void
+makefile(const char *name, unsigned npages, unsigned seed)
+{
+	unsigned i;
+	ssize_t r;
+	int fd;
+
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", name);
+	}
+	for (i=0; i<npages; i++) {
+		fillpage(pagebuf, seed, i);
+		r = write(fd, pagebuf, PAGESIZE);
+		if (r < 0) {
+			err(1, "%s: write", name);
+		}
+		if (r != PAGESIZE) {
+			errx(1, "%s: short write", name);
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Check all NPAGES pages of NAME with read(), against pattern SEED.
+ */
+static
+void
+readcheck(const char *name, unsigned npages, unsigned seed)
+{
+	unsigned i;
+	ssize_t r;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	for (i=0; i<npages; i++) {
+		r = read(fd, pagebuf, PAGESIZE);
+		if (r < 0) {
+			err(1, "%s: read", name);
+		}
+		if (r != PAGESIZE) {
+			errx(1, "%s: short read", name);
+		}
+		checkpage(pagebuf, seed, i, name);
+	}
+	close(fd);
+}
+
+static
+char *
+mapfile(int fd, unsigned npages, int flags, const char *name)
+{
+	void *p;
+
+	p = mmap(NULL, npages * PAGESIZE, PROT_READ|PROT_WRITE, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap", name);
+	}
+	return p;
+}
+
+/*
+ * Rewrite the first NPAGES pages of a mapping with pattern SEED.
+ */
+static
+void
+writemap(char *map, unsigned npages, unsigned seed)
+{
+	unsigned i;
+
+	for (i=0; i<npages; i++) {
+		fillpage(map + i * PAGESIZE, seed, i);
+	}
+}
+
+static
+void
+checkmap(const char *map, unsigned npages, unsigned seed, const char *what)
+{
+	unsigned i;
+
+	for (i=0; i<npages; i++) {
+		checkpage(map + i * PAGESIZE, seed, i, what);
+	}
+}
+
+static
+void
+test_shared(void)
+{
+	char *map;
+	int fd;
+
+	printf("Shared mapping...\n");
+	makefile(SMALLFILE, SMALLPAGES, 1);
+	fd = open(SMALLFILE, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", SMALLFILE);
+	}
+	map = mapfile(fd, SMALLPAGES, MAP_SHARED, SMALLFILE);
+	close(fd);
+
+	checkmap(map, SMALLPAGES, 1, "shared mapping");
+	writemap(map, SMALLPAGES, 2);
+	checkmap(map, SMALLPAGES, 2, "shared mapping after writing");
+	if (munmap(map, SMALLPAGES * PAGESIZE)) {
+		err(1, "munmap");
+	}
+	readcheck(SMALLFILE, SMALLPAGES, 2);
+}
+
+static
+void
+test_private(void)
+{
+	char *map;
+	int fd;
+
+	printf("Private mapping...\n");
+	makefile(SMALLFILE, SMALLPAGES, 3);
+	fd = open(SMALLFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", SMALLFILE);
+	}
+	map = mapfile(fd, SMALLPAGES, MAP_PRIVATE, SMALLFILE);
+	close(fd);
+
+	checkmap(map, SMALLPAGES, 3, "private mapping");
+	writemap(map, SMALLPAGES, 4);
+	checkmap(map, SMALLPAGES, 4, "private mapping after writing");
+	/* the file must not have changed, before or after unmapping */
+	readcheck(SMALLFILE, SMALLPAGES, 3);
+	if (munmap(map, SMALLPAGES * PAGESIZE)) {
+		err(1, "munmap");
+	}
+	readcheck(SMALLFILE, SMALLPAGES, 3);
+}
+
+static
+void
+test_exit(void)
+{
+	char *map;
+	pid_t pid;
+	int fd, status;
+
+	printf("Shared mapping left at exit...\n");
+	makefile(SMALLFILE, SMALLPAGES, 5);
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		fd = open(SMALLFILE, O_RDWR);
+		if (fd < 0) {
+			err(1, "%s: open", SMALLFILE);
+		}
+		map = mapfile(fd, SMALLPAGES, MAP_SHARED, SMALLFILE);
+		close(fd);
+		writemap(map, SMALLPAGES, 6);
+		/* no munmap; exit has to write it back */
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+	readcheck(SMALLFILE, SMALLPAGES, 6);
+}
+
+static
+void
+test_big(unsigned megs)
+{
+	unsigned npages = megs * (1024 * 1024 / PAGESIZE);
+	char *map;
+	int fd;
+
+	printf("Shared mapping of a %uM file...\n", megs);
+	makefile(BIGFILE, npages, 7);
+	fd = open(BIGFILE, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", BIGFILE);
+	}
+	map = mapfile(fd, npages, MAP_SHARED, BIGFILE);
+	close(fd);
+
+	checkmap(map, npages, 7, "big mapping");
+	writemap(map, npages, 8);
+	checkmap(map, npages, 8, "big mapping after writing");
+	if (munmap(map, npages * PAGESIZE)) {
+		err(1, "munmap");
+	}
+	readcheck(BIGFILE, npages, 8);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned megs = BIGMEGS;
+
+	if (argc > 2) {
+		errx(1, "Usage: mmaptest [megabytes]");
+	}
+	if (argc == 2) {
+		megs = atoi(argv[1]);
+		if (megs == 0) {
+			errx(1, "Usage: mmaptest [megabytes]");
+		}
+	}
+
+	test_shared();
+	test_private();
+	test_exit();
+	test_big(megs);
+
+	remove(SMALLFILE);
+	remove(BIGFILE);
+	printf("Passed mmaptest.\n");
+	return 0;
+}
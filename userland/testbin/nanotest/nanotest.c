@@ -0,0 +1,181 @@
+/*
+ * nanotest.c
+ *
+ *	Tests nanosleep().
+ *
+ *	Checks that bad intervals are rejected with EINVAL, that a
+ *	zero-length sleep comes right back, and that sleeps of various
+ *	lengths last at least as long as asked (and not absurdly
+ *	longer), with the remaining time reported as zero. Then has
+ *	several processes sleep at once, which should take about as
+ *	long as one of them sleeping, not the sum.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define NSLEEPERS	4
+/* allowed overshoot, in nanoseconds; the sleep rounds up to clock ticks */
+#define SLACK		500000000ULL
+
+/* Current time in nanoseconds. */
+static
+unsigned long long
+now(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long long)secs * 1000000000ULL + nsecs;
+}
+
+static
+void
+sleepfor(time_t secs, long nsecs)
+{
+	struct timespec req, rem;
+
+	req.tv_sec = secs;
+	req.tv_nsec = nsecs;
+	rem.tv_sec = 1;
+	rem.tv_nsec = 1;
+	if (nanosleep(&req, &rem) < 0) {
+		err(1, "nanosleep %lld.%09ld", (long long)secs, nsecs);
+	}
+	if (rem.tv_sec != 0 || rem.tv_nsec != 0) {
+		errx(1, "nanosleep %lld.%09ld: time remaining was not zero",
+		     (long long)secs, nsecs);
+	}
+}
+
+static
+void
+checkbad(time_t secs, long nsecs)
+{
+	struct timespec req;
+
+	req.tv_sec = secs;
+	req.tv_nsec = nsecs;
+	if (nanosleep(&req, NULL) == 0) {
+		errx(1, "nanosleep %lld.%ld: succeeded", (long long)secs, nsecs);
+	}
+	if (errno != EINVAL) {
+		err(1, "nanosleep %lld.%ld: expected EINVAL, got",
+		    (long long)secs, nsecs);
+	}
+}
+
+/*
+ * Sleep for SECS.NSECS and check how long it took.
+ */
+static
+void
+timedsleep(time_t secs, long nsecs)
+{
+	unsigned long long want, start, took;
+
+	want = (unsigned long long)secs * 1000000000ULL + nsecs;
+	start = now();
+	sleepfor(secs, nsecs);
+	took = now() - start;
+
+	printf("Slept %lld.%09ld: took %llu.%09llu\n", (long long)secs, nsecs,
+	       took / 1000000000ULL, took % 1000000000ULL);
+	if (took < want) {
+		errx(1, "woke up early");
+	}
+	if (took > want + SLACK) {
+		errx(1, "woke up much too late");
+	}
+}
+
+static
+void
+test_bad(void)
+{
+	printf("Bad intervals...\n");
+	checkbad(0, -1);
+	checkbad(0, 1000000000);
+	checkbad(-1, 0);
+	if (nanosleep(NULL, NULL) == 0) {
+		errx(1, "nanosleep NULL: succeeded");
+	}
+}
+
+static
+void
+test_lengths(void)
+{
+	printf("Sleep lengths...\n");
+	timedsleep(0, 0);
+	timedsleep(0, 1);
+	timedsleep(0, 10000000);
+	timedsleep(0, 250000000);
+	timedsleep(1, 0);
+	timedsleep(1, 500000000);
+	/* rem may be NULL */
+	{
+		struct timespec req = { 0, 1000 };
+
+		if (nanosleep(&req, NULL) < 0) {
+			err(1, "nanosleep with NULL rem");
+		}
+	}
+}
+
+static
+void
+test_together(void)
+{
+	unsigned long long start, took;
+	pid_t pids[NSLEEPERS];
+	int i, status;
+
+	printf("%d sleepers at once...\n", NSLEEPERS);
+	start = now();
+	for (i=0; i<NSLEEPERS; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			sleepfor(1, 0);
+			_exit(0);
+		}
+	}
+	for (i=0; i<NSLEEPERS; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "sleeper %d failed", i);
+		}
+	}
+	took = now() - start;
+
+	printf("Took %llu.%09llu\n", took / 1000000000ULL,
+	       took % 1000000000ULL);
+	if (took < 1000000000ULL) {
+		errx(1, "sleepers woke up early");
+	}
+	if (took > 2000000000ULL) {
+		errx(1, "sleepers didn't sleep at the same time");
+	}
+}
+
+int
+main(void)
+{
+	test_bad();
+	test_lengths();
+	test_together();
+	printf("Passed nanotest.\n");
+	return 0;
+}